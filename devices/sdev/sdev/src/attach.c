@@ -0,0 +1,285 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * sdev: Abstraction for storage devices under /dev/sdX
+ */
+
+/* File system servers can attach to a device or partition and then send
+ * SDevRWCommand requests straight to sdev, which relays them to the driver
+ * without going through the kernel, vfs and devfs for every block. Access is
+ * checked once when attaching, and every request after that is confined to
+ * the attached device or partition. sdev can't ask the kernel for the rights
+ * of a process, and the requester field of a message from a server is only
+ * what the server claims, so access is tied to the socket instead: sdev sends
+ * a random range of the device to the socket that asks to attach, and only
+ * attaches it once a read of exactly that range reaches sdev through the
+ * kernel and devfs, which only allow it on a device file opened with read
+ * access, and with write access if the server asked for it. That read is
+ * answered by sdev itself and never reaches the device. */
+
+#include <liblux/liblux.h>
+#include <liblux/sdev.h>
+#include <sdev/sdev.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+static Attachment *attachments = NULL;
+static uint64_t nextHandle = 1;
+
+/* findAttachment(): finds the attachment a request refers to
+ * params: sd - socket of the attached server
+ * params: handle - handle returned when attaching
+ * returns: pointer to attachment, NULL if none
+ */
+
+static Attachment *findAttachment(int sd, uint64_t handle) {
+    Attachment *list = attachments;
+    while(list) {
+        if(list->handle && (list->sd == sd) && (list->handle == handle)) return list;
+        list = list->next;
+    }
+
+    return NULL;
+}
+
+/* dropPending(): helper function to forget the attachments a server hasn't
+ * proven its access for yet
+ * params: sd - socket of the server
+ * returns: nothing
+ */
+
+static void dropPending(int sd) {
+    Attachment **list = &attachments;
+    while(*list) {
+        Attachment *attachment = *list;
+        if((attachment->sd == sd) && !attachment->handle) {
+            *list = attachment->next;
+            free(attachment);
+        } else {
+            list = &attachment->next;
+        }
+    }
+}
+
+/* sdevAttach(): starts attaching a file system server to a storage device or
+ * partition, by sending it the range it has to read to prove its access
+ * params: sd - socket of the server
+ * params: server - non-zero if the socket is bound in the server namespace
+ * params: cmd - attach command message
+ * returns: nothing, response sent to the server
+ */
+
+void sdevAttach(int sd, int server, SDevAttachCommand *cmd) {
+    cmd->header.response = 1;
+    cmd->header.length = sizeof(SDevAttachCommand);
+    cmd->handle = 0;
+
+    // only servers may bypass the permission checks of the kernel and devfs
+    if(!server) {
+        cmd->header.status = -EPERM;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    cmd->device[sizeof(cmd->device)-1] = 0;
+    if(strncmp(cmd->device, "/sd", 3)) {
+        cmd->header.status = -ENODEV;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    StorageDevice *dev = findDevice(atoi(&cmd->device[3]));
+    if(!dev) {
+        cmd->header.status = -ENODEV;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    int partition = -1;
+    char *p = strchr(&cmd->device[3], 'p');
+    if(p) {
+        partition = atoi(p+1);
+        if((partition < 0) || (partition >= dev->partitionCount)) {
+            cmd->header.status = -ENODEV;
+            luxSend(sd, cmd);
+            return;
+        }
+    }
+
+    uint64_t size = (partition >= 0) ? dev->partitionSize[partition] : dev->size;
+    uint64_t random;
+    if((size < 2) || luxRequestRNG(&random)) {
+        cmd->header.status = -EIO;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    // a server only proves one attachment at a time
+    dropPending(sd);
+
+    Attachment *attachment = calloc(1, sizeof(Attachment));
+    if(!attachment) {
+        cmd->header.status = -ENOMEM;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    // a sector and an odd length within it, which ordinary I/O doesn't use
+    attachment->sd = sd;
+    attachment->device = dev;
+    attachment->partition = partition;
+    attachment->write = cmd->write;
+    attachment->proofStart = ((random % (size - 1)) * dev->sectorSize) + ((random >> 48) % dev->sectorSize);
+    attachment->proofCount = 1 + ((random >> 32) % (dev->sectorSize - 1));
+    attachment->next = attachments;
+    attachments = attachment;
+
+    cmd->header.status = 0;
+    cmd->proofStart = attachment->proofStart;
+    cmd->proofCount = attachment->proofCount;
+    cmd->sectorSize = dev->sectorSize;
+    cmd->size = size;
+    luxSend(sd, cmd);
+}
+
+/* sdevProve(): completes the attachment a read through the kernel proves the
+ * access of a server to, called for every read of a device file
+ * params: dev - storage device
+ * params: partition - partition number, negative for the whole device
+ * params: cmd - read command message from devfs
+ * returns: one if the read was a proof, which is not to be relayed
+ */
+
+int sdevProve(StorageDevice *dev, int partition, RWCommand *cmd) {
+    Attachment *attachment = attachments;
+    while(attachment) {
+        if(!attachment->handle && (attachment->device == dev) && (attachment->partition == partition) &&
+        (attachment->proofStart == cmd->position) && (attachment->proofCount == cmd->length))
+            break;
+        attachment = attachment->next;
+    }
+
+    if(!attachment) return 0;
+
+    SDevAttachCommand res;
+    memset(&res, 0, sizeof(SDevAttachCommand));
+    res.header.command = COMMAND_SDEV_ATTACH;
+    res.header.length = sizeof(SDevAttachCommand);
+    res.header.response = 1;
+    strcpy(res.device, dev->name);
+    res.write = attachment->write;
+
+    // the kernel passes the flags the device file was opened with
+    if(attachment->write && !(cmd->flags & O_WRONLY)) {
+        dropPending(attachment->sd);
+        res.header.status = -EACCES;
+        luxSend(attachment->sd, &res);
+        return 1;
+    }
+
+    attachment->handle = nextHandle++;
+
+    res.header.status = 0;
+    res.handle = attachment->handle;
+    res.sectorSize = dev->sectorSize;
+    res.size = (partition >= 0) ? dev->partitionSize[partition] : dev->size;
+    luxSend(attachment->sd, &res);
+    return 1;
+}
+
+/* sdevDetach(): frees the attachments of a server that disconnected
+ * params: sd - socket of the server
+ * returns: nothing
+ */
+
+void sdevDetach(int sd) {
+    Attachment **list = &attachments;
+    while(*list) {
+        Attachment *attachment = *list;
+        if(attachment->sd == sd) {
+            *list = attachment->next;
+            sdevRequestOrphan(attachment);
+            free(attachment);
+        } else {
+            list = &attachment->next;
+        }
+    }
+}
+
+/* sdevDirect(): relays a read or write request from an attached server
+ * params: sd - socket of the server
+ * params: cmd - read or write command message
+ * returns: nothing, request relayed to the storage device driver
+ */
+
+void sdevDirect(int sd, SDevRWCommand *cmd) {
+    Attachment *attachment = findAttachment(sd, cmd->device);
+    uint16_t id = 0;
+    int status = 0;
+
+    if(!attachment) {
+        status = -EBADF;
+    } else if((cmd->header.command == COMMAND_SDEV_WRITE) && !attachment->write) {
+        status = -EPERM;
+    } else {
+        // confine the request to the attached device or partition
+        StorageDevice *dev = attachment->device;
+        uint64_t size;
+        if(attachment->partition >= 0) size = dev->partitionSize[attachment->partition];
+        else size = dev->size;
+        size *= dev->sectorSize;
+
+        if((cmd->start > size) || (cmd->count > (size - cmd->start))) status = -EIO;
+        else if(!(id = sdevRequestStart(0, attachment->device->sd, attachment))) status = -ENOMEM;
+    }
+
+    if(status) {
+        cmd->header.response = 1;
+        cmd->header.length = sizeof(SDevRWCommand);
+        cmd->header.status = status;
+        cmd->count = 0;
+        luxSend(sd, cmd);
+        return;
+    }
+
+    StorageDevice *dev = attachment->device;
+    cmd->device = dev->deviceID;
+    cmd->client = sd;
+    cmd->syscall = id;
+    cmd->pid = 0;
+    cmd->partition = attachment->partition;
+    cmd->sectorSize = dev->sectorSize;
+
+    if(attachment->partition >= 0) {
+        cmd->partitionStart = dev->partitionStart[attachment->partition];
+        cmd->start += cmd->partitionStart * dev->sectorSize;
+    } else {
+        cmd->partitionStart = 0;
+    }
+
+    luxSend(dev->sd, cmd);
+}
+
+/* relayDirect(): relays the response from a device driver to an attached server
+ * params: driver - socket of the device driver
+ * params: res - read or write response message
+ * returns: nothing, response relayed to the server
+ */
+
+void relayDirect(int driver, SDevRWCommand *res) {
+    Request request;
+    if(sdevRequestEnd(res->syscall, driver, &request) || !request.attachment) {
+        luxLogf(KPRINT_LEVEL_WARNING, "dropping response to unknown request %d from storage device driver\n", res->syscall);
+        return;
+    }
+
+    // translate back to the handle and offsets the server knows
+    Attachment *attachment = request.attachment;
+    res->device = attachment->handle;
+    res->syscall = 0;
+    if(res->partition >= 0) res->start -= res->partitionStart * res->sectorSize;
+    luxSend(attachment->sd, res);
+}
\ No newline at end of file
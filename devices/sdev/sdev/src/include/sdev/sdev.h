@@ -36,6 +36,29 @@ typedef struct StorageDevice {
     uint64_t partitionSize[16];     // sectors
 } StorageDevice;
 
+/* file system server attached directly to a device or partition, or waiting
+ * to prove its access to it while the handle is zero */
+typedef struct Attachment {
+    struct Attachment *next;
+    int sd;                     // socket of the server
+    uint64_t handle;
+    StorageDevice *device;
+    int partition;              // negative for the whole device
+    int write;
+
+    uint64_t proofStart;        // range the server has to read through the kernel
+    uint64_t proofCount;
+} Attachment;
+
+/* request relayed to a device driver, see request.c */
+typedef struct Request {
+    struct Request *next;
+    uint16_t id;                // unique non-zero ID given to the driver
+    uint16_t syscall;           // ID of the syscall, for requests from the kernel
+    int driver;                 // socket of the driver the request was sent to
+    Attachment *attachment;     // attached server, NULL for requests from the kernel
+} Request;
+
 extern int drvCount, devCount;
 extern StorageDevice *sdev;
 
@@ -43,6 +66,14 @@ void registerDevice(int, SDevRegisterCommand *);
 void partitionDevice(const char *, StorageDevice *);
 StorageDevice *findDevice(int);
 void sdevRead(RWCommand *);
-void relayRead(SDevRWCommand *);
+void relayRead(int, SDevRWCommand *);
 void sdevWrite(RWCommand *);
-void relayWrite(SDevRWCommand *);
+void relayWrite(int, SDevRWCommand *);
+void sdevAttach(int, int, SDevAttachCommand *);
+int sdevProve(StorageDevice *, int, RWCommand *);
+void sdevDetach(int);
+void sdevDirect(int, SDevRWCommand *);
+void relayDirect(int, SDevRWCommand *);
+uint16_t sdevRequestStart(uint16_t, int, Attachment *);
+int sdevRequestEnd(uint16_t, int, Request *);
+void sdevRequestOrphan(Attachment *);
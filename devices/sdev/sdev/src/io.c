@@ -36,12 +36,22 @@ void sdevRead(RWCommand *cmd) {
         if(cmd->path[i] == 'p') partition = atoi(&cmd->path[i+1]);
     }
 
+    // reads that prove the access of a server attaching to the device are
+    // answered here, with no data
+    if(sdevProve(dev, partition, cmd)) {
+        cmd->header.header.response = 1;
+        cmd->header.header.length = sizeof(RWCommand);
+        cmd->header.header.status = 0;
+        cmd->length = 0;
+        luxSendDependency(cmd);
+        return;
+    }
+
     // relay the request to the appropriate device driver
     SDevRWCommand rcmd;
     memset(&rcmd, 0, sizeof(SDevRWCommand));
     rcmd.header.command = COMMAND_SDEV_READ;
     rcmd.header.length = sizeof(SDevRWCommand);
-    rcmd.syscall = cmd->header.id;
     rcmd.start = cmd->position;
     rcmd.count = cmd->length;
     rcmd.device = dev->deviceID;
@@ -67,15 +77,32 @@ void sdevRead(RWCommand *cmd) {
         }
     }
 
+    rcmd.syscall = sdevRequestStart(cmd->header.id, dev->sd, NULL);
+    if(!rcmd.syscall) {
+        cmd->header.header.response = 1;
+        cmd->header.header.length = sizeof(RWCommand);
+        cmd->header.header.status = -ENOMEM;
+        cmd->length = 0;
+        luxSendDependency(cmd);
+        return;
+    }
+
     luxSend(dev->sd, &rcmd);
 }
 
 /* relayRead(): relays the read response from a device driver to the requester
+ * params: driver - socket of the device driver
  * params: res - read response message
  * returns: nothing, response relayed to the requester
  */
 
-void relayRead(SDevRWCommand *res) {
+void relayRead(int driver, SDevRWCommand *res) {
+    Request request;
+    if(sdevRequestEnd(res->syscall, driver, &request)) {
+        luxLogf(KPRINT_LEVEL_WARNING, "dropping response to unknown request %d from storage device driver\n", res->syscall);
+        return;
+    }
+
     // allocate a buffer of differing size according to the command's status
     if(!res->header.status) {
         // success
@@ -90,7 +117,7 @@ void relayRead(SDevRWCommand *res) {
         rcmd->header.header.response = 1;
         rcmd->header.header.status = res->count;
         rcmd->header.header.requester = res->pid;
-        rcmd->header.id = res->syscall;
+        rcmd->header.id = request.syscall;
         rcmd->position = res->start + res->count;
         rcmd->length = res->count;
 
@@ -112,7 +139,7 @@ void relayRead(SDevRWCommand *res) {
         rcmd.header.header.response = 1;
         rcmd.header.header.status = res->header.status;
         rcmd.header.header.requester = res->pid;
-        rcmd.header.id = res->syscall;
+        rcmd.header.id = request.syscall;
         rcmd.position = res->start;
         rcmd.length = 0;
 
@@ -158,7 +185,6 @@ void sdevWrite(RWCommand *cmd) {
     memset(wcmd, 0, sizeof(SDevRWCommand));
     wcmd->header.command = COMMAND_SDEV_WRITE;
     wcmd->header.length = sizeof(SDevRWCommand) + cmd->length;
-    wcmd->syscall = cmd->header.id;
     wcmd->start = cmd->position;
     wcmd->count = cmd->length;
     wcmd->device = dev->deviceID;
@@ -180,21 +206,40 @@ void sdevWrite(RWCommand *cmd) {
             cmd->header.header.status = -EIO;
             cmd->length = 0;
             luxSendDependency(cmd);
+            free(wcmd);
             return;
         }
     }
 
+    wcmd->syscall = sdevRequestStart(cmd->header.id, dev->sd, NULL);
+    if(!wcmd->syscall) {
+        cmd->header.header.response = 1;
+        cmd->header.header.length = sizeof(RWCommand);
+        cmd->header.header.status = -ENOMEM;
+        cmd->length = 0;
+        luxSendDependency(cmd);
+        free(wcmd);
+        return;
+    }
+
     memcpy(wcmd->buffer, cmd->data, cmd->length);
     luxSend(dev->sd, wcmd);
     free(wcmd);
 }
 
 /* relayWrite(): relays the write response from a device driver to the requester
+ * params: driver - socket of the device driver
  * params: res - write response message
  * returns: nothing, response relayed to the requester
  */
 
-void relayWrite(SDevRWCommand *res) {
+void relayWrite(int driver, SDevRWCommand *res) {
+    Request request;
+    if(sdevRequestEnd(res->syscall, driver, &request)) {
+        luxLogf(KPRINT_LEVEL_WARNING, "dropping response to unknown request %d from storage device driver\n", res->syscall);
+        return;
+    }
+
     // allocate a buffer of differing size according to the command's status
     RWCommand wcmd;
     memset(&wcmd, 0, sizeof(RWCommand));
@@ -202,7 +247,7 @@ void relayWrite(SDevRWCommand *res) {
     wcmd.header.header.length = sizeof(RWCommand);
     wcmd.header.header.response = 1;
     wcmd.header.header.requester = res->pid;
-    wcmd.header.id = res->syscall;
+    wcmd.header.id = request.syscall;
 
     if(!res->header.status) {
         wcmd.header.header.status = res->count;
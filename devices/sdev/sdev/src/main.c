@@ -9,20 +9,26 @@
 #include <liblux/sdev.h>
 #include <sdev/sdev.h>
 #include <stdlib.h>
-#include <unistd.h>         // sched_yield()
+#include <string.h>
+#include <unistd.h>         // sched_yield(), close()
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define MAX_DRIVERS         8
+/* storage device drivers and attached file system servers */
+#define MAX_CONNECTIONS     32
 
 static int *connections;
+static int *servers;        // connection is bound in the server namespace
 
 int main() {
     luxInit("sdev");
     while(luxConnectDependency("devfs"));   // obviously depend on devfs
 
-    connections = calloc(MAX_DRIVERS, sizeof(int));
+    connections = calloc(MAX_CONNECTIONS, sizeof(int));
+    servers = calloc(MAX_CONNECTIONS, sizeof(int));
     MessageHeader *msg = calloc(1, SERVER_MAX_SIZE);
 
-    if(!connections || !msg) {
+    if(!connections || !servers || !msg) {
         luxLogf(KPRINT_LEVEL_ERROR, "unable to allocate memory for storage device layer\n");
         return -1;
     }
@@ -34,19 +40,37 @@ int main() {
     for(;;) {
         int actions = 0;
 
-        // wait for connections from device drivers
-        if(drvCount < MAX_DRIVERS) {
-            int sd = luxAccept();
+        // wait for connections from device drivers and file system servers
+        if(drvCount < MAX_CONNECTIONS) {
+            struct sockaddr_un addr;
+            socklen_t len = sizeof(struct sockaddr_un);
+            memset(&addr, 0, sizeof(struct sockaddr_un));
+            int sd = luxAcceptAddr((struct sockaddr *) &addr, &len);
             if(sd > 0) {
                 actions++;
                 connections[drvCount] = sd;
+                servers[drvCount] = !strncmp(addr.sun_path, "lux:///ds", 9);
                 drvCount++;
             }
         }
 
-        // receive requests and responses from device drivers
+        // receive requests and responses from device drivers, and requests
+        // from attached file system servers
         for(int i = 0; drvCount && (i < drvCount); i++) {
             ssize_t s = luxRecv(connections[i], msg, SERVER_MAX_SIZE, false, true);     // peek first
+            if((s < 0) && servers[i]) {
+                // a server that disconnected gives up its attachments and slot
+                actions++;
+                sdevDetach(connections[i]);
+                close(connections[i]);
+
+                drvCount--;
+                connections[i] = connections[drvCount];
+                servers[i] = servers[drvCount];
+                i--;
+                continue;
+            }
+
             if(s > 0 && s <= SERVER_MAX_SIZE) {
                 actions++;
                 if(msg->length > SERVER_MAX_SIZE) {
@@ -62,8 +86,17 @@ int main() {
                 luxRecv(connections[i], msg, msg->length, false, false);    // receive the actual msg
                 switch(msg->command) {
                 case COMMAND_SDEV_REGISTER: registerDevice(connections[i], (SDevRegisterCommand *) msg); break;
-                case COMMAND_SDEV_READ: relayRead((SDevRWCommand *) msg); break;
-                case COMMAND_SDEV_WRITE: relayWrite((SDevRWCommand *) msg); break;
+                case COMMAND_SDEV_READ:
+                    if(!msg->response) sdevDirect(connections[i], (SDevRWCommand *) msg);
+                    else if(((SDevRWCommand *) msg)->client) relayDirect(connections[i], (SDevRWCommand *) msg);
+                    else relayRead(connections[i], (SDevRWCommand *) msg);
+                    break;
+                case COMMAND_SDEV_WRITE:
+                    if(!msg->response) sdevDirect(connections[i], (SDevRWCommand *) msg);
+                    else if(((SDevRWCommand *) msg)->client) relayDirect(connections[i], (SDevRWCommand *) msg);
+                    else relayWrite(connections[i], (SDevRWCommand *) msg);
+                    break;
+                case COMMAND_SDEV_ATTACH: sdevAttach(connections[i], servers[i], (SDevAttachCommand *) msg); break;
                 default:
                     luxLogf(KPRINT_LEVEL_WARNING, "unimplemented command 0x%04X from storage device driver, dropping message\n", msg->command);
                 }
@@ -0,0 +1,98 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * sdev: Abstraction for storage devices under /dev/sdX
+ */
+
+/* Requests relayed to device drivers: drivers use the syscall field of an
+ * SDevRWCommand as their own command ID, e.g. the NVMe command identifier, so
+ * it has to be non-zero and unique among the requests in flight. Syscalls
+ * from the kernel and requests from attached servers are relayed to the same
+ * drivers, so every request is given an ID of its own here, and the response
+ * is mapped back to the syscall or server it answers. Only the driver the
+ * request was sent to can answer it. */
+
+#include <liblux/liblux.h>
+#include <sdev/sdev.h>
+#include <stdlib.h>
+
+static Request *requests = NULL;
+static uint16_t nextID = 0;
+
+/* findRequest(): helper function to find a request in flight
+ * params: id - ID given to the driver
+ * params: prev - pointer to store the link to the request in
+ * returns: pointer to request, NULL if none
+ */
+
+static Request *findRequest(uint16_t id, Request ***prev) {
+    Request **list = &requests;
+    while(*list) {
+        if((*list)->id == id) {
+            if(prev) *prev = list;
+            return *list;
+        }
+
+        list = &(*list)->next;
+    }
+
+    return NULL;
+}
+
+/* sdevRequestStart(): allocates the ID of a request relayed to a driver
+ * params: syscall - ID of the syscall, for requests from the kernel
+ * params: driver - socket of the driver the request is sent to
+ * params: attachment - attached server, NULL for requests from the kernel
+ * returns: non-zero ID on success, zero on fail
+ */
+
+uint16_t sdevRequestStart(uint16_t syscall, int driver, Attachment *attachment) {
+    Request *request = calloc(1, sizeof(Request));
+    if(!request) return 0;
+
+    // skip zero and any ID still in flight
+    do {
+        nextID++;
+    } while(!nextID || findRequest(nextID, NULL));
+
+    request->id = nextID;
+    request->syscall = syscall;
+    request->driver = driver;
+    request->attachment = attachment;
+    request->next = requests;
+    requests = request;
+    return request->id;
+}
+
+/* sdevRequestEnd(): releases the ID of a request the driver responded to
+ * params: id - ID given to the driver
+ * params: driver - socket the response came from
+ * params: request - buffer to store the request in
+ * returns: zero on success, non-zero if no such request is in flight there
+ */
+
+int sdevRequestEnd(uint16_t id, int driver, Request *request) {
+    Request **prev;
+    Request *found = findRequest(id, &prev);
+    if(!found || (found->driver != driver)) return 1;
+
+    *prev = found->next;
+    *request = *found;
+    free(found);
+    return 0;
+}
+
+/* sdevRequestOrphan(): forgets the server behind requests still in flight,
+ * whose responses are then dropped, for a server that disconnected
+ * params: attachment - attachment of the server
+ * returns: nothing
+ */
+
+void sdevRequestOrphan(Attachment *attachment) {
+    Request *request = requests;
+    while(request) {
+        if(request->attachment == attachment) request->attachment = NULL;
+        request = request->next;
+    }
+}
\ No newline at end of file
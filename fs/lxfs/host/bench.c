@@ -0,0 +1,508 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+/* lxfs-bench: runs workloads against an lxfs image on the build machine
+ * usage: lxfs-bench [-w workload] [-n count] [-s size] [-i io size] [-v] image
+ *
+ * The driver is called the same way the main loop calls it, one request at a
+ * time with housekeeping after each, and every workload ends by syncing the
+ * volume so that its writes are counted in full. Files are written with a
+ * pattern that depends on the position in the file, and every read is checked
+ * against it, so a workload that reads back anything else fails. For each
+ * workload this reports the rate of operations, the requests and blocks that
+ * reached the image, and the hit rate of the block cache. */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+static const char *device;
+static uint64_t nextID = 1;
+static uint64_t count = 1000;           // files or operations per workload
+static uint64_t fileSize = 64 << 20;    // for the sequential and random workloads
+static uint64_t ioSize = 16384;         // for the sequential workload
+
+/* status(): helper function to return the status of the last request
+ * params: none
+ * returns: status of the response, -ENOSYS if there was none
+ */
+
+static int64_t status() {
+    MessageHeader *header = (MessageHeader *) luxHostResponse();
+    if(!header) return -ENOSYS;
+    return (int64_t) header->status;
+}
+
+/* pattern(): helper function to return the byte written at a position
+ * params: position - byte offset in the file
+ * returns: byte of the pattern
+ */
+
+static uint8_t pattern(uint64_t position) {
+    return (uint8_t)((position * 0x9E3779B1) >> 24);
+}
+
+/* helper functions to issue requests as the kernel would */
+
+static uint64_t benchOpen(const char *path, int flags) {
+    OpenCommand cmd;
+    memset(&cmd, 0, sizeof(OpenCommand));
+    cmd.header.header.command = COMMAND_OPEN;
+    cmd.header.header.length = sizeof(OpenCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+    cmd.flags = flags;
+    cmd.mode = 0644;
+    cmd.id = nextID++;
+
+    lxfsOpen(&cmd);
+    lxfsTick(0);
+    return status() ? 0 : cmd.id;
+}
+
+static int64_t benchClose(uint64_t id, const char *path) {
+    FsyncCommand cmd;
+    memset(&cmd, 0, sizeof(FsyncCommand));
+    cmd.header.header.command = COMMAND_FSYNC;
+    cmd.header.header.length = sizeof(FsyncCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+    cmd.id = id;
+    cmd.close = 1;
+
+    lxfsFsync(&cmd);
+    lxfsTick(0);
+    return status();
+}
+
+static int64_t benchSync() {
+    FsyncCommand cmd;
+    memset(&cmd, 0, sizeof(FsyncCommand));
+    cmd.header.header.command = COMMAND_FSYNC;
+    cmd.header.header.length = sizeof(FsyncCommand);
+    strcpy(cmd.path, "/");
+    strcpy(cmd.device, device);
+
+    lxfsFsync(&cmd);
+    lxfsTick(1);
+    return status();
+}
+
+static int64_t benchRW(int write, uint64_t id, const char *path, off_t position, size_t length) {
+    RWCommand *cmd = calloc(1, sizeof(RWCommand) + length);
+    if(!cmd) return -ENOMEM;
+
+    cmd->header.header.command = write ? COMMAND_WRITE : COMMAND_READ;
+    cmd->header.header.length = sizeof(RWCommand) + (write ? length : 0);
+    strcpy(cmd->path, path);
+    strcpy(cmd->device, device);
+    cmd->id = id;
+    cmd->position = position;
+    cmd->length = length;
+
+    if(write) {
+        for(size_t i = 0; i < length; i++)
+            ((uint8_t *) cmd->data)[i] = pattern(position + i);
+        lxfsWrite(cmd);
+    } else {
+        lxfsRead(cmd);
+    }
+
+    free(cmd);
+    lxfsTick(0);
+    int64_t s = status();
+
+    // every byte read must be what was written there
+    if(!write && (s > 0)) {
+        uint8_t *buffer = (uint8_t *) ((RWCommand *) luxHostResponse())->data;
+        for(int64_t i = 0; i < s; i++) {
+            if(buffer[i] != pattern(position + i)) {
+                fprintf(stderr, "%s: data read back from %s at %ld doesn't match what was written\n",
+                        device, path, (long)(position + i));
+                return -EIO;
+            }
+        }
+    }
+
+    return s;
+}
+
+/* benchHole(): helper function to read a range that must read back as zeros
+ * params: id - file ID
+ * params: path - path of the file
+ * params: position - first byte of the range
+ * params: length - length of the range
+ * returns: number of bytes read, negative error code on fail
+ */
+
+static int64_t benchHole(uint64_t id, const char *path, off_t position, size_t length) {
+    RWCommand *cmd = calloc(1, sizeof(RWCommand) + 4096);
+    if(!cmd) return -ENOMEM;
+
+    size_t total = 0;
+    while(total < length) {
+        memset(cmd, 0, sizeof(RWCommand));
+        cmd->header.header.command = COMMAND_READ;
+        cmd->header.header.length = sizeof(RWCommand);
+        strcpy(cmd->path, path);
+        strcpy(cmd->device, device);
+        cmd->id = id;
+        cmd->position = position + total;
+        cmd->length = (length - total) > 4096 ? 4096 : (length - total);
+
+        lxfsRead(cmd);
+        lxfsTick(0);
+        int64_t s = status();
+        if(s <= 0) {
+            free(cmd);
+            return s ? s : -EIO;
+        }
+
+        uint8_t *buffer = (uint8_t *) ((RWCommand *) luxHostResponse())->data;
+        for(int64_t i = 0; i < s; i++) {
+            if(buffer[i]) {
+                fprintf(stderr, "%s: hole in %s at %ld doesn't read back as zeros\n",
+                        device, path, (long)(position + total + i));
+                free(cmd);
+                return -EIO;
+            }
+        }
+
+        total += s;
+    }
+
+    free(cmd);
+    return total;
+}
+
+static int64_t benchStat(const char *path) {
+    StatCommand cmd;
+    memset(&cmd, 0, sizeof(StatCommand));
+    cmd.header.header.command = COMMAND_STAT;
+    cmd.header.header.length = sizeof(StatCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.source, device);
+
+    lxfsStat(&cmd);
+    lxfsTick(0);
+    return status();
+}
+
+static int64_t benchUnlink(const char *path) {
+    UnlinkCommand cmd;
+    memset(&cmd, 0, sizeof(UnlinkCommand));
+    cmd.header.header.command = COMMAND_UNLINK;
+    cmd.header.header.length = sizeof(UnlinkCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+
+    lxfsUnlink(&cmd);
+    lxfsTick(0);
+    return status();
+}
+
+static int64_t benchMkdir(const char *path) {
+    MkdirCommand cmd;
+    memset(&cmd, 0, sizeof(MkdirCommand));
+    cmd.header.header.command = COMMAND_MKDIR;
+    cmd.header.header.length = sizeof(MkdirCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+    cmd.mode = 0755;
+
+    lxfsMkdir(&cmd);
+    lxfsTick(0);
+    return status();
+}
+
+/* benchReaddir(): helper function to list a whole directory
+ * params: path - path of the directory
+ * returns: number of entries, negative error code on fail
+ */
+
+static int64_t benchReaddir(const char *path) {
+    OpendirCommand ocmd;
+    memset(&ocmd, 0, sizeof(OpendirCommand));
+    ocmd.header.header.command = COMMAND_OPENDIR;
+    ocmd.header.header.length = sizeof(OpendirCommand);
+    strcpy(ocmd.path, path);
+    strcpy(ocmd.device, device);
+
+    lxfsOpendir(&ocmd);
+    if(status()) return status();
+
+    ReaddirCommand cmd;
+    memset(&cmd, 0, sizeof(ReaddirCommand));
+    cmd.header.header.command = COMMAND_READDIR;
+    cmd.header.header.length = sizeof(ReaddirCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+
+    int64_t entries = 0;
+    for(;;) {
+        lxfsReaddir(&cmd);
+        lxfsTick(0);
+
+        ReaddirCommand *res = (ReaddirCommand *) luxHostResponse();
+        if(res->header.header.status) return res->header.header.status;
+        if(res->end) return entries;
+
+        entries++;
+        cmd.position = res->position;
+    }
+}
+
+/* workloads, each returns the number of operations, negative on fail */
+
+/* benchSequential(): writes a large file in order, then reads it back */
+static int64_t benchSequential() {
+    uint64_t id = benchOpen("seq", O_CREAT | O_RDWR | O_TRUNC);
+    if(!id) return status();
+
+    int64_t ops = 0;
+    for(uint64_t pos = 0; pos < fileSize; pos += ioSize, ops++) {
+        if(benchRW(1, id, "seq", pos, ioSize) != ioSize) return -EIO;
+    }
+
+    for(uint64_t pos = 0; pos < fileSize; pos += ioSize, ops++) {
+        if(benchRW(0, id, "seq", pos, ioSize) != ioSize) return -EIO;
+    }
+
+    if(benchClose(id, "seq")) return status();
+    return ops;
+}
+
+/* benchRandom(): reads and writes single blocks at random in the same file */
+static int64_t benchRandom() {
+    uint64_t id = benchOpen("seq", O_RDWR);
+    if(!id) return status();
+
+    Mountpoint *mp = findMP(device);
+    uint64_t blocks = fileSize / mp->blockSizeBytes;
+
+    for(uint64_t i = 0; i < count; i++) {
+        off_t pos = (rand() % blocks) * mp->blockSizeBytes;
+        if(benchRW(i & 1, id, "seq", pos, mp->blockSizeBytes) != mp->blockSizeBytes) return -EIO;
+    }
+
+    if(benchClose(id, "seq")) return status();
+    return count;
+}
+
+/* benchMetadata(): creates, writes, stats and deletes small files */
+static int64_t benchMetadata() {
+    char path[64];
+    if(benchMkdir("meta")) return status();
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "meta/file%lu", i);
+        uint64_t id = benchOpen(path, O_CREAT | O_RDWR);
+        if(!id) return status();
+        if(benchRW(1, id, path, 0, 100) != 100) return -EIO;
+        if(benchClose(id, path)) return status();
+    }
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "meta/file%lu", rand() % count);
+        if(benchStat(path)) return status();
+    }
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "meta/file%lu", i);
+        if(benchUnlink(path)) return status();
+    }
+
+    return count * 3;
+}
+
+/* benchDirectory(): fills one directory, lists it and looks up its entries */
+static int64_t benchDirectory() {
+    char path[64];
+    if(benchMkdir("dir")) return status();
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "dir/entry_with_a_longer_name_%lu", i);
+        uint64_t id = benchOpen(path, O_CREAT | O_RDWR);
+        if(!id) return status();
+        if(benchClose(id, path)) return status();
+    }
+
+    int64_t entries = benchReaddir("dir");
+    if(entries < 0) return entries;
+    if(entries != (count + 2)) return -EIO;     // with . and ..
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "dir/entry_with_a_longer_name_%lu", rand() % count);
+        if(benchStat(path)) return status();
+    }
+
+    return (count * 2) + entries;
+}
+
+/* benchSparse(): extends small files past their end, leaving holes that must
+ * read back as zeros even where the last block held stale data past the end,
+ * as blocks written by older drivers may */
+static int64_t benchSparse() {
+    char path[64];
+    if(benchMkdir("sparse")) return status();
+
+    // just too large to be kept in the metadata block
+    Mountpoint *mp = findMP(device);
+    size_t head = lxfsInlineCapacity(mp) + 100;
+    off_t gap = mp->blockSizeBytes + 200;
+
+    for(uint64_t i = 0; i < count; i++) {
+        sprintf(path, "sparse/file%lu", i);
+        uint64_t id = benchOpen(path, O_CREAT | O_RDWR);
+        if(!id) return status();
+        if(benchRW(1, id, path, 0, head) != head) return -EIO;
+
+        // compressed files have no last block to leave stale data in
+        OpenFile *file = lxfsGetFile(mp, id, path);
+        if(!file) return -ENOENT;
+        if(!file->units) {
+            uint64_t block = lxfsChainBlock(mp, file->entry.block, 0);
+            if(!block || (block == LXFS_BLOCK_EOF)) return -EIO;
+
+            uint8_t *slot = lxfsModifyBlock(mp, block, 1);
+            if(!slot) return -EIO;
+            memset(slot + head, 'Z', mp->blockSizeBytes - head);
+        }
+
+        if(benchRW(1, id, path, gap, 10) != 10) return -EIO;
+        if(benchRW(0, id, path, 0, head) != head) return -EIO;
+        if(benchHole(id, path, head, gap - head) != (gap - head)) return -EIO;
+        if(benchRW(0, id, path, gap, 10) != 10) return -EIO;
+        if(benchClose(id, path)) return status();
+    }
+
+    return count * 5;
+}
+
+static const struct {
+    const char *name;
+    int64_t (*run)();
+} workloads[] = {
+    { "seq", benchSequential },
+    { "random", benchRandom },
+    { "meta", benchMetadata },
+    { "bigdir", benchDirectory },
+    { "sparse", benchSparse },
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-w workload] [-n count] [-s size] [-i io size] [-v] image\n", name);
+    fprintf(stderr, "  -w  seq, random, meta, bigdir, sparse or all (default all)\n");
+    fprintf(stderr, "  -n  files or operations per workload (default 1000)\n");
+    fprintf(stderr, "  -s  size of the file for seq and random, in MB (default 64)\n");
+    fprintf(stderr, "  -i  size of each sequential request in bytes (default 16384)\n");
+    fprintf(stderr, "  -v  print the log messages of the driver\n");
+}
+
+int main(int argc, char **argv) {
+    const char *workload = "all";
+
+    int opt;
+    while((opt = getopt(argc, argv, "w:n:s:i:v")) != -1) {
+        switch(opt) {
+        case 'w': workload = optarg; break;
+        case 'n': count = strtoull(optarg, NULL, 10); break;
+        case 's': fileSize = strtoull(optarg, NULL, 10) << 20; break;
+        case 'i': ioSize = strtoull(optarg, NULL, 10); break;
+        case 'v': luxHostVerbose(1); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(((argc - optind) != 1) || !count || !ioSize || (ioSize > (SERVER_MAX_SIZE - sizeof(RWCommand)))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    device = argv[optind];
+    fileSize -= fileSize % ioSize;
+
+    MountCommand mount;
+    memset(&mount, 0, sizeof(MountCommand));
+    mount.header.header.command = COMMAND_MOUNT;
+    mount.header.header.length = sizeof(MountCommand);
+    strcpy(mount.source, device);
+    strcpy(mount.target, "/");
+    strcpy(mount.type, "lxfs");
+
+    lxfsMount(&mount);
+    if(status()) {
+        fprintf(stderr, "%s: unable to mount %s: %s\n", argv[0], device, strerror(-status()));
+        return 1;
+    }
+
+    Mountpoint *mp = findMP(device);
+    srand(1);
+
+    printf("%-8s %10s %12s %18s %18s %10s\n", "workload", "ops", "ops/sec",
+           "reads (blocks)", "writes (blocks)", "cache hits");
+
+    int ran = 0;
+    for(int i = 0; i < (sizeof(workloads) / sizeof(workloads[0])); i++) {
+        if(strcmp(workload, "all") && strcmp(workload, workloads[i].name)) continue;
+
+        // random reuses the file written by seq
+        if(!strcmp(workloads[i].name, "random") && strcmp(workload, "all")) {
+            if(benchSequential() < 0) {
+                fprintf(stderr, "%s: unable to create the file for random\n", argv[0]);
+                return 1;
+            }
+
+            benchSync();
+        }
+
+        ran++;
+        mp->cacheHits = mp->cacheMisses = 0;
+        mp->deviceReads = mp->deviceWrites = 0;
+        mp->blocksRead = mp->blocksWritten = 0;
+
+        double start = now();
+        int64_t ops = workloads[i].run();
+        if((ops >= 0) && benchSync()) ops = status();
+        double elapsed = now() - start;
+
+        if(ops < 0) {
+            fprintf(stderr, "%s: %s failed: %s\n", argv[0], workloads[i].name, strerror(-ops));
+            return 1;
+        }
+
+        char reads[32], writes[32];
+        sprintf(reads, "%lu (%lu)", mp->deviceReads, mp->blocksRead);
+        sprintf(writes, "%lu (%lu)", mp->deviceWrites, mp->blocksWritten);
+
+        uint64_t lookups = mp->cacheHits + mp->cacheMisses;
+        printf("%-8s %10ld %12.0f %18s %18s %9.1f%%\n", workloads[i].name, ops, ops / elapsed,
+               reads, writes, lookups ? (mp->cacheHits * 100.0) / lookups : 0.0);
+    }
+
+    if(!ran) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,257 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+/* lxfs-dedup: shares the data blocks of identical files on an lxfs image
+ * usage: lxfs-dedup [-v] image [directory]
+ *
+ * This is the offline pass of deduplication, for files that were written
+ * before the volume had it or that are too large to be deduplicated as they
+ * are closed. The driver mounts the image the same way lxfs-bench does, and
+ * every regular file under the directory, the root by default, is opened and
+ * handed to it with the LXFS_DEDUP ioctl, which hashes the file and shares
+ * its blocks with an identical file it hashed before. The volume must have
+ * been created with deduplication, and must not be mounted while this runs. */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+static const char *device;
+static uint64_t nextID = 1;
+static uint64_t files = 0, shared = 0, bytes = 0, freed = 0;
+
+/* status(): helper function to return the status of the last request
+ * params: none
+ * returns: status of the response, -ENOSYS if there was none
+ */
+
+static int64_t status() {
+    MessageHeader *header = (MessageHeader *) luxHostResponse();
+    if(!header) return -ENOSYS;
+    return (int64_t) header->status;
+}
+
+/* dedupFile(): helper function to open a file and pass it to the driver
+ * params: path - path of the file
+ * returns: zero on success, negative error code on fail
+ */
+
+static int64_t dedupFile(const char *path) {
+    OpenCommand ocmd;
+    memset(&ocmd, 0, sizeof(OpenCommand));
+    ocmd.header.header.command = COMMAND_OPEN;
+    ocmd.header.header.length = sizeof(OpenCommand);
+    strcpy(ocmd.path, path);
+    strcpy(ocmd.device, device);
+    ocmd.flags = O_RDONLY;
+    ocmd.id = nextID++;
+
+    lxfsOpen(&ocmd);
+    lxfsTick(0);
+    if(status()) return status();
+
+    IOCTLCommand cmd;
+    memset(&cmd, 0, sizeof(IOCTLCommand));
+    cmd.header.header.command = COMMAND_IOCTL;
+    cmd.header.header.length = sizeof(IOCTLCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+    cmd.id = ocmd.id;
+    cmd.opcode = LXFS_DEDUP;
+
+    lxfsIoctl(&cmd);
+    lxfsTick(0);
+
+    IOCTLCommand *res = (IOCTLCommand *) luxHostResponse();
+    int64_t s = res->header.header.status;
+    if(!s && res->parameter) {
+        shared++;
+        freed += res->parameter;
+    }
+
+    FsyncCommand fcmd;
+    memset(&fcmd, 0, sizeof(FsyncCommand));
+    fcmd.header.header.command = COMMAND_FSYNC;
+    fcmd.header.header.length = sizeof(FsyncCommand);
+    strcpy(fcmd.path, path);
+    strcpy(fcmd.device, device);
+    fcmd.id = ocmd.id;
+    fcmd.close = 1;
+
+    lxfsFsync(&fcmd);
+    lxfsTick(0);
+    return s;
+}
+
+/* dedupDirectory(): helper function to pass every file under a directory to the driver
+ * params: path - path of the directory
+ * returns: zero on success, negative error code on fail
+ */
+
+static int64_t dedupDirectory(const char *path) {
+    OpendirCommand ocmd;
+    memset(&ocmd, 0, sizeof(OpendirCommand));
+    ocmd.header.header.command = COMMAND_OPENDIR;
+    ocmd.header.header.length = sizeof(OpendirCommand);
+    strcpy(ocmd.path, path);
+    strcpy(ocmd.device, device);
+
+    lxfsOpendir(&ocmd);
+    if(status()) return status();
+
+    ReaddirCommand cmd;
+    memset(&cmd, 0, sizeof(ReaddirCommand));
+    cmd.header.header.command = COMMAND_READDIR;
+    cmd.header.header.length = sizeof(ReaddirCommand);
+    strcpy(cmd.path, path);
+    strcpy(cmd.device, device);
+
+    // list the whole directory first, as the files are opened by path
+    char **names = NULL;
+    size_t count = 0, size = 0;
+    for(;;) {
+        lxfsReaddir(&cmd);
+        lxfsTick(0);
+
+        ReaddirCommand *res = (ReaddirCommand *) luxHostResponse();
+        if(res->header.header.status || res->end) break;
+        cmd.position = res->position;
+
+        if(!strcmp(res->entry.d_name, ".") || !strcmp(res->entry.d_name, "..")) continue;
+
+        if(count == size) {
+            size_t newSize = size ? (size * 2) : 64;
+            char **newNames = realloc(names, newSize * sizeof(char *));
+            if(!newNames) break;
+            names = newNames;
+            size = newSize;
+        }
+
+        names[count] = malloc(strlen(path) + strlen(res->entry.d_name) + 2);
+        if(!names[count]) break;
+        if(strcmp(path, "/")) sprintf(names[count], "%s/%s", path, res->entry.d_name);
+        else strcpy(names[count], res->entry.d_name);
+        count++;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        StatCommand scmd;
+        memset(&scmd, 0, sizeof(StatCommand));
+        scmd.header.header.command = COMMAND_STAT;
+        scmd.header.header.length = sizeof(StatCommand);
+        strcpy(scmd.path, names[i]);
+        strcpy(scmd.source, device);
+
+        lxfsStat(&scmd);
+        lxfsTick(0);
+
+        StatCommand *res = (StatCommand *) luxHostResponse();
+        if(!res->header.header.status) {
+            if(S_ISDIR(res->buffer.st_mode)) {
+                dedupDirectory(names[i]);
+            } else if(S_ISREG(res->buffer.st_mode)) {
+                uint64_t fileSize = res->buffer.st_size;
+                int64_t s = dedupFile(names[i]);
+                if(s) {
+                    fprintf(stderr, "lxfs-dedup: %s: %s\n", names[i], strerror(-s));
+                } else {
+                    files++;
+                    bytes += fileSize;
+                }
+            }
+        }
+
+        free(names[i]);
+    }
+
+    free(names);
+    return 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-v] image [directory]\n", name);
+    fprintf(stderr, "  -v  print the log messages of the driver\n");
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while((opt = getopt(argc, argv, "v")) != -1) {
+        switch(opt) {
+        case 'v': luxHostVerbose(1); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(((argc - optind) != 1) && ((argc - optind) != 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    device = argv[optind];
+    const char *dir = ((argc - optind) == 2) ? argv[optind+1] : "/";
+
+    MountCommand mount;
+    memset(&mount, 0, sizeof(MountCommand));
+    mount.header.header.command = COMMAND_MOUNT;
+    mount.header.header.length = sizeof(MountCommand);
+    strcpy(mount.source, device);
+    strcpy(mount.target, "/");
+    strcpy(mount.type, "lxfs");
+
+    lxfsMount(&mount);
+    if(status()) {
+        fprintf(stderr, "%s: unable to mount %s: %s\n", argv[0], device, strerror(-status()));
+        return 1;
+    }
+
+    Mountpoint *mp = findMP(device);
+    if(!mp->dedup) {
+        fprintf(stderr, "%s: %s was not created with deduplication\n", argv[0], device);
+        return 1;
+    }
+
+    double start = now();
+    int64_t s = dedupDirectory(dir);
+
+    FsyncCommand cmd;
+    memset(&cmd, 0, sizeof(FsyncCommand));
+    cmd.header.header.command = COMMAND_FSYNC;
+    cmd.header.header.length = sizeof(FsyncCommand);
+    strcpy(cmd.path, "/");
+    strcpy(cmd.device, device);
+
+    lxfsFsync(&cmd);
+    lxfsTick(1);
+    if(!s) s = status();
+
+    double elapsed = now() - start;
+    if(s) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], dir, strerror(-s));
+        return 1;
+    }
+
+    printf("%s: %lu files, %.1f MB in %.2f s (%.1f MB/s), %lu files newly shared, %.1f MB freed\n",
+           device, files, bytes / 1048576.0, elapsed, elapsed ? (bytes / 1048576.0) / elapsed : 0.0,
+           shared, (freed * mp->blockSizeBytes) / 1048576.0);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,1010 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+/* lxfs-fsck: checks the consistency of an lxfs volume and optionally repairs it
+ * usage: lxfs-fsck [-r] [-j threads] [-v] device
+ *
+ * The device is an image file or a block device. The block table is read into
+ * memory once, so following a chain never costs a read, and every block that
+ * is reached from the root directory is marked in a bitmap of two bits per
+ * block, one for being in use and one for being the head of a file. A block
+ * that is reached twice is cross-linked, unless it is the metadata block of a
+ * file reached through another hard link or the first data block of a chain
+ * shared by deduplicated files, and a block that is allocated in
+ * the table but never reached is leaked. Directories are walked by a pool of
+ * threads sharing a queue, and the metadata blocks of the files they hold are
+ * handed back to the queue in batches, so large directories are spread over
+ * the threads as well. Link counts are compared with the number of entries
+ * pointing to each file once every directory has been walked.
+ *
+ * Transactions left in the metadata journal are applied to what is checked as
+ * if the volume had been mounted, and written in place before any repair. The
+ * volume must not be mounted while it is repaired, but checking a mounted
+ * volume is safe and reports on what has reached the device.
+ *
+ * Exit status is zero if the volume is clean, 1 if every problem was repaired,
+ * 4 if problems are left and 8 if the volume could not be checked. */
+
+#include <lxfs/lxfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_BATCH          256         // files per work item
+#define MAX_THREADS         64
+#define ENTRY_HEADER        offsetof(LXFSDirectoryEntry, name)
+
+#define MARK_USED           1
+#define MARK_HEAD           2
+
+typedef struct Work {
+    struct Work *next;
+    uint64_t dir;               // directory to walk, zero for a batch of files
+    char *path;                 // of the directory, or of the one holding the files
+    size_t count;
+    uint64_t files[FILE_BATCH];
+} Work;
+
+typedef struct {
+    uint64_t block;
+    uint64_t refCount;
+} Claim;
+
+typedef struct {
+    pthread_t thread;
+    void *buffer;               // one block, or a whole directory
+    size_t bufferSize;
+    uint64_t *chain;            // blocks of the directory being walked
+    size_t chainCount, chainSize;
+    Claim *claims;              // files whose metadata this thread checked
+    size_t claimCount, claimSize;
+    uint64_t *refs;             // entries pointing to files
+    size_t refCount, refSize;
+    Work *batch;                // files waiting to be queued
+} Checker;
+
+static const char *device;
+static int fd;
+static int repair = 0, verbose = 0;
+static uint64_t blockSize, volumeSize, entries, tableBlocks, firstData, root;
+static int extents;             // version 2 metadata is present
+static int dedup;               // files may share their data chains
+static uint64_t *table;
+static uint64_t *marks;
+static uint8_t *tableDirty;
+
+// latest images of blocks in the journal that have yet to be written in place
+static uint64_t overlayCount = 0;
+static uint64_t overlayBlocks[LXFS_JOURNAL_BLOCKS];
+static void *overlayImages[LXFS_JOURNAL_BLOCKS];
+
+static Work *queue = NULL;
+static int busy = 0;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t errors = 0, repaired = 0, bytesRead = 0;
+static uint64_t directories = 0, files = 0, links = 0;
+
+/* problem(): helper function to report a problem with the volume
+ * params: path - file or directory the problem was found in, NULL if none
+ * params: fixable - non-zero if the caller can repair the problem
+ * params: f - format of the message, followed by its arguments
+ * returns: non-zero if the caller is to repair the problem
+ */
+
+static int problem(const char *path, int fixable, const char *f, ...) {
+    int fix = repair && fixable;
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    if(fix) __atomic_add_fetch(&repaired, 1, __ATOMIC_RELAXED);
+
+    va_list args;
+    va_start(args, f);
+    pthread_mutex_lock(&outputLock);
+    if(path) printf("%s: ", path);
+    vprintf(f, args);
+    printf(fix ? ", repaired\n" : "\n");
+    pthread_mutex_unlock(&outputLock);
+    va_end(args);
+    return fix;
+}
+
+/* readBlocks(): helper function to read consecutive blocks from the device
+ * blocks with an image in the journal are read from there instead
+ * params: block - first block
+ * params: count - number of blocks
+ * params: buffer - destination buffer
+ * returns: zero on success
+ */
+
+static int readBlocks(uint64_t block, uint64_t count, void *buffer) {
+    size_t size = count * blockSize;
+    off_t offset = block * blockSize;
+    size_t done = 0;
+
+    while(done < size) {
+        ssize_t s = pread(fd, (void *)((uintptr_t) buffer + done), size - done, offset + done);
+        if(s <= 0) return 1;
+        done += s;
+    }
+
+    __atomic_add_fetch(&bytesRead, size, __ATOMIC_RELAXED);
+
+    for(uint64_t i = 0; i < overlayCount; i++) {
+        if((overlayBlocks[i] >= block) && (overlayBlocks[i] < (block + count)))
+            memcpy((void *)((uintptr_t) buffer + ((overlayBlocks[i] - block) * blockSize)),
+                   overlayImages[i], blockSize);
+    }
+
+    return 0;
+}
+
+/* writeBlocks(): helper function to write consecutive blocks to the device
+ * params: block - first block
+ * params: count - number of blocks
+ * params: buffer - source buffer
+ * returns: zero on success
+ */
+
+static int writeBlocks(uint64_t block, uint64_t count, const void *buffer) {
+    size_t size = count * blockSize;
+    off_t offset = block * blockSize;
+    size_t done = 0;
+
+    while(done < size) {
+        ssize_t s = pwrite(fd, (const void *)((uintptr_t) buffer + done), size - done, offset + done);
+        if(s <= 0) {
+            problem(NULL, 0, "%s: unable to write block %lu: %s", device, block, strerror(errno));
+            return 1;
+        }
+
+        done += s;
+    }
+
+    return 0;
+}
+
+/* mark(): helper function to mark a block as reached
+ * params: block - block number
+ * params: bits - MARK_USED, optionally with MARK_HEAD
+ * returns: bits the block was marked with before
+ */
+
+static int mark(uint64_t block, int bits) {
+    int shift = (block % 32) * 2;
+    uint64_t old = __atomic_fetch_or(&marks[block / 32], (uint64_t) bits << shift, __ATOMIC_RELAXED);
+    return (old >> shift) & 3;
+}
+
+/* setNext(): helper function to change an entry of the block table in memory
+ * params: block - block number
+ * params: next - next block in the chain
+ * returns: nothing
+ */
+
+static void setNext(uint64_t block, uint64_t next) {
+    table[block] = next;
+    tableDirty[block / entries] = 1;
+}
+
+static int valid(uint64_t block) {
+    return (block >= firstData) && (block < volumeSize);
+}
+
+/* grow(): helper function to make room for one more element of an array
+ * params: array - pointer to the array
+ * params: count - number of elements in use
+ * params: size - pointer to the number of elements allocated
+ * params: element - size of an element
+ * returns: zero on success
+ */
+
+static int grow(void **array, size_t count, size_t *size, size_t element) {
+    if(count < *size) return 0;
+
+    size_t newSize = *size ? (*size * 2) : 1024;
+    void *newArray = realloc(*array, newSize * element);
+    if(!newArray) return 1;
+
+    *array = newArray;
+    *size = newSize;
+    return 0;
+}
+
+/* walkChain(): follows and marks the blocks of a chain after its first block
+ * the first block must already be marked by the caller; in repair mode the
+ * chain is cut short before the first block that is wrong
+ * params: ck - checker
+ * params: path - file the chain belongs to
+ * params: what - description of the chain
+ * params: first - first block of the chain
+ * params: record - non-zero to record the blocks in the chain list
+ * returns: number of blocks after the first one
+ */
+
+static uint64_t walkChain(Checker *ck, const char *path, const char *what, uint64_t first, int record) {
+    uint64_t count = 0;
+    uint64_t block = first;
+
+    if(record) ck->chainCount = 0;
+
+    for(;;) {
+        if(record) {
+            if(grow((void **) &ck->chain, ck->chainCount, &ck->chainSize, sizeof(uint64_t))) return count;
+            ck->chain[ck->chainCount] = block;
+            ck->chainCount++;
+        }
+
+        uint64_t next = table[block];
+        if(next == LXFS_BLOCK_EOF) return count;
+
+        if(next == LXFS_BLOCK_FREE) {
+            if(problem(path, 1, "block %lu of the %s is marked free", block, what))
+                setNext(block, LXFS_BLOCK_EOF);
+            return count;
+        }
+
+        if(!valid(next)) {
+            if(problem(path, 1, "%s links block %lu to invalid block %lu", what, block, next))
+                setNext(block, LXFS_BLOCK_EOF);
+            return count;
+        }
+
+        if(mark(next, MARK_USED)) {
+            if(problem(path, 1, "%s is cross-linked at block %lu", what, next))
+                setNext(block, LXFS_BLOCK_EOF);
+            return count;
+        }
+
+        count++;
+        block = next;
+    }
+}
+
+/* claim(): helper function to mark a block pointed to by a directory entry or
+ * metadata block as the head of a chain
+ * params: path - file the block belongs to
+ * params: what - description of the block
+ * params: block - block number
+ * returns: zero if the block was claimed, non-zero if it is invalid or in use
+ */
+
+static int claim(const char *path, const char *what, uint64_t block) {
+    if(!valid(block)) return problem(path, 1, "%s is at invalid block %lu", what, block), 1;
+    if(mark(block, MARK_USED | MARK_HEAD)) return problem(path, 1, "%s at block %lu is cross-linked", what, block), 1;
+    return 0;
+}
+
+/* push(): helper function to add work to the queue
+ * params: work - work item
+ * returns: nothing
+ */
+
+static void push(Work *work) {
+    pthread_mutex_lock(&queueLock);
+    work->next = queue;
+    queue = work;
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueLock);
+}
+
+/* queueFile(): helper function to queue the metadata block of a file
+ * params: ck - checker
+ * params: path - directory holding the file
+ * params: block - metadata block of the file
+ * returns: nothing
+ */
+
+static void queueFile(Checker *ck, const char *path, uint64_t block) {
+    if(!ck->batch) {
+        ck->batch = calloc(1, sizeof(Work));
+        if(!ck->batch) return;
+        ck->batch->path = strdup(path);
+    }
+
+    ck->batch->files[ck->batch->count] = block;
+    ck->batch->count++;
+
+    if(ck->batch->count == FILE_BATCH) {
+        push(ck->batch);
+        ck->batch = NULL;
+    }
+}
+
+/* chainLength(): helper function to count the blocks of a chain without marking them
+ * params: first - first block of the chain
+ * returns: number of blocks
+ */
+
+static uint64_t chainLength(uint64_t first) {
+    uint64_t count = 1;
+    uint64_t block = first;
+    while(valid(table[block]) && (count < volumeSize)) {
+        block = table[block];
+        count++;
+    }
+
+    return count;
+}
+
+/* checkShared(): checks a file that shares its data chain with others, and
+ * walks the chain if no other file of the ring has
+ * params: ck - checker
+ * params: path - description of the file
+ * params: meta - metadata block of the file
+ * params: share - share record of the file
+ * returns: number of data blocks
+ */
+
+static uint64_t checkShared(Checker *ck, const char *path, uint64_t meta, const LXFSShare *share) {
+    uint64_t first = table[meta];
+    if(!valid(first)) {
+        problem(path, 0, "shared data chain is at invalid block %lu", first);
+        return 0;
+    }
+
+    // the next file of the ring must link back and have the same chain
+    void *block = malloc(blockSize);
+    if(!block || readBlocks(share->next, 1, block)) {
+        problem(path, 0, "unable to read the next file sharing its data");
+    } else {
+        LXFSShare *next = (LXFSShare *)((uintptr_t) block + LXFS_SHARE_OFFSET);
+        if((next->magic != LXFS_SHARE_MAGIC) || (next->prev != meta) || (table[share->next] != first))
+            problem(path, 0, "ring of files sharing data is broken at block %lu", share->next);
+    }
+
+    free(block);
+
+    // the first file of the ring to get here owns the chain for the check
+    int old = mark(first, MARK_USED | MARK_HEAD);
+    if(!old) return walkChain(ck, path, "shared data chain", first, 0) + 1;
+    if(old == MARK_USED) problem(path, 0, "shared data chain at block %lu is cross-linked", first);
+    return chainLength(first);
+}
+
+/* checkFile(): checks the metadata block of a file and the chains hanging off it
+ * params: ck - checker
+ * params: path - directory holding the file
+ * params: meta - metadata block of the file
+ * returns: nothing
+ */
+
+static void checkFile(Checker *ck, const char *path, uint64_t meta) {
+    char *name = malloc(strlen(path) + 48);
+    if(!name) return;
+    sprintf(name, "%s (file at block %lu)", path, meta);
+
+    if(readBlocks(meta, 1, ck->buffer)) {
+        problem(name, 0, "unable to read metadata block");
+        free(name);
+        return;
+    }
+
+    LXFSFileHeader *header = (LXFSFileHeader *) ck->buffer;
+    if(!grow((void **) &ck->claims, ck->claimCount, &ck->claimSize, sizeof(Claim))) {
+        ck->claims[ck->claimCount].block = meta;
+        ck->claims[ck->claimCount].refCount = header->refCount;
+        ck->claimCount++;
+    }
+
+    LXFSShare *share = (LXFSShare *)((uintptr_t) ck->buffer + LXFS_SHARE_OFFSET);
+    int shared = dedup && (share->magic == LXFS_SHARE_MAGIC) && valid(share->prev) && valid(share->next);
+
+    uint64_t data = shared ? checkShared(ck, name, meta, share) : walkChain(ck, name, "data chain", meta, 0);
+    int modified = 0, sized = 1;
+
+    if(extents) {
+        LXFSExtentMap *map = (LXFSExtentMap *)((uintptr_t) ck->buffer + LXFS_EXTENT_MAP_OFFSET);
+        uint64_t *units = (uint64_t *)((uintptr_t) ck->buffer + LXFS_UNITS_OFFSET);
+
+        if(map->magic == LXFS_INLINE_MAGIC) sized = 0;
+
+        if((map->magic == LXFS_EXTENT_MAP_MAGIC) && map->overflow) {
+            if(claim(name, "extent map overflow", map->overflow)) {
+                map->overflow = 0;
+                map->count = LXFS_EXTENTS_INVALID;  // rebuilt by the driver
+                modified = 1;
+            } else {
+                walkChain(ck, name, "extent map overflow", map->overflow, 0);
+            }
+        }
+
+        // compressed files take up fewer blocks than their size
+        if(*units) sized = 0;
+
+        if(*units && (*units != LXFS_UNITS_PENDING)) {
+            if(claim(name, "unit table", *units)) {
+                problem(name, 0, "compressed data can't be read without its unit table");
+            } else {
+                walkChain(ck, name, "unit table", *units, 0);
+            }
+        }
+    }
+
+    uint64_t needed = (header->size + blockSize - 1) / blockSize;
+    if(sized && (data < needed)) {
+        if(problem(name, 1, "size of %lu bytes exceeds its %lu data blocks", header->size, data)) {
+            header->size = data * blockSize;
+            modified = 1;
+        }
+    }
+
+    if(modified && repair) writeBlocks(meta, 1, ck->buffer);
+    free(name);
+}
+
+/* checkEntry(): checks an entry of a directory and queues what it points to
+ * params: ck - checker
+ * params: path - path of the directory
+ * params: entry - directory entry
+ * returns: non-zero if the entry is to be deleted
+ */
+
+static int checkEntry(Checker *ck, const char *path, LXFSDirectoryEntry *entry) {
+    size_t nameSize = entry->entrySize - ENTRY_HEADER;
+    if(!memchr(entry->name, 0, nameSize))
+        return problem(path, 1, "entry with an unterminated name at block %lu", entry->block);
+
+    char *child = malloc(strlen(path) + strlen((const char *) entry->name) + 2);
+    if(!child) return 0;
+    if(strcmp(path, "/")) sprintf(child, "%s/%s", path, entry->name);
+    else sprintf(child, "/%s", entry->name);
+
+    int drop = 0;
+    uint8_t type = (entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+
+    if(type == LXFS_DIR_TYPE_DIR) {
+        drop = claim(child, "directory", entry->block);
+        if(!drop) {
+            Work *work = calloc(1, sizeof(Work));
+            if(work) {
+                work->dir = entry->block;
+                work->path = child;
+                child = NULL;
+                push(work);
+            }
+        }
+    } else if(type == LXFS_DIR_TYPE_SOFT_LINK) {
+        drop = claim(child, "symbolic link", entry->block);
+        if(!drop) walkChain(ck, child, "symbolic link", entry->block, 0);
+        __atomic_add_fetch(&links, 1, __ATOMIC_RELAXED);
+    } else if(!valid(entry->block)) {
+        drop = problem(child, 1, "file is at invalid block %lu", entry->block);
+    } else {
+        // the metadata block of a file is shared by its hard links, so only
+        // the first entry to reach it checks the file
+        int old = mark(entry->block, MARK_USED | MARK_HEAD);
+        if(old == MARK_USED) {
+            drop = problem(child, 1, "file at block %lu is cross-linked", entry->block);
+        } else {
+            if(!grow((void **) &ck->refs, ck->refCount, &ck->refSize, sizeof(uint64_t))) {
+                ck->refs[ck->refCount] = entry->block;
+                ck->refCount++;
+            }
+
+            if(!old) queueFile(ck, path, entry->block);
+        }
+    }
+
+    free(child);
+    return drop;
+}
+
+/* checkDirectory(): checks the entries and the header of a directory
+ * params: ck - checker
+ * params: dir - first block of the directory
+ * params: path - path of the directory
+ * returns: nothing
+ */
+
+static void checkDirectory(Checker *ck, uint64_t dir, const char *path) {
+    __atomic_add_fetch(&directories, 1, __ATOMIC_RELAXED);
+
+    walkChain(ck, path, "directory", dir, 1);
+
+    size_t size = ck->chainCount * blockSize;
+    if(size > ck->bufferSize) {
+        void *buffer = realloc(ck->buffer, size);
+        if(!buffer) {
+            problem(path, 0, "directory of %lu blocks is too large to check", ck->chainCount);
+            return;
+        }
+
+        ck->buffer = buffer;
+        ck->bufferSize = size;
+    }
+
+    // read the directory in as few requests as its layout allows
+    for(size_t i = 0; i < ck->chainCount;) {
+        size_t run = 1;
+        while(((i + run) < ck->chainCount) && (ck->chain[i + run] == (ck->chain[i] + run))) run++;
+
+        if(readBlocks(ck->chain[i], run, (void *)((uintptr_t) ck->buffer + (i * blockSize)))) {
+            problem(path, 0, "unable to read directory block %lu", ck->chain[i]);
+            return;
+        }
+
+        i += run;
+    }
+
+    LXFSDirectoryHeader *header = (LXFSDirectoryHeader *) ck->buffer;
+    uint64_t count = 0;
+    size_t lowDirty = size, highDirty = 0;
+
+    // entries may cross block boundaries, and the directory ends at the first
+    // entry with a size of zero
+    size_t offset = sizeof(LXFSDirectoryHeader);
+    while((offset + ENTRY_HEADER) <= size) {
+        LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t) ck->buffer + offset);
+        if(!entry->entrySize) break;
+
+        if((entry->entrySize <= ENTRY_HEADER) || (entry->entrySize > sizeof(LXFSDirectoryEntry)) ||
+        ((offset + entry->entrySize) > size)) {
+            // nothing after a corrupt entry can be found, so the directory ends there
+            if(problem(path, 1, "corrupt entry of %u bytes at offset %lu, the rest of the directory is lost",
+                       entry->entrySize, offset)) {
+                memset(entry, 0, size - offset);
+                if(offset < lowDirty) lowDirty = offset;
+                highDirty = size;
+            }
+
+            break;
+        }
+
+        if(entry->flags & LXFS_DIR_VALID) {
+            if(checkEntry(ck, path, entry)) {
+                // delete the entry the same way unlinking does
+                entry->flags = LXFS_DIR_DELETED;
+                entry->block = 0;
+                entry->permissions = 0;
+                entry->createTime = 0;
+                entry->accessTime = 0;
+                entry->modTime = 0;
+                entry->owner = 0;
+                entry->group = 0;
+                memset(entry->name, 0, entry->entrySize - ENTRY_HEADER);
+                if(offset < lowDirty) lowDirty = offset;
+                if((offset + entry->entrySize) > highDirty) highDirty = offset + entry->entrySize;
+            } else {
+                count++;
+            }
+        }
+
+        offset += entry->entrySize;
+    }
+
+    if(header->index) {
+        if(claim(path, "hash index", header->index)) {
+            // the driver builds a new one when it needs it
+            header->index = 0;
+            lowDirty = 0;
+            if(highDirty < sizeof(LXFSDirectoryHeader)) highDirty = sizeof(LXFSDirectoryHeader);
+        } else {
+            walkChain(ck, path, "hash index", header->index, 0);
+        }
+    }
+
+    if(header->sizeEntries != count) {
+        if(problem(path, 1, "directory records %lu entries but holds %lu", header->sizeEntries, count)) {
+            header->sizeEntries = count;
+            lowDirty = 0;
+            if(highDirty < sizeof(LXFSDirectoryHeader)) highDirty = sizeof(LXFSDirectoryHeader);
+        }
+    }
+
+    if(header->sizeBytes != offset) {
+        if(problem(path, 1, "directory records a size of %lu bytes but its entries end at %lu",
+                   header->sizeBytes, offset)) {
+            header->sizeBytes = offset;
+            lowDirty = 0;
+            if(highDirty < sizeof(LXFSDirectoryHeader)) highDirty = sizeof(LXFSDirectoryHeader);
+        }
+    }
+
+    if(repair && (lowDirty < highDirty)) {
+        for(size_t i = lowDirty / blockSize; i <= ((highDirty - 1) / blockSize); i++)
+            writeBlocks(ck->chain[i], 1, (const void *)((uintptr_t) ck->buffer + (i * blockSize)));
+    }
+
+    if(ck->batch) {
+        push(ck->batch);
+        ck->batch = NULL;
+    }
+}
+
+/* worker(): takes work from the queue until every directory has been walked
+ * params: arg - checker of the thread
+ * returns: NULL
+ */
+
+static void *worker(void *arg) {
+    Checker *ck = (Checker *) arg;
+
+    for(;;) {
+        pthread_mutex_lock(&queueLock);
+        while(!queue && busy) pthread_cond_wait(&queueCond, &queueLock);
+
+        Work *work = queue;
+        if(!work) {
+            // nothing is queued and nothing more can be, so everyone is done
+            pthread_cond_broadcast(&queueCond);
+            pthread_mutex_unlock(&queueLock);
+            return NULL;
+        }
+
+        queue = work->next;
+        busy++;
+        pthread_mutex_unlock(&queueLock);
+
+        if(work->dir) {
+            checkDirectory(ck, work->dir, work->path);
+        } else {
+            __atomic_add_fetch(&files, work->count, __ATOMIC_RELAXED);
+            for(size_t i = 0; i < work->count; i++) checkFile(ck, work->path, work->files[i]);
+        }
+
+        free(work->path);
+        free(work);
+
+        pthread_mutex_lock(&queueLock);
+        busy--;
+        if(!queue && !busy) pthread_cond_broadcast(&queueCond);
+        pthread_mutex_unlock(&queueLock);
+    }
+}
+
+/* journalChecksum(): helper function to checksum part of the log
+ * params: data - data to checksum
+ * params: size - size in bytes, a multiple of eight
+ * returns: 64-bit FNV-1a hash of the data, as the driver computes it
+ */
+
+static uint64_t journalChecksum(const void *data, size_t size) {
+    const uint64_t *words = (const uint64_t *) data;
+    uint64_t hash = 0xCBF29CE484222325;
+    for(size_t i = 0; i < (size / 8); i++) {
+        hash ^= words[i];
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+/* openJournal(): finds the transactions left in the metadata journal
+ * params: none
+ * returns: number of transactions, negative on fail
+ */
+
+static int openJournal() {
+    void *log = malloc(LXFS_JOURNAL_BLOCKS * blockSize);
+    if(!log) return -1;
+
+    if(readBlocks(LXFS_JOURNAL_START, LXFS_JOURNAL_BLOCKS, log)) {
+        free(log);
+        return -1;
+    }
+
+    LXFSJournalHeader *header = (LXFSJournalHeader *) log;
+    if(header->magic != LXFS_JOURNAL_MAGIC) {
+        free(log);
+        return 0;
+    }
+
+    // the same scan as on mount, which stops at the first torn transaction
+    int transactions = 0;
+    uint64_t head = 0;
+    uint64_t sequence = header->sequence;
+    while(head < (LXFS_JOURNAL_LOG - 1)) {
+        LXFSJournalDescriptor *desc = (LXFSJournalDescriptor *)((uintptr_t) log + ((head + 1) * blockSize));
+        if((desc->magic != LXFS_JOURNAL_COMMIT) || (desc->sequence != sequence)) break;
+        if(!desc->count || (desc->count > (LXFS_JOURNAL_LOG - 1 - head))) break;
+
+        uint64_t checksum = desc->checksum;
+        desc->checksum = 0;
+        int intact = checksum == journalChecksum(desc, (desc->count + 1) * blockSize);
+        desc->checksum = checksum;
+        if(!intact) break;
+
+        for(uint64_t i = 0; i < desc->count; i++) {
+            if((desc->blocks[i] < (LXFS_JOURNAL_START + LXFS_JOURNAL_BLOCKS)) || (desc->blocks[i] >= volumeSize))
+                intact = 0;
+        }
+
+        if(!intact) break;
+
+        // later images of a block replace earlier ones
+        for(uint64_t i = 0; i < desc->count; i++) {
+            uint64_t slot = 0;
+            while((slot < overlayCount) && (overlayBlocks[slot] != desc->blocks[i])) slot++;
+            overlayBlocks[slot] = desc->blocks[i];
+            overlayImages[slot] = (void *)((uintptr_t) desc + ((i + 1) * blockSize));
+            if(slot == overlayCount) overlayCount++;
+        }
+
+        head += desc->count + 1;
+        sequence++;
+        transactions++;
+    }
+
+    if(!transactions) {
+        free(log);
+        return 0;
+    }
+
+    if(!repair) return transactions;    // the log stays around for the overlay
+
+    // write the transactions in place and empty the log, as mounting would
+    for(uint64_t i = 0; i < overlayCount; i++) {
+        if(writeBlocks(overlayBlocks[i], 1, overlayImages[i])) {
+            free(log);
+            return -1;
+        }
+    }
+
+    overlayCount = 0;
+    memset(header, 0, blockSize);
+    header->magic = LXFS_JOURNAL_MAGIC;
+    header->sequence = sequence;
+    int status = writeBlocks(LXFS_JOURNAL_START, 1, header);
+    free(log);
+    return status ? -1 : transactions;
+}
+
+/* checkLinks(): compares the link count of every file with the number of
+ * entries pointing to it
+ * params: checkers - checkers of all threads
+ * params: threads - number of threads
+ * returns: nothing
+ */
+
+static int compareBlocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void checkLinks(Checker *checkers, int threads) {
+    size_t total = 0;
+    for(int i = 0; i < threads; i++) total += checkers[i].refCount;
+
+    uint64_t *refs = malloc((total + 1) * sizeof(uint64_t));
+    void *block = malloc(blockSize);
+    if(!refs || !block) {
+        problem(NULL, 0, "not enough memory to check link counts");
+        free(refs);
+        free(block);
+        return;
+    }
+
+    total = 0;
+    for(int i = 0; i < threads; i++) {
+        memcpy(&refs[total], checkers[i].refs, checkers[i].refCount * sizeof(uint64_t));
+        total += checkers[i].refCount;
+    }
+
+    qsort(refs, total, sizeof(uint64_t), compareBlocks);
+
+    for(int i = 0; i < threads; i++) {
+        for(size_t j = 0; j < checkers[i].claimCount; j++) {
+            Claim *claim = &checkers[i].claims[j];
+
+            // find the run of references to this file
+            size_t low = 0, high = total;
+            while(low < high) {
+                size_t mid = (low + high) / 2;
+                if(refs[mid] < claim->block) low = mid + 1;
+                else high = mid;
+            }
+
+            uint64_t count = 0;
+            while(((low + count) < total) && (refs[low + count] == claim->block)) count++;
+
+            if(claim->refCount == count) continue;
+
+            char name[48];
+            sprintf(name, "file at block %lu", claim->block);
+            if(problem(name, 1, "link count is %lu but %lu entries point to it", claim->refCount, count)) {
+                if(!readBlocks(claim->block, 1, block)) {
+                    ((LXFSFileHeader *) block)->refCount = count;
+                    writeBlocks(claim->block, 1, block);
+                }
+            }
+        }
+    }
+
+    free(refs);
+    free(block);
+}
+
+/* checkTable(): checks the reserved entries of the block table and finds
+ * blocks that are allocated but were never reached
+ * params: none
+ * returns: nothing
+ */
+
+static void checkTable() {
+    for(uint64_t b = 0; b < firstData; b++) {
+        uint64_t expected;
+        if(!b) expected = LXFS_BLOCK_ID;
+        else if(b < LXFS_TABLE_START) expected = LXFS_BLOCK_BOOT;
+        else expected = LXFS_BLOCK_TABLE;
+
+        if(table[b] != expected) {
+            if(problem(NULL, 1, "reserved block %lu is marked %lx in the block table", b, table[b]))
+                setNext(b, expected);
+        }
+    }
+
+    uint64_t leaked = 0;
+    for(uint64_t b = firstData; b < volumeSize; b++) {
+        if((table[b] == LXFS_BLOCK_FREE) || (marks[b / 32] & ((uint64_t) MARK_USED << ((b % 32) * 2)))) continue;
+
+        leaked++;
+        if(verbose) printf("block %lu is allocated but not used by any file\n", b);
+        if(repair) setNext(b, LXFS_BLOCK_FREE);
+    }
+
+    if(leaked) problem(NULL, 1, "%lu blocks are allocated but not used by any file", leaked);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-r] [-j threads] [-v] device\n", name);
+    fprintf(stderr, "  -r  repair the problems found, the volume must not be mounted\n");
+    fprintf(stderr, "  -j  number of threads walking directories (default one per CPU)\n");
+    fprintf(stderr, "  -v  list every leaked block\n");
+}
+
+int main(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while((opt = getopt(argc, argv, "rj:v")) != -1) {
+        switch(opt) {
+        case 'r': repair = 1; break;
+        case 'j': threads = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return 8;
+        }
+    }
+
+    if(((argc - optind) != 1) || (threads < 1)) {
+        usage(argv[0]);
+        return 8;
+    }
+
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+
+    device = argv[optind];
+    fd = open(device, repair ? O_RDWR : O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], device, strerror(errno));
+        return 8;
+    }
+
+    double start = now();
+
+    LXFSIdentification id;
+    if((pread(fd, &id, sizeof(LXFSIdentification), 0) != sizeof(LXFSIdentification)) ||
+    (id.identifier != LXFS_MAGIC)) {
+        fprintf(stderr, "%s: %s is not an lxfs volume\n", argv[0], device);
+        return 8;
+    }
+
+    uint64_t sectorSize = 512 << ((id.parameters >> LXFS_ID_SECTOR_SIZE_SHIFT) & LXFS_ID_SECTOR_SIZE_MASK);
+    blockSize = sectorSize * (((id.parameters >> LXFS_ID_BLOCK_SIZE_SHIFT) & LXFS_ID_BLOCK_SIZE_MASK) + 1);
+    volumeSize = id.volumeSize;
+    entries = blockSize / 8;
+    tableBlocks = (volumeSize + entries - 1) / entries;
+    firstData = LXFS_TABLE_START + tableBlocks;
+    root = id.rootBlock;
+    extents = id.version >= LXFS_VERSION_EXTENTS;
+    dedup = (id.features & LXFS_FEATURE_DEDUP) != 0;
+
+    if((volumeSize <= firstData) || !valid(root)) {
+        fprintf(stderr, "%s: %s has an invalid identification block\n", argv[0], device);
+        return 8;
+    }
+
+    table = malloc(tableBlocks * blockSize);
+    marks = calloc((volumeSize + 31) / 32, sizeof(uint64_t));
+    tableDirty = calloc(tableBlocks, 1);
+    if(!table || !marks || !tableDirty) {
+        fprintf(stderr, "%s: not enough memory for the block table of %s\n", argv[0], device);
+        return 8;
+    }
+
+    // the journal is only there on v2 volumes that aren't bootable, and
+    // replaying it may change the block table itself
+    if(extents && !(id.parameters & LXFS_ID_BOOTABLE)) {
+        int transactions = openJournal();
+        if(transactions < 0) {
+            fprintf(stderr, "%s: unable to read the journal of %s\n", argv[0], device);
+            return 8;
+        }
+
+        if(transactions) printf("%s: %s %d journal transactions\n", device,
+                                repair ? "replayed" : "checking as if mounted, with", transactions);
+    }
+
+    // the whole table is read at once, in large requests
+    uint64_t chunk = (8 << 20) / blockSize;
+    for(uint64_t t = 0; t < tableBlocks; t += chunk) {
+        uint64_t count = (tableBlocks - t) < chunk ? (tableBlocks - t) : chunk;
+        if(readBlocks(LXFS_TABLE_START + t, count, (void *)((uintptr_t) table + (t * blockSize)))) {
+            fprintf(stderr, "%s: unable to read the block table of %s\n", argv[0], device);
+            return 8;
+        }
+    }
+
+    // blocks before the data area can't be part of any chain
+    for(uint64_t b = 0; b < firstData; b++) mark(b, MARK_USED);
+
+    Checker *checkers = calloc(threads, sizeof(Checker));
+    Work *work = calloc(1, sizeof(Work));
+    if(!checkers || !work) return 8;
+
+    for(int i = 0; i < threads; i++) {
+        checkers[i].buffer = malloc(blockSize);
+        checkers[i].bufferSize = blockSize;
+        if(!checkers[i].buffer) return 8;
+    }
+
+    mark(root, MARK_USED | MARK_HEAD);
+    work->dir = root;
+    work->path = strdup("/");
+    push(work);
+
+    for(int i = 0; i < threads; i++) {
+        if(pthread_create(&checkers[i].thread, NULL, worker, &checkers[i])) {
+            fprintf(stderr, "%s: unable to start thread %d\n", argv[0], i);
+            return 8;
+        }
+    }
+
+    for(int i = 0; i < threads; i++) pthread_join(checkers[i].thread, NULL);
+
+    checkLinks(checkers, threads);
+    checkTable();
+
+    if(repair) {
+        for(uint64_t t = 0; t < tableBlocks; t++) {
+            if(tableDirty[t]) writeBlocks(LXFS_TABLE_START + t, 1, (const void *)((uintptr_t) table + (t * blockSize)));
+        }
+
+        fsync(fd);
+    }
+
+    double elapsed = now() - start;
+    double gb = (double) (volumeSize * blockSize) / (1 << 30);
+
+    printf("%s: %lu directories, %lu files, %lu symbolic links, %lu blocks of %lu bytes\n", device,
+           directories, files, links, volumeSize, blockSize);
+    if(!errors) printf("%s: clean\n", device);
+    else printf("%s: problems found: %lu, repaired: %lu\n", device, errors, repaired);
+    printf("%s: checked %.2f GB in %.2f s with %d threads, %.1f GB/min, %.1f MB of metadata read\n",
+           device, gb, elapsed, threads, gb * 60 / elapsed, (double) bytesRead / (1 << 20));
+
+    close(fd);
+    if(!errors) return 0;
+    return (errors == repaired) ? 1 : 4;
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "host.h"
+
+static void *response = NULL;
+static size_t responseSize = 0;
+static int verbose = 0;
+
+/* luxHostResponse(): returns the last response sent by the driver
+ * the pointer is only valid until the next request
+ * params: none
+ * returns: pointer to the response, NULL if there was none
+ */
+
+void *luxHostResponse() {
+    return response;
+}
+
+/* luxHostVerbose(): sets whether log messages of the driver are printed
+ * params: level - non-zero to print them to stderr
+ * returns: nothing
+ */
+
+void luxHostVerbose(int level) {
+    verbose = level;
+}
+
+/* luxHostKeep(): helper function to keep a copy of a response
+ * requests such as memory usage polls are dropped, as nothing answers them
+ * params: msg - message sent by the driver
+ * returns: size of the message, negative on fail
+ */
+
+static ssize_t luxHostKeep(void *msg) {
+    MessageHeader *header = (MessageHeader *) msg;
+    if(!header->response) return header->length;
+
+    if(header->length > responseSize) {
+        void *buffer = realloc(response, header->length);
+        if(!buffer) return -1;
+        response = buffer;
+        responseSize = header->length;
+    }
+
+    memcpy(response, msg, header->length);
+    return header->length;
+}
+
+pid_t luxGetSelf() {
+    return getpid();
+}
+
+ssize_t luxSendKernel(void *msg) {
+    return luxHostKeep(msg);
+}
+
+ssize_t luxSendDependency(void *msg) {
+    return luxHostKeep(msg);
+}
+
+ssize_t luxSendLumen(void *msg) {
+    return luxHostKeep(msg);
+}
+
+// there are no servers to connect to, so the driver uses the image file directly
+int luxConnectServer(const char *server) {
+    return -1;
+}
+
+ssize_t luxSend(int sd, void *msg) {
+    return -1;
+}
+
+ssize_t luxRecv(int sd, void *buffer, size_t len, bool block, bool peek) {
+    return 0;
+}
+
+void luxLog(int level, const char *msg) {
+    if(verbose) fputs(msg, stderr);
+}
+
+void luxLogf(int level, const char *f, ...) {
+    if(!verbose) return;
+
+    va_list args;
+    va_start(args, f);
+    vfprintf(stderr, f, args);
+    va_end(args);
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#pragma once
+
+/* Host build: the driver only does block I/O through open(), read(), write()
+ * and lseek() on the device file, so it runs unmodified against an image file
+ * on the build machine once the messaging of liblux is replaced. The stand-in
+ * in host.c keeps the last response the driver sent instead of delivering it,
+ * and tells the driver that no server can be connected to, so it never tries
+ * to attach to sdev. */
+
+void *luxHostResponse();
+void luxHostVerbose(int);
\ No newline at end of file
@@ -0,0 +1,178 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+/* lxfs-mkfs: creates an empty lxfs volume in an image file
+ * usage: lxfs-mkfs [-s sector size] [-b sectors per block] [-v version] [-c] [-a] [-d] [-n name] image size
+ *
+ * The size is in bytes, optionally followed by K, M or G. The image is made
+ * sparse, so only the identification block, the used part of the block table
+ * and the root directory are actually written. Volumes are never bootable,
+ * which leaves the reserved blocks free for the metadata journal of v2. */
+
+#include <lxfs/lxfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* parseSize(): helper function to parse a size with an optional suffix
+ * params: s - string to parse
+ * returns: size in bytes, zero if invalid
+ */
+
+static uint64_t parseSize(const char *s) {
+    char *end;
+    uint64_t size = strtoull(s, &end, 10);
+
+    switch(*end) {
+    case 'G': case 'g': size <<= 10;
+    case 'M': case 'm': size <<= 10;
+    case 'K': case 'k': size <<= 10; end++;
+    }
+
+    if(*end) return 0;
+    return size;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s sector size] [-b sectors per block] [-v version] [-c] [-a] [-d] [-n name] image size\n", name);
+    fprintf(stderr, "  -s  bytes per sector, 512, 1024, 2048 or 4096 (default 512)\n");
+    fprintf(stderr, "  -b  sectors per block, 1 to 16 (default 4)\n");
+    fprintf(stderr, "  -v  1, or 2 for extent maps and the metadata journal (default 2)\n");
+    fprintf(stderr, "  -c  compress new files, v2 only\n");
+    fprintf(stderr, "  -a  append mode, allocate new blocks at a log head\n");
+    fprintf(stderr, "  -d  deduplicate, files with the same contents share their blocks\n");
+    fprintf(stderr, "  -n  volume name, up to 16 characters\n");
+}
+
+int main(int argc, char **argv) {
+    int sectorSize = 512, blockSize = 4, version = LXFS_VERSION_EXTENTS;
+    int compress = 0, append = 0, dedup = 0;
+    const char *name = "lxfs";
+
+    int opt;
+    while((opt = getopt(argc, argv, "s:b:v:cadn:")) != -1) {
+        switch(opt) {
+        case 's': sectorSize = atoi(optarg); break;
+        case 'b': blockSize = atoi(optarg); break;
+        case 'v': version = atoi(optarg); break;
+        case 'c': compress = 1; break;
+        case 'a': append = 1; break;
+        case 'd': dedup = 1; break;
+        case 'n': name = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((argc - optind) != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int sectorShift = -1;
+    for(int i = 0; i <= LXFS_ID_SECTOR_SIZE_MASK; i++) {
+        if(sectorSize == (512 << i)) sectorShift = i;
+    }
+
+    if(sectorShift < 0 || (blockSize < 1) || (blockSize > (LXFS_ID_BLOCK_SIZE_MASK + 1)) ||
+    (version < LXFS_VERSION) || (version > LXFS_VERSION_EXTENTS) || (strlen(name) > 16)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(compress && (version < LXFS_VERSION_EXTENTS)) {
+        fprintf(stderr, "%s: compression needs a v2 volume\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    uint64_t bytes = parseSize(argv[optind+1]);
+    uint64_t blockSizeBytes = sectorSize * blockSize;
+    uint64_t volumeSize = bytes / blockSizeBytes;
+    uint64_t entries = blockSizeBytes / 8;
+    uint64_t tableSize = (volumeSize + entries - 1) / entries;
+    uint64_t root = LXFS_TABLE_START + tableSize;
+
+    if(volumeSize <= (root + 1)) {
+        fprintf(stderr, "%s: %s is too small for a volume\n", argv[0], argv[optind+1]);
+        return 1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+        return 1;
+    }
+
+    if(ftruncate(fd, volumeSize * blockSizeBytes)) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    void *block = calloc(1, blockSizeBytes);
+    if(!block) {
+        close(fd);
+        return 1;
+    }
+
+    int status = 0;
+
+    // identification block
+    LXFSIdentification *id = (LXFSIdentification *) block;
+    id->identifier = LXFS_MAGIC;
+    id->volumeSize = volumeSize;
+    id->rootBlock = root;
+    id->parameters = (sectorShift << LXFS_ID_SECTOR_SIZE_SHIFT) | ((blockSize - 1) << LXFS_ID_BLOCK_SIZE_SHIFT);
+    if(compress) id->parameters |= LXFS_ID_COMPRESS;
+    id->version = version;
+    memcpy(id->name, name, strlen(name));
+    if(append) id->features |= LXFS_FEATURE_APPEND;
+    if(dedup) id->features |= LXFS_FEATURE_DEDUP;
+
+    if(pwrite(fd, block, blockSizeBytes, 0) != blockSizeBytes) status = 1;
+
+    // block table, of which only the blocks covering the reserved blocks, the
+    // table itself and the root directory hold anything
+    uint64_t *table = (uint64_t *) block;
+    for(uint64_t t = 0; !status && (t <= (root / entries)); t++) {
+        memset(block, 0, blockSizeBytes);
+        for(uint64_t i = 0; i < entries; i++) {
+            uint64_t b = (t * entries) + i;
+            if(!b) table[i] = LXFS_BLOCK_ID;
+            else if(b < LXFS_TABLE_START) table[i] = LXFS_BLOCK_BOOT;
+            else if(b < root) table[i] = LXFS_BLOCK_TABLE;
+            else if(b == root) table[i] = LXFS_BLOCK_EOF;
+        }
+
+        if(pwrite(fd, block, blockSizeBytes, (LXFS_TABLE_START + t) * blockSizeBytes) != blockSizeBytes) status = 1;
+    }
+
+    // empty root directory
+    memset(block, 0, blockSizeBytes);
+    LXFSDirectoryHeader *dir = (LXFSDirectoryHeader *) block;
+    dir->createTime = time(NULL);
+    dir->modTime = dir->createTime;
+    dir->accessTime = dir->createTime;
+    dir->sizeBytes = sizeof(LXFSDirectoryHeader);
+
+    if(!status && (pwrite(fd, block, blockSizeBytes, root * blockSizeBytes) != blockSizeBytes)) status = 1;
+
+    if(status) fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+    else printf("%s: %lu blocks of %lu bytes, v%d%s%s%s, root directory at block %lu\n", path,
+                volumeSize, blockSizeBytes, version, compress ? ", compressed" : "",
+                append ? ", append mode" : "", dedup ? ", deduplicated" : "", root);
+
+    free(block);
+    close(fd);
+    return status;
+}
\ No newline at end of file
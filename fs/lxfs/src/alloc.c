@@ -0,0 +1,359 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+
+/* Block allocation: blocks are allocated as runs of contiguous blocks found
+ * by scanning the block table from a goal, which is the block after the end
+ * of the file being extended. New files start at a rotor that leaves room
+ * after each file so it can keep growing in place, and open files reserve
+ * the free blocks following their last run in memory so that interleaved
+ * appends to several files don't fragment each other.
+ *
+ * Volumes in append mode, meant for rotating disks, instead allocate every
+ * new block, data or metadata, at a log head that only moves forward through
+ * the free space, so that writes land one after another rather than next to
+ * whichever file they belong to. This leaves files that grew in small steps
+ * fragmented, so they are rewritten in one piece at the log head later on,
+ * which also frees the blocks they were scattered over. */
+
+/* lxfsReservations(): helper function to collect the reservations of other files
+ * params: mp - mountpoint
+ * params: owner - open file whose reservation may be used, NULL if none
+ * params: count - pointer to store the number of reservations
+ * returns: list of reserved runs, NULL if none
+ */
+
+static BlockRun *lxfsReservations(Mountpoint *mp, OpenFile *owner, size_t *count) {
+    BlockRun *runs = NULL;
+    size_t max = 0;
+    *count = 0;
+
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->reserveCount && (!owner || (file->entry.block != owner->entry.block))) {
+                if(*count == max) {
+                    BlockRun *list = realloc(runs, (max + 16) * sizeof(BlockRun));
+                    if(!list) return runs;  // best effort
+                    runs = list;
+                    max += 16;
+                }
+
+                runs[*count].block = file->reserveStart;
+                runs[*count].count = file->reserveCount;
+                (*count)++;
+            }
+
+            file = file->next;
+        }
+    }
+
+    return runs;
+}
+
+/* lxfsReservedEnd(): helper function to check if a block is reserved
+ * params: block - block number
+ * params: reserved - list of reserved runs
+ * params: count - number of reserved runs
+ * returns: first block after the reservation covering the block, zero if not reserved
+ */
+
+static uint64_t lxfsReservedEnd(uint64_t block, BlockRun *reserved, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        if((block >= reserved[i].block) && (block < (reserved[i].block + reserved[i].count)))
+            return reserved[i].block + reserved[i].count;
+    }
+
+    return 0;
+}
+
+/* lxfsScanRun(): helper function to find a run of free blocks in a range
+ * params: mp - mountpoint
+ * params: from - first block to scan
+ * params: to - block to stop at
+ * params: count - number of blocks wanted
+ * params: reserved - list of runs reserved by other files
+ * params: reservedCount - number of reserved runs
+ * params: best - pointer to the longest run found so far, updated
+ * params: bestLength - pointer to its length, updated
+ * returns: first block of a run of at least count blocks, zero if none
+ */
+
+static uint64_t lxfsScanRun(Mountpoint *mp, uint64_t from, uint64_t to, uint64_t count,
+                            BlockRun *reserved, size_t reservedCount,
+                            uint64_t *best, uint64_t *bestLength) {
+    uint64_t start = 0, length = 0;
+    for(uint64_t i = from; i < to; i++) {
+        uint64_t end = lxfsReservedEnd(i, reserved, reservedCount);
+        if(end || (lxfsNextBlock(mp, i) != LXFS_BLOCK_FREE)) {
+            length = 0;
+            if(end) i = end - 1;
+            continue;
+        }
+
+        if(!length) start = i;
+        length++;
+
+        if(length > *bestLength) {
+            *best = start;
+            *bestLength = length;
+        }
+
+        if(length >= count) return start;
+    }
+
+    return 0;
+}
+
+/* lxfsFindRun(): helper function to find free blocks starting as close as
+ * possible after a goal
+ * params: mp - mountpoint
+ * params: goal - block to start searching from
+ * params: count - number of blocks wanted
+ * params: owner - open file the blocks are for, NULL if none
+ * params: contiguous - non-zero to fail rather than return a shorter run
+ * params: length - pointer to store the length of the run found
+ * returns: first block of the run, zero if none
+ */
+
+static uint64_t lxfsFindRun(Mountpoint *mp, uint64_t goal, uint64_t count, OpenFile *owner,
+                            int contiguous, uint64_t *length) {
+    size_t reservedCount;
+    BlockRun *reserved = lxfsReservations(mp, owner, &reservedCount);
+
+    if((goal < LXFS_TABLE_START) || (goal >= mp->volumeSize)) goal = LXFS_TABLE_START;
+
+    uint64_t best = 0, bestLength = 0;
+    uint64_t start = lxfsScanRun(mp, goal, mp->volumeSize, count, reserved, reservedCount, &best, &bestLength);
+    if(!start && (goal > LXFS_TABLE_START))
+        start = lxfsScanRun(mp, LXFS_TABLE_START, goal, count, reserved, reservedCount, &best, &bestLength);
+
+    if(!start && reservedCount && !bestLength) {
+        // the volume is nearly full, reservations are only a hint
+        free(reserved);
+        reserved = NULL;
+        reservedCount = 0;
+        start = lxfsScanRun(mp, LXFS_TABLE_START, mp->volumeSize, count, NULL, 0, &best, &bestLength);
+    }
+
+    free(reserved);
+
+    if(start) {
+        *length = count;
+        return start;
+    }
+
+    // no run is long enough, settle for the longest one
+    if(contiguous || !bestLength) return 0;
+    *length = bestLength;
+    return best;
+}
+
+/* lxfsLinkRun(): helper function to chain a run of contiguous blocks
+ * params: mp - mountpoint
+ * params: start - first block
+ * params: count - number of blocks
+ * params: next - block the last block of the run links to
+ * returns: zero on success
+ */
+
+static int lxfsLinkRun(Mountpoint *mp, uint64_t start, uint64_t count, uint64_t next) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t block = start + i;
+        uint64_t *entry = lxfsTableEntry(mp, block, 1);
+        if(!entry) return 1;
+
+        if(i == (count - 1)) *entry = next;
+        else *entry = block + 1;
+    }
+
+    // write through the block table once per table block rather than per entry
+    for(uint64_t table = start / entries; table <= ((start + count - 1) / entries); table++) {
+        if(lxfsJournalBlock(mp, LXFS_TABLE_START + table)) return 1;
+    }
+
+    return 0;
+}
+
+/* lxfsFreeRun(): frees a run of contiguous blocks
+ * params: mp - mountpoint
+ * params: start - first block
+ * params: count - number of blocks
+ * returns: zero on success
+ */
+
+int lxfsFreeRun(Mountpoint *mp, uint64_t start, uint64_t count) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t block = start + i;
+        uint64_t *entry = lxfsTableEntry(mp, block, 1);
+        if(!entry) return 1;
+        *entry = LXFS_BLOCK_FREE;
+    }
+
+    for(uint64_t table = start / entries; table <= ((start + count - 1) / entries); table++) {
+        if(lxfsJournalBlock(mp, LXFS_TABLE_START + table)) return 1;
+    }
+
+    return 0;
+}
+
+/* lxfsFreeChain(): frees a chain of blocks a run at a time
+ * params: mp - mountpoint
+ * params: first - first block of the chain
+ * returns: nothing
+ */
+
+void lxfsFreeChain(Mountpoint *mp, uint64_t first) {
+    uint64_t block = first;
+    while(block && (block != LXFS_BLOCK_EOF)) {
+        uint64_t start = block, count = 0;
+        uint64_t next;
+        do {
+            next = lxfsNextBlock(mp, block);
+            count++;
+            if(next != (block + 1)) break;
+            block = next;
+        } while(1);
+
+        lxfsFreeRun(mp, start, count);
+        block = next;
+    }
+}
+
+/* lxfsReserve(): helper function to reserve the free blocks after the last
+ * block of an open file for its next appends
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: last - last block of the file
+ * returns: nothing
+ */
+
+static void lxfsReserve(Mountpoint *mp, OpenFile *file, uint64_t last) {
+    size_t reservedCount;
+    BlockRun *reserved = lxfsReservations(mp, file, &reservedCount);
+
+    uint64_t count = 0;
+    while((count < ALLOC_RESERVE) && ((last + 1 + count) < mp->volumeSize)) {
+        uint64_t block = last + 1 + count;
+        if(lxfsReservedEnd(block, reserved, reservedCount)) break;
+        if(lxfsNextBlock(mp, block) != LXFS_BLOCK_FREE) break;
+        count++;
+    }
+
+    free(reserved);
+    file->reserveStart = last + 1;
+    file->reserveCount = count;
+}
+
+/* lxfsAllocate(): allocates new blocks
+ * params: mp - mountpoint
+ * params: count - number of blocks to allocate
+ * params: goal - block to allocate at or after, zero to place a new file,
+ * ignored in append mode
+ * params: owner - open file the blocks are for, NULL if none
+ * returns: first block in chain, zero on fail
+ */
+
+uint64_t lxfsAllocate(Mountpoint *mp, uint64_t count, uint64_t goal, OpenFile *owner) {
+    if(!count) return 0;
+
+    int placing = !goal;
+    if(mp->append) goal = mp->logHead;
+    else if(placing) goal = mp->allocRotor;
+
+    uint64_t first = 0, prev = 0, remaining = count;
+    while(remaining) {
+        uint64_t length;
+        uint64_t start = lxfsFindRun(mp, goal, remaining, owner, 0, &length);
+        if(!start || lxfsLinkRun(mp, start, length, LXFS_BLOCK_EOF) ||
+        (prev && lxfsSetNextBlock(mp, prev, start))) {
+            // give back what was already allocated
+            uint64_t block = first;
+            while(block && (block != LXFS_BLOCK_EOF)) {
+                uint64_t next = lxfsNextBlock(mp, block);
+                lxfsSetNextBlock(mp, block, LXFS_BLOCK_FREE);
+                if(block == prev) break;
+                block = next;
+            }
+
+            if(start) lxfsFreeRun(mp, start, length);
+            return 0;
+        }
+
+        if(!first) first = start;
+        prev = start + length - 1;
+        remaining -= length;
+        goal = prev + 1;
+    }
+
+    if(mp->append) {
+        mp->logHead = prev + 1;
+        if(owner) owner->appended = 1;
+        return first;
+    }
+
+    // leave room after a new file before placing the next one
+    if(placing) {
+        mp->allocRotor = prev + 1 + ALLOC_SPREAD;
+        if(mp->allocRotor >= mp->volumeSize) mp->allocRotor = LXFS_TABLE_START;
+    }
+
+    if(owner) lxfsReserve(mp, owner, prev);
+    return first;
+}
+
+/* lxfsAllocateRun(): allocates a run of contiguous blocks
+ * params: mp - mountpoint
+ * params: count - number of blocks to allocate
+ * params: goal - block to allocate at or after
+ * returns: first block of the run, chained and terminated, zero on fail
+ */
+
+uint64_t lxfsAllocateRun(Mountpoint *mp, uint64_t count, uint64_t goal) {
+    if(!count) return 0;
+    if(mp->append) goal = mp->logHead;
+
+    uint64_t length;
+    uint64_t start = lxfsFindRun(mp, goal, count, NULL, 1, &length);
+    if(!start) return 0;
+
+    if(lxfsLinkRun(mp, start, count, LXFS_BLOCK_EOF)) {
+        lxfsFreeRun(mp, start, count);
+        return 0;
+    }
+
+    if(mp->append) mp->logHead = start + count;
+    return start;
+}
+
+/* lxfsFreeRuns(): counts the runs of free blocks on a volume
+ * params: mp - mountpoint
+ * params: largest - pointer to store the length of the largest run, optional
+ * returns: number of runs of free blocks
+ */
+
+uint64_t lxfsFreeRuns(Mountpoint *mp, uint64_t *largest) {
+    uint64_t runs = 0, length = 0, max = 0;
+    for(uint64_t i = LXFS_TABLE_START; i < mp->volumeSize; i++) {
+        if(lxfsNextBlock(mp, i) == LXFS_BLOCK_FREE) {
+            if(!length) runs++;
+            length++;
+            if(length > max) max = length;
+        } else {
+            length = 0;
+        }
+    }
+
+    if(largest) *largest = max;
+    return runs;
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Cleaning in append mode: since blocks are handed out at the log head in the
+ * order they are asked for, a file that grew alongside others or a little at
+ * a time ends up spread over the log. Such files are queued by path when they
+ * are closed, and while the volume is idle they are rewritten one at a time
+ * as a single run at the log head. That turns their later reads sequential
+ * and frees the scattered blocks, so the older parts of the log become free
+ * space again. Paths are looked up again before cleaning, so a file that was
+ * deleted or replaced in the meantime is simply skipped or cleaned as is. */
+
+/* lxfsAppendQueue(): queues a file that was just closed for cleaning if it
+ * grew at the log head and is fragmented
+ * params: mp - mountpoint
+ * params: file - open file being released
+ * returns: nothing
+ */
+
+void lxfsAppendQueue(Mountpoint *mp, OpenFile *file) {
+    if(!mp->append || !file->appended || file->inlined) return;
+    if(mp->cleanCount >= APPEND_CLEAN_MAX) return;
+
+    ChainIndex *index = lxfsChainIndex(mp, file->entry.block);
+    uint64_t extents = index ? index->extentCount : lxfsExtents(mp, file->entry.block, NULL);
+    if(extents <= APPEND_FRAGMENTED) return;
+
+    for(size_t i = 0; i < mp->cleanCount; i++) {
+        if(!strcmp(mp->cleanQueue[i], file->path)) return;
+    }
+
+    char *path = strdup(file->path);
+    if(!path) return;   // best effort
+
+    mp->cleanQueue[mp->cleanCount] = path;
+    mp->cleanCount++;
+}
+
+/* lxfsAppendClean(): rewrites the oldest queued file at the log head
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+void lxfsAppendClean(Mountpoint *mp) {
+    if(!mp->cleanCount) return;
+
+    char *path = mp->cleanQueue[0];
+    mp->cleanCount--;
+    memmove(&mp->cleanQueue[0], &mp->cleanQueue[1], mp->cleanCount * sizeof(char *));
+
+    LXFSDirectoryEntry entry;
+    if(lxfsFind(&entry, mp, path, NULL, NULL)) {
+        uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+        if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) {
+            uint64_t before = lxfsExtents(mp, entry.block, NULL);
+            int status = lxfsDefrag(mp, entry.block);
+            if(status) {
+                luxLogf(KPRINT_LEVEL_DEBUG, "%s: unable to clean %s, error %d\n", mp->device, path, status);
+            } else {
+                luxLogf(KPRINT_LEVEL_DEBUG, "%s: cleaned %s, %d extents rewritten at the log head\n",
+                        mp->device, path, (int) before);
+            }
+        }
+    }
+
+    free(path);
+}
\ No newline at end of file
@@ -0,0 +1,345 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <vfs.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Asynchronous block reads: instead of blocking on a cache miss, a request
+ * submits the reads for the blocks it is missing and is parked as a
+ * continuation, i.e. a copy of its message. Other requests are served in the
+ * meantime, and the parked request is dispatched again once every read it
+ * waits for has completed, at which point its blocks are in the cache. */
+
+/* set while a parked request is dispatched again, which must not park twice */
+static int resuming = 0;
+
+/* lxfsCached(): helper function to check if a block is in the cache
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: one if cached, zero if not
+ */
+
+static int lxfsCached(Mountpoint *mp, uint64_t block) {
+    uint64_t index = block % CACHE_SIZE;
+    return mp->cache[index].valid && (mp->cache[index].tag == (block / CACHE_SIZE));
+}
+
+/* lxfsInFlight(): helper function to check if a block is being read
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: one if a read that will be cached covers the block, zero if not
+ */
+
+static int lxfsInFlight(Mountpoint *mp, uint64_t block) {
+    BlockRead *read = mp->reads;
+    while(read) {
+        if(!read->stale && (block >= read->block) && (block < (read->block + read->count)))
+            return 1;
+        read = read->next;
+    }
+
+    return 0;
+}
+
+/* lxfsWaiting(): helper function to check if a parked request still waits for a read
+ * params: mp - mountpoint
+ * params: c - continuation
+ * returns: one if any of its blocks are still being read, zero if not
+ */
+
+static int lxfsWaiting(Mountpoint *mp, Continuation *c) {
+    BlockRead *read = mp->reads;
+    while(read) {
+        for(size_t i = 0; i < c->runCount; i++) {
+            if((c->runs[i].block < (read->block + read->count)) &&
+            (read->block < (c->runs[i].block + c->runs[i].count)))
+                return 1;
+        }
+
+        read = read->next;
+    }
+
+    return 0;
+}
+
+/* lxfsSubmit(): helper function to submit a single asynchronous read
+ * params: mp - mountpoint
+ * params: block - first block
+ * params: count - number of blocks
+ * params: prefetched - non-zero if the blocks are read ahead of being needed
+ * returns: zero on success
+ */
+
+static int lxfsSubmit(Mountpoint *mp, uint64_t block, uint64_t count, int prefetched) {
+    if(mp->readCount >= ASYNC_READS_MAX) return 1;
+
+    BlockRead *read = calloc(1, sizeof(BlockRead));
+    if(!read) return 1;
+
+    read->id = ++mp->nextRead;
+    read->block = block;
+    read->count = count;
+    read->prefetched = prefetched;
+
+    // the backend must not complete the read before returning
+    if(mp->submitRead(mp, read->id, block, count)) {
+        free(read);
+        return 1;
+    }
+
+    read->next = mp->reads;
+    mp->reads = read;
+    mp->readCount++;
+    mp->deviceReads++;
+    mp->blocksRead += count;
+    return 0;
+}
+
+/* lxfsSubmitRead(): submits asynchronous reads for a run of contiguous blocks,
+ * skipping the blocks that are already cached or being read
+ * params: mp - mountpoint
+ * params: block - first block
+ * params: count - number of blocks
+ * params: prefetched - non-zero if the blocks are read ahead of being needed
+ * returns: zero on success, non-zero if the device only supports synchronous
+ * I/O or the queue is full
+ */
+
+int lxfsSubmitRead(Mountpoint *mp, uint64_t block, uint64_t count, int prefetched) {
+    if(!mp->submitRead) return 1;
+
+    uint64_t i = 0;
+    while(i < count) {
+        if(lxfsCached(mp, block + i) || lxfsInFlight(mp, block + i)) {
+            i++;
+            continue;
+        }
+
+        uint64_t start = i;
+        while((i < count) && !lxfsCached(mp, block + i) && !lxfsInFlight(mp, block + i))
+            i++;
+
+        if(lxfsSubmit(mp, block + start, i - start, prefetched)) return 1;
+    }
+
+    return 0;
+}
+
+/* lxfsAwaitBlocks(): parks a request until a range of blocks of a file is cached
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: first - file-relative index of the first block
+ * params: count - number of blocks
+ * params: msg - request message, which is copied
+ * returns: one if the request was parked and must not be answered yet, zero
+ * if the caller should proceed, reading any missing blocks synchronously
+ */
+
+int lxfsAwaitBlocks(Mountpoint *mp, uint64_t meta, uint64_t first, uint64_t count, const void *msg) {
+    if(!mp->submitRead || resuming || !count) return 0;
+
+    uint64_t maxRun = READAHEAD_MAX / mp->blockSizeBytes;
+    if(!maxRun) maxRun = 1;
+
+    // collect the missing blocks as runs of contiguous blocks
+    BlockRun *runs = NULL;
+    size_t runCount = 0, runMax = 0;
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t block = lxfsChainBlock(mp, meta, first + i);
+        if(!block || (block == LXFS_BLOCK_EOF)) break;  // reported by the caller
+        if(lxfsCached(mp, block)) continue;
+
+        if(runCount && (runs[runCount-1].count < maxRun) &&
+        ((runs[runCount-1].block + runs[runCount-1].count) == block)) {
+            runs[runCount-1].count++;
+            continue;
+        }
+
+        if(runCount == runMax) {
+            BlockRun *list = realloc(runs, (runMax + 8) * sizeof(BlockRun));
+            if(!list) {
+                free(runs);
+                return 0;
+            }
+
+            runs = list;
+            runMax += 8;
+        }
+
+        runs[runCount].block = block;
+        runs[runCount].count = 1;
+        runCount++;
+    }
+
+    if(!runCount) {
+        free(runs);
+        return 0;
+    }
+
+    // blocks submitted before a failure will still arrive, just read the
+    // rest synchronously
+    for(size_t i = 0; i < runCount; i++) {
+        if(lxfsSubmitRead(mp, runs[i].block, runs[i].count, 0)) {
+            free(runs);
+            return 0;
+        }
+    }
+
+    const SyscallHeader *header = (const SyscallHeader *) msg;
+    Continuation *c = calloc(1, sizeof(Continuation));
+    if(!c) {
+        free(runs);
+        return 0;
+    }
+
+    c->msg = malloc(header->header.length);
+    if(!c->msg) {
+        free(runs);
+        free(c);
+        return 0;
+    }
+
+    memcpy(c->msg, msg, header->header.length);
+    c->runs = runs;
+    c->runCount = runCount;
+
+    // requests are resumed in the order they were parked
+    Continuation **tail = &mp->parked;
+    while(*tail) tail = &(*tail)->next;
+    *tail = c;
+    return 1;
+}
+
+/* lxfsResume(): helper function to dispatch the parked requests that no
+ * longer wait for any read
+ * params: mp - mountpoint
+ * returns: nothing
+ */
+
+static void lxfsResume(Mountpoint *mp) {
+    Continuation **c = &mp->parked;
+    while(*c) {
+        if(lxfsWaiting(mp, *c)) {
+            c = &(*c)->next;
+            continue;
+        }
+
+        Continuation *ready = *c;
+        *c = ready->next;
+
+        // blocks evicted or lost to an I/O error since are read synchronously
+        resuming = 1;
+        switch(ready->msg->header.command) {
+        case COMMAND_READ: lxfsRead((RWCommand *) ready->msg); break;
+        case COMMAND_MMAP: lxfsMmap((MmapCommand *) ready->msg); break;
+        }
+        resuming = 0;
+
+        free(ready->msg);
+        free(ready->runs);
+        free(ready);
+    }
+}
+
+/* lxfsCompleteRead(): completes an asynchronous read, called by the backend
+ * params: mp - mountpoint
+ * params: id - ID of the read as given to the backend
+ * params: status - zero on success
+ * params: data - blocks that were read
+ * returns: nothing
+ */
+
+void lxfsCompleteRead(Mountpoint *mp, uint64_t id, int status, const void *data) {
+    BlockRead **read = &mp->reads;
+    while(*read && ((*read)->id != id)) read = &(*read)->next;
+    if(!*read) return;
+
+    BlockRead *done = *read;
+    *read = done->next;
+    mp->readCount--;
+
+    // blocks written to while the read was in flight would be stale
+    if(!status && !done->stale && data) {
+        for(uint64_t i = 0; i < done->count; i++)
+            lxfsFillSlot(mp, done->block + i, (const void *)((uintptr_t)data + (i * mp->blockSizeBytes)), done->prefetched);
+    }
+
+    free(done);
+    if(mp->parked) lxfsResume(mp);
+}
+
+/* lxfsStaleReads(): discards the results of reads that overlap a write
+ * params: mp - mountpoint
+ * params: block - first block written
+ * params: count - number of blocks written
+ * returns: nothing
+ */
+
+void lxfsStaleReads(Mountpoint *mp, uint64_t block, uint64_t count) {
+    BlockRead *read = mp->reads;
+    while(read) {
+        if((block < (read->block + read->count)) && (read->block < (block + count)))
+            read->stale = 1;
+        read = read->next;
+    }
+}
+
+/* lxfsFailReads(): fails every read in flight, after the backend went away
+ * params: mp - mountpoint
+ * returns: nothing, parked requests are resumed and read synchronously
+ */
+
+void lxfsFailReads(Mountpoint *mp) {
+    while(mp->reads) lxfsCompleteRead(mp, mp->reads->id, -1, NULL);
+}
+
+/* lxfsDropParked(): answers the parked requests on a file that was closed,
+ * which must not be dispatched again under an ID that is no longer open
+ * params: mp - mountpoint
+ * params: id - kernel file ID
+ * returns: nothing
+ */
+
+void lxfsDropParked(Mountpoint *mp, uint64_t id) {
+    Continuation **c = &mp->parked;
+    while(*c) {
+        SyscallHeader *msg = (*c)->msg;
+        int match = 0;
+        size_t length = 0;
+        switch(msg->header.command) {
+        case COMMAND_READ:
+            match = ((RWCommand *) msg)->id == id;
+            length = sizeof(RWCommand);
+            break;
+        case COMMAND_MMAP:
+            match = ((MmapCommand *) msg)->id == id;
+            length = lxfsMmapHeader((MmapCommand *) msg);
+            break;
+        }
+
+        if(!match) {
+            c = &(*c)->next;
+            continue;
+        }
+
+        Continuation *dropped = *c;
+        *c = dropped->next;
+
+        msg->header.response = 1;
+        msg->header.length = length;
+        msg->header.status = -EBADF;
+        luxSendKernel(msg);
+
+        free(dropped->msg);
+        free(dropped->runs);
+        free(dropped);
+    }
+}
\ No newline at end of file
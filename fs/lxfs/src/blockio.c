@@ -10,6 +10,104 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* lxfsDirtySlot(): helper function to mark a cache slot as dirty
+ * params: mp - mountpoint
+ * params: index - cache slot index
+ * returns: nothing
+ */
+
+static void lxfsDirtySlot(Mountpoint *mp, uint64_t index) {
+    mp->cache[index].logged = 0;
+    if(mp->cache[index].dirty) return;
+
+    mp->cache[index].dirty = 1;
+    mp->cache[index].dirtied = mp->clock;
+    mp->dirtyBlocks++;
+
+    // a read of the block still in flight would bring back the old contents
+    if(mp->reads)
+        lxfsStaleReads(mp, (mp->cache[index].tag * CACHE_SIZE) + index, 1);
+}
+
+/* lxfsDeviceRead(): reads blocks from the device, bypassing the cache
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsDeviceRead(Mountpoint *mp, uint64_t block, uint64_t count, void *buffer) {
+    mp->deviceReads++;
+    mp->blocksRead += count;
+    if(mp->handle) {
+        int status = lxfsChannelIO(mp, 0, block, count, buffer);
+        if(!status) lxfsJournalOverlay(mp, block, count, buffer);
+        if(status >= 0) return status;
+    }
+
+    size_t size = count * mp->blockSizeBytes;
+    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
+    ssize_t s = read(mp->fd, buffer, size);
+    if(s != size) return 1;
+
+    lxfsJournalOverlay(mp, block, count, buffer);
+    return 0;
+}
+
+/* lxfsDeviceWriteRun(): helper function to write a run of blocks to the device
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to write from
+ * returns: zero on success
+ */
+
+static int lxfsDeviceWriteRun(Mountpoint *mp, uint64_t block, uint64_t count, const void *buffer) {
+    mp->deviceWrites++;
+    mp->blocksWritten += count;
+    if(mp->handle) {
+        int status = lxfsChannelIO(mp, 1, block, count, (void *) buffer);
+        if(status >= 0) return status;
+    }
+
+    size_t size = count * mp->blockSizeBytes;
+    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
+    ssize_t s = write(mp->fd, buffer, size);
+    if(s != size) return 1;
+    return 0;
+}
+
+/* lxfsDeviceWrite(): writes blocks to the device, bypassing the cache
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * params: buffer - buffer to write from
+ * returns: zero on success
+ */
+
+int lxfsDeviceWrite(Mountpoint *mp, uint64_t block, uint64_t count, const void *buffer) {
+    if(lxfsJournalGuard(mp, block, count, buffer)) return 1;
+
+    // blocks held back by the journal are left out of the write
+    uint64_t i = 0;
+    while(i < count) {
+        if(lxfsJournalHeld(mp, block + i)) {
+            i++;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while(((i + run) < count) && !lxfsJournalHeld(mp, block + i + run)) run++;
+        if(lxfsDeviceWriteRun(mp, block + i, run, (const void *)((uintptr_t) buffer + (i * mp->blockSizeBytes))))
+            return 1;
+
+        i += run;
+    }
+
+    return 0;
+}
+
 /* lxfsFlushSlot(): flush a slot from the cache to the physical drive
  * params: mp - mountpoint
  * params: index - cache slot index
@@ -20,11 +118,10 @@ int lxfsFlushSlot(Mountpoint *mp, uint64_t index) {
     if(!mp->cache[index].valid || !mp->cache[index].dirty) return 0;
     uint64_t block = (mp->cache[index].tag*CACHE_SIZE) + (index%CACHE_SIZE);
 
-    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
-    ssize_t s = write(mp->fd, mp->cache[index].data, mp->blockSizeBytes);
-    if(s != mp->blockSizeBytes) return 1;
+    if(lxfsDeviceWrite(mp, block, 1, mp->cache[index].data)) return 1;
 
     mp->cache[index].dirty = 0;
+    mp->dirtyBlocks--;
     return 0;
 }
 
@@ -35,6 +132,8 @@ int lxfsFlushSlot(Mountpoint *mp, uint64_t index) {
  */
 
 int lxfsFlushBlock(Mountpoint *mp, uint64_t block) {
+    if(lxfsTablePage(mp, block)) return lxfsTableFlush(mp, block);
+
     uint64_t tag = block / CACHE_SIZE;
     uint64_t i = block % CACHE_SIZE;
 
@@ -43,49 +142,88 @@ int lxfsFlushBlock(Mountpoint *mp, uint64_t block) {
     return lxfsFlushSlot(mp, i);
 }
 
-/* lxfsReadBlock(): reads a block on a mounted lxfs partition
+/* lxfsPeekBlock(): returns the cache slot of a block for reading in place
+ * the pointer is only valid until the next cache operation
  * params: mp - mountpoint
  * params: block - block number
- * params: buffer - buffer to read into
- * returns: zero on success
+ * returns: pointer to block data, NULL on fail
  */
 
-int lxfsReadBlock(Mountpoint *mp, uint64_t block, void *buffer) {
+const void *lxfsPeekBlock(Mountpoint *mp, uint64_t block) {
     // check if the block is already in the cache
     uint64_t tag = block / CACHE_SIZE;
     uint64_t index = block % CACHE_SIZE;
 
     if(mp->cache[index].valid && (mp->cache[index].tag == tag)) {
-        memcpy(buffer, mp->cache[index].data, mp->blockSizeBytes);
-        return 0;
+        if(mp->cache[index].prefetched) {
+            mp->cache[index].prefetched = 0;
+            mp->raHits++;
+        }
+
+        mp->cacheHits++;
+        return mp->cache[index].data;
     }
 
+    mp->cacheMisses++;
+
     // flush the cache if necessary
     if(mp->cache[index].valid && mp->cache[index].dirty) {
-        if(lxfsFlushSlot(mp, index)) return 1;
+        if(lxfsFlushSlot(mp, index)) return NULL;
     }
 
+    // evicting a block that was read ahead but never used
+    if(mp->cache[index].valid && mp->cache[index].prefetched)
+        mp->raWasted++;
+
     mp->cache[index].valid = 1;
     mp->cache[index].dirty = 0;
+    mp->cache[index].prefetched = 0;
+    mp->cache[index].logged = 0;
     mp->cache[index].tag = tag;
 
-    if(!mp->cache[index].data) mp->cache[index].data = malloc(mp->blockSizeBytes);
-    if(!mp->cache[index].data) {
+    if(!lxfsCacheBuffer(mp, index)) {
         mp->cache[index].valid = 0;
-        return 1;
+        return NULL;
     }
 
-    lseek(mp->fd, block * mp->blockSizeBytes, SEEK_SET);
-    ssize_t s = read(mp->fd, mp->cache[index].data, mp->blockSizeBytes);
-    if(s != mp->blockSizeBytes) {
+    if(lxfsDeviceRead(mp, block, 1, mp->cache[index].data)) {
         mp->cache[index].valid = 0;
-        return 1;
+        return NULL;
     }
 
-    memcpy(buffer, mp->cache[index].data, mp->blockSizeBytes);
+    return mp->cache[index].data;
+}
+
+/* lxfsReadBlock(): reads a block on a mounted lxfs partition
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsReadBlock(Mountpoint *mp, uint64_t block, void *buffer) {
+    const void *data = lxfsPeekBlock(mp, block);
+    if(!data) return 1;
+
+    memcpy(buffer, data, mp->blockSizeBytes);
     return 0;
 }
 
+/* lxfsReadBlocks(): reads a run of contiguous blocks directly from the device
+ * this bypasses the cache and is used to coalesce multiple block reads
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks to read
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsReadBlocks(Mountpoint *mp, uint64_t block, uint64_t count, void *buffer) {
+    if(mp->reads) lxfsStaleReads(mp, block, count);
+
+    return lxfsDeviceRead(mp, block, count, buffer);
+}
+
 /* lxfsWriteBlock(): writes a block to a mounted lxfs partition
  * params: mp - mountpoint
  * params: block - block number
@@ -99,7 +237,8 @@ int lxfsWriteBlock(Mountpoint *mp, uint64_t block, const void *buffer) {
 
     if(mp->cache[index].valid && (mp->cache[index].tag == tag)) {
         memcpy(mp->cache[index].data, buffer, mp->blockSizeBytes);
-        mp->cache[index].dirty = 1;
+        mp->cache[index].prefetched = 0;
+        lxfsDirtySlot(mp, index);
         return 0;
     }
 
@@ -107,20 +246,95 @@ int lxfsWriteBlock(Mountpoint *mp, uint64_t block, const void *buffer) {
         if(lxfsFlushSlot(mp, index)) return 1;
     }
 
+    if(mp->cache[index].valid && mp->cache[index].prefetched)
+        mp->raWasted++;
+
     mp->cache[index].valid = 1;
-    mp->cache[index].dirty = 1;
+    mp->cache[index].dirty = 0;
+    mp->cache[index].prefetched = 0;
+    mp->cache[index].logged = 0;
     mp->cache[index].tag = tag;
 
-    if(!mp->cache[index].data) mp->cache[index].data = malloc(mp->blockSizeBytes);
-    if(!mp->cache[index].data) {
+    if(!lxfsCacheBuffer(mp, index)) {
         mp->cache[index].valid = 0;
         return 1;
     }
 
     memcpy(mp->cache[index].data, buffer, mp->blockSizeBytes);
+    lxfsDirtySlot(mp, index);
     return 0;
 }
 
+/* lxfsModifyBlock(): returns the cache slot of a block for in-place modification
+ * the slot is marked dirty, so the caller must finish modifying it before the
+ * next cache operation may evict it
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: fill - whether to read the current contents of the block on a miss,
+ * zero if the caller will overwrite the whole block
+ * returns: pointer to block data, NULL on fail
+ */
+
+void *lxfsModifyBlock(Mountpoint *mp, uint64_t block, int fill) {
+    uint64_t tag = block / CACHE_SIZE;
+    uint64_t index = block % CACHE_SIZE;
+
+    if(mp->cache[index].valid && (mp->cache[index].tag == tag)) {
+        mp->cache[index].prefetched = 0;
+        mp->cacheHits++;
+        lxfsDirtySlot(mp, index);
+        return mp->cache[index].data;
+    }
+
+    // a block that is about to be overwritten whole costs nothing to miss
+    if(fill) mp->cacheMisses++;
+
+    if(mp->cache[index].valid && mp->cache[index].dirty) {
+        if(lxfsFlushSlot(mp, index)) return NULL;
+    }
+
+    if(mp->cache[index].valid && mp->cache[index].prefetched)
+        mp->raWasted++;
+
+    mp->cache[index].valid = 0;
+    mp->cache[index].prefetched = 0;
+
+    if(!lxfsCacheBuffer(mp, index)) return NULL;
+
+    if(fill && lxfsDeviceRead(mp, block, 1, mp->cache[index].data)) return NULL;
+
+    mp->cache[index].valid = 1;
+    mp->cache[index].dirty = 0;
+    mp->cache[index].tag = tag;
+    lxfsDirtySlot(mp, index);
+    return mp->cache[index].data;
+}
+
+/* lxfsWriteBlocks(): writes a run of contiguous blocks directly to the device
+ * this bypasses the cache and discards any cached copies of the blocks
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks to write
+ * params: buffer - buffer to write from
+ * returns: zero on success
+ */
+
+int lxfsWriteBlocks(Mountpoint *mp, uint64_t block, uint64_t count, const void *buffer) {
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t index = (block + i) % CACHE_SIZE;
+        if(mp->cache[index].valid && (mp->cache[index].tag == ((block + i) / CACHE_SIZE))) {
+            if(mp->cache[index].dirty) mp->dirtyBlocks--;
+            mp->cache[index].valid = 0;
+            mp->cache[index].dirty = 0;
+            mp->cache[index].prefetched = 0;
+        }
+    }
+
+    if(mp->reads) lxfsStaleReads(mp, block, count);
+
+    return lxfsDeviceWrite(mp, block, count, buffer);
+}
+
 /* lxfsNextBlock(): returns the next block in a chain of blocks
  * params: mp - mountpoint
  * params: block - current block number
@@ -128,15 +342,10 @@ int lxfsWriteBlock(Mountpoint *mp, uint64_t block, const void *buffer) {
  */
 
 uint64_t lxfsNextBlock(Mountpoint *mp, uint64_t block) {
-    // read the relevant part of the block table
-    uint64_t tableBlock = block / (mp->blockSizeBytes / 8);
-    tableBlock += 33;   // the first 33 blocks are reserved
-    uint64_t tableIndex = block % (mp->blockSizeBytes / 8);
-
-    if(lxfsReadBlock(mp, tableBlock, mp->blockTableBuffer)) return 0;
-
-    uint64_t *data = (uint64_t *) mp->blockTableBuffer;
-    return data[tableIndex];
+    // read the entry in place rather than copying the whole table block
+    const uint64_t *entry = lxfsTableEntry(mp, block, 0);
+    if(!entry) return 0;
+    return *entry;
 }
 
 /* lxfsReadNextBlock(): reads a block and returns the next block in its chain
@@ -163,25 +372,6 @@ uint64_t lxfsWriteNextBlock(Mountpoint *mp, uint64_t block, const void *buffer)
     return lxfsNextBlock(mp, block);
 }
 
-/* lxfsFindFreeBlock(): finds a free block on the LXFS volume
- * params: mp - mountpoint
- * params: index - zero-based index of free blocks to return
- * i.e. guarantee the volume has at least (index) free blocks
- * returns: block number, zero if no space available
- */
-
-uint64_t lxfsFindFreeBlock(Mountpoint *mp, uint64_t index) {
-    uint64_t block;
-    uint64_t current = 0;
-    for(uint64_t i = 33; i < mp->volumeSize; i++) {
-        block = lxfsNextBlock(mp, i);
-        if(block == LXFS_BLOCK_FREE) current++;
-        if(current > index) return i;
-    }
-
-    return 0;
-}
-
 /* lxfsSetNextBlock(): sets the next block in a chain
  * params: mp - mountpoint
  * params: block - block to modify
@@ -190,51 +380,13 @@ uint64_t lxfsFindFreeBlock(Mountpoint *mp, uint64_t index) {
  */
 
 int lxfsSetNextBlock(Mountpoint *mp, uint64_t block, uint64_t next) {
-    uint64_t tableBlock = block / (mp->blockSizeBytes / 8);
-    tableBlock += 33;   // the first 33 blocks are reserved
-    uint64_t tableIndex = block % (mp->blockSizeBytes / 8);
-
-    if(lxfsReadBlock(mp, tableBlock, mp->blockTableBuffer)) return 1;
-
-    uint64_t *data = (uint64_t *) mp->blockTableBuffer;
-    data[tableIndex] = next;
-    if(lxfsWriteBlock(mp, tableBlock, mp->blockTableBuffer)) return 1;
-    return lxfsFlushBlock(mp, tableBlock);
-}
-
-/* lxfsAllocate(): allocates new blocks
- * params: mp - mountpoint
- * params: count - number of blocks to allocate
- * returns: first block in chain, zero on fail
- */
-
-uint64_t lxfsAllocate(Mountpoint *mp, uint64_t count) {
-    uint64_t *blocks = calloc(count, sizeof(uint64_t));
-    if(!blocks) return 0;
+    uint64_t tableBlock = LXFS_TABLE_START + (block / (mp->blockSizeBytes / 8));
 
-    for(uint64_t i = 0; i < count; i++) {
-        blocks[i] = lxfsFindFreeBlock(mp, i);
-        if(!blocks[i]) {
-            free(blocks);
-            return 0;
-        }
-    }
-
-    for(uint64_t i = 0; i < count-1; i++) {
-        if(lxfsSetNextBlock(mp, blocks[i], blocks[i+1])) {
-            free(blocks);
-            return 0;
-        }
-    }
-    
-    if(lxfsSetNextBlock(mp, blocks[count-1], LXFS_BLOCK_EOF)) {
-        free(blocks);
-        return 0;
-    }
+    uint64_t *entry = lxfsTableEntry(mp, block, 1);
+    if(!entry) return 1;
 
-    uint64_t block = blocks[0];
-    free(blocks);
-    return block;
+    *entry = next;
+    return lxfsJournalBlock(mp, tableBlock);
 }
 
 /* lxfsGetBlock(): returns the block containing the nth byte of a file
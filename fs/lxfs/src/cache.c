@@ -0,0 +1,178 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Cache budget: every mountpoint has its own direct-mapped table of cache
+ * slots, but the buffers holding the data of the slots come out of a single
+ * budget shared by all mountpoints. A slot is given a buffer the first time it
+ * is filled, and once the budget is spent, the buffer is taken from a slot of
+ * the mountpoint that has gone the longest without a request, so an idle
+ * volume gives up its memory to a busy one. Each mountpoint keeps at least
+ * CACHE_MIN_BUFFERS buffers regardless. The budget itself shrinks while the
+ * system is short on memory and grows back once it isn't. */
+
+static size_t cacheBudget = CACHE_BUDGET_MAX;   // in bytes
+static size_t cacheBytes = 0;                   // allocated across all mountpoints
+static time_t cacheChecked = 0;
+
+/* lxfsCacheVictim(): helper function to choose the mountpoint to take a buffer from
+ * params: none
+ * returns: least recently used mountpoint above its minimum, NULL if none
+ */
+
+static Mountpoint *lxfsCacheVictim() {
+    Mountpoint *victim = NULL;
+    Mountpoint *mp = firstMP();
+    while(mp) {
+        if((mp->cacheBuffers > CACHE_MIN_BUFFERS) && (!victim || (mp->lastUse < victim->lastUse)))
+            victim = mp;
+
+        mp = mp->next;
+    }
+
+    return victim;
+}
+
+/* lxfsCacheRelease(): helper function to free the buffer of a cache slot
+ * params: mp - mountpoint
+ * params: index - cache slot index, which must not be dirty
+ * returns: nothing
+ */
+
+static void lxfsCacheRelease(Mountpoint *mp, uint64_t index) {
+    if(mp->cache[index].valid && mp->cache[index].prefetched)
+        mp->raWasted++;
+
+    free(mp->cache[index].data);
+    mp->cache[index].data = NULL;
+    mp->cache[index].valid = 0;
+    mp->cache[index].prefetched = 0;
+
+    mp->cacheBuffers--;
+    cacheBytes -= mp->blockSizeBytes;
+}
+
+/* lxfsCacheReclaim(): helper function to free one cache buffer of a mountpoint
+ * clean slots go first, dirty ones are only written back and freed if there
+ * are no clean slots left
+ * params: mp - mountpoint
+ * params: keep - cache slot index that must not be freed
+ * returns: zero on success
+ */
+
+static int lxfsCacheReclaim(Mountpoint *mp, uint64_t keep) {
+    for(int pass = 0; pass < 2; pass++) {
+        for(uint64_t i = 0; i < CACHE_SIZE; i++) {
+            uint64_t index = mp->cacheHand;
+            mp->cacheHand = (mp->cacheHand + 1) % CACHE_SIZE;
+
+            if((index == keep) || !mp->cache[index].data) continue;
+
+            if(mp->cache[index].valid && mp->cache[index].dirty) {
+                if(!pass || lxfsFlushSlot(mp, index)) continue;
+            }
+
+            lxfsCacheRelease(mp, index);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* lxfsCacheTrim(): helper function to free buffers until the budget is met
+ * params: mp - mountpoint asking for a buffer, NULL if none
+ * params: index - cache slot index the buffer is for
+ * params: bytes - number of bytes about to be allocated
+ * returns: nothing
+ */
+
+static void lxfsCacheTrim(Mountpoint *mp, uint64_t index, size_t bytes) {
+    while((cacheBytes + bytes) > cacheBudget) {
+        Mountpoint *victim = lxfsCacheVictim();
+        if(!victim) return;
+
+        if(lxfsCacheReclaim(victim, (victim == mp) ? index : CACHE_SIZE)) return;
+    }
+}
+
+/* lxfsCacheBuffer(): returns the data buffer of a cache slot, allocating it
+ * within the shared budget if the slot has none
+ * this may free the buffers of other slots, of this or any other mountpoint
+ * params: mp - mountpoint
+ * params: index - cache slot index
+ * returns: pointer to the buffer, NULL on fail
+ */
+
+void *lxfsCacheBuffer(Mountpoint *mp, uint64_t index) {
+    if(mp->cache[index].data) return mp->cache[index].data;
+
+    // the minimum is guaranteed even if it goes over the budget
+    if(mp->cacheBuffers >= CACHE_MIN_BUFFERS)
+        lxfsCacheTrim(mp, index, mp->blockSizeBytes);
+
+    mp->cache[index].data = malloc(mp->blockSizeBytes);
+    if(!mp->cache[index].data) return NULL;
+
+    mp->cacheBuffers++;
+    cacheBytes += mp->blockSizeBytes;
+    return mp->cache[index].data;
+}
+
+/* lxfsCachePoll(): periodically asks the kernel for the memory usage of the
+ * system, the response is handled by lxfsCacheBalance()
+ * this doesn't wait for the response, which arrives like any other message
+ * params: none
+ * returns: nothing
+ */
+
+void lxfsCachePoll() {
+    time_t now = time(NULL);
+    if((now - cacheChecked) < CACHE_PRESSURE_INTERVAL) return;
+    cacheChecked = now;
+
+    MessageHeader req;
+    memset(&req, 0, sizeof(MessageHeader));
+    req.command = COMMAND_SYSINFO;
+    req.length = sizeof(MessageHeader);
+    req.requester = luxGetSelf();
+    luxSendKernel(&req);
+}
+
+/* lxfsCacheBalance(): adjusts the cache budget to the memory usage of the system
+ * params: sysinfo - sysinfo response from the kernel
+ * returns: nothing
+ */
+
+void lxfsCacheBalance(SysInfoResponse *sysinfo) {
+    if(sysinfo->header.status || (sysinfo->memorySize <= 0)) return;
+
+    int usage = ((uint64_t) sysinfo->memoryUsage * 100) / sysinfo->memorySize;
+    size_t budget = cacheBudget;
+
+    if(usage >= CACHE_PRESSURE_HIGH) {
+        budget -= budget / 4;
+        if(budget < CACHE_BUDGET_MIN) budget = CACHE_BUDGET_MIN;
+    } else if(usage < CACHE_PRESSURE_LOW) {
+        budget += budget / 4;
+        if(budget > CACHE_BUDGET_MAX) budget = CACHE_BUDGET_MAX;
+    }
+
+    if(budget == cacheBudget) return;
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "memory usage at %d%%, cache budget %d KB -> %d KB\n",
+            usage, (int) (cacheBudget / 1024), (int) (budget / 1024));
+
+    // give back memory right away instead of waiting for the next allocation
+    cacheBudget = budget;
+    lxfsCacheTrim(NULL, CACHE_SIZE, 0);
+}
\ No newline at end of file
@@ -0,0 +1,663 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lxfsChainUnlink(): helper function to remove an index from the hash table and LRU list
+ * params: mp - mountpoint
+ * params: index - chain index
+ * returns: nothing
+ */
+
+static void lxfsChainUnlink(Mountpoint *mp, ChainIndex *index) {
+    ChainIndex **bucket = &mp->chains[index->meta % CHAIN_INDEX_BUCKETS];
+    while(*bucket) {
+        if(*bucket == index) {
+            *bucket = index->next;
+            break;
+        }
+
+        bucket = &(*bucket)->next;
+    }
+
+    if(index->older) index->older->newer = index->newer;
+    else mp->oldestChain = index->newer;
+    if(index->newer) index->newer->older = index->older;
+    else mp->newestChain = index->older;
+}
+
+/* lxfsChainFree(): helper function to free a chain index
+ * params: mp - mountpoint
+ * params: index - chain index
+ * returns: nothing
+ */
+
+static void lxfsChainFree(Mountpoint *mp, ChainIndex *index) {
+    lxfsChainUnlink(mp, index);
+    mp->chainExtents -= index->extentMax;
+    free(index->extents);
+    free(index);
+}
+
+/* lxfsChainEvict(): helper function to evict the least recently used index
+ * params: mp - mountpoint
+ * params: keep - index that must not be evicted
+ * returns: zero if an index was evicted
+ */
+
+static int lxfsChainEvict(Mountpoint *mp, ChainIndex *keep) {
+    ChainIndex *victim = mp->oldestChain;
+    if(victim == keep) victim = victim->newer;
+    if(!victim) return 1;
+
+    lxfsChainFree(mp, victim);
+    return 0;
+}
+
+/* lxfsChainTouch(): helper function to mark an index as most recently used
+ * params: mp - mountpoint
+ * params: index - chain index
+ * returns: nothing
+ */
+
+static void lxfsChainTouch(Mountpoint *mp, ChainIndex *index) {
+    if(mp->newestChain == index) return;
+
+    // remove from the list
+    if(index->older) index->older->newer = index->newer;
+    else if(mp->oldestChain == index) mp->oldestChain = index->newer;
+    if(index->newer) index->newer->older = index->older;
+
+    // and re-insert at the head
+    index->older = mp->newestChain;
+    index->newer = NULL;
+    if(mp->newestChain) mp->newestChain->newer = index;
+    mp->newestChain = index;
+    if(!mp->oldestChain) mp->oldestChain = index;
+}
+
+/* lxfsChainAppend(): helper function to append a run of blocks to an index
+ * params: mp - mountpoint
+ * params: index - chain index
+ * params: block - first block of the run
+ * params: count - number of contiguous blocks
+ * returns: zero on success
+ */
+
+static int lxfsChainAppend(Mountpoint *mp, ChainIndex *index, uint64_t block, uint64_t count) {
+    if(index->extentCount) {
+        LXFSExtent *last = &index->extents[index->extentCount-1];
+        if((last->start + last->count) == block) {
+            last->count += count;
+            index->blocks += count;
+            return 0;
+        }
+    }
+
+    if(index->extentCount == index->extentMax) {
+        size_t newMax = index->extentMax ? index->extentMax * 2 : 4;
+
+        // stay within the extent budget of the mountpoint
+        while((mp->chainExtents + newMax - index->extentMax) > CHAIN_INDEX_EXTENTS) {
+            if(lxfsChainEvict(mp, index)) return 1;
+        }
+
+        LXFSExtent *extents = realloc(index->extents, newMax * sizeof(LXFSExtent));
+        while(!extents) {
+            // memory pressure, give up older indexes first
+            if(lxfsChainEvict(mp, index)) return 1;
+            extents = realloc(index->extents, newMax * sizeof(LXFSExtent));
+        }
+
+        mp->chainExtents += newMax - index->extentMax;
+        index->extents = extents;
+        index->extentMax = newMax;
+    }
+
+    LXFSExtent *extent = &index->extents[index->extentCount];
+    extent->index = index->blocks;
+    extent->start = block;
+    extent->count = count;
+    index->extentCount++;
+    index->blocks += count;
+    return 0;
+}
+
+/* lxfsChainWalk(): helper function to index the chain following a block
+ * params: mp - mountpoint
+ * params: index - chain index
+ * params: block - last block already indexed, or the metadata block
+ * returns: zero on success
+ */
+
+static int lxfsChainWalk(Mountpoint *mp, ChainIndex *index, uint64_t block) {
+    uint64_t limit = mp->volumeSize;
+    block = lxfsNextBlock(mp, block);
+    while(block != LXFS_BLOCK_EOF) {
+        // guard against corrupt tables with cycles or reserved entries
+        if(!block || (block >= mp->volumeSize) || !limit) return 1;
+        if(lxfsChainAppend(mp, index, block, 1)) return 1;
+
+        block = lxfsNextBlock(mp, block);
+        limit--;
+    }
+
+    return 0;
+}
+
+/* lxfsChainInline(): helper function to return the extents that fit in the
+ * metadata block of a file
+ * params: mp - mountpoint
+ * returns: number of extents
+ */
+
+static uint64_t lxfsChainInline(Mountpoint *mp) {
+    return (mp->blockSizeBytes - LXFS_EXTENT_MAP_OFFSET - sizeof(LXFSExtentMap)) / sizeof(LXFSExtentRecord);
+}
+
+/* lxfsChainLoad(): helper function to index a file from its extent map
+ * params: mp - mountpoint
+ * params: index - empty chain index
+ * returns: zero on success, non-zero if the map is missing or out of date
+ */
+
+static int lxfsChainLoad(Mountpoint *mp, ChainIndex *index) {
+    if(!mp->extentMaps) return 1;
+
+    const void *data = lxfsPeekBlock(mp, index->meta);
+    if(!data) return 1;
+
+    LXFSExtentMap map;
+    memcpy(&map, (const void *)((uintptr_t)data + LXFS_EXTENT_MAP_OFFSET), sizeof(LXFSExtentMap));
+    if(map.magic != LXFS_EXTENT_MAP_MAGIC) return 1;
+
+    uint64_t capacity = lxfsChainInline(mp);
+    uint64_t overflowCapacity = mp->blockSizeBytes / sizeof(LXFSExtentRecord);
+    if(map.count > (capacity + overflowCapacity)) return 1;
+    if((map.count > capacity) && (!map.overflow || (map.overflow >= mp->volumeSize))) return 1;
+
+    LXFSExtentRecord *records = NULL;
+    if(map.count) {
+        // copy the extents out before reading anything else can evict them
+        records = malloc(map.count * sizeof(LXFSExtentRecord));
+        if(!records) return 1;
+
+        uint64_t count = (map.count > capacity) ? capacity : map.count;
+        memcpy(records, (const void *)((uintptr_t)data + LXFS_EXTENT_MAP_OFFSET + sizeof(LXFSExtentMap)),
+               count * sizeof(LXFSExtentRecord));
+
+        if(map.count > capacity) {
+            const void *overflow = lxfsPeekBlock(mp, map.overflow);
+            if(!overflow) goto fail;
+            memcpy(&records[capacity], overflow, (map.count - capacity) * sizeof(LXFSExtentRecord));
+        }
+    }
+
+    // a v1 driver appending to or truncating the file changes either end of
+    // the chain without updating the map
+    uint64_t first = map.count ? records[0].start : LXFS_BLOCK_EOF;
+    if(lxfsNextBlock(mp, index->meta) != first) goto fail;
+    if(map.count && (lxfsNextBlock(mp, map.last) != LXFS_BLOCK_EOF)) goto fail;
+
+    for(uint64_t i = 0; i < map.count; i++) {
+        if(!records[i].count || (records[i].start < LXFS_TABLE_START) ||
+        ((records[i].start + records[i].count) > mp->volumeSize))
+            goto fail;
+        if(lxfsChainAppend(mp, index, records[i].start, records[i].count)) goto fail;
+    }
+
+    if((index->blocks != map.blocks) || (map.count &&
+    (map.last != (records[map.count-1].start + records[map.count-1].count - 1))))
+        goto fail;
+
+    free(records);
+    return 0;
+
+fail:
+    free(records);
+    index->extentCount = 0;
+    index->blocks = 0;
+    return 1;
+}
+
+/* lxfsChainStore(): helper function to record the extents of a file in its
+ * metadata block
+ * params: mp - mountpoint
+ * params: index - chain index
+ * returns: nothing, a map that can't be stored is marked invalid and the
+ * chain is walked instead
+ */
+
+static void lxfsChainStore(Mountpoint *mp, ChainIndex *index) {
+    if(!mp->extentMaps) return;
+
+    uint64_t capacity = lxfsChainInline(mp);
+    uint64_t overflowCapacity = mp->blockSizeBytes / sizeof(LXFSExtentRecord);
+
+    const void *data = lxfsPeekBlock(mp, index->meta);
+    if(!data) return;
+
+    // never write a map into a file that wasn't created with one
+    const LXFSExtentMap *old = (const LXFSExtentMap *)((uintptr_t)data + LXFS_EXTENT_MAP_OFFSET);
+    if(old->magic != LXFS_EXTENT_MAP_MAGIC) return;
+
+    uint64_t overflow = old->overflow;
+    if(overflow >= mp->volumeSize) overflow = 0;
+
+    uint64_t count = index->extentCount;
+    if(count > (capacity + overflowCapacity)) count = LXFS_EXTENTS_INVALID;
+
+    // only keep the overflow block while it is needed
+    if(overflow && ((count == LXFS_EXTENTS_INVALID) || (count <= capacity))) {
+        lxfsFreeRun(mp, overflow, 1);
+        overflow = 0;
+    }
+
+    if((count != LXFS_EXTENTS_INVALID) && (count > capacity)) {
+        if(!overflow) overflow = lxfsAllocate(mp, 1, index->meta + 1, NULL);
+
+        LXFSExtentRecord *records = overflow ? lxfsModifyBlock(mp, overflow, 0) : NULL;
+        if(records) {
+            memset(records, 0, mp->blockSizeBytes);
+            for(uint64_t i = capacity; i < count; i++) {
+                records[i - capacity].start = index->extents[i].start;
+                records[i - capacity].count = index->extents[i].count;
+            }
+        } else {
+            count = LXFS_EXTENTS_INVALID;
+        }
+    }
+
+    void *block = lxfsModifyBlock(mp, index->meta, 1);
+    if(!block) return;
+
+    LXFSExtentMap *map = (LXFSExtentMap *)((uintptr_t)block + LXFS_EXTENT_MAP_OFFSET);
+    map->count = count;
+    map->blocks = index->blocks;
+    map->overflow = overflow;
+    map->last = 0;
+
+    if(count == LXFS_EXTENTS_INVALID) return;
+
+    if(count) {
+        LXFSExtent *last = &index->extents[count-1];
+        map->last = last->start + last->count - 1;
+    }
+
+    for(uint64_t i = 0; (i < count) && (i < capacity); i++) {
+        map->extents[i].start = index->extents[i].start;
+        map->extents[i].count = index->extents[i].count;
+    }
+}
+
+/* lxfsChainFind(): helper function to find an existing index
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: pointer to index, NULL if not indexed
+ */
+
+static ChainIndex *lxfsChainFind(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = mp->chains[meta % CHAIN_INDEX_BUCKETS];
+    while(index) {
+        if(index->meta == meta) return index;
+        index = index->next;
+    }
+
+    return NULL;
+}
+
+/* lxfsChainCreate(): helper function to create an empty index
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: pointer to index, NULL on fail
+ */
+
+static ChainIndex *lxfsChainCreate(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = calloc(1, sizeof(ChainIndex));
+    if(!index) return NULL;
+    index->meta = meta;
+
+    uint64_t bucket = meta % CHAIN_INDEX_BUCKETS;
+    index->next = mp->chains[bucket];
+    mp->chains[bucket] = index;
+
+    index->older = mp->newestChain;
+    if(mp->newestChain) mp->newestChain->newer = index;
+    mp->newestChain = index;
+    if(!mp->oldestChain) mp->oldestChain = index;
+    return index;
+}
+
+/* lxfsChainIndex(): returns the chain index of a file, building it if necessary
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: pointer to index, NULL on fail
+ */
+
+ChainIndex *lxfsChainIndex(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = lxfsChainFind(mp, meta);
+    if(index) {
+        lxfsChainTouch(mp, index);
+        return index;
+    }
+
+    index = lxfsChainCreate(mp, meta);
+    if(!index) return NULL;
+
+    // v2 volumes record the extents, so only walk the chain if they don't
+    if(!lxfsChainLoad(mp, index)) return index;
+
+    if(lxfsChainWalk(mp, index, meta)) {
+        lxfsChainFree(mp, index);
+        return NULL;
+    }
+
+    lxfsChainStore(mp, index);
+    return index;
+}
+
+/* lxfsChainExtent(): helper function to find the extent containing a block
+ * params: index - chain index
+ * params: n - zero-based index of the block within the file, must be indexed
+ * returns: pointer to extent
+ */
+
+static LXFSExtent *lxfsChainExtent(ChainIndex *index, uint64_t n) {
+    // binary search for the extent containing the block
+    size_t low = 0;
+    size_t high = index->extentCount - 1;
+    while(low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if(index->extents[mid].index <= n) low = mid;
+        else high = mid - 1;
+    }
+
+    return &index->extents[low];
+}
+
+/* lxfsChainBlock(): returns the nth data block of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: n - zero-based index of the block within the file
+ * returns: block number, LXFS_BLOCK_EOF if beyond the file, zero on fail
+ */
+
+uint64_t lxfsChainBlock(Mountpoint *mp, uint64_t meta, uint64_t n) {
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(!index) {
+        // fall back to walking the chain
+        uint64_t block = lxfsNextBlock(mp, meta);
+        while(n && block && (block != LXFS_BLOCK_EOF)) {
+            block = lxfsNextBlock(mp, block);
+            n--;
+        }
+
+        return block;
+    }
+
+    if(n >= index->blocks) return LXFS_BLOCK_EOF;
+
+    LXFSExtent *extent = lxfsChainExtent(index, n);
+    return extent->start + (n - extent->index);
+}
+
+/* lxfsChainRun(): returns the nth data block of a file and the number of
+ * blocks physically contiguous with it
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: n - zero-based index of the block within the file
+ * params: run - pointer to store the length of the run starting at the block
+ * returns: block number, LXFS_BLOCK_EOF if beyond the file, zero on fail
+ */
+
+uint64_t lxfsChainRun(Mountpoint *mp, uint64_t meta, uint64_t n, uint64_t *run) {
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(!index) {
+        // fall back to following the links for as long as they are contiguous
+        uint64_t block = lxfsChainBlock(mp, meta, n);
+        *run = 1;
+        if(!block || (block == LXFS_BLOCK_EOF)) return block;
+
+        uint64_t next = lxfsNextBlock(mp, block);
+        while(next == (block + *run)) {
+            (*run)++;
+            next = lxfsNextBlock(mp, next);
+        }
+
+        return block;
+    }
+
+    if(n >= index->blocks) {
+        *run = 0;
+        return LXFS_BLOCK_EOF;
+    }
+
+    LXFSExtent *extent = lxfsChainExtent(index, n);
+    *run = extent->count - (n - extent->index);
+    return extent->start + (n - extent->index);
+}
+
+/* lxfsChainExtend(): updates a chain index after blocks were appended to a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsChainExtend(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = lxfsChainFind(mp, meta);
+    if(!index) return 0;    // nothing to update, will be built on demand
+
+    uint64_t last = meta;
+    if(index->extentCount) {
+        LXFSExtent *extent = &index->extents[index->extentCount-1];
+        last = extent->start + extent->count - 1;
+    }
+
+    if(lxfsChainWalk(mp, index, last)) {
+        lxfsChainFree(mp, index);
+        return 1;
+    }
+
+    lxfsChainStore(mp, index);
+    return 0;
+}
+
+/* lxfsChainTruncate(): updates a chain index after a file was truncated
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: blocks - number of data blocks remaining in the file
+ * returns: nothing
+ */
+
+void lxfsChainTruncate(Mountpoint *mp, uint64_t meta, uint64_t blocks) {
+    ChainIndex *index = lxfsChainFind(mp, meta);
+    if(!index || (blocks >= index->blocks)) return;
+
+    while(index->extentCount) {
+        LXFSExtent *extent = &index->extents[index->extentCount-1];
+        if(extent->index >= blocks) {
+            index->extentCount--;
+        } else {
+            extent->count = blocks - extent->index;
+            break;
+        }
+    }
+
+    index->blocks = blocks;
+    lxfsChainStore(mp, index);
+}
+
+/* lxfsChainDrop(): discards the chain index of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: nothing
+ */
+
+void lxfsChainDrop(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = lxfsChainFind(mp, meta);
+    if(index) lxfsChainFree(mp, index);
+}
+
+/* lxfsChainRebuild(): re-indexes a file after blocks in the middle of its
+ * chain were replaced, which neither end of the chain reflects
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsChainRebuild(Mountpoint *mp, uint64_t meta) {
+    lxfsChainDrop(mp, meta);
+
+    // the extent map would still pass as up to date, so never load it
+    ChainIndex *index = lxfsChainCreate(mp, meta);
+    if(index && !lxfsChainWalk(mp, index, meta)) {
+        lxfsChainStore(mp, index);
+        return 0;
+    }
+
+    if(index) lxfsChainFree(mp, index);
+
+    // without an index, make sure the stale map is never trusted
+    void *block = mp->extentMaps ? lxfsModifyBlock(mp, meta, 1) : NULL;
+    if(block) {
+        LXFSExtentMap *map = (LXFSExtentMap *)((uintptr_t)block + LXFS_EXTENT_MAP_OFFSET);
+        if(map->magic == LXFS_EXTENT_MAP_MAGIC) map->count = LXFS_EXTENTS_INVALID;
+    }
+
+    return 1;
+}
+
+/* lxfsChainCut(): frees the data blocks of a file past a number of blocks
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: blocks - number of data blocks to keep
+ * returns: zero on success
+ */
+
+int lxfsChainCut(Mountpoint *mp, uint64_t meta, uint64_t blocks) {
+    // blocks shared with other files stay with them
+    if(lxfsUnshare(mp, meta, blocks)) return 1;
+
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+
+    uint64_t last = blocks ? lxfsChainBlock(mp, meta, blocks - 1) : meta;
+    if(!last) return 1;
+    if(last == LXFS_BLOCK_EOF) return 0;    // already shorter
+
+    uint64_t following = lxfsNextBlock(mp, last);
+    if(!following) return 1;
+    if(following == LXFS_BLOCK_EOF) return 0;
+
+    if(lxfsSetNextBlock(mp, last, LXFS_BLOCK_EOF)) return 1;
+
+    if(!index) {
+        lxfsFreeChain(mp, following);
+        return 0;
+    }
+
+    // release whole extents rather than following the links one at a time
+    for(size_t i = index->extentCount; i > 0; i--) {
+        LXFSExtent *extent = &index->extents[i-1];
+        if((extent->index + extent->count) <= blocks) break;
+
+        uint64_t skip = (extent->index < blocks) ? (blocks - extent->index) : 0;
+        if(lxfsFreeRun(mp, extent->start + skip, extent->count - skip)) return 1;
+    }
+
+    lxfsChainTruncate(mp, meta, blocks);
+    return 0;
+}
+
+/* lxfsChainRelease(): frees every block of a file whose last link was removed
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsChainRelease(Mountpoint *mp, uint64_t meta) {
+    // truncating also gives up the overflow block of the extent map
+    if(lxfsChainCut(mp, meta, 0)) return 1;
+
+    lxfsChainDrop(mp, meta);
+    lxfsDedupForget(mp, meta);
+    return lxfsFreeRun(mp, meta, 1);
+}
+
+/* lxfsChainStep(): helper function to find where to cut back a chain for the
+ * blocks after the cut to span at most JOURNAL_CUT_MAX blocks of the table
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: number of data blocks to keep, zero if the whole chain fits
+ */
+
+static uint64_t lxfsChainStep(Mountpoint *mp, uint64_t meta) {
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(!index) return 0;
+
+    // extents ending and starting in the same block of the table count it
+    // twice, which only makes the steps smaller
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t budget = JOURNAL_CUT_MAX;
+    for(size_t i = index->extentCount; i > 0; i--) {
+        LXFSExtent *extent = &index->extents[i-1];
+        uint64_t last = (extent->start + extent->count - 1) / entries;
+        uint64_t span = last - (extent->start / entries) + 1;
+        if(span <= budget) {
+            budget -= span;
+            continue;
+        }
+
+        if(!budget) return extent->index + extent->count;
+        return extent->index + (((last - budget + 1) * entries) - extent->start);
+    }
+
+    return 0;
+}
+
+/* lxfsChainShrink(): empties a file whose chain is too long to free in one
+ * journal transaction, and cuts the chain back from its end a transaction at
+ * a time until the rest fits; every step leaves an empty file with a shorter
+ * chain behind, so a crash in between doesn't leave blocks that are in use by
+ * no file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsChainShrink(Mountpoint *mp, uint64_t meta) {
+    if(!mp->journal) return 0;
+
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 1;
+
+    // blocks shared with other files stay with them, and the units of a
+    // compressed file go with its unit table
+    if(lxfsUnitTable(mp, data) || (mp->dedup &&
+    (((const LXFSShare *)((uintptr_t) data + LXFS_SHARE_OFFSET))->magic == LXFS_SHARE_MAGIC)))
+        return 0;
+
+    uint64_t keep = lxfsChainStep(mp, meta);
+    if(!keep) return 0;
+
+    LXFSFileHeader *header = lxfsModifyBlock(mp, meta, 1);
+    if(!header) return 1;
+
+    header->size = 0;
+    memset((void *)((uintptr_t) header + sizeof(LXFSFileHeader)), 0,
+           mp->dedup ? (LXFS_SHARE_OFFSET - sizeof(LXFSFileHeader)) : sizeof(LXFSUnwritten));
+    if(lxfsJournalBlock(mp, meta)) return 1;
+
+    while(keep) {
+        if(lxfsJournalReserve(mp, JOURNAL_RESERVE) || lxfsChainCut(mp, meta, keep)) return 1;
+        keep = lxfsChainStep(mp, meta);
+    }
+
+    // and whatever the caller does next starts with room to spare
+    return lxfsJournalReserve(mp, JOURNAL_RESERVE);
+}
\ No newline at end of file
@@ -0,0 +1,287 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+/* Block I/O directly through sdev: a mountpoint on a storage device attaches
+ * to it through sdev's socket and sends SDevRWCommand requests, instead of
+ * going through the kernel, vfs, devfs and sdev on every cache miss. Reads
+ * submitted asynchronously are completed from lxfsChannelPoll(), and other
+ * requests wait for their own responses, for at most CHANNEL_TIMEOUT seconds,
+ * after which the mountpoint is detached and goes back to the device file. */
+
+#include <liblux/liblux.h>
+#include <liblux/sdev.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+static int channel = -1;    // shared by every attached mountpoint
+static void *buffer = NULL;
+static size_t bufferSize = 0;
+
+/* responses that arrived while waiting for another one */
+typedef struct Deferred {
+    struct Deferred *next;
+    SDevRWCommand *msg;
+} Deferred;
+
+static Deferred *deferred = NULL;
+
+/* lxfsChannelRecv(): helper function to receive a message from sdev
+ * params: block - whether to wait for a message
+ * returns: pointer to message valid until the next call, NULL if none
+ */
+
+static MessageHeader *lxfsChannelRecv(int block) {
+    MessageHeader header;
+    ssize_t s = luxRecv(channel, &header, sizeof(MessageHeader), block, true);    // peek
+    if(s < (ssize_t) sizeof(MessageHeader)) return NULL;
+
+    if(header.length > bufferSize) {
+        void *newptr = realloc(buffer, header.length);
+        if(!newptr) {
+            // drop the message rather than leaving it at the head of the queue
+            luxRecv(channel, &header, sizeof(MessageHeader), false, false);
+            return NULL;
+        }
+
+        buffer = newptr;
+        bufferSize = header.length;
+    }
+
+    s = luxRecv(channel, buffer, header.length, false, false);
+    if(s < (ssize_t) sizeof(MessageHeader)) return NULL;
+    return (MessageHeader *) buffer;
+}
+
+/* lxfsChannelWait(): helper function to wait for a message from sdev
+ * params: timeout - time at which to give up
+ * returns: pointer to message valid until the next call, NULL on timeout
+ */
+
+static MessageHeader *lxfsChannelWait(time_t timeout) {
+    for(;;) {
+        MessageHeader *msg = lxfsChannelRecv(0);
+        if(msg || (time(NULL) >= timeout)) return msg;
+        sched_yield();
+    }
+}
+
+/* lxfsChannelDefer(): helper function to keep a response for lxfsChannelPoll()
+ * params: msg - response message
+ * returns: nothing
+ */
+
+static void lxfsChannelDefer(MessageHeader *msg) {
+    Deferred *d = calloc(1, sizeof(Deferred));
+    if(!d) return;
+
+    d->msg = malloc(msg->length);
+    if(!d->msg) {
+        free(d);
+        return;
+    }
+
+    memcpy(d->msg, msg, msg->length);
+
+    Deferred **tail = &deferred;
+    while(*tail) tail = &(*tail)->next;
+    *tail = d;
+}
+
+/* lxfsChannelComplete(): helper function to complete an asynchronous read
+ * params: res - read response message
+ * returns: nothing
+ */
+
+static void lxfsChannelComplete(SDevRWCommand *res) {
+    if((res->header.command != COMMAND_SDEV_READ) || !res->tag) return;
+
+    Mountpoint *mp = findAttachedMP(res->device);
+    if(!mp) return;
+
+    int status = res->header.status;
+    if(!status && (res->header.length < (sizeof(SDevRWCommand) + res->count))) status = -1;
+    lxfsCompleteRead(mp, res->tag, status, res->buffer);
+}
+
+/* lxfsChannelAttach(): attaches a mountpoint directly to its storage device
+ * params: mp - mountpoint
+ * params: source - device file the volume was mounted from
+ * returns: zero on success, in which case block I/O goes through sdev
+ */
+
+int lxfsChannelAttach(Mountpoint *mp, const char *source) {
+    // only storage devices are handled by sdev
+    if(strncmp(source, "/dev/sd", 7)) return 1;
+
+    if(channel < 0) {
+        channel = luxConnectServer("sdev");
+        if(channel < 0) return 1;
+    }
+
+    SDevAttachCommand cmd;
+    memset(&cmd, 0, sizeof(SDevAttachCommand));
+    cmd.header.command = COMMAND_SDEV_ATTACH;
+    cmd.header.length = sizeof(SDevAttachCommand);
+    cmd.header.requester = luxGetSelf();
+    strcpy(cmd.device, source + 4);     // name under /dev
+    cmd.write = 1;
+    if(luxSend(channel, &cmd) != sizeof(SDevAttachCommand)) return 1;
+
+    // sdev first asks for a read through the device file, whose access the
+    // kernel checked when it was opened, and then answers with the handle
+    MessageHeader *res;
+    int proven = 0;
+    time_t timeout = time(NULL) + CHANNEL_TIMEOUT;
+    for(;;) {
+        res = lxfsChannelWait(timeout);
+        if(!res) return 1;
+        if(res->command != COMMAND_SDEV_ATTACH) {
+            lxfsChannelDefer(res);
+            continue;
+        }
+
+        SDevAttachCommand *attach = (SDevAttachCommand *) res;
+        if(attach->header.status || attach->handle || proven) break;
+
+        void *proof = malloc(attach->proofCount);
+        if(!proof) return 1;
+
+        int status = (lseek(mp->fd, attach->proofStart, SEEK_SET) != attach->proofStart) ||
+                     (read(mp->fd, proof, attach->proofCount) < 0);
+        free(proof);
+        if(status) return 1;
+        proven = 1;
+    }
+
+    SDevAttachCommand *attach = (SDevAttachCommand *) res;
+    if(attach->header.status || !attach->handle || !attach->sectorSize ||
+    (mp->blockSizeBytes % attach->sectorSize))
+        return 1;
+
+    mp->handle = attach->handle;
+    mp->submitRead = lxfsChannelRead;
+    return 0;
+}
+
+/* lxfsChannelIO(): reads or writes blocks through sdev and waits for completion
+ * params: mp - mountpoint
+ * params: write - non-zero to write, zero to read
+ * params: block - first block
+ * params: count - number of blocks
+ * params: data - buffer to read into or write from
+ * returns: zero on success, negative if the mountpoint was detached and the
+ * I/O has to go through the device file instead
+ */
+
+int lxfsChannelIO(Mountpoint *mp, int write, uint64_t block, uint64_t count, void *data) {
+    size_t size = count * mp->blockSizeBytes;
+    size_t length = sizeof(SDevRWCommand) + (write ? size : 0);
+
+    SDevRWCommand *cmd = calloc(1, length);
+    if(!cmd) return 1;
+
+    cmd->header.command = write ? COMMAND_SDEV_WRITE : COMMAND_SDEV_READ;
+    cmd->header.length = length;
+    cmd->header.requester = luxGetSelf();
+    cmd->device = mp->handle;
+    cmd->start = block * mp->blockSizeBytes;
+    cmd->count = size;
+    cmd->tag = 0;       // only one request waits at a time
+    if(write) memcpy(cmd->buffer, data, size);
+
+    ssize_t s = luxSend(channel, cmd);
+    free(cmd);
+    if(s != length) return 1;
+
+    SDevRWCommand *res;
+    time_t timeout = time(NULL) + CHANNEL_TIMEOUT;
+    for(;;) {
+        res = (SDevRWCommand *) lxfsChannelWait(timeout);
+        if(!res) {
+            // reads still in flight are failed from lxfsTick(), so that the
+            // requests parked on them aren't resumed in the middle of this one
+            luxLogf(KPRINT_LEVEL_WARNING, "%s: no response from sdev, detaching from the storage device\n", mp->device);
+            mp->handle = 0;
+            mp->submitRead = NULL;
+            return -1;
+        }
+
+        if(!res->tag && (res->device == mp->handle) &&
+        (res->header.command == (write ? COMMAND_SDEV_WRITE : COMMAND_SDEV_READ)))
+            break;
+        lxfsChannelDefer(&res->header);
+    }
+
+    if(res->header.status || (res->count != size)) return 1;
+    if(!write) {
+        if(res->header.length < (sizeof(SDevRWCommand) + size)) return 1;
+        memcpy(data, res->buffer, size);
+    }
+
+    return 0;
+}
+
+/* lxfsChannelRead(): submits an asynchronous read through sdev
+ * params: mp - mountpoint
+ * params: id - ID of the read, passed back to lxfsCompleteRead()
+ * params: block - first block
+ * params: count - number of blocks
+ * returns: zero on success
+ */
+
+int lxfsChannelRead(Mountpoint *mp, uint64_t id, uint64_t block, uint64_t count) {
+    SDevRWCommand cmd;
+    memset(&cmd, 0, sizeof(SDevRWCommand));
+    cmd.header.command = COMMAND_SDEV_READ;
+    cmd.header.length = sizeof(SDevRWCommand);
+    cmd.header.requester = luxGetSelf();
+    cmd.device = mp->handle;
+    cmd.start = block * mp->blockSizeBytes;
+    cmd.count = count * mp->blockSizeBytes;
+    cmd.tag = id;
+
+    if(luxSend(channel, &cmd) != sizeof(SDevRWCommand)) return 1;
+    return 0;
+}
+
+/* lxfsChannelPoll(): completes asynchronous reads that sdev responded to
+ * params: none
+ * returns: number of responses handled
+ */
+
+int lxfsChannelPoll() {
+    if(channel < 0) return 0;
+
+    int count = 0;
+    while(deferred) {
+        Deferred *d = deferred;
+        deferred = d->next;
+        lxfsChannelComplete(d->msg);
+        free(d->msg);
+        free(d);
+        count++;
+    }
+
+    // bounded, so that a busy device can't starve requests from the kernel
+    while(count < ASYNC_READS_MAX) {
+        SDevRWCommand *res = (SDevRWCommand *) lxfsChannelRecv(0);
+        if(!res) break;
+
+        // take the buffer, completing the read may wait on the channel again
+        buffer = NULL;
+        bufferSize = 0;
+        lxfsChannelComplete(res);
+        free(res);
+        count++;
+    }
+
+    return count;
+}
\ No newline at end of file
@@ -0,0 +1,612 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <errno.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compressed files: the data of a compressed file is split into units of
+ * LXFS_UNIT_BLOCKS blocks, and the chain of the file holds the blocks of each
+ * unit one after the other. A whole unit that compresses into fewer blocks is
+ * stored as an LZ4 block, anything else is stored raw with its trailing zero
+ * blocks left out, so a unit of zeros takes no blocks at all. The unit table
+ * records how many blocks each unit takes, which locates a unit in the chain
+ * without reading any of the units before it. Units are read and written
+ * whole through a buffer that keeps the last unit decompressed, so small
+ * sequential reads and appends don't decompress the same unit over and over.
+ * Files keep the blocks they already had when compression is turned on as
+ * raw units, and a file whose table was never created stores every unit raw
+ * in its full size. */
+
+/* lxfsUnitBytes(): helper function to return the size of a unit
+ * params: mp - mountpoint
+ * returns: size in bytes
+ */
+
+static uint64_t lxfsUnitBytes(Mountpoint *mp) {
+    return (uint64_t) LXFS_UNIT_BLOCKS * mp->blockSizeBytes;
+}
+
+/* lxfsUnitTable(): returns the unit table of a file
+ * params: mp - mountpoint
+ * params: data - contents of the metadata block of the file
+ * returns: first block of the unit table, LXFS_UNITS_PENDING if it was not
+ * created yet, zero if the file isn't compressed
+ */
+
+uint64_t lxfsUnitTable(Mountpoint *mp, const void *data) {
+    if(!mp->extentMaps) return 0;
+
+    uint64_t table;
+    memcpy(&table, (const void *)((uintptr_t)data + LXFS_UNITS_OFFSET), sizeof(uint64_t));
+    if(table == LXFS_UNITS_PENDING) return table;
+    if((table < LXFS_TABLE_START) || (table >= mp->volumeSize)) return 0;
+    return table;
+}
+
+/* lxfsUnitSet(): helper function to record the unit table of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: table - first block of the unit table, or LXFS_UNITS_PENDING
+ * returns: zero on success
+ */
+
+static int lxfsUnitSet(Mountpoint *mp, uint64_t meta, uint64_t table) {
+    void *data = lxfsModifyBlock(mp, meta, 1);
+    if(!data) return 1;
+
+    memcpy((void *)((uintptr_t)data + LXFS_UNITS_OFFSET), &table, sizeof(uint64_t));
+
+    // the table is allocated in the same request, so both commit together
+    if(mp->journal && lxfsJournalBlock(mp, meta)) return 1;
+
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta) file->units = table;
+            file = file->next;
+        }
+    }
+
+    return 0;
+}
+
+/* lxfsUnitBuffers(): helper function to allocate the unit buffers
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+static int lxfsUnitBuffers(Mountpoint *mp) {
+    if(!mp->unitData) mp->unitData = malloc(lxfsUnitBytes(mp));
+    if(!mp->unitPacked) mp->unitPacked = malloc(lxfsUnitBytes(mp));
+    return !mp->unitData || !mp->unitPacked;
+}
+
+/* lxfsUnitTableBlock(): helper function to find a block of the unit table
+ * params: mp - mountpoint
+ * params: table - first block of the unit table
+ * params: n - index of the block within the table
+ * params: extend - non-zero to grow the table with empty blocks to reach it
+ * returns: block number, zero if the table doesn't reach it or on fail
+ */
+
+static uint64_t lxfsUnitTableBlock(Mountpoint *mp, uint64_t table, uint64_t n, int extend) {
+    uint64_t block = table;
+    while(n--) {
+        uint64_t next = lxfsNextBlock(mp, block);
+        if(!next) return 0;
+
+        if(next == LXFS_BLOCK_EOF) {
+            if(!extend) return 0;
+
+            next = lxfsAllocate(mp, 1, block + 1, NULL);
+            if(!next) return 0;
+
+            void *records = lxfsModifyBlock(mp, next, 0);
+            if(!records) {
+                lxfsFreeRun(mp, next, 1);
+                return 0;
+            }
+
+            memset(records, 0, mp->blockSizeBytes);
+            if(lxfsSetNextBlock(mp, block, next)) {
+                lxfsFreeRun(mp, next, 1);
+                return 0;
+            }
+        }
+
+        block = next;
+    }
+
+    return block;
+}
+
+/* lxfsUnitLocate(): helper function to find the blocks of a unit in the chain
+ * params: mp - mountpoint
+ * params: table - first block of the unit table, or LXFS_UNITS_PENDING
+ * params: unit - index of the unit
+ * params: position - pointer to store the file-relative index of its first block
+ * returns: table record of the unit, negative on fail
+ */
+
+static int lxfsUnitLocate(Mountpoint *mp, uint64_t table, uint64_t unit, uint64_t *position) {
+    if(table == LXFS_UNITS_PENDING) {
+        *position = unit * LXFS_UNIT_BLOCKS;
+        return LXFS_UNIT_BLOCKS;
+    }
+
+    uint64_t perBlock = mp->blockSizeBytes;
+    uint64_t sum = 0;
+    uint64_t block = table;
+    for(uint64_t n = 0; ; n++) {
+        const uint8_t *records = lxfsPeekBlock(mp, block);
+        if(!records) return -1;
+
+        uint64_t within = unit - (n * perBlock);
+        uint64_t count = (within < perBlock) ? within : perBlock;
+        for(uint64_t i = 0; i < count; i++)
+            sum += records[i] & LXFS_UNIT_COUNT_MASK;
+
+        if(within < perBlock) {
+            *position = sum;
+            return records[within];
+        }
+
+        block = lxfsNextBlock(mp, block);
+        if(!block) return -1;
+
+        // units past the end of the table were never written
+        if(block == LXFS_BLOCK_EOF) {
+            *position = sum;
+            return 0;
+        }
+    }
+}
+
+/* lxfsUnitRecord(): helper function to update the table record of a unit
+ * params: mp - mountpoint
+ * params: table - first block of the unit table
+ * params: unit - index of the unit
+ * params: record - new record
+ * returns: zero on success
+ */
+
+static int lxfsUnitRecord(Mountpoint *mp, uint64_t table, uint64_t unit, uint8_t record) {
+    uint64_t block = lxfsUnitTableBlock(mp, table, unit / mp->blockSizeBytes, record != 0);
+    if(!block) return record != 0;     // empty units past the table need no record
+
+    uint8_t *records = lxfsModifyBlock(mp, block, 1);
+    if(!records) return 1;
+
+    records[unit % mp->blockSizeBytes] = record;
+    return 0;
+}
+
+/* lxfsUnitStart(): helper function to create the unit table of a file, which
+ * turns the blocks the file already has into raw units
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success, negative error code on fail
+ */
+
+static int lxfsUnitStart(Mountpoint *mp, OpenFile *file) {
+    if(file->units != LXFS_UNITS_PENDING) return 0;
+
+    uint64_t meta = file->entry.block;
+    uint64_t blocks;
+    lxfsExtents(mp, meta, &blocks);
+
+    uint64_t units = (blocks + LXFS_UNIT_BLOCKS - 1) / LXFS_UNIT_BLOCKS;
+    uint64_t tableBlocks = units ? (units + mp->blockSizeBytes - 1) / mp->blockSizeBytes : 1;
+    uint64_t table = lxfsAllocate(mp, tableBlocks, meta + 1, NULL);
+    if(!table) return -ENOSPC;
+
+    uint64_t block = table;
+    for(uint64_t n = 0; n < tableBlocks; n++) {
+        uint8_t *records = lxfsModifyBlock(mp, block, 0);
+        if(!records) goto fail;
+
+        memset(records, 0, mp->blockSizeBytes);
+        for(uint64_t i = 0; (i < mp->blockSizeBytes) && (((n * mp->blockSizeBytes) + i) < units); i++) {
+            uint64_t remaining = blocks - (((n * mp->blockSizeBytes) + i) * LXFS_UNIT_BLOCKS);
+            records[i] = (remaining > LXFS_UNIT_BLOCKS) ? LXFS_UNIT_BLOCKS : remaining;
+        }
+
+        block = lxfsNextBlock(mp, block);
+    }
+
+    if(lxfsUnitSet(mp, meta, table)) goto fail;
+    return 0;
+
+fail:
+    lxfsFreeChain(mp, table);
+    return -EIO;
+}
+
+/* lxfsUnitLoad(): helper function to read a unit of a file into the unit buffer
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: unit - index of the unit
+ * returns: zero on success
+ */
+
+static int lxfsUnitLoad(Mountpoint *mp, OpenFile *file, uint64_t unit) {
+    uint64_t meta = file->entry.block;
+    if((mp->unitFile == meta) && (mp->unitIndex == unit)) return 0;
+    if(lxfsUnitBuffers(mp)) return 1;
+
+    mp->unitFile = 0;
+    memset(mp->unitData, 0, lxfsUnitBytes(mp));
+
+    uint64_t position;
+    int record = lxfsUnitLocate(mp, file->units, unit, &position);
+    if(record < 0) return 1;
+
+    int compressed = record & LXFS_UNIT_COMPRESSED;
+    uint64_t count = record & LXFS_UNIT_COUNT_MASK;
+    if((count > LXFS_UNIT_BLOCKS) || (compressed && !count)) return 1;
+
+    // bring the whole unit in with as few device reads as possible
+    if(count && !mp->submitRead) lxfsPrefetch(mp, meta, position, count);
+
+    void *dest = compressed ? mp->unitPacked : mp->unitData;
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t block = lxfsChainBlock(mp, meta, position + i);
+        if(!block) return 1;
+        if(block == LXFS_BLOCK_EOF) {
+            if(compressed) return 1;
+            break;
+        }
+
+        const void *data = lxfsPeekBlock(mp, block);
+        if(!data) return 1;
+        memcpy((void *)((uintptr_t)dest + (i * mp->blockSizeBytes)), data, mp->blockSizeBytes);
+    }
+
+    if(compressed) {
+        LXFSCompressedUnit *packed = (LXFSCompressedUnit *) mp->unitPacked;
+        if(packed->length > ((count * mp->blockSizeBytes) - sizeof(LXFSCompressedUnit))) return 1;
+
+        ssize_t size = lxfsDecompress(packed->data, packed->length, mp->unitData, lxfsUnitBytes(mp));
+        if(size != (ssize_t) lxfsUnitBytes(mp)) return 1;
+    }
+
+    mp->unitFile = meta;
+    mp->unitIndex = unit;
+    return 0;
+}
+
+/* lxfsUnitSplice(): helper function to replace the blocks of a unit in the chain
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - file-relative index of the first block of the unit
+ * params: old - number of blocks the unit takes up now
+ * params: count - number of blocks it will take up
+ * params: source - new contents of the blocks
+ * returns: zero on success, negative error code on fail
+ */
+
+static int lxfsUnitSplice(Mountpoint *mp, OpenFile *file, uint64_t position, uint64_t old,
+                          uint64_t count, const void *source) {
+    uint64_t meta = file->entry.block;
+    uint64_t prev = position ? lxfsChainBlock(mp, meta, position - 1) : meta;
+    if(!prev || (prev == LXFS_BLOCK_EOF)) return -EIO;
+
+    // the blocks the unit keeps are overwritten in place
+    uint64_t kept = (old < count) ? old : count;
+    uint64_t last = prev;
+    for(uint64_t i = 0; i < kept; i++) {
+        last = lxfsChainBlock(mp, meta, position + i);
+        if(!last || (last == LXFS_BLOCK_EOF)) return -EIO;
+
+        void *slot = lxfsModifyBlock(mp, last, 0);
+        if(!slot) return -EIO;
+        memcpy(slot, (const void *)((uintptr_t)source + (i * mp->blockSizeBytes)), mp->blockSizeBytes);
+    }
+
+    if(old == count) return 0;
+
+    uint64_t oldLast = old ? lxfsChainBlock(mp, meta, position + old - 1) : prev;
+    if(!oldLast || (oldLast == LXFS_BLOCK_EOF)) return -EIO;
+
+    uint64_t next = lxfsNextBlock(mp, oldLast);
+    if(!next) return -EIO;
+
+    if(count > old) {
+        uint64_t first = lxfsAllocate(mp, count - old, last + 1, file);
+        if(!first) return -ENOSPC;
+
+        uint64_t block = first, tail = first;
+        for(uint64_t i = old; i < count; i++) {
+            void *slot = lxfsModifyBlock(mp, block, 0);
+            if(!slot) {
+                lxfsFreeChain(mp, first);
+                return -EIO;
+            }
+
+            memcpy(slot, (const void *)((uintptr_t)source + (i * mp->blockSizeBytes)), mp->blockSizeBytes);
+            tail = block;
+            block = lxfsNextBlock(mp, block);
+        }
+
+        // the new blocks are only reachable once everything else is in place
+        if(lxfsSetNextBlock(mp, tail, next)) {
+            lxfsFreeChain(mp, first);
+            return -EIO;
+        }
+
+        if(lxfsSetNextBlock(mp, last, first)) {
+            lxfsSetNextBlock(mp, tail, LXFS_BLOCK_EOF);
+            lxfsFreeChain(mp, first);
+            return -EIO;
+        }
+    } else {
+        uint64_t surplus = lxfsNextBlock(mp, last);
+        if(!surplus) return -EIO;
+
+        if(lxfsSetNextBlock(mp, last, next) || lxfsSetNextBlock(mp, oldLast, LXFS_BLOCK_EOF))
+            return -EIO;
+
+        lxfsFreeChain(mp, surplus);
+    }
+
+    // growing or shrinking the last unit only changes the end of the chain,
+    // anything else moves the blocks that follow within the file
+    if(next != LXFS_BLOCK_EOF) {
+        lxfsChainRebuild(mp, meta);
+    } else if(count > old) {
+        lxfsChainExtend(mp, meta);
+    } else {
+        lxfsChainTruncate(mp, meta, position + count);
+    }
+
+    return 0;
+}
+
+/* lxfsUnitStore(): helper function to write the unit buffer back to a file
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: unit - index of the unit
+ * params: length - number of bytes of the unit within the file
+ * returns: zero on success, negative error code on fail
+ */
+
+static int lxfsUnitStore(Mountpoint *mp, OpenFile *file, uint64_t unit, uint64_t length) {
+    size_t blockSize = mp->blockSizeBytes;
+    const uint8_t *data = (const uint8_t *) mp->unitData;
+
+    // trailing blocks of zeros are left out
+    uint64_t count = (length + blockSize - 1) / blockSize;
+    while(count) {
+        const uint8_t *block = data + ((count - 1) * blockSize);
+        size_t i = 0;
+        while((i < blockSize) && !block[i]) i++;
+        if(i < blockSize) break;
+        count--;
+    }
+
+    uint8_t record = count;
+    const void *source = mp->unitData;
+
+    // only whole units are compressed, and only when that saves a block
+    if((count > 1) && (length == lxfsUnitBytes(mp))) {
+        LXFSCompressedUnit *packed = (LXFSCompressedUnit *) mp->unitPacked;
+        size_t capacity = ((count - 1) * blockSize) - sizeof(LXFSCompressedUnit);
+        size_t size = lxfsCompress(mp->unitData, lxfsUnitBytes(mp), packed->data, capacity);
+        if(size) {
+            packed->length = size;
+            packed->reserved = 0;
+
+            count = (sizeof(LXFSCompressedUnit) + size + blockSize - 1) / blockSize;
+            memset(&packed->data[size], 0, (count * blockSize) - sizeof(LXFSCompressedUnit) - size);
+
+            record = count | LXFS_UNIT_COMPRESSED;
+            source = packed;
+        }
+    }
+
+    uint64_t position;
+    int old = lxfsUnitLocate(mp, file->units, unit, &position);
+    if(old < 0) return -EIO;
+
+    int status = lxfsUnitSplice(mp, file, position, old & LXFS_UNIT_COUNT_MASK, count, source);
+    if(status) return status;
+
+    if(lxfsUnitRecord(mp, file->units, unit, record)) return -EIO;
+    return 0;
+}
+
+/* lxfsCompressSpan(): returns the blocks of a compressed file holding a range
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file
+ * params: length - number of bytes, non-zero
+ * params: first - pointer to store the file-relative index of the first block
+ * params: count - pointer to store the number of blocks
+ * returns: zero on success
+ */
+
+int lxfsCompressSpan(Mountpoint *mp, OpenFile *file, off_t position, size_t length,
+                     uint64_t *first, uint64_t *count) {
+    uint64_t start, end;
+    int firstRecord = lxfsUnitLocate(mp, file->units, position / lxfsUnitBytes(mp), &start);
+    int lastRecord = lxfsUnitLocate(mp, file->units, (position + length - 1) / lxfsUnitBytes(mp), &end);
+    if((firstRecord < 0) || (lastRecord < 0)) return 1;
+
+    *first = start;
+    *count = end + (lastRecord & LXFS_UNIT_COUNT_MASK) - start;
+    return 0;
+}
+
+/* lxfsCompressRead(): reads data out of a compressed file
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file to read from
+ * params: length - number of bytes to read, within the file
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsCompressRead(Mountpoint *mp, OpenFile *file, off_t position, size_t length, void *buffer) {
+    uint64_t unitBytes = lxfsUnitBytes(mp);
+    size_t copied = 0;
+    while(copied < length) {
+        uint64_t unit = (position + copied) / unitBytes;
+        size_t offset = (position + copied) % unitBytes;
+        size_t s = unitBytes - offset;
+        if(s > (length - copied)) s = length - copied;
+
+        if(lxfsUnitLoad(mp, file, unit)) return 1;
+
+        memcpy((void *)((uintptr_t)buffer + copied), (const void *)((uintptr_t)mp->unitData + offset), s);
+        copied += s;
+    }
+
+    return 0;
+}
+
+/* lxfsCompressWrite(): writes data into a compressed file, without changing its size
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file to write at
+ * params: data - data to write
+ * params: length - number of bytes to write
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsCompressWrite(Mountpoint *mp, OpenFile *file, off_t position, const void *data, size_t length) {
+    int status = lxfsUnitStart(mp, file);
+    if(status) return status;
+
+    uint64_t unitBytes = lxfsUnitBytes(mp);
+    uint64_t end = position + length;
+    if(end < file->meta.size) end = file->meta.size;
+
+    size_t written = 0;
+    while(written < length) {
+        uint64_t unit = (position + written) / unitBytes;
+        size_t offset = (position + written) % unitBytes;
+        size_t s = unitBytes - offset;
+        if(s > (length - written)) s = length - written;
+
+        // whole units are replaced without reading what they held
+        if(s == unitBytes) {
+            if(lxfsUnitBuffers(mp)) return -ENOMEM;
+            mp->unitFile = 0;
+        } else if(lxfsUnitLoad(mp, file, unit)) {
+            return -EIO;
+        }
+
+        memcpy((void *)((uintptr_t)mp->unitData + offset), (const void *)((uintptr_t)data + written), s);
+
+        uint64_t unitLength = end - (unit * unitBytes);
+        if(unitLength > unitBytes) unitLength = unitBytes;
+
+        status = lxfsUnitStore(mp, file, unit, unitLength);
+        if(status) {
+            mp->unitFile = 0;
+            return status;
+        }
+
+        // the buffer now holds what the unit reads back as
+        mp->unitFile = file->entry.block;
+        mp->unitIndex = unit;
+        written += s;
+    }
+
+    return 0;
+}
+
+/* lxfsCompressEnable(): compresses the data written to a file from now on
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsCompressEnable(Mountpoint *mp, OpenFile *file) {
+    if(!mp->extentMaps) return -ENODEV;
+    if(file->units) return 0;
+
+    // blocks that were preallocated and never written would read back as
+    // whatever they held before, since units don't track them
+    if(file->unwritten) return -EBUSY;
+
+    if(lxfsUnitSet(mp, file->entry.block, LXFS_UNITS_PENDING)) return -EIO;
+
+    // inline files get their table once they outgrow the metadata block
+    if(file->inlined) return 0;
+    if(lxfsUnshare(mp, file->entry.block, LXFS_BLOCK_EOF)) return -EIO;
+    return lxfsUnitStart(mp, file);
+}
+
+/* lxfsCompressReset(): drops the unit table of a file whose data blocks were
+ * freed, keeping it compressed
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsCompressReset(Mountpoint *mp, uint64_t meta) {
+    if(mp->unitFile == meta) mp->unitFile = 0;
+
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 1;
+
+    uint64_t table = lxfsUnitTable(mp, data);
+    if(!table) return 0;
+
+    if(table != LXFS_UNITS_PENDING) lxfsFreeChain(mp, table);
+    return lxfsUnitSet(mp, meta, LXFS_UNITS_PENDING);
+}
+
+/* lxfsCompressSync(): writes back the unit table of a compressed file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsCompressSync(Mountpoint *mp, uint64_t meta) {
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 1;
+
+    uint64_t block = lxfsUnitTable(mp, data);
+    if(!block || (block == LXFS_UNITS_PENDING)) return 0;
+
+    while(block != LXFS_BLOCK_EOF) {
+        if(!block || lxfsFlushBlock(mp, block)) return 1;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    return 0;
+}
+
+/* lxfsCompressedBlocks(): counts the blocks a compressed file takes up
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: number of data and unit table blocks
+ */
+
+uint64_t lxfsCompressedBlocks(Mountpoint *mp, uint64_t meta) {
+    uint64_t blocks;
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(index) blocks = index->blocks;
+    else lxfsExtents(mp, meta, &blocks);
+
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return blocks;
+
+    uint64_t block = lxfsUnitTable(mp, data);
+    if(!block || (block == LXFS_UNITS_PENDING)) return blocks;
+
+    while(block && (block != LXFS_BLOCK_EOF)) {
+        blocks++;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    return blocks;
+}
\ No newline at end of file
@@ -14,6 +14,32 @@
 #include <errno.h>
 #include <time.h>
 
+/* lxfsExtendDirectory(): helper function to append an empty block to a directory
+ * params: mp - mountpoint
+ * params: last - last block of the directory
+ * returns: new block, zero on fail
+ */
+
+static uint64_t lxfsExtendDirectory(Mountpoint *mp, uint64_t last) {
+    uint64_t block = lxfsAllocate(mp, 1, last + 1, NULL);
+    if(!block) return 0;
+
+    // an empty block marks the end of the directory, so zero it before linking
+    void *data = lxfsModifyBlock(mp, block, 0);
+    if(!data) {
+        lxfsSetNextBlock(mp, block, LXFS_BLOCK_FREE);
+        return 0;
+    }
+
+    memset(data, 0, mp->blockSizeBytes);
+    if(lxfsJournalBlock(mp, block) || lxfsSetNextBlock(mp, last, block)) {
+        lxfsSetNextBlock(mp, block, LXFS_BLOCK_FREE);
+        return 0;
+    }
+
+    return block;
+}
+
 /* lxfsCreate(): creates a file or directory on the lxfs volume
  * params: dest - destination buffer to store directory entry
  * non-zero block in the dest structure indicates hard link creation
@@ -107,10 +133,10 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
     memset(dest->reserved, 0, sizeof(dest->reserved));
 
     if(!hardLink) {
-        dest->block = lxfsFindFreeBlock(mp, 0);
+        // place the new file where it has room to grow, its data will
+        // follow the metadata block
+        dest->block = lxfsAllocate(mp, 1, 0, NULL);
         if(!dest->block) return -ENOSPC;
-        if(lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_EOF))
-            return -EIO;
 
         memset(mp->dataBuffer, 0, mp->blockSizeBytes);
         
@@ -118,6 +144,20 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
             LXFSFileHeader *fileHeader = (LXFSFileHeader *) mp->dataBuffer;
             fileHeader->refCount = 1;
             fileHeader->size = 0;
+
+            // files on v2 volumes start out inline, and are given an extent
+            // map once they outgrow their metadata block
+            if(lxfsInlineCapacity(mp)) {
+                LXFSInlineData *inl = (LXFSInlineData *)((uintptr_t) mp->dataBuffer + LXFS_INLINE_OFFSET);
+                inl->magic = LXFS_INLINE_MAGIC;
+            }
+
+            // and compressed ones are given a unit table at the same time
+            if(mp->compress) {
+                uint64_t *units = (uint64_t *)((uintptr_t) mp->dataBuffer + LXFS_UNITS_OFFSET);
+                *units = LXFS_UNITS_PENDING;
+            }
+
             if(lxfsWriteBlock(mp, dest->block, mp->dataBuffer)) {
                 lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
                 return -EIO;
@@ -127,7 +167,7 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
             dirHeader->accessTime = timestamp;
             dirHeader->createTime = timestamp;
             dirHeader->modTime = timestamp;
-            dirHeader->reserved = 0;
+            dirHeader->index = 0;
             dirHeader->sizeBytes = sizeof(LXFSDirectoryHeader);
             dirHeader->sizeEntries = 0;
             if(lxfsWriteBlock(mp, dest->block, mp->dataBuffer)) {
@@ -151,82 +191,70 @@ int lxfsCreate(LXFSDirectoryEntry *dest, Mountpoint *mp, const char *path,
         if(lxfsWriteBlock(mp, dest->block, mp->dataBuffer)) return -EIO;
     }
 
-    lxfsFlushBlock(mp, dest->block);
-    uint64_t block = parent.block;
-    uint64_t prevBlock;
+    lxfsJournalBlock(mp, dest->block);
 
-    LXFSDirectoryHeader *parentHeader = (LXFSDirectoryHeader *) mp->dataBuffer;
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t) mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-    off_t offset = sizeof(LXFSDirectoryHeader);
+    // new entries are appended after the last entry of the parent directory
+    uint64_t block;
+    off_t offset;
+    if(lxfsIndexTail(mp, parent.block, &block, &offset)) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return -EIO;
+    }
 
-    for(;;) {
-        prevBlock = block;
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) return -EIO;
+    // which may start in or cross into blocks the directory doesn't have yet
+    uint64_t next = lxfsNextBlock(mp, block);
+    while(next && (offset >= mp->blockSizeBytes)) {
+        if(next == LXFS_BLOCK_EOF) next = lxfsExtendDirectory(mp, block);
+        if(!next) break;
 
-        if(block != LXFS_BLOCK_EOF)
-            lxfsReadBlock(mp, block, mp->dataBuffer + mp->blockSizeBytes);
-        
-        while(offset < mp->blockSizeBytes) {
-            if(!dir->flags & LXFS_DIR_VALID && (!dir->entrySize || (dir->entrySize >= dest->entrySize)))
-                break;
-            offset += dir->entrySize;
-            dir = (LXFSDirectoryEntry *)((uintptr_t) dir + dir->entrySize);
-        }
+        block = next;
+        offset -= mp->blockSizeBytes;
+        next = lxfsNextBlock(mp, block);
+    }
 
-        if(!dir->flags & LXFS_DIR_VALID && (!dir->entrySize || (dir->entrySize >= dest->entrySize))) {
-            if(offset + dest->entrySize <= mp->blockSizeBytes) {
-                // directory entry doesn't cross block boundary
-                memcpy(dir, dest, dest->entrySize);
-                if(lxfsWriteBlock(mp, prevBlock, mp->dataBuffer)) {
-                    if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
-                    return -EIO;
-                }
-                lxfsFlushBlock(mp, prevBlock);
-            } else {
-                // free entry but it crosses a block boundary, so allocate one more block
-                block = lxfsFindFreeBlock(mp, 0);
-                if(!block) return -ENOSPC;
-                if(lxfsSetNextBlock(mp, prevBlock, block)) return -EIO;
-                if(lxfsSetNextBlock(mp, block, LXFS_BLOCK_EOF)) {
-                    lxfsSetNextBlock(mp, prevBlock, LXFS_BLOCK_EOF);
-                    return -EIO;
-                }
-
-                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
-                memcpy(dir, dest, dest->entrySize);
-                if(lxfsWriteBlock(mp, prevBlock, mp->dataBuffer))
-                    return -EIO;
-                if(lxfsWriteBlock(mp, block, mp->dataBuffer + mp->blockSizeBytes))
-                    return -EIO;
-                
-                lxfsFlushBlock(mp, prevBlock);
-                lxfsFlushBlock(mp, block);
-            }
+    int crosses = (offset + dest->entrySize) > mp->blockSizeBytes;
+    if(next && crosses && (next == LXFS_BLOCK_EOF)) next = lxfsExtendDirectory(mp, block);
+    if(!next) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return -ENOSPC;
+    }
 
-            // TODO: is there a better way to handle errors here?
-            // I'd argue this is a forgiveable error for lack of a better word
-            // and the POSIX spec doesn't cover this afaik
-            if(lxfsReadBlock(mp, parent.block, mp->dataBuffer))
-                return 0;
-
-            parentHeader->sizeBytes += dest->entrySize;
-            parentHeader->sizeEntries++;
-            parentHeader->accessTime = timestamp;
-            parentHeader->modTime = timestamp;
-            lxfsWriteBlock(mp, parent.block, mp->dataBuffer);
-            lxfsFlushBlock(mp, parent.block);
-            return 0;
-        }
+    if(lxfsReadBlock(mp, block, mp->dataBuffer) ||
+    (crosses && lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes))) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return -EIO;
+    }
 
-        if(block == LXFS_BLOCK_EOF) {
-            // TODO:
-            // reached last block without finding a free entry, allocate a new block here too
-            luxLogf(KPRINT_LEVEL_ERROR, "TODO: %s: %d\n", __FILE__, __LINE__);
-            return -ENOSYS;
-        }
+    memcpy((void *)((uintptr_t) mp->dataBuffer + offset), dest, dest->entrySize);
+    if(lxfsWriteBlock(mp, block, mp->dataBuffer)) {
+        if(!hardLink) lxfsSetNextBlock(mp, dest->block, LXFS_BLOCK_FREE);
+        return -EIO;
+    }
 
-        memcpy(mp->dataBuffer + mp->blockSizeBytes, mp->dataBuffer, mp->blockSizeBytes);
-        offset -= mp->blockSizeBytes;
+    lxfsJournalBlock(mp, block);
+
+    if(crosses) {
+        if(lxfsWriteBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -EIO;
+        lxfsJournalBlock(mp, next);
     }
-}
+
+    // remember where the new entry lives, replacing any negative entry
+    lxfsDentryInsert(mp, parent.block, (const char *) dest->name, dest, block, offset);
+
+    // TODO: is there a better way to handle errors here?
+    // I'd argue this is a forgiveable error for lack of a better word
+    // and the POSIX spec doesn't cover this afaik
+    if(lxfsReadBlock(mp, parent.block, mp->dataBuffer))
+        return 0;
+
+    LXFSDirectoryHeader *parentHeader = (LXFSDirectoryHeader *) mp->dataBuffer;
+    parentHeader->sizeBytes += dest->entrySize;
+    parentHeader->sizeEntries++;
+    parentHeader->accessTime = timestamp;
+    parentHeader->modTime = timestamp;
+    lxfsWriteBlock(mp, parent.block, mp->dataBuffer);
+    lxfsJournalBlock(mp, parent.block);
+
+    lxfsIndexAdd(mp, parent.block, dest, block, offset);
+    return 0;
+}
\ No newline at end of file
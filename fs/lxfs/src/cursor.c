@@ -0,0 +1,74 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <string.h>
+
+/* Directory cursors: readdir positions past '.' and '..' are indexes of entry
+ * slots, deleted ones included, so a position always names the same slot for
+ * as long as the directory exists. A cursor remembers where the slot of the
+ * next position lives so that sequential readdir calls resume in place instead
+ * of scanning the directory from its first entry. Entries never move within a
+ * directory, unlinking only marks a slot deleted and new entries are appended
+ * after the last one, so cursors survive both; they are dropped whenever the
+ * blocks of a directory are freed or relocated. */
+
+/* lxfsCursorLookup(): looks up the cursor of a directory at a position
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: position - readdir position
+ * returns: pointer to cursor, NULL if none is cached
+ */
+
+DirCursor *lxfsCursorLookup(Mountpoint *mp, uint64_t dir, size_t position) {
+    for(int i = 0; i < DIR_CURSORS; i++) {
+        if((mp->cursors[i].dir == dir) && (mp->cursors[i].position == position)) {
+            mp->cursors[i].used = ++mp->cursorClock;
+            return &mp->cursors[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* lxfsCursorAllocate(): allocates a cursor for a directory, evicting the least
+ * recently used one if all are taken
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * returns: pointer to cursor at the first entry of the directory
+ */
+
+DirCursor *lxfsCursorAllocate(Mountpoint *mp, uint64_t dir) {
+    DirCursor *cursor = &mp->cursors[0];
+    for(int i = 0; i < DIR_CURSORS; i++) {
+        if(!mp->cursors[i].dir) {
+            cursor = &mp->cursors[i];
+            break;
+        }
+
+        if(mp->cursors[i].used < cursor->used) cursor = &mp->cursors[i];
+    }
+
+    cursor->dir = dir;
+    cursor->position = 2;
+    cursor->block = dir;
+    cursor->offset = sizeof(LXFSDirectoryHeader);
+    cursor->used = ++mp->cursorClock;
+    return cursor;
+}
+
+/* lxfsCursorForget(): discards every cursor of a directory whose blocks move
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * returns: nothing
+ */
+
+void lxfsCursorForget(Mountpoint *mp, uint64_t dir) {
+    for(int i = 0; i < DIR_CURSORS; i++) {
+        if(mp->cursors[i].dir == dir) memset(&mp->cursors[i], 0, sizeof(DirCursor));
+    }
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <errno.h>
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+
+/* lxfsExtents(): counts the runs of contiguous blocks in a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: blocks - pointer to store the number of data blocks, optional
+ * returns: number of extents, zero if the file has no data
+ */
+
+uint64_t lxfsExtents(Mountpoint *mp, uint64_t meta, uint64_t *blocks) {
+    uint64_t extents = 0, count = 0;
+    uint64_t prev = 0;
+    uint64_t block = lxfsNextBlock(mp, meta);
+    while(block && (block != LXFS_BLOCK_EOF)) {
+        if(block != (prev + 1)) extents++;
+        count++;
+        prev = block;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    if(blocks) *blocks = count;
+    return extents;
+}
+
+/* lxfsDefrag(): moves the data of a file into one run of contiguous blocks
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsDefrag(Mountpoint *mp, uint64_t meta) {
+    uint64_t count;
+    if(lxfsExtents(mp, meta, &count) <= 1) return 0;
+
+    // the whole file must fit in one run, as close as possible after its metadata
+    uint64_t start = lxfsAllocateRun(mp, count, meta + 1);
+    if(!start) return -ENOSPC;
+
+    uint64_t chunk = READAHEAD_MAX / mp->blockSizeBytes;
+    uint64_t first = lxfsNextBlock(mp, meta);
+    uint64_t block = first;
+    uint64_t copied = 0;
+
+    // copy the data one old extent at a time, bounded by the staging buffer
+    while(copied < count) {
+        uint64_t run = 1;
+        if(lxfsFlushBlock(mp, block)) goto fail;
+
+        uint64_t next = lxfsNextBlock(mp, block);
+        while((run < chunk) && (next == (block + run))) {
+            if(lxfsFlushBlock(mp, next)) goto fail;
+            run++;
+            next = lxfsNextBlock(mp, next);
+        }
+
+        if(lxfsReadBlocks(mp, block, run, mp->raBuffer)) goto fail;
+        if(lxfsWriteBlocks(mp, start + copied, run, mp->raBuffer)) goto fail;
+
+        copied += run;
+        block = next;
+    }
+
+    // switch the file over to the new copy before the old one is released,
+    // along with any files sharing the old one
+    if(lxfsShareMove(mp, meta, start)) goto fail;
+
+    lxfsFreeChain(mp, first);
+    lxfsChainDrop(mp, meta);
+    lxfsCursorForget(mp, meta);
+
+    // the file no longer ends where its reservations were made
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta) file->reserveCount = 0;
+            file = file->next;
+        }
+    }
+
+    return 0;
+
+fail:
+    lxfsFreeRun(mp, start, count);
+    return -EIO;
+}
\ No newline at end of file
@@ -0,0 +1,180 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lxfsDentryHash(): helper function to hash a path component
+ * params: name - path component
+ * returns: 32-bit FNV-1a hash
+ */
+
+static uint32_t lxfsDentryHash(const char *name) {
+    uint32_t hash = 0x811C9DC5;
+    while(*name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x01000193;
+        name++;
+    }
+
+    return hash;
+}
+
+/* lxfsDentryBucket(): helper function to return the hash bucket of a dentry
+ * params: parent - metadata block of the parent directory
+ * params: hash - hash of the name
+ * returns: bucket index
+ */
+
+static uint64_t lxfsDentryBucket(uint64_t parent, uint32_t hash) {
+    return ((parent * 0x9E3779B97F4A7C15) ^ hash) % DENTRY_BUCKETS;
+}
+
+/* lxfsDentryFree(): helper function to remove and free a dentry
+ * params: mp - mountpoint
+ * params: dentry - dentry to free
+ * returns: nothing
+ */
+
+static void lxfsDentryFree(Mountpoint *mp, Dentry *dentry) {
+    Dentry **bucket = &mp->dentries[lxfsDentryBucket(dentry->parent, dentry->hash)];
+    while(*bucket) {
+        if(*bucket == dentry) {
+            *bucket = dentry->next;
+            break;
+        }
+
+        bucket = &(*bucket)->next;
+    }
+
+    if(dentry->older) dentry->older->newer = dentry->newer;
+    else mp->oldestDentry = dentry->newer;
+    if(dentry->newer) dentry->newer->older = dentry->older;
+    else mp->newestDentry = dentry->older;
+
+    mp->dentryCount--;
+    free(dentry->name);
+    free(dentry);
+}
+
+/* lxfsDentryTouch(): helper function to mark a dentry as most recently used
+ * params: mp - mountpoint
+ * params: dentry - dentry
+ * returns: nothing
+ */
+
+static void lxfsDentryTouch(Mountpoint *mp, Dentry *dentry) {
+    if(mp->newestDentry == dentry) return;
+
+    // remove from the list
+    if(dentry->older) dentry->older->newer = dentry->newer;
+    else mp->oldestDentry = dentry->newer;
+    dentry->newer->older = dentry->older;
+
+    // and re-insert at the head
+    dentry->older = mp->newestDentry;
+    dentry->newer = NULL;
+    mp->newestDentry->newer = dentry;
+    mp->newestDentry = dentry;
+}
+
+/* lxfsDentryLookup(): looks up a path component in the dentry cache
+ * params: mp - mountpoint
+ * params: parent - metadata block of the parent directory
+ * params: name - path component
+ * returns: pointer to dentry, NULL if not cached
+ */
+
+Dentry *lxfsDentryLookup(Mountpoint *mp, uint64_t parent, const char *name) {
+    uint32_t hash = lxfsDentryHash(name);
+    Dentry *dentry = mp->dentries[lxfsDentryBucket(parent, hash)];
+    while(dentry) {
+        if((dentry->parent == parent) && (dentry->hash == hash) && !strcmp(dentry->name, name)) {
+            lxfsDentryTouch(mp, dentry);
+            return dentry;
+        }
+
+        dentry = dentry->next;
+    }
+
+    return NULL;
+}
+
+/* lxfsDentryInsert(): caches the result of a path component lookup
+ * params: mp - mountpoint
+ * params: parent - metadata block of the parent directory
+ * params: name - path component
+ * params: entry - directory entry, NULL if the component doesn't exist
+ * params: block - block containing the directory entry
+ * params: offset - offset of the directory entry within the block
+ * returns: nothing
+ */
+
+void lxfsDentryInsert(Mountpoint *mp, uint64_t parent, const char *name,
+                      const LXFSDirectoryEntry *entry, uint64_t block, off_t offset) {
+    Dentry *dentry = lxfsDentryLookup(mp, parent, name);
+    if(!dentry) {
+        // the cache is only a hint, so failing to allocate is not an error
+        dentry = calloc(1, sizeof(Dentry));
+        if(!dentry) return;
+
+        dentry->name = strdup(name);
+        if(!dentry->name) {
+            free(dentry);
+            return;
+        }
+
+        dentry->parent = parent;
+        dentry->hash = lxfsDentryHash(name);
+
+        uint64_t bucket = lxfsDentryBucket(parent, dentry->hash);
+        dentry->next = mp->dentries[bucket];
+        mp->dentries[bucket] = dentry;
+
+        dentry->older = mp->newestDentry;
+        if(mp->newestDentry) mp->newestDentry->newer = dentry;
+        mp->newestDentry = dentry;
+        if(!mp->oldestDentry) mp->oldestDentry = dentry;
+
+        mp->dentryCount++;
+        if(mp->dentryCount > DENTRY_MAX)
+            lxfsDentryFree(mp, mp->oldestDentry);
+    }
+
+    if(entry) {
+        dentry->negative = 0;
+        dentry->type = (entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+        dentry->target = entry->block;
+        dentry->block = block;
+        dentry->offset = offset;
+    } else {
+        dentry->negative = 1;
+        dentry->type = 0;
+        dentry->target = 0;
+        dentry->block = 0;
+        dentry->offset = 0;
+    }
+}
+
+/* lxfsDentryForget(): discards every dentry pointing to or contained in a
+ * file or directory that is being deleted
+ * params: mp - mountpoint
+ * params: target - metadata block of the deleted file or directory
+ * returns: nothing
+ */
+
+void lxfsDentryForget(Mountpoint *mp, uint64_t target) {
+    Dentry *dentry = mp->oldestDentry;
+    while(dentry) {
+        Dentry *newer = dentry->newer;
+        if((dentry->parent == target) || (!dentry->negative && (dentry->target == target)))
+            lxfsDentryFree(mp, dentry);
+
+        dentry = newer;
+    }
+}
\ No newline at end of file
@@ -149,83 +149,94 @@ void lxfsReaddir(ReaddirCommand *rcmd) {
         return;
     }
 
-    // now simply iterate over the directory
-    size_t position = 0;
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-    uint64_t next = entry.block;
+    // resume from the cursor left by the previous call if there is one, or
+    // else skip over the slots before the requested position
+    DirCursor *cursor = lxfsCursorLookup(mp, entry.block, rcmd->position);
+    uint64_t block = cursor ? cursor->block : entry.block;
+    off_t offset = cursor ? cursor->offset : sizeof(LXFSDirectoryHeader);
+    size_t position = cursor ? rcmd->position : 2;
+    uint64_t loaded = 0;
+    uint64_t next = 0;
+
+    for(;;) {
+        if(offset >= mp->blockSizeBytes) {
+            if(!loaded) next = lxfsNextBlock(mp, block);
+            if(!next) {
+                rcmd->header.header.status = -EIO;
+                luxSendKernel(rcmd);
+                return;
+            }
 
-    if(lxfsReadBlock(mp, next, mp->dataBuffer)) {
-        rcmd->header.header.status = -EIO;
-        luxSendKernel(rcmd);
-        return;
-    }
+            if(next == LXFS_BLOCK_EOF) break;
+
+            // slide the window forward by one block
+            offset -= mp->blockSizeBytes;
+            block = next;
+            if(loaded) {
+                memmove(mp->dataBuffer, mp->dataBuffer + mp->blockSizeBytes, mp->blockSizeBytes);
+                next = lxfsNextBlock(mp, block);
+                if(next && (next != LXFS_BLOCK_EOF) && lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes))
+                    next = 0;
+                else if(next == LXFS_BLOCK_EOF)
+                    memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+                if(!next) {
+                    rcmd->header.header.status = -EIO;
+                    luxSendKernel(rcmd);
+                    return;
+                }
+            }
 
-    while(dir->entrySize) {
-        next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-        if(!next) {
-            rcmd->header.header.status = -EIO;
-            luxSendKernel(rcmd);
-            return;
+            continue;
         }
 
-        // read two blocks at a time for entries that cross boundaries
-        if(next != LXFS_BLOCK_EOF)
-            lxfsReadNextBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes);
-        
-        dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-        off_t offset = sizeof(LXFSDirectoryHeader);
-
-        while(offset < mp->blockSizeBytes) {
-            if((dir->flags & LXFS_DIR_VALID) && (position == (rcmd->position-2))) {
-                strcpy(rcmd->entry.d_name, (char *) dir->name);
-                rcmd->entry.d_ino = dir->block;
-                rcmd->position++;
-                rcmd->end = 0;
-                rcmd->header.header.status = 0;
+        if(!loaded) {
+            // read two blocks at a time for entries that cross boundaries
+            // past the end of the chain, the second half is zeroed so that it
+            // reads as the end of the directory rather than stale entries
+            next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+            if(next && (next != LXFS_BLOCK_EOF) && lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes))
+                next = 0;
+            else if(next == LXFS_BLOCK_EOF)
+                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+            if(!next) {
+                rcmd->header.header.status = -EIO;
                 luxSendKernel(rcmd);
                 return;
             }
 
-            // skip over to the next entry
-            position++;
+            loaded = 1;
+        }
 
-            uint16_t oldSize = dir->entrySize;
-            if(!oldSize) {
-                rcmd->header.header.status = 0;
-                rcmd->end = 1;
-                luxSendKernel(rcmd);
-                return;
-            }
+        LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+        if(!dir->entrySize) break;      // end of directory
+        if(dir->entrySize > sizeof(LXFSDirectoryEntry)) {
+            rcmd->header.header.status = -EIO;
+            luxSendKernel(rcmd);
+            return;
+        }
 
-            dir = (LXFSDirectoryEntry *)((uintptr_t)dir + oldSize);
-            offset += oldSize;
+        offset += dir->entrySize;
+        position++;
 
-            if((offset >= mp->blockSizeBytes) && (next != LXFS_BLOCK_EOF)) {
-                // copy the second block to the first block
-                offset -= mp->blockSizeBytes;
-                dir = (LXFSDirectoryEntry *)((uintptr_t)dir - mp->blockSizeBytes);
-                memmove(mp->dataBuffer, mp->dataBuffer+mp->blockSizeBytes, mp->blockSizeBytes);
+        if((position > rcmd->position) && (dir->flags & LXFS_DIR_VALID)) {
+            strcpy(rcmd->entry.d_name, (char *) dir->name);
+            rcmd->entry.d_ino = dir->block;
 
-                if(!dir->entrySize) {
-                    rcmd->header.header.status = 0;
-                    rcmd->end = 1;
-                    luxSendKernel(rcmd);
-                    return;
-                }
+            // leave a cursor at the following slot for the next call
+            if(!cursor) cursor = lxfsCursorAllocate(mp, entry.block);
+            cursor->position = position;
+            cursor->block = block;
+            cursor->offset = offset;
 
-                // and read the next block
-                next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-                if(!next) {
-                    rcmd->header.header.status = -EIO;
-                    luxSendKernel(rcmd);
-                    return;
-                }
-            }
+            rcmd->position = position;
+            rcmd->end = 0;
+            rcmd->header.header.status = 0;
+            luxSendKernel(rcmd);
+            return;
         }
     }
 
     rcmd->header.header.status = 0;
     rcmd->end = 1;
     luxSendKernel(rcmd);
-    return;
 }
\ No newline at end of file
@@ -0,0 +1,440 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <string.h>
+#include <errno.h>
+
+/* Directory index: once a directory reaches DIR_INDEX_MIN entries, a run of
+ * blocks is allocated to map the hash of each name to the location of its
+ * entry, so a cold lookup reads the index header, one bucket and the entry
+ * instead of walking every block of the directory. The index also remembers
+ * where the directory ends so new entries are appended without a walk. The
+ * index is only trusted while the size it recorded matches the size of the
+ * directory; any mismatch means the directory was changed by a driver that
+ * doesn't know about it, and the index is rebuilt on the next insertion. */
+
+typedef struct {
+    uint64_t index;
+    uint32_t buckets;
+    uint64_t records;
+} IndexBuilder;
+
+/* lxfsIndexHash(): helper function to hash a name, part of the on-disk format
+ * params: name - name of the entry
+ * returns: 32-bit FNV-1a hash
+ */
+
+static uint32_t lxfsIndexHash(const char *name) {
+    uint32_t hash = 0x811C9DC5;
+    while(*name) {
+        hash ^= (uint8_t) *name;
+        hash *= 0x01000193;
+        name++;
+    }
+
+    return hash;
+}
+
+/* lxfsIndexCapacity(): helper function to return the records per bucket
+ * params: mp - mountpoint
+ * returns: number of records that fit in a bucket block
+ */
+
+static uint64_t lxfsIndexCapacity(Mountpoint *mp) {
+    return (mp->blockSizeBytes - sizeof(LXFSIndexBucket)) / sizeof(LXFSIndexRecord);
+}
+
+/* lxfsIndexValid(): helper function to check for an index written by lxfs
+ * params: mp - mountpoint
+ * params: index - header block of the index
+ * params: header - buffer to copy the index header into
+ * returns: one if valid, zero if not
+ */
+
+static int lxfsIndexValid(Mountpoint *mp, uint64_t index, LXFSIndexHeader *header) {
+    if(!index || (index >= mp->volumeSize)) return 0;
+
+    const LXFSIndexHeader *data = lxfsPeekBlock(mp, index);
+    if(!data) return 0;
+    if((data->magic != LXFS_INDEX_MAGIC) || !data->buckets) return 0;
+    if((index + data->buckets) >= mp->volumeSize) return 0;
+
+    memcpy(header, data, sizeof(LXFSIndexHeader));
+    return 1;
+}
+
+/* lxfsIndexCurrent(): helper function to return the index of a directory if
+ * it is up to date with the directory
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: header - buffer to copy the index header into
+ * returns: header block of the index, zero if none or out of date
+ */
+
+static uint64_t lxfsIndexCurrent(Mountpoint *mp, uint64_t dir, LXFSIndexHeader *header) {
+    const LXFSDirectoryHeader *dirHeader = lxfsPeekBlock(mp, dir);
+    if(!dirHeader) return 0;
+
+    // copy out before the index is read, it may evict the directory
+    uint64_t index = dirHeader->index;
+    uint64_t bytes = dirHeader->sizeBytes;
+
+    if(!lxfsIndexValid(mp, index, header)) return 0;
+    if(header->bytes != bytes) return 0;
+    return index;
+}
+
+/* lxfsIndexRecord(): helper function to add a record to a bucket
+ * params: mp - mountpoint
+ * params: index - header block of the index
+ * params: buckets - number of buckets
+ * params: hash - hash of the name
+ * params: block - block containing the directory entry
+ * params: offset - offset of the directory entry within the block
+ * returns: zero on success, one if the bucket is full, negative on I/O error
+ */
+
+static int lxfsIndexRecord(Mountpoint *mp, uint64_t index, uint32_t buckets,
+                           uint32_t hash, uint64_t block, off_t offset) {
+    uint64_t bucketBlock = index + 1 + (hash % buckets);
+    const LXFSIndexBucket *peek = lxfsPeekBlock(mp, bucketBlock);
+    if(!peek) return -1;
+    if(peek->count >= lxfsIndexCapacity(mp)) return 1;
+
+    LXFSIndexBucket *bucket = lxfsModifyBlock(mp, bucketBlock, 1);
+    if(!bucket) return -1;
+
+    bucket->records[bucket->count].hash = hash;
+    bucket->records[bucket->count].offset = offset;
+    bucket->records[bucket->count].block = block;
+    bucket->count++;
+    return 0;
+}
+
+/* lxfsIndexWalk(): helper function to iterate over the entries of a directory
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: builder - index to record valid entries in, NULL to only find the end
+ * params: tailBlock - pointer to store the block the last entry starts in
+ * params: tailOffset - pointer to store the end of the last entry relative to that block
+ * returns: zero on success, one if a bucket filled up, negative on I/O error
+ */
+
+static int lxfsIndexWalk(Mountpoint *mp, uint64_t dir, IndexBuilder *builder,
+                         uint64_t *tailBlock, off_t *tailOffset) {
+    // read two blocks at a time for entries that cross boundaries
+    uint64_t block = dir;
+    uint64_t next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+    if(!next) return -1;
+
+    if(next != LXFS_BLOCK_EOF) {
+        if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -1;
+    } else {
+        memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+    }
+
+    off_t offset = sizeof(LXFSDirectoryHeader);
+    for(;;) {
+        if(offset >= mp->blockSizeBytes) {
+            if(next == LXFS_BLOCK_EOF) break;
+
+            // slide the window forward by one block
+            offset -= mp->blockSizeBytes;
+            block = next;
+            memmove(mp->dataBuffer, mp->dataBuffer + mp->blockSizeBytes, mp->blockSizeBytes);
+
+            next = lxfsNextBlock(mp, block);
+            if(!next) return -1;
+
+            if(next != LXFS_BLOCK_EOF) {
+                if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -1;
+            } else {
+                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+            }
+
+            continue;
+        }
+
+        LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+        if(!entry->entrySize) break;                                    // end of directory
+        if(entry->entrySize > sizeof(LXFSDirectoryEntry)) return -1;    // corrupt
+
+        if(builder && (entry->flags & LXFS_DIR_VALID)) {
+            int status = lxfsIndexRecord(mp, builder->index, builder->buckets,
+                                         lxfsIndexHash((const char *) entry->name), block, offset);
+            if(status) return status;
+            builder->records++;
+        }
+
+        offset += entry->entrySize;
+    }
+
+    *tailBlock = block;
+    *tailOffset = offset;
+    return 0;
+}
+
+/* lxfsIndexFind(): looks up the possible locations of a name in the hash
+ * index of a directory
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: name - name of the entry
+ * params: blocks - array to store the blocks of the candidate entries
+ * params: offsets - array to store the offsets of the candidate entries
+ * params: max - maximum number of candidates
+ * returns: number of candidates, negative if the index can't be used
+ */
+
+int lxfsIndexFind(Mountpoint *mp, uint64_t dir, const char *name, uint64_t *blocks, off_t *offsets, int max) {
+    LXFSIndexHeader header;
+    uint64_t index = lxfsIndexCurrent(mp, dir, &header);
+    if(!index) return -1;
+
+    uint32_t hash = lxfsIndexHash(name);
+    const LXFSIndexBucket *bucket = lxfsPeekBlock(mp, index + 1 + (hash % header.buckets));
+    if(!bucket) return -1;
+
+    uint64_t count = bucket->count;
+    if(count > lxfsIndexCapacity(mp)) return -1;
+
+    int candidates = 0;
+    for(uint64_t i = 0; i < count; i++) {
+        if(bucket->records[i].hash != hash) continue;
+        if(candidates == max) return -1;
+
+        blocks[candidates] = bucket->records[i].block;
+        offsets[candidates] = bucket->records[i].offset;
+        candidates++;
+    }
+
+    return candidates;
+}
+
+/* lxfsIndexTail(): finds where the next entry of a directory will be appended
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: block - pointer to store the block
+ * params: offset - pointer to store the offset relative to the block, which
+ *   may lie past the end of the block
+ * returns: zero on success
+ */
+
+int lxfsIndexTail(Mountpoint *mp, uint64_t dir, uint64_t *block, off_t *offset) {
+    LXFSIndexHeader header;
+    if(lxfsIndexCurrent(mp, dir, &header) && header.tailBlock) {
+        *block = header.tailBlock;
+        *offset = header.tailOffset;
+        return 0;
+    }
+
+    return lxfsIndexWalk(mp, dir, NULL, block, offset) ? 1 : 0;
+}
+
+/* lxfsIndexBuild(): builds or rebuilds the hash index of a directory
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * returns: number of buckets on success, negative error code on fail
+ */
+
+int lxfsIndexBuild(Mountpoint *mp, uint64_t dir) {
+    const LXFSDirectoryHeader *dirHeader = lxfsPeekBlock(mp, dir);
+    if(!dirHeader) return -EIO;
+
+    uint64_t old = dirHeader->index;
+    uint64_t entries = dirHeader->sizeEntries;
+
+    // size the index so that the buckets start out half full
+    uint64_t capacity = lxfsIndexCapacity(mp);
+    uint64_t buckets = ((entries * 2) + capacity - 1) / capacity;
+    if(!buckets) buckets = 1;
+
+    // names rarely hash unevenly enough to need more than one retry
+    for(int attempt = 0; attempt < 4; attempt++, buckets *= 2) {
+        uint64_t index = lxfsAllocateRun(mp, buckets + 1, dir + 1);
+        if(!index) return -ENOSPC;
+
+        int status = 0;
+        for(uint64_t i = 0; i < buckets; i++) {
+            LXFSIndexBucket *bucket = lxfsModifyBlock(mp, index + 1 + i, 0);
+            if(!bucket) {
+                status = -1;
+                break;
+            }
+
+            memset(bucket, 0, mp->blockSizeBytes);
+        }
+
+        IndexBuilder builder;
+        builder.index = index;
+        builder.buckets = buckets;
+        builder.records = 0;
+
+        uint64_t tailBlock;
+        off_t tailOffset;
+        if(!status) status = lxfsIndexWalk(mp, dir, &builder, &tailBlock, &tailOffset);
+        if(status) {
+            lxfsFreeChain(mp, index);
+            if(status < 0) return -EIO;
+            continue;   // a bucket overflowed, try again with more of them
+        }
+
+        dirHeader = lxfsPeekBlock(mp, dir);
+        if(!dirHeader) {
+            lxfsFreeChain(mp, index);
+            return -EIO;
+        }
+
+        uint64_t bytes = dirHeader->sizeBytes;
+
+        LXFSIndexHeader *header = lxfsModifyBlock(mp, index, 0);
+        if(!header) {
+            lxfsFreeChain(mp, index);
+            return -EIO;
+        }
+
+        memset(header, 0, mp->blockSizeBytes);
+        header->magic = LXFS_INDEX_MAGIC;
+        header->buckets = buckets;
+        header->bytes = bytes;
+        header->entries = builder.records;
+        header->tailBlock = tailBlock;
+        header->tailOffset = tailOffset;
+
+        // the index must be on disk before the directory points to it
+        for(uint64_t i = 0; i <= buckets; i++) {
+            if(lxfsJournalBlock(mp, index + i)) {
+                lxfsFreeChain(mp, index);
+                return -EIO;
+            }
+        }
+
+        LXFSIndexHeader oldHeader;
+        int hadIndex = lxfsIndexValid(mp, old, &oldHeader);
+
+        LXFSDirectoryHeader *modify = lxfsModifyBlock(mp, dir, 1);
+        if(!modify) {
+            lxfsFreeChain(mp, index);
+            return -EIO;
+        }
+
+        modify->index = index;
+        if(lxfsJournalBlock(mp, dir)) return -EIO;
+
+        if(hadIndex) lxfsFreeChain(mp, old);
+        return buckets;
+    }
+
+    return -ENOSPC;
+}
+
+/* lxfsIndexAdd(): records a new entry in the hash index of a directory, after
+ * the entry was written and the size of the directory updated
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: entry - new directory entry
+ * params: block - block containing the directory entry
+ * params: offset - offset of the directory entry within the block
+ * returns: nothing, a directory that can't be indexed is walked instead
+ */
+
+void lxfsIndexAdd(Mountpoint *mp, uint64_t dir, const LXFSDirectoryEntry *entry, uint64_t block, off_t offset) {
+    const LXFSDirectoryHeader *dirHeader = lxfsPeekBlock(mp, dir);
+    if(!dirHeader) return;
+
+    uint64_t index = dirHeader->index;
+    uint64_t entries = dirHeader->sizeEntries;
+    uint64_t bytes = dirHeader->sizeBytes;
+
+    LXFSIndexHeader header;
+    if(!lxfsIndexValid(mp, index, &header)) {
+        if(entries >= DIR_INDEX_MIN) lxfsIndexBuild(mp, dir);
+        return;
+    }
+
+    // the index must have been current before this entry was added
+    if((header.bytes + entry->entrySize) != bytes) {
+        lxfsIndexBuild(mp, dir);
+        return;
+    }
+
+    uint32_t hash = lxfsIndexHash((const char *) entry->name);
+    int status = lxfsIndexRecord(mp, index, header.buckets, hash, block, offset);
+    if(status) {
+        // grow the index when a bucket fills up
+        if(status > 0) lxfsIndexBuild(mp, dir);
+        return;
+    }
+
+    LXFSIndexHeader *modify = lxfsModifyBlock(mp, index, 1);
+    if(!modify) return;
+
+    modify->bytes = bytes;
+    modify->entries++;
+    modify->tailBlock = block;
+    modify->tailOffset = offset + entry->entrySize;
+
+    lxfsJournalBlock(mp, index + 1 + (hash % header.buckets));
+    lxfsJournalBlock(mp, index);
+}
+
+/* lxfsIndexRemove(): removes a deleted entry from the hash index of a directory
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * params: block - block containing the deleted entry
+ * params: offset - offset of the deleted entry within the block
+ * returns: nothing
+ */
+
+void lxfsIndexRemove(Mountpoint *mp, uint64_t dir, uint64_t block, off_t offset) {
+    LXFSIndexHeader header;
+    uint64_t index = lxfsIndexCurrent(mp, dir, &header);
+    if(!index) return;
+
+    // the hash of the name is unknown once the entry is deleted, but its
+    // location is unique so every bucket can be searched for it
+    for(uint64_t i = 0; i < header.buckets; i++) {
+        const LXFSIndexBucket *peek = lxfsPeekBlock(mp, index + 1 + i);
+        if(!peek) return;
+
+        uint64_t count = peek->count;
+        if(count > lxfsIndexCapacity(mp)) continue;
+
+        for(uint64_t j = 0; j < count; j++) {
+            if((peek->records[j].block != block) || (peek->records[j].offset != offset))
+                continue;
+
+            LXFSIndexBucket *bucket = lxfsModifyBlock(mp, index + 1 + i, 1);
+            if(!bucket) return;
+
+            bucket->records[j] = bucket->records[count - 1];
+            bucket->count--;
+            lxfsJournalBlock(mp, index + 1 + i);
+
+            LXFSIndexHeader *modify = lxfsModifyBlock(mp, index, 1);
+            if(!modify) return;
+            modify->entries--;
+            lxfsJournalBlock(mp, index);
+            return;
+        }
+    }
+}
+
+/* lxfsIndexDrop(): frees the hash index of a directory that is being deleted
+ * params: mp - mountpoint
+ * params: dir - metadata block of the directory
+ * returns: nothing
+ */
+
+void lxfsIndexDrop(Mountpoint *mp, uint64_t dir) {
+    const LXFSDirectoryHeader *dirHeader = lxfsPeekBlock(mp, dir);
+    if(!dirHeader) return;
+
+    uint64_t index = dirHeader->index;
+    LXFSIndexHeader header;
+    if(lxfsIndexValid(mp, index, &header)) lxfsFreeChain(mp, index);
+}
\ No newline at end of file
@@ -16,7 +16,7 @@
  */
 
 int pathDepth(const char *path) {
-    if(!path || !strlen(path) || strlen(path) == 1) return 0;
+    if(!path || !strlen(path) || !strcmp(path, "/")) return 0;
 
     int c = 1;
     for(int i = 0; i < strlen(path); i++) {
@@ -62,6 +62,110 @@ char *pathComponent(char *dest, const char *path, int n) {
     return NULL;
 }
 
+/* lxfsLoadEntry(): helper function to load a directory entry at a known location
+ * params: dest - destination buffer to store the directory entry
+ * params: mp - lxfs mountpoint
+ * params: block - block containing the directory entry
+ * params: offset - offset of the directory entry within the block
+ * returns: zero on success, one if there is no valid entry, negative on I/O error
+ */
+
+static int lxfsLoadEntry(LXFSDirectoryEntry *dest, Mountpoint *mp, uint64_t block, off_t offset) {
+    uint64_t next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+    if(!next) return -1;
+
+    // entries may cross into the next block
+    if(next != LXFS_BLOCK_EOF) {
+        if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -1;
+    } else {
+        memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+    }
+
+    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+    if(!dir->entrySize || (dir->entrySize > sizeof(LXFSDirectoryEntry))) return 1;
+
+    memcpy(dest, dir, dir->entrySize);
+    return 0;
+}
+
+/* lxfsScanDirectory(): helper function to search a directory for an entry
+ * params: dest - destination buffer to store the directory entry
+ * params: mp - lxfs mountpoint
+ * params: dirBlock - metadata block of the directory
+ * params: name - name of the entry
+ * params: blockPtr - pointer to store the block containing the entry
+ * params: offPtr - pointer to store the offset of the entry within the block
+ * returns: zero if found, one if not found, negative on I/O error
+ */
+
+static int lxfsScanDirectory(LXFSDirectoryEntry *dest, Mountpoint *mp, uint64_t dirBlock,
+                             const char *name, uint64_t *blockPtr, off_t *offPtr) {
+    // large directories have a hash index pointing straight at the entry
+    uint64_t blocks[DIR_INDEX_CANDIDATES];
+    off_t offsets[DIR_INDEX_CANDIDATES];
+    int candidates = lxfsIndexFind(mp, dirBlock, name, blocks, offsets, DIR_INDEX_CANDIDATES);
+    if(candidates >= 0) {
+        for(int i = 0; i < candidates; i++) {
+            int status = lxfsLoadEntry(dest, mp, blocks[i], offsets[i]);
+            if(status < 0) return -1;
+            if(!status && (dest->flags & LXFS_DIR_VALID) && !strcmp((const char *) dest->name, name)) {
+                *blockPtr = blocks[i];
+                *offPtr = offsets[i];
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    // read two blocks at a time for entries that cross boundaries
+    uint64_t block = dirBlock;
+    uint64_t next = lxfsReadNextBlock(mp, block, mp->dataBuffer);
+    if(!next) return -1;
+
+    if(next != LXFS_BLOCK_EOF) {
+        if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -1;
+    } else {
+        memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+    }
+
+    off_t offset = sizeof(LXFSDirectoryHeader);
+    for(;;) {
+        if(offset >= mp->blockSizeBytes) {
+            if(next == LXFS_BLOCK_EOF) return 1;
+
+            // slide the window forward by one block
+            offset -= mp->blockSizeBytes;
+            block = next;
+            memmove(mp->dataBuffer, mp->dataBuffer + mp->blockSizeBytes, mp->blockSizeBytes);
+
+            next = lxfsNextBlock(mp, block);
+            if(!next) return -1;
+
+            if(next != LXFS_BLOCK_EOF) {
+                if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return -1;
+            } else {
+                memset(mp->dataBuffer + mp->blockSizeBytes, 0, mp->blockSizeBytes);
+            }
+
+            continue;
+        }
+
+        LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + offset);
+        if(!dir->entrySize) return 1;                                   // end of directory
+        if(dir->entrySize > sizeof(LXFSDirectoryEntry)) return -1;      // corrupt
+
+        if((dir->flags & LXFS_DIR_VALID) && !strcmp((const char *) dir->name, name)) {
+            memcpy(dest, dir, dir->entrySize);
+            *blockPtr = block;
+            *offPtr = offset;
+            return 0;
+        }
+
+        offset += dir->entrySize;
+    }
+}
+
 /* lxfsFind(): finds the directory entry associated with a file
  * params: dest - destination buffer to store the directory entry
  * params: mp - lxfs mountpoint
@@ -98,74 +202,59 @@ LXFSDirectoryEntry *lxfsFind(LXFSDirectoryEntry *dest, Mountpoint *mp, const cha
     }
 
     // for everything else we will need to traverse the file system starting
-    // at the root directory
-    LXFSDirectoryEntry *dir;
-    uint64_t prev;
-    uint64_t next = mp->root;
+    // at the root directory, using the dentry cache wherever possible
+    uint64_t parent = mp->root;
     int depth = pathDepth(path);
     char component[MAX_FILE_PATH];
 
-    int i = 0;
-
-traverse:
-    while(i < depth) {
-        // iterate over each component in the path and search for it in the directory
+    for(int i = 0; i < depth; i++) {
         if(!pathComponent(component, path, i)) return NULL;
 
-        prev = next;
-        next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-        if(!next) return NULL;
-        
-        // read two blocks at a time for entries that cross boundaries
-        if(next != LXFS_BLOCK_EOF)
-            lxfsReadNextBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes);
-
-        dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + sizeof(LXFSDirectoryHeader));
-        off_t offset = sizeof(LXFSDirectoryHeader);
-
-        while(offset < mp->blockSizeBytes) {
-            if((dir->flags & LXFS_DIR_VALID) && !strcmp((const char *) dir->name, component)) {
-                if(i == depth-1) {
-                    // found the file we're looking for
-                    if(blockPtr) *blockPtr = prev;
-                    if(offPtr) *offPtr = offset;
-                    return (LXFSDirectoryEntry *) memcpy(dest, dir, dir->entrySize);
-                } else {
-                    // found a parent component, ensure it is a directory
-                    i++;
-
-                    if(((dir->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR)
-                        return NULL;
-
-                    // and go back to the beginning of the loop but searching for this component
-                    next = dir->block;
-                    goto traverse;
-                }
-            }
-            
-            // advance to the next entry
-            uint16_t oldSize = dir->entrySize;
-            dir = (LXFSDirectoryEntry *)((uintptr_t)dir + oldSize);
-            offset += oldSize;
-
-            if(!dir->entrySize) {
-                // file doesn't exist
-                return NULL;
+        Dentry *dentry = lxfsDentryLookup(mp, parent, component);
+        if(dentry && dentry->negative) return NULL;
+
+        if(dentry && (i < depth-1)) {
+            // parent components only need to be directories
+            if(dentry->type != LXFS_DIR_TYPE_DIR) return NULL;
+            parent = dentry->target;
+            continue;
+        }
+
+        if(dentry) {
+            // the caller expects the blocks containing the entry in the data
+            // buffer, so load them and ensure the entry is still the same
+            int status = lxfsLoadEntry(dest, mp, dentry->block, dentry->offset);
+            if(status < 0) return NULL;
+            if(!status && (dest->flags & LXFS_DIR_VALID) && !strcmp((const char *) dest->name, component)) {
+                if(blockPtr) *blockPtr = dentry->block;
+                if(offPtr) *offPtr = dentry->offset;
+                return dest;
             }
+        }
 
-            if((offset >= mp->blockSizeBytes) && (next != LXFS_BLOCK_EOF)) {
-                // copy the second block to the first block
-                offset -= mp->blockSizeBytes;
-                dir = (LXFSDirectoryEntry *)((uintptr_t)dir - mp->blockSizeBytes);
-                memmove(mp->dataBuffer, mp->dataBuffer+mp->blockSizeBytes, mp->blockSizeBytes);
+        uint64_t block;
+        off_t offset;
+        int status = lxfsScanDirectory(dest, mp, parent, component, &block, &offset);
+        if(status < 0) return NULL;
+        if(status) {
+            lxfsDentryInsert(mp, parent, component, NULL, 0, 0);
+            return NULL;
+        }
 
-                if(!dir->entrySize) return NULL;
+        lxfsDentryInsert(mp, parent, component, dest, block, offset);
 
-                // and read the next block
-                next = lxfsReadNextBlock(mp, next, mp->dataBuffer);
-                if(!next) return NULL;
-            }
+        if(i == depth-1) {
+            // found the file we're looking for
+            if(blockPtr) *blockPtr = block;
+            if(offPtr) *offPtr = offset;
+            return dest;
         }
+
+        // found a parent component, ensure it is a directory
+        if(((dest->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR)
+            return NULL;
+
+        parent = dest->block;
     }
 
     return NULL;
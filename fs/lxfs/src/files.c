@@ -0,0 +1,391 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* lxfsMarkFile(): helper function to mark attributes of an open file as dirty
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: flags - attributes to mark, FILE_DIRTY_*
+ * returns: nothing
+ */
+
+static void lxfsMarkFile(Mountpoint *mp, OpenFile *file, int flags) {
+    if(!file->dirty) {
+        file->dirtySince = time(NULL);
+        mp->dirtyFiles++;
+    }
+
+    file->dirty |= flags;
+}
+
+/* lxfsWriteSize(): helper function to write the size of a file to its metadata block
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success
+ */
+
+static int lxfsWriteSize(Mountpoint *mp, OpenFile *file) {
+    if(lxfsReadBlock(mp, file->entry.block, mp->meta)) return 1;
+
+    // only the size is owned by the open file, the reference count may have
+    // been changed by link() or unlink() since the file was opened
+    LXFSFileHeader *header = (LXFSFileHeader *) mp->meta;
+    header->size = file->meta.size;
+    return lxfsWriteBlock(mp, file->entry.block, mp->meta);
+}
+
+/* lxfsWriteTimes(): helper function to write the timestamps of a file to its
+ * directory entry
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success
+ */
+
+static int lxfsWriteTimes(Mountpoint *mp, OpenFile *file) {
+    if(!file->dirBlock) return 0;   // root directory has no entry
+
+    uint64_t next = lxfsReadNextBlock(mp, file->dirBlock, mp->dataBuffer);
+    if(!next) return 1;
+
+    // entries may cross block boundaries
+    int crosses = (file->dirOffset + file->entry.entrySize) > mp->blockSizeBytes;
+    if(crosses) {
+        if(next == LXFS_BLOCK_EOF) return 1;
+        if(lxfsReadBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes)) return 1;
+    }
+
+    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + file->dirOffset);
+    dir->accessTime = file->entry.accessTime;
+    dir->modTime = file->entry.modTime;
+
+    if(lxfsWriteBlock(mp, file->dirBlock, mp->dataBuffer)) return 1;
+    if(crosses && lxfsWriteBlock(mp, next, mp->dataBuffer + mp->blockSizeBytes))
+        return 1;
+
+    return 0;
+}
+
+/* lxfsFreeFile(): helper function to write back and free the state of an open file
+ * params: mp - mountpoint
+ * params: file - open file, already removed from the table
+ * params: times - zero if the directory entry no longer exists
+ * returns: nothing
+ */
+
+static void lxfsFreeFile(Mountpoint *mp, OpenFile *file, int times) {
+    if(file->dirty) {
+        if(file->dirty & FILE_DIRTY_SIZE) lxfsWriteSize(mp, file);
+        if(times && (file->dirty & FILE_DIRTY_TIMES)) lxfsWriteTimes(mp, file);
+        mp->dirtyFiles--;
+    }
+
+    // files that were just written are shared with an identical file if
+    // there is one, before they are considered for cleaning
+    uint64_t freed;
+    if(times && file->written && mp->dedup && (file->meta.size <= DEDUP_INLINE_MAX))
+        lxfsDedup(mp, file, &freed);
+
+    if(times) lxfsAppendQueue(mp, file);
+
+    free(file->path);
+    free(file);
+}
+
+/* lxfsAllocateFile(): allocates the per-open state of a file
+ * params: mp - mountpoint
+ * params: id - kernel file ID
+ * params: path - path the file was opened with
+ * params: entry - directory entry of the file
+ * params: dirBlock - block containing the directory entry
+ * params: dirOffset - offset of the directory entry within the block
+ * returns: pointer to open file, NULL on fail
+ */
+
+OpenFile *lxfsAllocateFile(Mountpoint *mp, uint64_t id, const char *path,
+                           const LXFSDirectoryEntry *entry, uint64_t dirBlock, off_t dirOffset) {
+    // replace any stale state left behind under the same ID
+    lxfsReleaseFile(mp, id);
+
+    OpenFile *file = calloc(1, sizeof(OpenFile));
+    if(!file) return NULL;
+
+    file->path = strdup(path);
+    if(!file->path) {
+        free(file);
+        return NULL;
+    }
+
+    if(lxfsReadBlock(mp, entry->block, mp->meta)) {
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+
+    file->id = id;
+    memcpy(&file->entry, entry, entry->entrySize);
+    file->dirBlock = dirBlock;
+    file->dirOffset = dirOffset;
+    memcpy(&file->meta, mp->meta, sizeof(LXFSFileHeader));
+
+    // only the metadata blocks of files hold a table of unwritten blocks
+    int type = (entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+    if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) {
+        LXFSUnwritten *unwritten = (LXFSUnwritten *)((uintptr_t)mp->meta + sizeof(LXFSFileHeader));
+        file->unwritten = unwritten->count && (unwritten->count <= LXFS_UNWRITTEN_MAX);
+        file->inlined = lxfsIsInline(mp, mp->meta);
+        file->units = lxfsUnitTable(mp, mp->meta);
+    }
+
+    lxfsReadAheadReset(mp, &file->readahead);
+
+    // other open instances may hold a size that was not written back yet
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *other = mp->files[i];
+        while(other) {
+            if((other->entry.block == entry->block) && (other->dirty & FILE_DIRTY_SIZE))
+                file->meta.size = other->meta.size;
+            other = other->next;
+        }
+    }
+
+    uint64_t bucket = id % OPEN_FILE_BUCKETS;
+    file->next = mp->files[bucket];
+    mp->files[bucket] = file;
+    return file;
+}
+
+/* lxfsGetFile(): returns the per-open state of a file, allocating it if needed
+ * params: mp - mountpoint
+ * params: id - kernel file ID
+ * params: path - path of the file
+ * returns: pointer to open file, NULL if the file doesn't exist
+ */
+
+OpenFile *lxfsGetFile(Mountpoint *mp, uint64_t id, const char *path) {
+    OpenFile *file = mp->files[id % OPEN_FILE_BUCKETS];
+    while(file) {
+        if(file->id == id) {
+            if(!strcmp(file->path, path)) return file;
+            break;
+        }
+
+        file = file->next;
+    }
+
+    // not opened through lxfsOpen() or invalidated since, fall back to the path
+    LXFSDirectoryEntry entry;
+    uint64_t dirBlock = 0;
+    off_t dirOffset = 0;
+    if(!lxfsFind(&entry, mp, path, &dirBlock, &dirOffset)) return NULL;
+
+    return lxfsAllocateFile(mp, id, path, &entry, dirBlock, dirOffset);
+}
+
+/* lxfsReleaseFile(): writes back and releases the per-open state of a file
+ * params: mp - mountpoint
+ * params: id - kernel file ID
+ * returns: nothing
+ */
+
+void lxfsReleaseFile(Mountpoint *mp, uint64_t id) {
+    OpenFile **file = &mp->files[id % OPEN_FILE_BUCKETS];
+    while(*file) {
+        if((*file)->id == id) {
+            OpenFile *victim = *file;
+            *file = victim->next;
+            lxfsFreeFile(mp, victim, 1);
+            return;
+        }
+
+        file = &(*file)->next;
+    }
+}
+
+/* lxfsSyncFiles(): updates the cached metadata of every open instance of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: header - new metadata header
+ * returns: nothing
+ */
+
+void lxfsSyncFiles(Mountpoint *mp, uint64_t meta, const LXFSFileHeader *header) {
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta)
+                memcpy(&file->meta, header, sizeof(LXFSFileHeader));
+            file = file->next;
+        }
+    }
+}
+
+/* lxfsInvalidateFiles(): discards every open instance of a file, forcing the
+ * next I/O on it to resolve its path again
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: nothing
+ */
+
+void lxfsInvalidateFiles(Mountpoint *mp, uint64_t meta) {
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile **file = &mp->files[i];
+        while(*file) {
+            if((*file)->entry.block == meta) {
+                OpenFile *victim = *file;
+                *file = victim->next;
+
+                // the directory entry is gone, so only the size is kept
+                lxfsFreeFile(mp, victim, 0);
+            } else {
+                file = &(*file)->next;
+            }
+        }
+    }
+}
+
+/* lxfsFlushFile(): writes back the dirty attributes of an open file
+ * this uses both the data buffer and the metadata buffer
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success
+ */
+
+int lxfsFlushFile(Mountpoint *mp, OpenFile *file) {
+    if(!file->dirty) return 0;
+
+    if((file->dirty & FILE_DIRTY_SIZE) && lxfsWriteSize(mp, file)) return 1;
+    file->dirty &= ~FILE_DIRTY_SIZE;
+
+    if((file->dirty & FILE_DIRTY_TIMES) && lxfsWriteTimes(mp, file)) return 1;
+    file->dirty = 0;
+
+    mp->dirtyFiles--;
+    return 0;
+}
+
+/* lxfsFlushFiles(): writes back the dirty attributes of every open instance of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsFlushFiles(Mountpoint *mp, uint64_t meta) {
+    int status = 0;
+    for(int i = 0; mp->dirtyFiles && (i < OPEN_FILE_BUCKETS); i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if((file->entry.block == meta) && lxfsFlushFile(mp, file)) status = 1;
+            file = file->next;
+        }
+    }
+
+    return status;
+}
+
+/* lxfsExpireFiles(): writes back attributes that have been dirty for too long
+ * params: mp - mountpoint
+ * params: now - current time
+ * returns: nothing
+ */
+
+void lxfsExpireFiles(Mountpoint *mp, time_t now) {
+    for(int i = 0; mp->dirtyFiles && (i < OPEN_FILE_BUCKETS); i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->dirty && ((now - file->dirtySince) >= ATTR_FLUSH_INTERVAL))
+                lxfsFlushFile(mp, file);
+            file = file->next;
+        }
+    }
+}
+
+/* lxfsResizeFile(): changes the size of an open file in memory
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: size - new size in bytes
+ * returns: nothing
+ */
+
+void lxfsResizeFile(Mountpoint *mp, OpenFile *file, uint64_t size) {
+    file->meta.size = size;
+    lxfsSyncFiles(mp, file->entry.block, &file->meta);
+    lxfsMarkFile(mp, file, FILE_DIRTY_SIZE);
+}
+
+/* lxfsTouchFile(): updates the timestamps of an open file in memory
+ * access times follow a relatime policy: they are only updated if they are
+ * older than the modification time or than RELATIME_INTERVAL
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: timestamp - current time
+ * params: modified - non-zero if the file was modified, zero if only accessed
+ * returns: nothing
+ */
+
+void lxfsTouchFile(Mountpoint *mp, OpenFile *file, time_t timestamp, int modified) {
+    if(modified) {
+        file->entry.accessTime = timestamp;
+        file->entry.modTime = timestamp;
+        file->written = 1;
+    } else if((file->entry.accessTime <= file->entry.modTime) ||
+    ((timestamp - (time_t) file->entry.accessTime) >= RELATIME_INTERVAL)) {
+        file->entry.accessTime = timestamp;
+    } else {
+        return;
+    }
+
+    lxfsMarkFile(mp, file, FILE_DIRTY_TIMES);
+}
+
+/* lxfsPendingAttributes(): applies attributes that were not written back yet
+ * to a directory entry and metadata header read from the disk
+ * params: mp - mountpoint
+ * params: entry - directory entry
+ * params: dirBlock - block containing the directory entry
+ * params: dirOffset - offset of the directory entry within the block
+ * params: header - metadata header of the file
+ * returns: nothing
+ */
+
+void lxfsPendingAttributes(Mountpoint *mp, LXFSDirectoryEntry *entry, uint64_t dirBlock,
+                           off_t dirOffset, LXFSFileHeader *header) {
+    for(int i = 0; mp->dirtyFiles && (i < OPEN_FILE_BUCKETS); i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == entry->block) {
+                if(file->dirty & FILE_DIRTY_SIZE)
+                    header->size = file->meta.size;
+
+                if((file->dirty & FILE_DIRTY_TIMES) && (file->dirBlock == dirBlock) &&
+                (file->dirOffset == dirOffset)) {
+                    entry->accessTime = file->entry.accessTime;
+                    entry->modTime = file->entry.modTime;
+                }
+            }
+
+            file = file->next;
+        }
+    }
+}
+
+/* lxfsWritable(): checks if a user may write to an open file
+ * params: file - open file
+ * params: uid - user ID
+ * params: gid - group ID
+ * returns: one if writable, zero if not
+ */
+
+int lxfsWritable(OpenFile *file, uid_t uid, gid_t gid) {
+    if(!uid) return 1;
+    if(uid == file->entry.owner) return (file->entry.permissions & LXFS_PERMS_OWNER_W) != 0;
+    if(gid == file->entry.group) return (file->entry.permissions & LXFS_PERMS_GROUP_W) != 0;
+    return (file->entry.permissions & LXFS_PERMS_OTHER_W) != 0;
+}
\ No newline at end of file
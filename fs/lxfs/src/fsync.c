@@ -7,6 +7,7 @@
 
 #include <liblux/liblux.h>
 #include <lxfs/lxfs.h>
+#include <string.h>
 #include <errno.h>
 
 /* lxfsFsync(): implementation of fsync() for lxfs
@@ -25,6 +26,21 @@ void lxfsFsync(FsyncCommand *cmd) {
         return;
     }
 
+    // the kernel sends a final fsync when a file is closed, and requests still
+    // parked on it would otherwise be resumed on a file that isn't open
+    if(cmd->close) {
+        lxfsDropParked(mp, cmd->id);
+        lxfsReleaseFile(mp, cmd->id);
+    }
+
+    // syncing the root directory writes back the whole volume in one pass
+    if(!strcmp(cmd->path, "/")) {
+        if(lxfsSyncVolume(mp)) cmd->header.header.status = -EIO;
+        else cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
     LXFSDirectoryEntry entry;
     if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
         if(!cmd->close) cmd->header.header.status = -ENOENT;
@@ -33,6 +49,52 @@ void lxfsFsync(FsyncCommand *cmd) {
         return;
     }
 
+    // write back attributes that are still held by open files
+    if(lxfsFlushFiles(mp, entry.block)) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // for regular files, use the chain index to avoid walking the block table
+    uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+    ChainIndex *index = NULL;
+    if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK))
+        index = lxfsChainIndex(mp, entry.block);
+
+    // with a journal, metadata is durable once committed rather than written in
+    // place, so it is added to the running transaction and committed after the
+    // data has been written; on close it goes out with the next group commit
+    if(index) {
+        cmd->header.header.status = 0;
+        int status = mp->journal ? lxfsJournalBlock(mp, entry.block) : lxfsFlushBlock(mp, entry.block);
+        if(status || lxfsCompressSync(mp, entry.block))
+            cmd->header.header.status = -EIO;
+
+        for(size_t i = 0; !cmd->header.header.status && (i < index->extentCount); i++) {
+            for(uint64_t j = 0; j < index->extents[i].count; j++) {
+                if(lxfsFlushBlock(mp, index->extents[i].start + j)) {
+                    cmd->header.header.status = -EIO;
+                    break;
+                }
+            }
+        }
+
+        if(!cmd->header.header.status && mp->journal && !cmd->close && lxfsJournalCommit(mp))
+            cmd->header.header.status = -EIO;
+
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // directories and links hold nothing but metadata
+    if(mp->journal) {
+        if(!cmd->close && lxfsJournalCommit(mp)) cmd->header.header.status = -EIO;
+        else cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
     uint64_t next = entry.block;
     while(next && (next != LXFS_BLOCK_EOF)) {
         if(lxfsFlushBlock(mp, next)) {
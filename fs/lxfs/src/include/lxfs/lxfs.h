@@ -8,17 +8,220 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <liblux/liblux.h>
 
-/* with a block size of 2 KB, this will give us 8 MB of cache */
+/* cache slots per mountpoint, i.e. 8 MB of cache with a block size of 2 KB */
 #define CACHE_SIZE          4096
 
+/* memory for cached block data shared by all mountpoints, in bytes, of which
+ * every mountpoint keeps at least CACHE_MIN_BUFFERS blocks */
+#define CACHE_BUDGET_MAX    (32 << 20)
+#define CACHE_BUDGET_MIN    (2 << 20)
+#define CACHE_MIN_BUFFERS   256
+
+/* the budget shrinks while more than CACHE_PRESSURE_HIGH percent of memory is
+ * in use and grows while less than CACHE_PRESSURE_LOW percent is, checked at
+ * most every CACHE_PRESSURE_INTERVAL seconds */
+#define CACHE_PRESSURE_HIGH     85
+#define CACHE_PRESSURE_LOW      60
+#define CACHE_PRESSURE_INTERVAL 2
+
+/* bounds of the sequential read-ahead window, in bytes */
+#define READAHEAD_MIN       16384
+#define READAHEAD_MAX       262144
+
+/* aligned writes of at least this many bytes of contiguous blocks bypass the cache */
+#define DIRECT_WRITE_MIN    65536
+
+#define OPEN_FILE_BUCKETS   64
+
+/* free blocks left after a new file for it to grow into, and free blocks
+ * after the end of an open file held back from other files' allocations */
+#define ALLOC_SPREAD        256
+#define ALLOC_RESERVE       64
+
+/* on volumes in append mode, files left with more than this many extents
+ * are queued to be rewritten at the log head, up to APPEND_CLEAN_MAX of them */
+#define APPEND_FRAGMENTED   4
+#define APPEND_CLEAN_MAX    32
+
+/* dirty attributes of open files are written back after this many seconds */
+#define ATTR_FLUSH_INTERVAL 5
+
+/* access times are updated at least this often in seconds */
+#define RELATIME_INTERVAL   86400
+
+#define FILE_DIRTY_SIZE     0x01
+#define FILE_DIRTY_TIMES    0x02
+
+/* dirty blocks are written back after this many seconds, or once there are
+ * more than WRITEBACK_HIGH of them, in which case down to WRITEBACK_LOW */
+#define WRITEBACK_AGE       5
+#define WRITEBACK_HIGH      (CACHE_SIZE / 4)
+#define WRITEBACK_LOW       (CACHE_SIZE / 8)
+
+/* largest merged write issued by writeback, in bytes */
+#define WRITEBACK_MAX       262144
+
+/* block tables of up to this many bytes are held in memory for the life of a
+ * mount, i.e. volumes of up to 16M blocks; larger ones go through the cache */
+#define TABLE_PINNED_MAX    (128 << 20)
+
+#define TABLE_PAGE_DIRTY    0x01
+#define TABLE_PAGE_LOGGED   0x02        // unmodified since it was copied to the journal
+
+/* the running journal transaction commits after this many seconds, and the
+ * log is checkpointed once it is half full or its oldest transaction is this
+ * old, between requests */
+#define JOURNAL_COMMIT_INTERVAL     1
+#define JOURNAL_CHECKPOINT_AGE      (WRITEBACK_AGE * 2)
+
+/* a request must never see the transaction fill up halfway through, so it is
+ * also committed between requests once fewer than this many blocks are free */
+#define JOURNAL_RESERVE             12
+
+/* blocks of the block table a file may free in one step of lxfsChainShrink(),
+ * leaving room in the transaction for the rest of the step */
+#define JOURNAL_CUT_MAX             (JOURNAL_RESERVE - 4)
+
+/* files are deduplicated against an index of this many files seen recently,
+ * and as they are closed after being written if they are at most
+ * DEDUP_INLINE_MAX bytes; larger files are left to an explicit ioctl() */
+#define DEDUP_INDEX_SIZE    8192
+#define DEDUP_INLINE_MAX    (16 << 20)
+
+/* asynchronous block reads in flight per mountpoint, i.e. the queue depth */
+#define ASYNC_READS_MAX     32
+
+/* seconds to wait for sdev before going back to the device file */
+#define CHANNEL_TIMEOUT     20
+
 typedef struct {
     int valid, dirty;
+    int prefetched;             // filled by read-ahead and not yet used
+    int logged;                 // unmodified since it was copied to the journal
+    time_t dirtied;             // mountpoint clock when the slot became dirty
     uint64_t tag;
     void *data;
 } Cache;
 
+/* extents held by the chain indexes of a mountpoint before eviction */
+#define CHAIN_INDEX_EXTENTS 65536
+#define CHAIN_INDEX_BUCKETS 256
+
+typedef struct {
+    uint64_t index;             // file-relative index of the first block
+    uint64_t start;             // first block of the run
+    uint64_t count;             // number of contiguous blocks
+} LXFSExtent;
+
+typedef struct ChainIndex {
+    struct ChainIndex *next;            // hash bucket
+    struct ChainIndex *older, *newer;   // least recently used list
+    uint64_t meta;              // metadata block of the file
+    uint64_t blocks;            // number of data blocks indexed
+    size_t extentCount, extentMax;
+    LXFSExtent *extents;
+} ChainIndex;
+
+typedef struct {
+    uint64_t hash;              // of the contents of the file
+    uint64_t size;
+    uint64_t meta;              // metadata block of the file, zero if unused
+} DedupRecord;
+
+/* directory entries remembered by the dentry cache before eviction */
+#define DENTRY_MAX          8192
+#define DENTRY_BUCKETS      1024
+
+typedef struct Dentry {
+    struct Dentry *next;            // hash bucket
+    struct Dentry *older, *newer;   // least recently used list
+    uint64_t parent;            // metadata block of the parent directory
+    uint32_t hash;              // hash of the name
+    char *name;
+    int negative;               // name is known not to exist
+    uint8_t type;               // entry type, LXFS_DIR_TYPE_*
+    uint64_t target;            // metadata block the entry points to
+    uint64_t block;             // location of the directory entry
+    off_t offset;
+} Dentry;
+
+/* directories with this many entries are given an on-disk hash index */
+#define DIR_INDEX_MIN       128
+#define DIR_INDEX_CANDIDATES 8
+
+/* readdir positions remembered so listings don't rescan the directory */
+#define DIR_CURSORS         64
+
+typedef struct {
+    uint64_t dir;               // metadata block of the directory, zero if unused
+    size_t position;            // readdir position the cursor resumes at
+    uint64_t block;             // location of the entry slot at that position
+    off_t offset;
+    uint64_t used;              // least recently used stamp
+} DirCursor;
+
+typedef struct {
+    off_t expected;             // position of the next sequential read
+    uint64_t window;            // current window size in blocks
+    uint64_t start, end;        // file-relative blocks of the last window
+    uint64_t wasted;            // mountpoint waste counter at the last window
+} ReadAhead;
+
+/* block read submitted to the device and not yet completed */
+typedef struct BlockRead {
+    struct BlockRead *next;
+    uint64_t id;
+    uint64_t block, count;
+    int prefetched;             // read ahead rather than on demand
+    int stale;                  // written to while in flight, result is discarded
+} BlockRead;
+
+typedef struct {
+    uint64_t block, count;
+} BlockRun;
+
+/* request parked until the blocks it needs are read */
+typedef struct Continuation {
+    struct Continuation *next;
+    SyscallHeader *msg;         // copy of the request message
+    size_t runCount;
+    BlockRun *runs;             // missing blocks the request waits for
+} Continuation;
+
+/* on-disk format of the journal, see below */
+#define LXFS_JOURNAL_START          1
+#define LXFS_JOURNAL_BLOCKS         32
+#define LXFS_JOURNAL_LOG            (LXFS_JOURNAL_BLOCKS - 1)
+
+/* the block table follows the reserved blocks */
+#define LXFS_TABLE_START            (LXFS_JOURNAL_START + LXFS_JOURNAL_BLOCKS)
+
+/* state of the metadata journal of a mountpoint */
+typedef struct {
+    uint64_t sequence;          // of the running transaction
+    uint64_t head;              // first free block of the log
+    time_t started;             // when the running transaction got its first block
+    time_t committed;           // when the oldest transaction in the log was committed
+    int busy;                   // committing or checkpointing, writes go straight through
+
+    // blocks of the running transaction, and whether an in-place write of
+    // each was held back until it commits, with the contents in copies
+    size_t count;
+    uint64_t blocks[LXFS_JOURNAL_LOG];
+    int held[LXFS_JOURNAL_LOG];
+    void *copies;               // LXFS_JOURNAL_LOG blocks
+
+    // blocks with an image in the log, and the log block of the latest one
+    size_t loggedCount;
+    uint64_t logged[LXFS_JOURNAL_LOG];
+    uint64_t images[LXFS_JOURNAL_LOG];
+
+    void *log;                  // copy of the log, LXFS_JOURNAL_LOG blocks
+} Journal;
+
 typedef struct Mountpoint {
     struct Mountpoint *next;
     char device[MAX_FILE_PATH];
@@ -27,11 +230,75 @@ typedef struct Mountpoint {
 
     uint64_t volumeSize;        // in blocks
     uint64_t root;              // root directory block
-    void *blockTableBuffer;     // of size blockSizeBytes
     void *dataBuffer;           // of size 2 * blockSizeBytes
     void *meta;                 // metadata buffer, blockSizeBytes
+    void *raBuffer;             // read-ahead buffer, READAHEAD_MAX
 
     Cache *cache;
+    size_t cacheBuffers;        // slots with a data buffer, counted against the budget
+    uint64_t cacheHand;         // next slot to consider when giving up a buffer
+    uint64_t lastUse;           // request count at the last request for this volume
+    ChainIndex *chains[CHAIN_INDEX_BUCKETS];
+    ChainIndex *oldestChain, *newestChain;
+    size_t chainExtents;        // extents allocated across all indexes
+    struct OpenFile *files[OPEN_FILE_BUCKETS];
+    size_t dirtyFiles;          // open files with dirty attributes
+    Dentry *dentries[DENTRY_BUCKETS];
+    Dentry *oldestDentry, *newestDentry;
+    size_t dentryCount;
+    DirCursor cursors[DIR_CURSORS];
+    uint64_t cursorClock;
+    uint64_t raHits, raWasted;  // read-ahead feedback counters
+
+    // for measurement only, nothing in the driver depends on these
+    uint64_t cacheHits, cacheMisses;        // lookups of blocks in the cache
+    uint64_t deviceReads, deviceWrites;     // requests issued to the device
+    uint64_t blocksRead, blocksWritten;
+
+    size_t dirtyBlocks;         // dirty cache slots
+    time_t clock;               // coarse clock, updated by lxfsTick()
+    time_t lastWriteback;
+    void *wbBuffer;             // writeback staging, WRITEBACK_MAX
+    uint64_t *wbList;           // writeback sort list, CACHE_SIZE entries
+
+    // block table pinned in memory, NULL if it is only reached through the cache
+    uint64_t *table;
+    uint64_t tableBlocks;
+    uint8_t *tablePages;        // TABLE_PAGE_* flags of each block of the table
+    size_t tableDirtyPages;
+    time_t tableDirtied;        // mountpoint clock when the first page became dirty
+
+    // asynchronous reads, submitRead is NULL if the device only supports
+    // synchronous I/O; completions are delivered through lxfsCompleteRead()
+    int (*submitRead)(struct Mountpoint *, uint64_t, uint64_t, uint64_t);
+    uint64_t handle;            // sdev attachment, zero if I/O goes through fd
+    BlockRead *reads;
+    size_t readCount;
+    uint64_t nextRead;
+    Continuation *parked;
+
+    uint64_t allocRotor;        // where the next new file is placed
+    int extentMaps;             // v2 volume, files record their extents
+
+    // append mode, new blocks are allocated one after another from a log head
+    // and fragmented files are rewritten there while the volume is idle
+    int append;
+    uint64_t logHead;
+    char *cleanQueue[APPEND_CLEAN_MAX];     // paths of files to rewrite
+    size_t cleanCount;
+
+    // compression, with the last unit that was decompressed kept around
+    int compress;               // new files are compressed
+    void *unitData;             // LXFS_UNIT_BLOCKS blocks, allocated on demand
+    void *unitPacked;
+    uint64_t unitFile;          // metadata block of the file unitData holds, zero if none
+    uint64_t unitIndex;
+
+    // deduplication, files with the same contents share their data blocks
+    int dedup;
+    DedupRecord *dedupIndex;    // DEDUP_INDEX_SIZE records, allocated on demand
+
+    Journal *journal;           // metadata journal, NULL if the volume has none
 } Mountpoint;
 
 typedef struct {
@@ -42,19 +309,25 @@ typedef struct {
     uint8_t parameters;
     uint8_t version;
     uint8_t name[16];
-    uint8_t reserved[6];
+    uint8_t features;
+    uint8_t reserved[5];
 
     // more boot code follows
 } __attribute__((packed)) LXFSIdentification;
 
 #define LXFS_MAGIC                  0x5346584C  // 'LXFS', little endian
 #define LXFS_VERSION                0x01
+#define LXFS_VERSION_EXTENTS        0x02        // files carry an extent map
 
 #define LXFS_ID_BOOTABLE            0x01
 #define LXFS_ID_SECTOR_SIZE_SHIFT   1
 #define LXFS_ID_SECTOR_SIZE_MASK    0x03
 #define LXFS_ID_BLOCK_SIZE_SHIFT    3
 #define LXFS_ID_BLOCK_SIZE_MASK     0x0F
+#define LXFS_ID_COMPRESS            0x80        // new files are compressed, v2 only
+
+#define LXFS_FEATURE_APPEND         0x01        // new blocks are appended at a log head
+#define LXFS_FEATURE_DEDUP          0x02        // files may share their data blocks
 
 typedef struct {
     uint32_t identifier;
@@ -81,7 +354,7 @@ typedef struct {
     uint64_t accessTime;
     uint64_t sizeEntries;
     uint64_t sizeBytes;
-    uint64_t reserved;
+    uint64_t index;             // hash index header block, zero if none
 } __attribute__((packed)) LXFSDirectoryHeader;
 
 typedef struct {
@@ -127,20 +400,314 @@ typedef struct {
     uint64_t refCount;
 } __attribute__((packed)) LXFSFileHeader;
 
+/* runs of file blocks that were allocated but never written, which read back
+ * as zeros; the table follows the file header in the metadata block */
+#define LXFS_UNWRITTEN_MAX          30
+
+typedef struct {
+    uint64_t count;
+    struct {
+        uint64_t start;         // file-relative index of the first block
+        uint64_t count;
+    } runs[LXFS_UNWRITTEN_MAX];
+} __attribute__((packed)) LXFSUnwritten;
+
+/* files with the same contents on a volume with deduplication share a single
+ * chain of data blocks: the metadata block of each of them links to the same
+ * first data block, and the files are linked into a ring through the last two
+ * slots of their tables of unwritten blocks, which are otherwise unused as
+ * files with unwritten blocks are never shared. The chain is only freed along
+ * with the last file of the ring, and a file whose data is about to change
+ * leaves the ring with a copy of its own first. Drivers that don't know about
+ * the feature would free the chain along with any one of the files. */
+#define LXFS_SHARE_MAGIC            0x444552414853584C  // 'LXSHARED'
+
+typedef struct {
+    uint64_t magic;
+    uint64_t prev;              // metadata blocks of the neighbours in the ring
+    uint64_t next;
+    uint64_t reserved;
+} __attribute__((packed)) LXFSShare;
+
+#define LXFS_SHARE_OFFSET           (sizeof(LXFSFileHeader) + sizeof(LXFSUnwritten) - sizeof(LXFSShare))
+
+/* extent map of a file on a v2 volume, at a fixed offset in its metadata
+ * block after the table of unwritten blocks; the block table still links the
+ * blocks of the file so allocation and v1 drivers keep working, but the map
+ * locates them in O(extents) without walking the table. Extents that don't
+ * fit go in one overflow block. Only files created on a v2 volume have a map,
+ * and a map that doesn't agree with the first and last links of the chain was
+ * left behind by a v1 driver and is rebuilt. */
+#define LXFS_EXTENT_MAP_OFFSET      512
+#define LXFS_EXTENT_MAP_MAGIC       0x50414D00FF545845  // 'EXT', 0xFF, 0, 'MAP'
+#define LXFS_EXTENTS_INVALID        0xFFFFFFFFFFFFFFFF
+
+typedef struct {
+    uint64_t start;
+    uint64_t count;
+} __attribute__((packed)) LXFSExtentRecord;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t count;             // extents recorded, LXFS_EXTENTS_INVALID if not
+    uint64_t blocks;            // data blocks covered
+    uint64_t last;              // last data block of the file
+    uint64_t overflow;          // block holding further extents, zero if none
+    LXFSExtentRecord extents[];
+} __attribute__((packed)) LXFSExtentMap;
+
+/* data of a small file on a v2 volume, stored in its metadata block in place
+ * of the extent map; a file is either inline or has data blocks and a map */
+#define LXFS_INLINE_OFFSET          LXFS_EXTENT_MAP_OFFSET
+#define LXFS_INLINE_MAGIC           0x41544144454E494C  // 'LINEDATA'
+
+typedef struct {
+    uint64_t magic;
+    uint8_t data[];
+} __attribute__((packed)) LXFSInlineData;
+
+/* compressed files on v2 volumes are stored in units of LXFS_UNIT_BLOCKS data
+ * blocks; the blocks of each unit hold either an LZ4 block, the raw data, or
+ * nothing if the unit reads back as zeros. The unit table has one byte per
+ * unit with the number of blocks it takes up in the chain, and is itself a
+ * chain of blocks, pointed to from the end of the metadata block after the
+ * table of unwritten blocks */
+#define LXFS_UNIT_BLOCKS            16
+#define LXFS_UNITS_OFFSET           504
+#define LXFS_UNITS_PENDING          0xFFFFFFFFFFFFFFFF  // compressed, but no unit table yet
+#define LXFS_UNIT_COMPRESSED        0x80
+#define LXFS_UNIT_COUNT_MASK        0x7F
+
+typedef struct {
+    uint32_t length;            // bytes of LZ4 data
+    uint32_t reserved;
+    uint8_t data[];
+} __attribute__((packed)) LXFSCompressedUnit;
+
+/* metadata journal of a v2 volume that isn't bootable, in place of the boot
+ * code in the reserved blocks after the identification block; the first holds
+ * the header and the rest are the log. Metadata blocks are modified in the
+ * cache as usual, but instead of being written through one at a time they are
+ * collected into a transaction, which is committed by writing a descriptor
+ * and a copy of each of its blocks to the log in one sequential write. A
+ * descriptor is only valid if its sequence number follows on from the one
+ * before it and its checksum matches, so a transaction torn by a crash is
+ * discarded. Blocks are written in place later by writeback, and once the log
+ * fills up or grows old its latest copies are written in place and the header
+ * is advanced past it. Mounting the volume replays whatever is left. */
+#define LXFS_JOURNAL_MAGIC          0x4C4E52554F4A584C  // 'LXJOURNL'
+#define LXFS_JOURNAL_COMMIT         0x54494D4D4F43584C  // 'LXCOMMIT'
+
+typedef struct {
+    uint64_t magic;
+    uint64_t sequence;          // of the first transaction in the log
+} __attribute__((packed)) LXFSJournalHeader;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t sequence;
+    uint64_t count;             // block images following the descriptor
+    uint64_t checksum;          // of the descriptor and images, with this field zero
+    uint64_t blocks[];          // where each image belongs
+} __attribute__((packed)) LXFSJournalDescriptor;
+
+/* hash index of a large directory, one header block followed by the bucket
+ * blocks in a single contiguous run; older drivers leave the field pointing
+ * at it zero, and an index whose recorded size differs from the size of its
+ * directory was left behind by one of them and is ignored */
+#define LXFS_INDEX_MAGIC            0x58444E49  // 'INDX', little endian
+
+typedef struct {
+    uint32_t magic;
+    uint32_t buckets;           // number of bucket blocks after the header
+    uint64_t bytes;             // sizeBytes of the directory when last updated
+    uint64_t entries;           // number of records
+    uint64_t tailBlock;         // end of the last entry of the directory
+    uint64_t tailOffset;
+} __attribute__((packed)) LXFSIndexHeader;
+
+typedef struct {
+    uint32_t hash;              // FNV-1a hash of the name
+    uint32_t offset;
+    uint64_t block;             // location of the directory entry
+} __attribute__((packed)) LXFSIndexRecord;
+
+typedef struct {
+    uint64_t count;
+    LXFSIndexRecord records[];
+} __attribute__((packed)) LXFSIndexBucket;
+
+/* ioctl() opcodes for files on lxfs volumes, results are returned in the parameter */
+#define LXFS_GET_EXTENTS            (0x10 | IOCTL_OUT_PARAM)    // runs of contiguous blocks in a file
+#define LXFS_DEFRAG                 (0x20 | IOCTL_OUT_PARAM)    // relocate a file into one run, returns its extents
+#define LXFS_GET_FREE_RUNS          (0x30 | IOCTL_OUT_PARAM)    // runs of free blocks on the volume
+#define LXFS_FALLOCATE              (0x40 | IOCTL_IN_PARAM)     // allocate blocks up to an offset, extending the size
+#define LXFS_PREALLOCATE            (0x50 | IOCTL_IN_PARAM)     // allocate blocks up to an offset, keeping the size
+#define LXFS_REINDEX                (0x60 | IOCTL_OUT_PARAM)    // rebuild the hash index of a directory, returns its buckets
+#define LXFS_COMPRESS               (0x70 | IOCTL_OUT_PARAM)    // compress data written from now on, returns the units
+#define LXFS_DEDUP                  (0x80 | IOCTL_OUT_PARAM)    // share the blocks of an identical file, returns those freed
+
+/* per-open state, keyed by the kernel's file ID */
+typedef struct OpenFile {
+    struct OpenFile *next;
+    uint64_t id;                // kernel file ID
+    char *path;                 // path the file was opened with
+    LXFSDirectoryEntry entry;   // directory entry of the file
+    uint64_t dirBlock;          // location of the directory entry
+    off_t dirOffset;
+    LXFSFileHeader meta;        // cached metadata header
+    ReadAhead readahead;
+    int dirty;                  // attributes not written back, FILE_DIRTY_*
+    time_t dirtySince;
+    uint64_t reserveStart;      // free blocks after the end held for appends
+    uint64_t reserveCount;
+    int unwritten;              // has blocks that were never written
+    int inlined;                // data is stored in the metadata block
+    uint64_t units;             // unit table of a compressed file, zero if not compressed
+    int appended;               // got blocks at the log head while open
+    int written;                // data was written while open
+} OpenFile;
+
 void lxfsMount(MountCommand *);
+int lxfsDeviceRead(Mountpoint *, uint64_t, uint64_t, void *);
+int lxfsDeviceWrite(Mountpoint *, uint64_t, uint64_t, const void *);
 int lxfsFlushSlot(Mountpoint *, uint64_t);
 int lxfsFlushBlock(Mountpoint *, uint64_t);
+void *lxfsCacheBuffer(Mountpoint *, uint64_t);
+void lxfsCachePoll();
+void lxfsCacheBalance(SysInfoResponse *);
+const void *lxfsPeekBlock(Mountpoint *, uint64_t);
 int lxfsReadBlock(Mountpoint *, uint64_t, void *);
 int lxfsWriteBlock(Mountpoint *, uint64_t, const void *);
 uint64_t lxfsNextBlock(Mountpoint *, uint64_t);
 uint64_t lxfsReadNextBlock(Mountpoint *, uint64_t, void *);
 uint64_t lxfsWriteNextBlock(Mountpoint *, uint64_t, const void *);
-uint64_t lxfsFindFreeBlock(Mountpoint *, uint64_t);
 int lxfsSetNextBlock(Mountpoint *, uint64_t, uint64_t);
-uint64_t lxfsAllocate(Mountpoint *, uint64_t);
 uint64_t lxfsGetBlock(Mountpoint *, uint64_t, uint64_t);
+int lxfsTableLoad(Mountpoint *);
+void *lxfsTablePage(Mountpoint *, uint64_t);
+uint64_t *lxfsTableEntry(Mountpoint *, uint64_t, int);
+int lxfsTableLogged(Mountpoint *, uint64_t, int);
+int lxfsTableFlush(Mountpoint *, uint64_t);
+int lxfsTableWriteback(Mountpoint *);
+uint64_t lxfsChainBlock(Mountpoint *, uint64_t, uint64_t);
+int lxfsChainExtend(Mountpoint *, uint64_t);
+void lxfsChainTruncate(Mountpoint *, uint64_t, uint64_t);
+void lxfsChainDrop(Mountpoint *, uint64_t);
+uint64_t lxfsChainRun(Mountpoint *, uint64_t, uint64_t, uint64_t *);
+int lxfsChainCut(Mountpoint *, uint64_t, uint64_t);
+int lxfsChainRelease(Mountpoint *, uint64_t);
+int lxfsChainShrink(Mountpoint *, uint64_t);
+int lxfsChainRebuild(Mountpoint *, uint64_t);
+ChainIndex *lxfsChainIndex(Mountpoint *, uint64_t);
+int lxfsReadBlocks(Mountpoint *, uint64_t, uint64_t, void *);
+int lxfsWriteBlocks(Mountpoint *, uint64_t, uint64_t, const void *);
+void *lxfsModifyBlock(Mountpoint *, uint64_t, int);
+void lxfsFillSlot(Mountpoint *, uint64_t, const void *, int);
+uint64_t lxfsPrefetch(Mountpoint *, uint64_t, uint64_t, uint64_t);
+void lxfsReadAheadReset(Mountpoint *, ReadAhead *);
+void lxfsReadAhead(Mountpoint *, ReadAhead *, uint64_t, off_t, size_t);
+
+OpenFile *lxfsAllocateFile(Mountpoint *, uint64_t, const char *, const LXFSDirectoryEntry *, uint64_t, off_t);
+OpenFile *lxfsGetFile(Mountpoint *, uint64_t, const char *);
+void lxfsReleaseFile(Mountpoint *, uint64_t);
+void lxfsSyncFiles(Mountpoint *, uint64_t, const LXFSFileHeader *);
+void lxfsInvalidateFiles(Mountpoint *, uint64_t);
+int lxfsFlushFile(Mountpoint *, OpenFile *);
+int lxfsFlushFiles(Mountpoint *, uint64_t);
+void lxfsExpireFiles(Mountpoint *, time_t);
+void lxfsResizeFile(Mountpoint *, OpenFile *, uint64_t);
+void lxfsTouchFile(Mountpoint *, OpenFile *, time_t, int);
+int lxfsWritable(OpenFile *, uid_t, gid_t);
+void lxfsPendingAttributes(Mountpoint *, LXFSDirectoryEntry *, uint64_t, off_t, LXFSFileHeader *);
+
+Dentry *lxfsDentryLookup(Mountpoint *, uint64_t, const char *);
+void lxfsDentryInsert(Mountpoint *, uint64_t, const char *, const LXFSDirectoryEntry *, uint64_t, off_t);
+void lxfsDentryForget(Mountpoint *, uint64_t);
+
+DirCursor *lxfsCursorLookup(Mountpoint *, uint64_t, size_t);
+DirCursor *lxfsCursorAllocate(Mountpoint *, uint64_t);
+void lxfsCursorForget(Mountpoint *, uint64_t);
+
+int lxfsIndexFind(Mountpoint *, uint64_t, const char *, uint64_t *, off_t *, int);
+int lxfsIndexTail(Mountpoint *, uint64_t, uint64_t *, off_t *);
+void lxfsIndexAdd(Mountpoint *, uint64_t, const LXFSDirectoryEntry *, uint64_t, off_t);
+void lxfsIndexRemove(Mountpoint *, uint64_t, uint64_t, off_t);
+int lxfsIndexBuild(Mountpoint *, uint64_t);
+void lxfsIndexDrop(Mountpoint *, uint64_t);
+
+int lxfsSubmitRead(Mountpoint *, uint64_t, uint64_t, int);
+int lxfsAwaitBlocks(Mountpoint *, uint64_t, uint64_t, uint64_t, const void *);
+void lxfsCompleteRead(Mountpoint *, uint64_t, int, const void *);
+void lxfsStaleReads(Mountpoint *, uint64_t, uint64_t);
+void lxfsFailReads(Mountpoint *);
+void lxfsDropParked(Mountpoint *, uint64_t);
+
+int lxfsChannelAttach(Mountpoint *, const char *);
+int lxfsChannelIO(Mountpoint *, int, uint64_t, uint64_t, void *);
+int lxfsChannelRead(Mountpoint *, uint64_t, uint64_t, uint64_t);
+int lxfsChannelPoll();
+
+uint64_t lxfsAllocate(Mountpoint *, uint64_t, uint64_t, struct OpenFile *);
+uint64_t lxfsAllocateRun(Mountpoint *, uint64_t, uint64_t);
+int lxfsFreeRun(Mountpoint *, uint64_t, uint64_t);
+void lxfsFreeChain(Mountpoint *, uint64_t);
+uint64_t lxfsExtents(Mountpoint *, uint64_t, uint64_t *);
+int lxfsDefrag(Mountpoint *, uint64_t);
+uint64_t lxfsFreeRuns(Mountpoint *, uint64_t *);
+void lxfsAppendQueue(Mountpoint *, struct OpenFile *);
+void lxfsAppendClean(Mountpoint *);
+
+size_t lxfsInlineCapacity(Mountpoint *);
+int lxfsIsInline(Mountpoint *, const void *);
+int lxfsInlineRead(Mountpoint *, OpenFile *, off_t, size_t, void *);
+int lxfsInlineWrite(Mountpoint *, OpenFile *, off_t, const void *, size_t);
+int lxfsInlineReset(Mountpoint *, uint64_t);
+int lxfsInlineMigrate(Mountpoint *, OpenFile *);
+
+size_t lxfsCompress(const void *, size_t, void *, size_t);
+ssize_t lxfsDecompress(const void *, size_t, void *, size_t);
+uint64_t lxfsUnitTable(Mountpoint *, const void *);
+int lxfsCompressSpan(Mountpoint *, OpenFile *, off_t, size_t, uint64_t *, uint64_t *);
+int lxfsCompressRead(Mountpoint *, OpenFile *, off_t, size_t, void *);
+int lxfsCompressWrite(Mountpoint *, OpenFile *, off_t, const void *, size_t);
+int lxfsCompressEnable(Mountpoint *, OpenFile *);
+int lxfsCompressReset(Mountpoint *, uint64_t);
+int lxfsCompressSync(Mountpoint *, uint64_t);
+uint64_t lxfsCompressedBlocks(Mountpoint *, uint64_t);
+
+int lxfsShareGet(Mountpoint *, uint64_t, LXFSShare *);
+int lxfsUnshare(Mountpoint *, uint64_t, uint64_t);
+int lxfsShareMove(Mountpoint *, uint64_t, uint64_t);
+int lxfsDedup(Mountpoint *, OpenFile *, uint64_t *);
+void lxfsDedupForget(Mountpoint *, uint64_t);
+
+int lxfsGetUnwritten(Mountpoint *, uint64_t, LXFSUnwritten *);
+int lxfsIsUnwritten(const LXFSUnwritten *, uint64_t);
+int lxfsZeroBlocks(Mountpoint *, uint64_t, uint64_t, uint64_t);
+int lxfsMarkUnwritten(Mountpoint *, uint64_t, uint64_t, uint64_t);
+int lxfsMarkWritten(Mountpoint *, uint64_t, uint64_t, uint64_t);
+int lxfsPrepareWrite(Mountpoint *, OpenFile *, off_t, size_t);
+int lxfsPreallocate(Mountpoint *, OpenFile *, uint64_t);
+ssize_t lxfsOverwrite(Mountpoint *, OpenFile *, off_t, const void *, size_t, uint64_t *);
+
+int lxfsJournalOpen(Mountpoint *, const LXFSIdentification *);
+int lxfsJournalBlock(Mountpoint *, uint64_t);
+int lxfsJournalGuard(Mountpoint *, uint64_t, uint64_t, const void *);
+int lxfsJournalHeld(Mountpoint *, uint64_t);
+void lxfsJournalOverlay(Mountpoint *, uint64_t, uint64_t, void *);
+int lxfsJournalReserve(Mountpoint *, size_t);
+int lxfsJournalCommit(Mountpoint *);
+int lxfsJournalCheckpoint(Mountpoint *);
+void lxfsJournalTick(Mountpoint *, int);
+
+int lxfsWriteback(Mountpoint *, size_t, time_t);
+int lxfsSyncVolume(Mountpoint *);
 
 Mountpoint *findMP(const char *);
+Mountpoint *firstMP();
+Mountpoint *findAttachedMP(uint64_t);
+void lxfsTick(int);
 int pathDepth(const char *);
 char *pathComponent(char *, const char *, int);
 LXFSDirectoryEntry *lxfsFind(LXFSDirectoryEntry *, Mountpoint *, const char *, uint64_t *, off_t *);
@@ -154,7 +721,9 @@ void lxfsOpendir(OpendirCommand *);
 void lxfsReaddir(ReaddirCommand *);
 void lxfsChmod(ChmodCommand *);
 void lxfsChown(ChownCommand *);
+size_t lxfsMmapHeader(const MmapCommand *);
 void lxfsMmap(MmapCommand *);
+void lxfsMsync(MsyncCommand *);
 void lxfsMkdir(MkdirCommand *);
 void lxfsUtime(UtimeCommand *);
 void lxfsLink(LinkCommand *);
@@ -163,3 +732,4 @@ void lxfsUnlink(UnlinkCommand *);
 void lxfsReadLink(ReadLinkCommand *);
 void lxfsFsync(FsyncCommand *);
 void lxfsStatvfs(StatvfsCommand *);
+void lxfsIoctl(IOCTLCommand *);
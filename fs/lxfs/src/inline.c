@@ -0,0 +1,174 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <errno.h>
+#include <lxfs/lxfs.h>
+#include <string.h>
+
+/* Inline files: on v2 volumes, a file small enough to fit in its metadata
+ * block keeps its data there, in place of the extent map it doesn't need
+ * because it has no data blocks. Reading it then costs only the metadata
+ * block. The bytes of the inline area past the end of the file are always
+ * zero, so the file can grow within it without clearing anything. Once a
+ * write or an allocation no longer fits, the data moves to a block of its
+ * own and the area becomes an extent map again; truncating a file to zero
+ * makes it inline again. */
+
+/* lxfsInlineCapacity(): returns the number of bytes a file can hold inline
+ * params: mp - mountpoint
+ * returns: capacity in bytes, zero if the volume doesn't support inline files
+ */
+
+size_t lxfsInlineCapacity(Mountpoint *mp) {
+    if(!mp->extentMaps) return 0;
+    return mp->blockSizeBytes - LXFS_INLINE_OFFSET - sizeof(LXFSInlineData);
+}
+
+/* lxfsIsInline(): checks whether a metadata block holds inline data
+ * params: mp - mountpoint
+ * params: data - contents of the metadata block of the file
+ * returns: non-zero if the file is inline
+ */
+
+int lxfsIsInline(Mountpoint *mp, const void *data) {
+    if(!lxfsInlineCapacity(mp)) return 0;
+
+    const LXFSInlineData *inl = (const LXFSInlineData *)((uintptr_t)data + LXFS_INLINE_OFFSET);
+    return inl->magic == LXFS_INLINE_MAGIC;
+}
+
+/* lxfsInlineMark(): helper function to update every open instance of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: inlined - whether the file is now inline
+ * returns: nothing
+ */
+
+static void lxfsInlineMark(Mountpoint *mp, uint64_t meta, int inlined) {
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta) {
+                file->inlined = inlined;
+                if(inlined) file->unwritten = 0;
+            }
+
+            file = file->next;
+        }
+    }
+}
+
+/* lxfsInlineRead(): reads data out of an inline file
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file to read from
+ * params: length - number of bytes to read, within the file
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+int lxfsInlineRead(Mountpoint *mp, OpenFile *file, off_t position, size_t length, void *buffer) {
+    if((position + length) > lxfsInlineCapacity(mp)) return 1;
+
+    const void *data = lxfsPeekBlock(mp, file->entry.block);
+    if(!data) return 1;
+
+    const LXFSInlineData *inl = (const LXFSInlineData *)((uintptr_t)data + LXFS_INLINE_OFFSET);
+    memcpy(buffer, &inl->data[position], length);
+    return 0;
+}
+
+/* lxfsInlineWrite(): writes data into an inline file, without changing its size
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file to write at
+ * params: data - data to write
+ * params: length - number of bytes to write, which must fit inline
+ * returns: zero on success
+ */
+
+int lxfsInlineWrite(Mountpoint *mp, OpenFile *file, off_t position, const void *data, size_t length) {
+    if((position + length) > lxfsInlineCapacity(mp)) return 1;
+
+    void *block = lxfsModifyBlock(mp, file->entry.block, 1);
+    if(!block) return 1;
+
+    LXFSInlineData *inl = (LXFSInlineData *)((uintptr_t)block + LXFS_INLINE_OFFSET);
+    memcpy(&inl->data[position], data, length);
+    return 0;
+}
+
+/* lxfsInlineReset(): makes a file with no data blocks inline and empty
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: zero on success
+ */
+
+int lxfsInlineReset(Mountpoint *mp, uint64_t meta) {
+    if(!lxfsInlineCapacity(mp)) return 0;
+
+    void *block = lxfsModifyBlock(mp, meta, 1);
+    if(!block) return 1;
+
+    LXFSInlineData *inl = (LXFSInlineData *)((uintptr_t)block + LXFS_INLINE_OFFSET);
+    memset(inl, 0, mp->blockSizeBytes - LXFS_INLINE_OFFSET);
+    inl->magic = LXFS_INLINE_MAGIC;
+
+    lxfsInlineMark(mp, meta, 1);
+    return 0;
+}
+
+/* lxfsInlineMigrate(): moves the data of an inline file into a data block
+ * and gives the file an extent map in its place
+ * this uses the metadata buffer
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsInlineMigrate(Mountpoint *mp, OpenFile *file) {
+    uint64_t meta = file->entry.block;
+
+    // an inline file never fills its metadata block, so one block is enough
+    uint64_t first = 0;
+    if(file->meta.size) {
+        first = lxfsAllocate(mp, 1, meta + 1, file);
+        if(!first) return -ENOSPC;
+    }
+
+    if(lxfsReadBlock(mp, meta, mp->meta)) goto fail;
+
+    LXFSInlineData *inl = (LXFSInlineData *)((uintptr_t)mp->meta + LXFS_INLINE_OFFSET);
+    if(first) {
+        // the area past the end of the file is zero, so copy all of it
+        void *data = lxfsModifyBlock(mp, first, 0);
+        if(!data) goto fail;
+
+        memset(data, 0, mp->blockSizeBytes);
+        memcpy(data, inl->data, lxfsInlineCapacity(mp));
+
+        // link the block before the inline copy is dropped
+        if(lxfsSetNextBlock(mp, meta, first)) goto fail;
+    }
+
+    memset(inl, 0, mp->blockSizeBytes - LXFS_INLINE_OFFSET);
+    LXFSExtentMap *map = (LXFSExtentMap *)((uintptr_t)mp->meta + LXFS_EXTENT_MAP_OFFSET);
+    map->magic = LXFS_EXTENT_MAP_MAGIC;
+
+    if(lxfsWriteBlock(mp, meta, mp->meta)) {
+        if(first) lxfsSetNextBlock(mp, meta, LXFS_BLOCK_EOF);
+        goto fail;
+    }
+
+    lxfsChainExtend(mp, meta);
+    lxfsInlineMark(mp, meta, 0);
+    return 0;
+
+fail:
+    if(first) lxfsFreeRun(mp, first, 1);
+    return -EIO;
+}
\ No newline at end of file
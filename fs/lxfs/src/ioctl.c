@@ -0,0 +1,145 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <errno.h>
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <time.h>
+
+/* lxfsIoctl(): handles ioctl() for files on an lxfs volume
+ * params: cmd - ioctl command message
+ * returns: nothing, response relayed to kernel
+ */
+
+void lxfsIoctl(IOCTLCommand *cmd) {
+    cmd->header.header.response = 1;
+    cmd->header.header.length = sizeof(IOCTLCommand);
+
+    Mountpoint *mp = findMP(cmd->device);
+    if(!mp) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    OpenFile *file = lxfsGetFile(mp, cmd->id, cmd->path);
+    if(!file) {
+        cmd->header.header.status = -ENOENT;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    int type = (file->entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+    uint64_t largest, freed;
+    int status;
+
+    switch(cmd->opcode) {
+    case LXFS_GET_EXTENTS:
+        cmd->parameter = lxfsExtents(mp, file->entry.block, NULL);
+        cmd->header.header.status = 0;
+        break;
+
+    case LXFS_DEFRAG:
+        // moving the data of a file is reserved for its owner
+        if(cmd->uid && (cmd->uid != file->entry.owner)) {
+            cmd->header.header.status = -EPERM;
+            break;
+        }
+
+        status = lxfsDefrag(mp, file->entry.block);
+        cmd->parameter = lxfsExtents(mp, file->entry.block, NULL);
+        cmd->header.header.status = status;
+        break;
+
+    case LXFS_GET_FREE_RUNS:
+        cmd->parameter = lxfsFreeRuns(mp, &largest);
+        luxLogf(KPRINT_LEVEL_DEBUG, "%s: %d runs of free blocks, largest is %d blocks\n",
+                mp->device, (int) cmd->parameter, (int) largest);
+        cmd->header.header.status = 0;
+        break;
+
+    case LXFS_FALLOCATE:
+    case LXFS_PREALLOCATE:
+        if((type != LXFS_DIR_TYPE_FILE) && (type != LXFS_DIR_TYPE_HARD_LINK)) {
+            cmd->header.header.status = -ENODEV;
+            break;
+        }
+
+        if(!lxfsWritable(file, cmd->uid, cmd->gid)) {
+            cmd->header.header.status = -EBADF;
+            break;
+        }
+
+        status = lxfsPreallocate(mp, file, cmd->parameter);
+        if(!status && (cmd->opcode == LXFS_FALLOCATE) && (cmd->parameter > file->meta.size)) {
+            lxfsResizeFile(mp, file, cmd->parameter);
+            lxfsTouchFile(mp, file, time(NULL), 1);
+        }
+
+        cmd->header.header.status = status;
+        break;
+
+    case LXFS_REINDEX:
+        if(type != LXFS_DIR_TYPE_DIR) {
+            cmd->header.header.status = -ENOTDIR;
+            break;
+        }
+
+        if(cmd->uid && (cmd->uid != file->entry.owner)) {
+            cmd->header.header.status = -EPERM;
+            break;
+        }
+
+        status = lxfsIndexBuild(mp, file->entry.block);
+        if(status >= 0) {
+            cmd->parameter = status;
+            status = 0;
+        }
+
+        cmd->header.header.status = status;
+        break;
+
+    case LXFS_COMPRESS:
+        if((type != LXFS_DIR_TYPE_FILE) && (type != LXFS_DIR_TYPE_HARD_LINK)) {
+            cmd->header.header.status = -ENODEV;
+            break;
+        }
+
+        if(!lxfsWritable(file, cmd->uid, cmd->gid)) {
+            cmd->header.header.status = -EBADF;
+            break;
+        }
+
+        status = lxfsCompressEnable(mp, file);
+        cmd->parameter = (file->meta.size + (LXFS_UNIT_BLOCKS * mp->blockSizeBytes) - 1) /
+            (LXFS_UNIT_BLOCKS * mp->blockSizeBytes);
+        cmd->header.header.status = status;
+        break;
+
+    case LXFS_DEDUP:
+        if((type != LXFS_DIR_TYPE_FILE) && (type != LXFS_DIR_TYPE_HARD_LINK)) {
+            cmd->header.header.status = -ENODEV;
+            break;
+        }
+
+        // like moving it, sharing the data of a file is reserved for its owner
+        if(cmd->uid && (cmd->uid != file->entry.owner)) {
+            cmd->header.header.status = -EPERM;
+            break;
+        }
+
+        status = lxfsDedup(mp, file, &freed);
+        cmd->parameter = freed;
+        cmd->header.header.status = status;
+        break;
+
+    default:
+        cmd->header.header.status = -ENOTTY;
+    }
+
+    luxSendKernel(cmd);
+}
\ No newline at end of file
@@ -0,0 +1,500 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Metadata journal: the steps of a metadata update call lxfsJournalBlock()
+ * where they used to write each block through, which adds the block to the
+ * running transaction. The transaction commits between requests, every
+ * JOURNAL_COMMIT_INTERVAL seconds, on fsync(), or once it has too little room
+ * left for another request, so an update always commits as a whole and a burst
+ * of them costs one sequential write to the log. The blocks stay dirty in the
+ * cache and reach their place through writeback as usual.
+ *
+ * Neither a partial update nor replaying the log may leave older contents in
+ * a block than it had, so every in-place write passes through
+ * lxfsJournalGuard() first. A write of a block of the running transaction is
+ * held back in a copy until the transaction commits, and so is a write of a
+ * block with an image in the log that was changed since then, which is logged
+ * again; this covers changes that didn't go through the journal, such as
+ * attributes written back by open files and freed blocks reused for data.
+ * Reads from the device see the held back copies and the images in the log.
+ * The checkpoint writes the latest image of every logged block in place from
+ * the copy of the log kept in memory, exactly as replaying it after a crash
+ * would, and then advances the header past the log. */
+
+/* lxfsJournalChecksum(): helper function to checksum part of the log
+ * params: data - data to checksum
+ * params: size - size in bytes, a multiple of eight
+ * returns: 64-bit FNV-1a hash of the data, a word at a time
+ */
+
+static uint64_t lxfsJournalChecksum(const void *data, size_t size) {
+    const uint64_t *words = (const uint64_t *) data;
+    uint64_t hash = 0xCBF29CE484222325;
+    for(size_t i = 0; i < (size / 8); i++) {
+        hash ^= words[i];
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+/* lxfsJournalFind(): helper function to find a block in a list of blocks
+ * params: list - list of blocks
+ * params: count - number of blocks in the list
+ * params: block - block to find
+ * returns: index in the list, -1 if not present
+ */
+
+static int lxfsJournalFind(const uint64_t *list, size_t count, uint64_t block) {
+    for(size_t i = 0; i < count; i++) {
+        if(list[i] == block) return i;
+    }
+
+    return -1;
+}
+
+/* lxfsJournalRecord(): helper function to remember the latest image of a block
+ * params: journal - journal
+ * params: block - block number
+ * params: image - position of the image in the log
+ * returns: nothing
+ */
+
+static void lxfsJournalRecord(Journal *journal, uint64_t block, uint64_t image) {
+    int i = lxfsJournalFind(journal->logged, journal->loggedCount, block);
+    if(i < 0) i = journal->loggedCount++;
+
+    journal->logged[i] = block;
+    journal->images[i] = image;
+}
+
+/* lxfsJournalCurrent(): helper function to check if the copy of a block in
+ * memory is unmodified since it was copied to the log
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: non-zero if the cache slot or table page holds the logged image
+ */
+
+static int lxfsJournalCurrent(Mountpoint *mp, uint64_t block) {
+    if(lxfsTablePage(mp, block)) return lxfsTableLogged(mp, block, 0);
+
+    uint64_t index = block % CACHE_SIZE;
+    return mp->cache[index].valid && (mp->cache[index].tag == (block / CACHE_SIZE)) &&
+        mp->cache[index].logged;
+}
+
+/* lxfsJournalAdd(): helper function to add a block to the running transaction
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: zero on success
+ */
+
+static int lxfsJournalAdd(Mountpoint *mp, uint64_t block) {
+    Journal *journal = mp->journal;
+
+    // a transaction needs one block of the log for its descriptor; this only
+    // commits halfway through a request larger than JOURNAL_RESERVE blocks
+    if(journal->count >= (LXFS_JOURNAL_LOG - 1)) {
+        luxLogf(KPRINT_LEVEL_WARNING, "%s: metadata update overflowed the journal transaction\n", mp->device);
+        if(lxfsJournalCommit(mp)) return 1;
+    }
+
+    if(!journal->count) journal->started = time(NULL);
+
+    journal->blocks[journal->count] = block;
+    journal->held[journal->count] = 0;
+    journal->count++;
+    return 0;
+}
+
+/* lxfsJournalHeader(): helper function to write the header of the journal
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+static int lxfsJournalHeader(Mountpoint *mp) {
+    Journal *journal = mp->journal;
+
+    LXFSJournalHeader *header = (LXFSJournalHeader *) journal->log;
+    memset(header, 0, mp->blockSizeBytes);
+    header->magic = LXFS_JOURNAL_MAGIC;
+    header->sequence = journal->sequence;
+
+    return lxfsDeviceWrite(mp, LXFS_JOURNAL_START, 1, header);
+}
+
+/* lxfsJournalScan(): helper function to find the transactions in the log
+ * params: mp - mountpoint
+ * returns: number of complete transactions
+ */
+
+static uint64_t lxfsJournalScan(Mountpoint *mp) {
+    Journal *journal = mp->journal;
+    uint64_t first = journal->sequence;
+
+    while(journal->head < (LXFS_JOURNAL_LOG - 1)) {
+        LXFSJournalDescriptor *desc = (LXFSJournalDescriptor *)((uintptr_t) journal->log +
+            ((journal->head + 1) * mp->blockSizeBytes));
+
+        // stop at the first transaction that isn't the next one or is torn
+        if((desc->magic != LXFS_JOURNAL_COMMIT) || (desc->sequence != journal->sequence)) break;
+        if(!desc->count || (desc->count > (LXFS_JOURNAL_LOG - 1 - journal->head))) break;
+
+        uint64_t checksum = desc->checksum;
+        desc->checksum = 0;
+        int valid = checksum == lxfsJournalChecksum(desc, (desc->count + 1) * mp->blockSizeBytes);
+        desc->checksum = checksum;
+        if(!valid) break;
+
+        for(uint64_t i = 0; i < desc->count; i++) {
+            if((desc->blocks[i] < (LXFS_JOURNAL_START + LXFS_JOURNAL_BLOCKS)) || (desc->blocks[i] >= mp->volumeSize)) {
+                valid = 0;
+                break;
+            }
+        }
+
+        if(!valid) break;
+
+        for(uint64_t i = 0; i < desc->count; i++)
+            lxfsJournalRecord(journal, desc->blocks[i], journal->head + 1 + i);
+
+        journal->head += desc->count + 1;
+        journal->sequence++;
+    }
+
+    return journal->sequence - first;
+}
+
+/* lxfsJournalOpen(): sets up the metadata journal of a volume and replays it
+ * this goes straight to the device and doesn't use the cache
+ * params: mp - mountpoint
+ * params: id - identification block of the volume
+ * returns: zero on success, including volumes without a journal
+ */
+
+int lxfsJournalOpen(Mountpoint *mp, const LXFSIdentification *id) {
+    if(!mp->extentMaps || (id->parameters & LXFS_ID_BOOTABLE)) return 0;
+
+    void *log = malloc(LXFS_JOURNAL_BLOCKS * mp->blockSizeBytes);
+    if(!log) return 1;
+
+    // the reserved blocks must be marked as such in the block table
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t *table = (uint64_t *) log;
+    for(uint64_t i = LXFS_JOURNAL_START; i < (LXFS_JOURNAL_START + LXFS_JOURNAL_BLOCKS); i++) {
+        if((i == LXFS_JOURNAL_START) || !(i % entries)) {
+            if(lxfsDeviceRead(mp, LXFS_TABLE_START + (i / entries), 1, table)) {
+                free(log);
+                return 1;
+            }
+        }
+
+        if(table[i % entries] != LXFS_BLOCK_BOOT) {
+            free(log);
+            return 0;
+        }
+    }
+
+    if(lxfsDeviceRead(mp, LXFS_JOURNAL_START, LXFS_JOURNAL_BLOCKS, log)) {
+        free(log);
+        return 1;
+    }
+
+    void *copies = malloc(LXFS_JOURNAL_LOG * mp->blockSizeBytes);
+    if(!copies) {
+        free(log);
+        return 1;
+    }
+
+    Journal *journal = calloc(1, sizeof(Journal));
+    if(!journal) {
+        free(copies);
+        free(log);
+        return 1;
+    }
+
+    journal->log = log;
+    journal->copies = copies;
+    mp->journal = journal;
+
+    LXFSJournalHeader *header = (LXFSJournalHeader *) log;
+    if(header->magic != LXFS_JOURNAL_MAGIC) {
+        // first mount with a journal, whatever is in the log is meaningless
+        journal->sequence = 1;
+        if(lxfsJournalHeader(mp)) goto fail;
+
+        luxLogf(KPRINT_LEVEL_DEBUG, "- created metadata journal in the reserved blocks\n");
+        return 0;
+    }
+
+    journal->sequence = header->sequence;
+    uint64_t replayed = lxfsJournalScan(mp);
+    if(replayed) {
+        luxLogf(KPRINT_LEVEL_DEBUG, "- replaying %d journal transactions with %d blocks\n",
+                (int) replayed, (int) journal->loggedCount);
+
+        if(lxfsJournalCheckpoint(mp)) goto fail;
+    }
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "- metadata journal at sequence %d\n", (int) journal->sequence);
+    return 0;
+
+fail:
+    mp->journal = NULL;
+    free(journal->copies);
+    free(journal->log);
+    free(journal);
+    return 1;
+}
+
+/* lxfsJournalBlock(): makes a modified metadata block durable, by adding it to
+ * the running transaction of the journal or by writing it through if there is
+ * no journal
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: zero on success
+ */
+
+int lxfsJournalBlock(Mountpoint *mp, uint64_t block) {
+    if(!mp->journal) return lxfsFlushBlock(mp, block);
+
+    // a block that wasn't modified since it was logged is durable already, and
+    // must not be held back in a transaction the checkpoint would then skip
+    if(lxfsJournalCurrent(mp, block)) return 0;
+    if(lxfsJournalFind(mp->journal->blocks, mp->journal->count, block) >= 0) return 0;
+    return lxfsJournalAdd(mp, block);
+}
+
+/* lxfsJournalReserve(): makes room in the running transaction for a request,
+ * by committing it between requests if needed
+ * params: mp - mountpoint
+ * params: count - number of blocks the request may add
+ * returns: zero on success
+ */
+
+int lxfsJournalReserve(Mountpoint *mp, size_t count) {
+    Journal *journal = mp->journal;
+    if(!journal || ((journal->count + count) <= (LXFS_JOURNAL_LOG - 1))) return 0;
+    return lxfsJournalCommit(mp);
+}
+
+/* lxfsJournalGuard(): holds back the blocks of an in-place write that would
+ * break up an update or be undone by replaying the log, until they commit
+ * params: mp - mountpoint
+ * params: block - first block about to be written
+ * params: count - number of blocks
+ * params: buffer - contents of the blocks
+ * returns: zero on success
+ */
+
+int lxfsJournalGuard(Mountpoint *mp, uint64_t block, uint64_t count, const void *buffer) {
+    Journal *journal = mp->journal;
+    if(!journal || journal->busy || (!journal->count && !journal->loggedCount)) return 0;
+
+    for(uint64_t i = 0; i < count; i++) {
+        int n = lxfsJournalFind(journal->blocks, journal->count, block + i);
+        if(n < 0) {
+            if(lxfsJournalFind(journal->logged, journal->loggedCount, block + i) < 0) continue;
+
+            // the log already holds what a slot that wasn't modified since holds
+            if(lxfsJournalCurrent(mp, block + i)) continue;
+
+            if(lxfsJournalAdd(mp, block + i)) return 1;
+            n = journal->count - 1;
+        }
+
+        memcpy((void *)((uintptr_t) journal->copies + (n * mp->blockSizeBytes)),
+               (const void *)((uintptr_t) buffer + (i * mp->blockSizeBytes)), mp->blockSizeBytes);
+        journal->held[n] = 1;
+    }
+
+    return 0;
+}
+
+/* lxfsJournalHeld(): checks if the in-place write of a block is held back
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: non-zero if the block must not be written in place
+ */
+
+int lxfsJournalHeld(Mountpoint *mp, uint64_t block) {
+    Journal *journal = mp->journal;
+    if(!journal || journal->busy || !journal->count) return 0;
+
+    int n = lxfsJournalFind(journal->blocks, journal->count, block);
+    return (n >= 0) && journal->held[n];
+}
+
+/* lxfsJournalOverlay(): brings blocks read from the device up to date with
+ * the images in the log and the copies held back from in-place writes
+ * params: mp - mountpoint
+ * params: block - first block that was read
+ * params: count - number of blocks
+ * params: buffer - contents of the blocks
+ * returns: nothing
+ */
+
+void lxfsJournalOverlay(Mountpoint *mp, uint64_t block, uint64_t count, void *buffer) {
+    Journal *journal = mp->journal;
+    if(!journal) return;
+
+    for(size_t i = 0; i < journal->loggedCount; i++) {
+        if((journal->logged[i] < block) || (journal->logged[i] >= (block + count))) continue;
+        memcpy((void *)((uintptr_t) buffer + ((journal->logged[i] - block) * mp->blockSizeBytes)),
+               (const void *)((uintptr_t) journal->log + ((journal->images[i] + 1) * mp->blockSizeBytes)),
+               mp->blockSizeBytes);
+    }
+
+    for(size_t i = 0; i < journal->count; i++) {
+        if(!journal->held[i] || (journal->blocks[i] < block) || (journal->blocks[i] >= (block + count)))
+            continue;
+        memcpy((void *)((uintptr_t) buffer + ((journal->blocks[i] - block) * mp->blockSizeBytes)),
+               (const void *)((uintptr_t) journal->copies + (i * mp->blockSizeBytes)), mp->blockSizeBytes);
+    }
+}
+
+/* lxfsJournalCommit(): commits the running transaction to the log
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsJournalCommit(Mountpoint *mp) {
+    Journal *journal = mp->journal;
+    if(!journal || !journal->count || journal->busy) return 0;
+
+    // an empty log always has room for a transaction
+    if((journal->head + 1 + journal->count) > LXFS_JOURNAL_LOG) {
+        if(lxfsJournalCheckpoint(mp)) return 1;
+    }
+
+    journal->busy = 1;
+
+    size_t size = (journal->count + 1) * mp->blockSizeBytes;
+    LXFSJournalDescriptor *desc = (LXFSJournalDescriptor *)((uintptr_t) journal->log +
+        ((journal->head + 1) * mp->blockSizeBytes));
+    memset(desc, 0, mp->blockSizeBytes);
+    desc->magic = LXFS_JOURNAL_COMMIT;
+    desc->sequence = journal->sequence;
+    desc->count = journal->count;
+
+    for(size_t i = 0; i < journal->count; i++) {
+        uint64_t block = journal->blocks[i];
+        uint64_t index = block % CACHE_SIZE;
+        void *image = (void *)((uintptr_t) desc + ((i + 1) * mp->blockSizeBytes));
+        desc->blocks[i] = block;
+
+        // the copy in memory is never older than a held back write
+        if(lxfsTablePage(mp, block)) {
+            memcpy(image, lxfsTablePage(mp, block), mp->blockSizeBytes);
+        } else if(mp->cache[index].valid && (mp->cache[index].tag == (block / CACHE_SIZE))) {
+            memcpy(image, mp->cache[index].data, mp->blockSizeBytes);
+        } else if(journal->held[i]) {
+            memcpy(image, (const void *)((uintptr_t) journal->copies + (i * mp->blockSizeBytes)),
+                   mp->blockSizeBytes);
+        } else if(lxfsDeviceRead(mp, block, 1, image)) {
+            journal->busy = 0;
+            return 1;
+        }
+    }
+
+    desc->checksum = lxfsJournalChecksum(desc, size);
+
+    // device writes complete synchronously, so once this returns the
+    // transaction is on disk ahead of any of its blocks
+    if(lxfsDeviceWrite(mp, LXFS_JOURNAL_START + 1 + journal->head, journal->count + 1, desc)) {
+        journal->busy = 0;
+        return 1;
+    }
+
+    if(!journal->loggedCount) journal->committed = time(NULL);
+
+    for(size_t i = 0; i < journal->count; i++) {
+        uint64_t block = journal->blocks[i];
+        uint64_t index = block % CACHE_SIZE;
+        lxfsJournalRecord(journal, block, journal->head + 1 + i);
+
+        // a held back write never reached its place, so the checkpoint has to
+        // write the image rather than leave it to a slot that looks clean
+        if(journal->held[i]) continue;
+
+        if(lxfsTablePage(mp, block)) lxfsTableLogged(mp, block, 1);
+        else if(mp->cache[index].valid && (mp->cache[index].tag == (block / CACHE_SIZE)))
+            mp->cache[index].logged = 1;
+    }
+
+    journal->head += journal->count + 1;
+    journal->sequence++;
+    journal->count = 0;
+    journal->busy = 0;
+    return 0;
+}
+
+/* lxfsJournalCheckpoint(): writes the latest image of every block in the log
+ * in place and empties the log
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsJournalCheckpoint(Mountpoint *mp) {
+    Journal *journal = mp->journal;
+    if(!journal || journal->busy) return 0;
+
+    journal->busy = 1;
+
+    for(size_t i = 0; i < journal->loggedCount; i++) {
+        uint64_t block = journal->logged[i];
+
+        // a slot that wasn't modified since holds the same data as the image
+        if(lxfsJournalCurrent(mp, block)) {
+            if(lxfsFlushBlock(mp, block)) goto fail;
+            continue;
+        }
+
+        const void *image = (const void *)((uintptr_t) journal->log +
+            ((journal->images[i] + 1) * mp->blockSizeBytes));
+        if(lxfsDeviceWrite(mp, block, 1, image)) goto fail;
+    }
+
+    // only forget the log once everything in it is in place
+    if(lxfsJournalHeader(mp)) goto fail;
+
+    journal->loggedCount = 0;
+    journal->head = 0;
+    journal->busy = 0;
+    return 0;
+
+fail:
+    journal->busy = 0;
+    return 1;
+}
+
+/* lxfsJournalTick(): commits the running transaction and checkpoints the log
+ * in the background once they are old enough
+ * params: mp - mountpoint
+ * params: idle - non-zero if there are no pending requests
+ * returns: nothing
+ */
+
+void lxfsJournalTick(Mountpoint *mp, int idle) {
+    Journal *journal = mp->journal;
+    if(!journal || (!journal->count && !journal->loggedCount)) return;
+
+    time_t now = time(NULL);
+    if(journal->count && ((now - journal->started) >= JOURNAL_COMMIT_INTERVAL))
+        lxfsJournalCommit(mp);
+    else
+        lxfsJournalReserve(mp, JOURNAL_RESERVE);
+
+    if(idle && !journal->count && journal->loggedCount &&
+    ((journal->head >= (LXFS_JOURNAL_LOG / 2)) || ((now - journal->committed) >= JOURNAL_CHECKPOINT_AGE)))
+        lxfsJournalCheckpoint(mp);
+}
\ No newline at end of file
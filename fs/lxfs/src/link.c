@@ -130,6 +130,17 @@ void lxfsUnlink(UnlinkCommand *cmd) {
         }
     }
 
+    // a file about to lose its last link may have more blocks than freeing
+    // them can fit in one journal transaction
+    if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) {
+        const LXFSFileHeader *header = lxfsPeekBlock(mp, entry.block);
+        if(!header || ((header->refCount == 1) && lxfsChainShrink(mp, entry.block))) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
+    }
+
     // delete the associated directory entry
     LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer+offset);
     dir->flags = LXFS_DIR_DELETED;
@@ -148,7 +159,7 @@ void lxfsUnlink(UnlinkCommand *cmd) {
         return;
     }
 
-    lxfsFlushBlock(mp, block);
+    lxfsJournalBlock(mp, block);
 
     if((offset + entry.entrySize) > mp->blockSizeBytes) {
         if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
@@ -157,9 +168,14 @@ void lxfsUnlink(UnlinkCommand *cmd) {
             return;
         }
 
-        lxfsFlushBlock(mp, next);
+        lxfsJournalBlock(mp, next);
     }
 
+    // the cached location of the entry is no longer valid
+    lxfsInvalidateFiles(mp, entry.block);
+    lxfsDentryForget(mp, entry.block);
+    lxfsCursorForget(mp, entry.block);
+
     // for regular files and hard links, decrement file ref counter
     if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) {
         if(lxfsReadBlock(mp, entry.block, mp->meta)) {
@@ -178,23 +194,19 @@ void lxfsUnlink(UnlinkCommand *cmd) {
                 return;
             }
 
-            lxfsFlushBlock(mp, entry.block);
+            lxfsJournalBlock(mp, entry.block);
         } else {
             // last reference deleted, free up all blocks used by the file
-            uint64_t prev = entry.block;
-            while(prev && prev != LXFS_BLOCK_EOF) {
-                next = lxfsNextBlock(mp, prev);
-                if(lxfsSetNextBlock(mp, prev, 0)) {
-                    cmd->header.header.status = -EIO;
-                    luxSendKernel(cmd);
-                    return;
-                }
-
-                prev = next;
+            if(lxfsCompressReset(mp, entry.block) || lxfsChainRelease(mp, entry.block)) {
+                cmd->header.header.status = -EIO;
+                luxSendKernel(cmd);
+                return;
             }
         }
     } else {
         // for symbolic links and directories, free up the blocks
+        if(type == LXFS_DIR_TYPE_DIR) lxfsIndexDrop(mp, entry.block);
+
         uint64_t prev = entry.block;
         while(prev && prev != LXFS_BLOCK_EOF) {
             next = lxfsNextBlock(mp, prev);
@@ -263,7 +275,9 @@ void lxfsUnlink(UnlinkCommand *cmd) {
         return;
     }
 
-    lxfsFlushBlock(mp, parent.block);
+    lxfsJournalBlock(mp, parent.block);
+    lxfsIndexRemove(mp, parent.block, block, offset);
+
     cmd->header.header.status = 0;
     luxSendKernel(cmd);
 }
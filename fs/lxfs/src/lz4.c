@@ -0,0 +1,225 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <string.h>
+
+/* LZ4 block format: a sequence of tokens, each with a run of literals and a
+ * match copied from up to 64 KB back. The high nibble of the token is the
+ * literal length and the low nibble the match length minus four, either of
+ * which continues in extra bytes when it is 15. The last five bytes are always
+ * literals and the last match starts at least twelve bytes before the end. */
+
+#define LZ4_HASH_BITS       12
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5
+#define LZ4_MF_LIMIT        12
+#define LZ4_MAX_OFFSET      65535
+
+/* lz4Read32(): helper function to read four unaligned bytes
+ * params: p - pointer to the bytes
+ * returns: value
+ */
+
+static uint32_t lz4Read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+/* lz4Hash(): helper function to hash the four bytes at a position
+ * params: value - four bytes
+ * returns: index into the hash table
+ */
+
+static uint32_t lz4Hash(uint32_t value) {
+    return (value * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* lz4Length(): helper function to write the extra bytes of a length
+ * params: op - output pointer
+ * params: length - length past the 15 held by the token
+ * returns: output pointer after the length
+ */
+
+static uint8_t *lz4Length(uint8_t *op, size_t length) {
+    while(length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+
+    *op++ = length;
+    return op;
+}
+
+/* lz4Literals(): helper function to write a token and its literals
+ * params: op - output pointer
+ * params: oend - end of the output buffer
+ * params: literals - literals to write
+ * params: length - number of literals
+ * params: token - pointer to store the location of the token
+ * returns: output pointer after the literals, NULL if they don't fit
+ */
+
+static uint8_t *lz4Literals(uint8_t *op, const uint8_t *oend, const uint8_t *literals,
+                            size_t length, uint8_t **token) {
+    if((size_t)(oend - op) < (1 + (length / 255) + 1 + length)) return NULL;
+
+    *token = op++;
+    if(length >= 15) {
+        **token = 15 << 4;
+        op = lz4Length(op, length - 15);
+    } else {
+        **token = length << 4;
+    }
+
+    memcpy(op, literals, length);
+    return op + length;
+}
+
+/* lxfsCompress(): compresses data into an LZ4 block
+ * params: source - data to compress
+ * params: size - number of bytes to compress
+ * params: dest - buffer to compress into
+ * params: capacity - size of the buffer
+ * returns: size of the compressed data, zero if it doesn't fit
+ */
+
+size_t lxfsCompress(const void *source, size_t size, void *dest, size_t capacity) {
+    const uint8_t *src = (const uint8_t *) source;
+    const uint8_t *end = src + size;
+    const uint8_t *anchor = src;
+    uint8_t *op = (uint8_t *) dest;
+    const uint8_t *oend = op + capacity;
+    uint8_t *token;
+
+    if(size > LZ4_MF_LIMIT) {
+        uint32_t table[1 << LZ4_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+        const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+        const uint8_t *ip = src + 1;
+
+        while(ip < mflimit) {
+            uint32_t sequence = lz4Read32(ip);
+            uint32_t hash = lz4Hash(sequence);
+            const uint8_t *ref = src + table[hash];
+            table[hash] = ip - src;
+
+            if((ref >= ip) || ((ip - ref) > LZ4_MAX_OFFSET) || (lz4Read32(ref) != sequence)) {
+                ip++;
+                continue;
+            }
+
+            // extend the match backwards into the pending literals, then forwards
+            while((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mend = ip + LZ4_MIN_MATCH;
+            const uint8_t *rend = ref + LZ4_MIN_MATCH;
+            while((mend < matchlimit) && (*mend == *rend)) {
+                mend++;
+                rend++;
+            }
+
+            op = lz4Literals(op, oend, anchor, ip - anchor, &token);
+            if(!op) return 0;
+
+            size_t match = (mend - ip) - LZ4_MIN_MATCH;
+            if((size_t)(oend - op) < (2 + (match / 255) + 1)) return 0;
+
+            size_t offset = ip - ref;
+            *op++ = offset & 0xFF;
+            *op++ = (offset >> 8) & 0xFF;
+
+            if(match >= 15) {
+                *token |= 15;
+                op = lz4Length(op, match - 15);
+            } else {
+                *token |= match;
+            }
+
+            ip = mend;
+            anchor = ip;
+
+            // remember a position inside the match to find repeats sooner
+            table[lz4Hash(lz4Read32(ip - 2))] = (ip - 2) - src;
+        }
+    }
+
+    // whatever is left over is stored as literals
+    op = lz4Literals(op, oend, anchor, end - anchor, &token);
+    if(!op) return 0;
+
+    return op - (uint8_t *) dest;
+}
+
+/* lxfsDecompress(): decompresses an LZ4 block
+ * params: source - compressed data
+ * params: size - size of the compressed data
+ * params: dest - buffer to decompress into
+ * params: capacity - size of the buffer
+ * returns: size of the decompressed data, negative if the data is corrupt
+ */
+
+ssize_t lxfsDecompress(const void *source, size_t size, void *dest, size_t capacity) {
+    const uint8_t *ip = (const uint8_t *) source;
+    const uint8_t *iend = ip + size;
+    uint8_t *op = (uint8_t *) dest;
+    uint8_t *oend = op + capacity;
+
+    while(ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t length = token >> 4;
+        if(length == 15) {
+            uint8_t more;
+            do {
+                if(ip >= iend) return -1;
+                more = *ip++;
+                length += more;
+            } while(more == 255);
+        }
+
+        if((length > (size_t)(iend - ip)) || (length > (size_t)(oend - op))) return -1;
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+
+        // the last sequence has no match
+        if(ip == iend) break;
+
+        if((iend - ip) < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(!offset || (offset > (size_t)(op - (uint8_t *) dest))) return -1;
+
+        length = token & 0x0F;
+        if(length == 15) {
+            uint8_t more;
+            do {
+                if(ip >= iend) return -1;
+                more = *ip++;
+                length += more;
+            } while(more == 255);
+        }
+
+        length += LZ4_MIN_MATCH;
+        if(length > (size_t)(oend - op)) return -1;
+
+        // matches may overlap their own output, so copy a byte at a time
+        const uint8_t *ref = op - offset;
+        for(size_t i = 0; i < length; i++)
+            op[i] = ref[i];
+        op += length;
+    }
+
+    return op - (uint8_t *) dest;
+}
\ No newline at end of file
@@ -45,6 +45,9 @@ int main() {
     luxReady();
 
     for(;;) {
+        // complete block reads submitted directly to sdev
+        int completions = lxfsChannelPoll();
+
         // handle requests here
         ssize_t s = luxRecvCommand((void **) &msg);
         if(s > 0) {
@@ -57,6 +60,7 @@ int main() {
             case COMMAND_OPENDIR: lxfsOpendir((OpendirCommand *) msg); break;
             case COMMAND_READDIR: lxfsReaddir((ReaddirCommand *) msg); break;
             case COMMAND_MMAP: lxfsMmap((MmapCommand *) msg); break;
+            case COMMAND_MSYNC: lxfsMsync((MsyncCommand *) msg); break;
             case COMMAND_CHMOD: lxfsChmod((ChmodCommand *) msg); break;
             case COMMAND_CHOWN: lxfsChown((ChownCommand *) msg); break;
             case COMMAND_MKDIR: lxfsMkdir((MkdirCommand *) msg); break;
@@ -67,12 +71,17 @@ int main() {
             case COMMAND_READLINK: lxfsReadLink((ReadLinkCommand *) msg); break;
             case COMMAND_FSYNC: lxfsFsync((FsyncCommand *) msg); break;
             case COMMAND_STATVFS: lxfsStatvfs((StatvfsCommand *) msg); break;
+            case COMMAND_IOCTL: lxfsIoctl((IOCTLCommand *) msg); break;
+            case COMMAND_SYSINFO: lxfsCacheBalance((SysInfoResponse *) msg); break;
             default:
                 msg->header.response = 1;
                 msg->header.status = -ENOSYS;
                 luxSendKernel(msg);
             }
-        } else {
+
+            lxfsTick(0);
+        } else if(!completions) {
+            lxfsTick(1);
             sched_yield();
         }
     }
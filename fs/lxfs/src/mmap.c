@@ -1,6 +1,6 @@
 /*
  * luxOS - a unix-like operating system
- * Omar Elghoul, 2024
+ * Omar Elghoul, 2024-25
  * 
  * lxfs: Driver for the lxfs file system
  */
@@ -8,20 +8,84 @@
 #include <liblux/liblux.h>
 #include <lxfs/lxfs.h>
 #include <vfs.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* lxfsCopyRange(): helper function to copy a range of a file out of the cache
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file, within the file
+ * params: length - number of bytes to copy, within the file
+ * params: buffer - buffer to copy into, which must be zeroed
+ * returns: zero on success
+ */
+
+static int lxfsCopyRange(Mountpoint *mp, OpenFile *file, off_t position, size_t length, void *buffer) {
+    if(file->inlined) return lxfsInlineRead(mp, file, position, length, buffer);
+    if(file->units) return lxfsCompressRead(mp, file, position, length, buffer);
+
+    // unwritten blocks are left as zeros
+    LXFSUnwritten unwritten;
+    int sparse = file->unwritten && !lxfsGetUnwritten(mp, file->entry.block, &unwritten);
+
+    uint64_t index = position / mp->blockSizeBytes;
+    uint64_t block = lxfsChainBlock(mp, file->entry.block, index);
+    size_t offset = position % mp->blockSizeBytes;
+    size_t copied = 0;
+
+    while(copied < length) {
+        if(!block || (block == LXFS_BLOCK_EOF)) return 1;
+
+        size_t s = mp->blockSizeBytes - offset;
+        if(s > (length - copied)) s = length - copied;
+
+        if(!sparse || !lxfsIsUnwritten(&unwritten, index)) {
+            const void *data = lxfsPeekBlock(mp, block);
+            if(!data) return 1;
+            memcpy((void *)((uintptr_t)buffer + copied), (const void *)((uintptr_t)data + offset), s);
+        }
+
+        copied += s;
+        offset = 0;
+        index++;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    return 0;
+}
+
+/* lxfsMmapHeader(): returns the size of the header of an mmap message, which
+ * kernels that predate paging send without the paging field
+ * params: cmd - mmap command message
+ * returns: size of the header, at which the data of the response begins
+ */
+
+size_t lxfsMmapHeader(const MmapCommand *cmd) {
+    if(cmd->header.header.length >= sizeof(MmapCommand)) return sizeof(MmapCommand);
+    return offsetof(MmapCommand, paging);
+}
 
 /* lxfsMmap(): implementation of mmap() for lxfs
+ * a new mapping is either returned whole, or paged on demand if the kernel
+ * supports it, in which case only the pages it faults in are returned
  * params: cmd - mmap command message
  * returns: nothing, response relayed to kernel
  */
 
 void lxfsMmap(MmapCommand *cmd) {
+    // older kernels are answered in the layout they sent, with no paging; the
+    // length is kept so that a parked request is resumed the same way
+    size_t header = lxfsMmapHeader(cmd);
+    int paging = (header == sizeof(MmapCommand)) ? cmd->paging : MMAP_PAGING_NONE;
+
     cmd->header.header.response = 1;
-    cmd->header.header.length = sizeof(MmapCommand);
+    cmd->header.header.length = header;
 
     // get the mountpoint
     Mountpoint *mp = findMP(cmd->device);
@@ -31,64 +95,198 @@ void lxfsMmap(MmapCommand *cmd) {
         return;
     }
 
-    // and the file entry
-    LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
+    // and the open file, which caches the entry and metadata
+    OpenFile *file = lxfsGetFile(mp, cmd->id, cmd->path);
+    if(!file) {
         cmd->header.header.status = -ENOENT;
         luxSendKernel(cmd);
         return;
     }
 
-    // use the file entry to read metadata as well as find the first file block
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        cmd->header.header.status = -EIO;
+    LXFSFileHeader *metadata = &file->meta;
+
+    if(paging == MMAP_PAGING_MAP) {
+        // writes to shared mappings are written back by msync()
+        if((cmd->flags & MAP_SHARED) && (cmd->prot & PROT_WRITE) &&
+        !lxfsWritable(file, cmd->uid, cmd->gid)) {
+            cmd->header.header.status = -EACCES;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        // nothing is read until the kernel faults the pages in
+        cmd->responseType = MMAP_RESPONSE_PAGED;
+        cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // pages entirely past the end of the file can't be faulted in
+    if((paging == MMAP_PAGING_FAULT) && (cmd->off >= metadata->size)) {
+        cmd->header.header.status = -EOVERFLOW;
         luxSendKernel(cmd);
         return;
     }
 
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+    // page requests always return whole pages, zero-filled past the end of
+    // the file, while whole mappings are limited to the file
+    size_t len = cmd->len;
+    if(cmd->off >= metadata->size) len = 0;
+    else if(len > (metadata->size - cmd->off)) len = metadata->size - cmd->off;
+    if(paging != MMAP_PAGING_FAULT) cmd->len = len;
 
-    if(cmd->len > metadata->size)
-        cmd->len = metadata->size;
+    // compressed files wait for the blocks holding their units instead
+    uint64_t first, count;
+    if(len && file->units && !file->inlined &&
+    !lxfsCompressSpan(mp, file, cmd->off, len, &first, &count) &&
+    lxfsAwaitBlocks(mp, file->entry.block, first, count, cmd))
+        return;
 
-    size_t blockCount = (cmd->len+mp->blockSizeBytes-1) / mp->blockSizeBytes;
+    // inline files have no data blocks to wait for or read ahead
+    if(len && !file->inlined && !file->units) {
+        uint64_t startBlock = cmd->off / mp->blockSizeBytes;
+        uint64_t endBlock = (cmd->off + len - 1) / mp->blockSizeBytes;
 
-    MmapCommand *res = calloc(1, sizeof(MmapCommand) + cmd->len);
+        // park the request instead of blocking while its blocks are read
+        if(lxfsAwaitBlocks(mp, file->entry.block, startBlock, endBlock - startBlock + 1, cmd))
+            return;
+
+        uint64_t block = lxfsChainBlock(mp, file->entry.block, startBlock);
+        if(!block || (block == LXFS_BLOCK_EOF)) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
+            return;
+        }
+
+        // faults on a mapping read sequentially are detected like reads, and
+        // whole mappings are read sequentially anyway
+        if(paging == MMAP_PAGING_FAULT)
+            lxfsReadAhead(mp, &file->readahead, file->entry.block, cmd->off, len);
+        else
+            lxfsPrefetch(mp, file->entry.block, startBlock, endBlock - startBlock + 1);
+    }
+
+    MmapCommand *res = calloc(1, header + cmd->len);
     if(!res) {
         cmd->header.header.status = -ENOMEM;
         luxSendKernel(cmd);
         return;
     }
 
-    memcpy(res, cmd, sizeof(MmapCommand));
-    res->responseType = 0;
+    memcpy(res, cmd, header);
+    res->responseType = MMAP_RESPONSE_DATA;
     res->mmio = 0;
 
-    uint64_t block = first;
-    void *position = (void *) res->data;
-    size_t remaining = cmd->len;
-    for(size_t i = 0; i < blockCount; i++) {
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) {
-            res->header.header.status = -EIO;
-            luxSendKernel(res);
-            free(res);
+    if(len && lxfsCopyRange(mp, file, cmd->off, len, (void *)((uintptr_t)res + header))) {
+        res->header.header.status = -EIO;
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    res->header.header.status = 0;
+    res->header.header.length += cmd->len;
+    luxSendKernel(res);
+    free(res);
+}
+
+/* lxfsMsync(): implementation of msync() for lxfs
+ * params: cmd - msync command message, carrying the pages to write back
+ * returns: nothing, response relayed to kernel
+ */
+
+void lxfsMsync(MsyncCommand *cmd) {
+    size_t length = cmd->header.header.length;
+    cmd->header.header.response = 1;
+    cmd->header.header.length = sizeof(MsyncCommand);
+
+    Mountpoint *mp = findMP(cmd->device);
+    if(!mp) {
+        cmd->header.header.status = -EIO;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    OpenFile *file = lxfsGetFile(mp, cmd->id, cmd->path);
+    if(!file) {
+        cmd->header.header.status = -ENOENT;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // changes to private mappings are never written back
+    if(!(cmd->mapFlags & MAP_SHARED)) {
+        cmd->header.header.status = 0;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    if(!lxfsWritable(file, cmd->uid, cmd->gid)) {
+        cmd->header.header.status = -EACCES;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    if((length < sizeof(MsyncCommand)) || (cmd->len > (length - sizeof(MsyncCommand)))) {
+        cmd->header.header.status = -EINVAL;
+        luxSendKernel(cmd);
+        return;
+    }
+
+    // mappings can't change the size of the file, so the part of the range
+    // past the end of the file is dropped
+    LXFSFileHeader *metadata = &file->meta;
+    size_t len = cmd->len;
+    if(cmd->off >= metadata->size) len = 0;
+    else if(len > (metadata->size - cmd->off)) len = metadata->size - cmd->off;
+
+    if(len) {
+        uint64_t last;
+        ssize_t s = lxfsOverwrite(mp, file, cmd->off, cmd->data, len, &last);
+        if((s < 0) || ((size_t) s != len)) {
+            cmd->header.header.status = -EIO;
+            luxSendKernel(cmd);
             return;
         }
 
-        if(remaining >= mp->blockSizeBytes)
-            memcpy(position, mp->dataBuffer, mp->blockSizeBytes);
-        else
-            memcpy(position, mp->dataBuffer, remaining);
-        
-        remaining -= mp->blockSizeBytes;
+        lxfsTouchFile(mp, file, time(NULL), 1);
+
+        // MS_ASYNC leaves the pages to writeback, MS_SYNC waits for them
+        if((cmd->syncFlags & MS_SYNC) && file->inlined) {
+            if(lxfsFlushBlock(mp, file->entry.block)) {
+                cmd->header.header.status = -EIO;
+                luxSendKernel(cmd);
+                return;
+            }
+        } else if((cmd->syncFlags & MS_SYNC) && file->units) {
+            // the range doesn't map to blocks, so write back the whole file
+            ChainIndex *index = lxfsChainIndex(mp, file->entry.block);
+            int status = !index || lxfsFlushBlock(mp, file->entry.block) ||
+                lxfsCompressSync(mp, file->entry.block);
+            for(size_t i = 0; !status && (i < index->extentCount); i++) {
+                for(uint64_t j = 0; !status && (j < index->extents[i].count); j++)
+                    status = lxfsFlushBlock(mp, index->extents[i].start + j);
+            }
 
-        if(block == LXFS_BLOCK_EOF) break;
-        position = (void *)(uintptr_t) position + mp->blockSizeBytes;
+            if(status) {
+                cmd->header.header.status = -EIO;
+                luxSendKernel(cmd);
+                return;
+            }
+        } else if(cmd->syncFlags & MS_SYNC) {
+            uint64_t first = cmd->off / mp->blockSizeBytes;
+            uint64_t count = ((cmd->off + len - 1) / mp->blockSizeBytes) - first + 1;
+            for(uint64_t i = 0; i < count; i++) {
+                uint64_t block = lxfsChainBlock(mp, file->entry.block, first + i);
+                if(!block || (block == LXFS_BLOCK_EOF) || lxfsFlushBlock(mp, block)) {
+                    cmd->header.header.status = -EIO;
+                    luxSendKernel(cmd);
+                    return;
+                }
+            }
+        }
     }
 
-    res->header.header.length += cmd->len;
-    luxSendKernel(res);
-    free(res);
+    cmd->header.header.status = 0;
+    luxSendKernel(cmd);
 }
\ No newline at end of file
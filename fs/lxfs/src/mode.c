@@ -64,7 +64,7 @@ void lxfsChmod(ChmodCommand *cmd) {
         return;
     }
 
-    lxfsFlushBlock(mp, block);
+    lxfsJournalBlock(mp, block);
 
     if((offset + entry.entrySize) > mp->blockSizeBytes) {
         if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
@@ -73,7 +73,7 @@ void lxfsChmod(ChmodCommand *cmd) {
             return;
         }
 
-        lxfsFlushBlock(mp, next);
+        lxfsJournalBlock(mp, next);
     }
 
     cmd->header.header.status = 0;
@@ -131,7 +131,7 @@ void lxfsChown(ChownCommand *cmd) {
         return;
     }
 
-    lxfsFlushBlock(mp, block);
+    lxfsJournalBlock(mp, block);
 
     if((offset + entry.entrySize) > mp->blockSizeBytes) {
         if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
@@ -140,7 +140,7 @@ void lxfsChown(ChownCommand *cmd) {
             return;
         }
 
-        lxfsFlushBlock(mp, next);
+        lxfsJournalBlock(mp, next);
     }
 
     cmd->header.header.status = 0;
@@ -198,7 +198,7 @@ void lxfsUtime(UtimeCommand *cmd) {
         return;
     }
 
-    lxfsFlushBlock(mp, block);
+    lxfsJournalBlock(mp, block);
 
     if((offset + entry.entrySize) > mp->blockSizeBytes) {
         if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
@@ -207,7 +207,7 @@ void lxfsUtime(UtimeCommand *cmd) {
             return;
         }
 
-        lxfsFlushBlock(mp, next);
+        lxfsJournalBlock(mp, next);
     }
 
     // update the directory header as well
@@ -227,7 +227,7 @@ void lxfsUtime(UtimeCommand *cmd) {
             return;
         }
 
-        lxfsFlushBlock(mp, entry.block);
+        lxfsJournalBlock(mp, entry.block);
     }
 
     cmd->header.header.status = 0;
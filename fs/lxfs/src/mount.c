@@ -13,8 +13,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 static Mountpoint *mps = NULL;
+static uint64_t requests = 0;
 
 static Mountpoint *allocateMP() {
     Mountpoint *mp = calloc(1, sizeof(Mountpoint));
@@ -38,18 +40,92 @@ static Mountpoint *allocateMP() {
     return mp;
 }
 
+static void freeMP(Mountpoint *mp) {
+    if(mps == mp) {
+        mps = mp->next;
+    } else {
+        Mountpoint *list = mps;
+        while(list->next != mp) list = list->next;
+        list->next = mp->next;
+    }
+
+    free(mp->cache);
+    free(mp);
+}
+
 Mountpoint *findMP(const char *dev) {
     if(!mps) return NULL;
 
     Mountpoint *list = mps;
     while(list) {
-        if(!strcmp(list->device, dev)) return list;
+        if(!strcmp(list->device, dev)) {
+            // every request looks up its mountpoint, so this tracks how recently
+            // the volume was used for sharing the cache budget
+            list->lastUse = ++requests;
+            return list;
+        } else {
+            list = list->next;
+        }
+    }
+
+    return NULL;
+}
+
+Mountpoint *firstMP() {
+    return mps;
+}
+
+Mountpoint *findAttachedMP(uint64_t handle) {
+    Mountpoint *list = mps;
+    while(list) {
+        if(list->handle == handle) return list;
         else list = list->next;
     }
 
     return NULL;
 }
 
+/* lxfsTick(): periodic housekeeping, writes back dirty attributes and blocks,
+ * cleans volumes in append mode and adjusts the cache budget to memory pressure
+ * params: idle - non-zero if there are no pending requests
+ * returns: nothing
+ */
+
+void lxfsTick(int idle) {
+    time_t now = 0;
+    Mountpoint *mp = mps;
+    while(mp) {
+        if(mp->dirtyFiles || mp->dirtyBlocks || mp->tableDirtyPages) {
+            if(!now) now = time(NULL);
+            mp->clock = now;
+
+            if(mp->dirtyFiles) lxfsExpireFiles(mp, now);
+
+            if(mp->dirtyBlocks > WRITEBACK_HIGH) {
+                // too much dirty data, write back regardless of age
+                lxfsWriteback(mp, WRITEBACK_LOW, 0);
+            } else if(idle && (mp->lastWriteback != now)) {
+                // at most one pass per second, and only between requests
+                mp->lastWriteback = now;
+                lxfsWriteback(mp, 0, WRITEBACK_AGE);
+
+                // pages of the block table are written back together
+                if(mp->tableDirtyPages && ((now - mp->tableDirtied) >= WRITEBACK_AGE))
+                    lxfsTableWriteback(mp);
+            }
+        }
+
+        // reads that were in flight when the backend was detached won't complete
+        if(mp->reads && !mp->submitRead) lxfsFailReads(mp);
+
+        if(mp->journal) lxfsJournalTick(mp, idle);
+        if(idle && mp->cleanCount) lxfsAppendClean(mp);
+        mp = mp->next;
+    }
+
+    if(idle && mps) lxfsCachePoll();
+}
+
 void lxfsMount(MountCommand *cmd) {
     cmd->header.header.response = 1;
 
@@ -85,12 +161,21 @@ void lxfsMount(MountCommand *cmd) {
         return;
     }
 
+    // v1 and v2 volumes only differ in the extent maps of files
+    if(id->version > LXFS_VERSION_EXTENTS) {
+        cmd->header.header.status = -ENODEV;
+        close(fd);
+        free(id);
+        luxSendDependency(cmd);
+        return;
+    }
+
     int sectorSize = 512 << ((id->parameters >> 1) & 3);
     int blockSize = ((id->parameters >> 3) & 0x0F) + 1;
     int blockSizeBytes = sectorSize * blockSize;
 
-    void *buffer = malloc(blockSizeBytes);
-    if(!buffer) {
+    void *buffer2 = malloc(blockSizeBytes*2);
+    if(!buffer2) {
         cmd->header.header.status = -ENOMEM;
         close(fd);
         free(id);
@@ -98,23 +183,23 @@ void lxfsMount(MountCommand *cmd) {
         return;
     }
 
-    void *buffer2 = malloc(blockSizeBytes*2);
-    if(!buffer2) {
+    void *meta = malloc(blockSizeBytes);
+    if(!meta) {
         cmd->header.header.status = -ENOMEM;
         close(fd);
         free(id);
-        free(buffer);
+        free(buffer2);
         luxSendDependency(cmd);
         return;
     }
 
-    void *meta = malloc(blockSizeBytes);
-    if(!meta) {
+    void *raBuffer = malloc(READAHEAD_MAX);
+    if(!raBuffer) {
         cmd->header.header.status = -ENOMEM;
         close(fd);
         free(id);
-        free(buffer);
         free(buffer2);
+        free(meta);
         luxSendDependency(cmd);
         return;
     }
@@ -124,8 +209,9 @@ void lxfsMount(MountCommand *cmd) {
         cmd->header.header.status = -ENOMEM;
         close(fd);
         free(id);
-        free(buffer);
         free(buffer2);
+        free(meta);
+        free(raBuffer);
         luxSendDependency(cmd);
         return;
     }
@@ -139,12 +225,65 @@ void lxfsMount(MountCommand *cmd) {
     mp->blockSizeBytes = blockSizeBytes;
     mp->volumeSize = id->volumeSize;
     mp->root = id->rootBlock;
-    mp->blockTableBuffer = buffer;
     mp->dataBuffer = buffer2;
     mp->meta = meta;
+    mp->raBuffer = raBuffer;
+
+    // the extent map sits after the table of unwritten blocks, so tiny blocks
+    // can't hold one and are treated as v1
+    mp->extentMaps = (id->version >= LXFS_VERSION_EXTENTS) &&
+        (blockSizeBytes >= (LXFS_EXTENT_MAP_OFFSET + sizeof(LXFSExtentMap) + sizeof(LXFSExtentRecord)));
 
     luxLogf(KPRINT_LEVEL_DEBUG, "- %d bytes per sector, %d sectors per block\n", mp->sectorSize, mp->blockSize);
     luxLogf(KPRINT_LEVEL_DEBUG, "- root directory at block %d\n", mp->root);
+    if(mp->extentMaps) luxLogf(KPRINT_LEVEL_DEBUG, "- v2 volume, files have extent maps\n");
+
+    mp->compress = mp->extentMaps && (id->parameters & LXFS_ID_COMPRESS);
+    if(mp->compress) luxLogf(KPRINT_LEVEL_DEBUG, "- new files are compressed\n");
+
+    // append mode only changes where blocks are allocated, so older drivers
+    // can still use the volume as usual
+    mp->append = (id->features & LXFS_FEATURE_APPEND) != 0;
+    if(mp->append) luxLogf(KPRINT_LEVEL_DEBUG, "- append mode, new blocks are allocated at a log head\n");
+
+    mp->dedup = (id->features & LXFS_FEATURE_DEDUP) != 0;
+    if(mp->dedup) luxLogf(KPRINT_LEVEL_DEBUG, "- deduplication, identical files share their data blocks\n");
+
+    // bring the metadata up to date before anything reads it
+    if(lxfsJournalOpen(mp, id)) {
+        luxLogf(KPRINT_LEVEL_ERROR, "unable to replay the metadata journal of %s\n", cmd->source);
+        cmd->header.header.status = -EIO;
+        freeMP(mp);
+        close(fd);
+        free(id);
+        free(buffer2);
+        free(meta);
+        free(raBuffer);
+        luxSendDependency(cmd);
+        return;
+    }
+
+    // and keep the block table in memory, as it is after the replay
+    if(lxfsTableLoad(mp)) {
+        luxLogf(KPRINT_LEVEL_ERROR, "unable to read the block table of %s\n", cmd->source);
+        cmd->header.header.status = -EIO;
+        freeMP(mp);
+        close(fd);
+        free(id);
+        free(buffer2);
+        free(meta);
+        free(raBuffer);
+        luxSendDependency(cmd);
+        return;
+    }
+
+    if(mp->table)
+        luxLogf(KPRINT_LEVEL_DEBUG, "- block table pinned in memory, %d KB\n",
+                (int) ((mp->tableBlocks * mp->blockSizeBytes) / 1024));
+
+    // do block I/O directly through sdev when possible
+    if(!lxfsChannelAttach(mp, cmd->source))
+        luxLogf(KPRINT_LEVEL_DEBUG, "- attached to storage device through sdev\n");
 
     cmd->header.header.status = 0;
     luxSendDependency(cmd);
@@ -31,7 +31,9 @@ void lxfsOpen(OpenCommand *ocmd) {
     }
 
     LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, ocmd->path, NULL, NULL)) {
+    uint64_t dirBlock = 0;
+    off_t dirOffset = 0;
+    if(!lxfsFind(&entry, mp, ocmd->path, &dirBlock, &dirOffset)) {
         // file doesn't exist, check if it should be created
         if(ocmd->flags & O_CREAT) {
             // no idea why this kinda masking is necessary but POSIX says so lol
@@ -52,6 +54,7 @@ void lxfsOpen(OpenCommand *ocmd) {
 
             entry.block = 0;
             ocmd->header.header.status = lxfsCreate(&entry, mp, ocmd->path, mode, ocmd->uid, ocmd->gid);
+            if(!ocmd->header.header.status) lxfsGetFile(mp, ocmd->id, ocmd->path);
             luxSendKernel(ocmd);
             return;
         }
@@ -86,31 +89,36 @@ void lxfsOpen(OpenCommand *ocmd) {
 
         LXFSFileHeader *meta = (LXFSFileHeader *) mp->meta;
         meta->size = 0;
+        // the share record is left for lxfsChainCut() to leave the ring with
+        memset((void *)((uintptr_t)mp->meta + sizeof(LXFSFileHeader)), 0,
+               mp->dedup ? (LXFS_SHARE_OFFSET - sizeof(LXFSFileHeader)) : sizeof(LXFSUnwritten));
         if(lxfsWriteBlock(mp, entry.block, mp->meta)) {
             ocmd->header.header.status = -EIO;
             luxSendKernel(ocmd);
             return;
         }
 
-        uint64_t next = entry.block;
-        while(next != LXFS_BLOCK_EOF) {
-            int s;
-            if(next == entry.block) s = lxfsSetNextBlock(mp, next, LXFS_BLOCK_EOF);
-            else s = lxfsSetNextBlock(mp, next, 0);
+        if(lxfsChainShrink(mp, entry.block) || lxfsChainCut(mp, entry.block, 0)) {
+            ocmd->header.header.status = -EIO;
+            luxSendKernel(ocmd);
+            return;
+        }
 
-            if(s) {
-                ocmd->header.header.status = -EIO;
-                luxSendKernel(ocmd);
-                return;
-            }
+        // files left without data blocks are inline again
+        if(((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) &&
+        (lxfsInlineReset(mp, entry.block) || lxfsCompressReset(mp, entry.block))) {
+            ocmd->header.header.status = -EIO;
+            luxSendKernel(ocmd);
+            return;
+        }
 
-            next = lxfsNextBlock(mp, next);
-            if(!next) {
-                ocmd->header.header.status = -EIO;
-                luxSendKernel(ocmd);
-                return;
-            }
+        if(lxfsReadBlock(mp, entry.block, mp->meta)) {
+            ocmd->header.header.status = -EIO;
+            luxSendKernel(ocmd);
+            return;
         }
+
+        lxfsSyncFiles(mp, entry.block, (LXFSFileHeader *) mp->meta);
     }
 
     // recursively redirect for soft links
@@ -148,5 +156,9 @@ void lxfsOpen(OpenCommand *ocmd) {
         if((ocmd->flags & O_WRONLY) && !(entry.permissions & LXFS_PERMS_OTHER_W)) ocmd->header.header.status = -EACCES;
     }
 
+    // keep the entry and metadata around for subsequent I/O on this file
+    if(!ocmd->header.header.status)
+        lxfsAllocateFile(mp, ocmd->id, ocmd->path, &entry, dirBlock, dirOffset);
+
     luxSendKernel(ocmd);
 }
\ No newline at end of file
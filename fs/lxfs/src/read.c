@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 /* lxfsRead(): reads from an opened file on an lxfs volume
  * params: rcmd - read command message
@@ -31,23 +32,15 @@ void lxfsRead(RWCommand *rcmd) {
         return;
     }
 
-    // and the file entry
-    LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, rcmd->path, NULL, NULL)) {
+    // and the open file, which caches the entry and metadata
+    OpenFile *file = lxfsGetFile(mp, rcmd->id, rcmd->path);
+    if(!file) {
         rcmd->header.header.status = -ENOENT;
         luxSendKernel(rcmd);
         return;
     }
 
-    // use the file entry to read metadata as well as find the first file block
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        rcmd->header.header.status = -EIO;
-        luxSendKernel(rcmd);
-        return;
-    }
-
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+    LXFSFileHeader *metadata = &file->meta;
 
     // input validation
     if(rcmd->position >= metadata->size) {
@@ -61,6 +54,78 @@ void lxfsRead(RWCommand *rcmd) {
         truelen = metadata->size - rcmd->position;
     else
         truelen = rcmd->length;
+
+    uint64_t startBlock = rcmd->position / mp->blockSizeBytes;
+    uint64_t endBlock = (rcmd->position + truelen - 1) / mp->blockSizeBytes;
+
+    // small files are read straight out of their metadata block
+    if(file->inlined) {
+        RWCommand *res = calloc(1, sizeof(RWCommand) + truelen);
+        if(!res) {
+            rcmd->header.header.status = -ENOMEM;
+            luxSendKernel(rcmd);
+            return;
+        }
+
+        memcpy(res, rcmd, sizeof(RWCommand));
+        if(lxfsInlineRead(mp, file, rcmd->position, truelen, res->data)) {
+            res->header.header.status = -EIO;
+        } else {
+            lxfsTouchFile(mp, file, time(NULL), 0);
+
+            res->position += truelen;
+            res->length = truelen;
+            res->header.header.status = truelen;
+            res->header.header.length += truelen;
+        }
+
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    // compressed files are read a unit at a time, once the blocks that hold
+    // the units are cached
+    if(file->units) {
+        uint64_t first, count;
+        if(!lxfsCompressSpan(mp, file, rcmd->position, truelen, &first, &count) &&
+        lxfsAwaitBlocks(mp, file->entry.block, first, count, rcmd))
+            return;
+
+        RWCommand *res = calloc(1, sizeof(RWCommand) + truelen);
+        if(!res) {
+            rcmd->header.header.status = -ENOMEM;
+            luxSendKernel(rcmd);
+            return;
+        }
+
+        memcpy(res, rcmd, sizeof(RWCommand));
+        if(lxfsCompressRead(mp, file, rcmd->position, truelen, res->data)) {
+            res->header.header.status = -EIO;
+        } else {
+            lxfsTouchFile(mp, file, time(NULL), 0);
+
+            res->position += truelen;
+            res->length = truelen;
+            res->header.header.status = truelen;
+            res->header.header.length += truelen;
+        }
+
+        luxSendKernel(res);
+        free(res);
+        return;
+    }
+
+    // blocks that were never written read back as zeros without any I/O
+    LXFSUnwritten unwritten;
+    int sparse = file->unwritten && !lxfsGetUnwritten(mp, file->entry.block, &unwritten);
+    int hole = sparse;
+    for(uint64_t i = startBlock; hole && (i <= endBlock); i++)
+        hole = lxfsIsUnwritten(&unwritten, i);
+
+    // park the request instead of blocking while its blocks are read
+    if(!hole && lxfsAwaitBlocks(mp, file->entry.block, startBlock, endBlock - startBlock + 1, rcmd))
+        return;
     
     RWCommand *res = calloc(1, sizeof(RWCommand) + truelen);
     if(!res) {
@@ -72,59 +137,68 @@ void lxfsRead(RWCommand *rcmd) {
     // copy the header
     memcpy(res, rcmd, sizeof(RWCommand));
 
-    // now calculate which block to start from and offset into the firsty block
-    uint64_t startBlock = rcmd->position / mp->blockSizeBytes;
+    // now calculate the offset into the first block
     uint64_t startOffset = rcmd->position % mp->blockSizeBytes;
-    uint64_t block = first;
-
-    // find the starting block
-    while(startBlock) {
-        block = lxfsNextBlock(mp, block);
-        if(!block) {
-            free(res);
-            rcmd->header.header.status = -EIO;
-            luxSendKernel(rcmd);
-            return;
-        }
 
-        startBlock--;
+    // find the starting block and the extent it belongs to
+    uint64_t run;
+    uint64_t block = lxfsChainRun(mp, file->entry.block, startBlock, &run);
+    if(!block || (block == LXFS_BLOCK_EOF)) {
+        free(res);
+        rcmd->header.header.status = -EIO;
+        luxSendKernel(rcmd);
+        return;
     }
 
+    // detect sequential access and bring this read and the read-ahead window
+    // into the cache with as few device reads as possible
+    if(!hole) lxfsReadAhead(mp, &file->readahead, file->entry.block, rcmd->position, truelen);
+
     // and begin - we will use separate counters for this, because even though
     // we have an ideal "true length" to read, we cannot guarantee that we will
     // actually read that many bytes due to things like I/O errors, file system
     // corruption, missing blocks, etc
     size_t readCount = 0;
     size_t remaining = truelen;
+    uint64_t index = startBlock;
     while(readCount < truelen) {
         size_t s;
 
         // here and ONLY here we're allowed to break out of the loop without
         // throwing errors, provided we've read at least some of the file
         if(block == LXFS_BLOCK_EOF) break;
-        block = lxfsReadNextBlock(mp, block, mp->dataBuffer);
-        if(!block) break;
 
-        if(!readCount) {
-            // special case for starting block
-            if(remaining >= (mp->blockSizeBytes - startOffset)) s = mp->blockSizeBytes - startOffset;
-            else s = remaining;
+        size_t offset = readCount ? 0 : startOffset;
+        if(remaining >= (mp->blockSizeBytes - offset)) s = mp->blockSizeBytes - offset;
+        else s = remaining;
 
-            memcpy((void *)((uintptr_t)res->data + readCount), mp->dataBuffer+startOffset, s);
+        if(sparse && lxfsIsUnwritten(&unwritten, index)) {
+            memset((void *)((uintptr_t)res->data + readCount), 0, s);
         } else {
-            // for all other blocks
-            if(remaining > mp->blockSizeBytes) s = mp->blockSizeBytes;
-            else s = remaining;
+            // copy straight out of the cache slot, before anything can evict it
+            const void *data = lxfsPeekBlock(mp, block);
+            if(!data) break;
 
-            memcpy((void *)((uintptr_t)res->data + readCount), mp->dataBuffer, s);
+            memcpy((void *)((uintptr_t)res->data + readCount), (const void *)((uintptr_t)data + offset), s);
         }
 
         readCount += s;
         remaining -= s;
+        index++;
+
+        // step within the extent, and only look up the next one at its end
+        if(--run) {
+            block++;
+        } else {
+            block = lxfsChainRun(mp, file->entry.block, index, &run);
+            if(!block) break;
+        }
     }
 
     // appropriately update the file descriptor position and status flags
     if(readCount) {
+        lxfsTouchFile(mp, file, time(NULL), 0);
+
         res->position += readCount;
         res->length = readCount;
         res->header.header.status = readCount;
@@ -0,0 +1,179 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lxfsFillSlot(): places a block that was read outside of the cache in the cache
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: data - block contents as read from the device
+ * params: prefetched - non-zero if the block was read ahead of being needed
+ * returns: nothing
+ */
+
+void lxfsFillSlot(Mountpoint *mp, uint64_t block, const void *data, int prefetched) {
+    uint64_t tag = block / CACHE_SIZE;
+    uint64_t index = block % CACHE_SIZE;
+
+    // never replace a cached copy of the same block, it may be newer than disk
+    if(mp->cache[index].valid && (mp->cache[index].tag == tag)) return;
+
+    // and don't discard dirty data that we failed to write back
+    if(mp->cache[index].valid && mp->cache[index].dirty) {
+        if(lxfsFlushSlot(mp, index)) return;
+    }
+
+    if(mp->cache[index].valid && mp->cache[index].prefetched)
+        mp->raWasted++;
+
+    if(!lxfsCacheBuffer(mp, index)) {
+        mp->cache[index].valid = 0;
+        return;
+    }
+
+    memcpy(mp->cache[index].data, data, mp->blockSizeBytes);
+    lxfsJournalOverlay(mp, block, 1, mp->cache[index].data);
+    mp->cache[index].valid = 1;
+    mp->cache[index].dirty = 0;
+    mp->cache[index].prefetched = prefetched;
+    mp->cache[index].logged = 0;
+    mp->cache[index].tag = tag;
+}
+
+/* lxfsCachedRun(): helper function to check if a run of blocks is already cached
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks
+ * returns: one if every block is cached, zero otherwise
+ */
+
+static int lxfsCachedRun(Mountpoint *mp, uint64_t block, uint64_t count) {
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t index = (block + i) % CACHE_SIZE;
+        if(!mp->cache[index].valid || (mp->cache[index].tag != (block + i) / CACHE_SIZE))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* lxfsPrefetch(): reads blocks of a file into the cache, coalescing
+ * physically contiguous runs into single device reads
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: first - file-relative index of the first block to prefetch
+ * params: count - number of blocks to prefetch
+ * returns: number of blocks covered
+ */
+
+uint64_t lxfsPrefetch(Mountpoint *mp, uint64_t meta, uint64_t first, uint64_t count) {
+    uint64_t maxRun = READAHEAD_MAX / mp->blockSizeBytes;
+    if(!maxRun) maxRun = 1;
+
+    uint64_t total = 0;
+    while(count) {
+        // runs come straight from the extents of the file
+        uint64_t run;
+        uint64_t start = lxfsChainRun(mp, meta, first + total, &run);
+        if(!start || (start == LXFS_BLOCK_EOF)) break;
+
+        if(run > count) run = count;
+        if(run > maxRun) run = maxRun;
+
+        // read ahead in the background when the device allows it
+        if(!lxfsCachedRun(mp, start, run) && lxfsSubmitRead(mp, start, run, 1)) {
+            if(lxfsReadBlocks(mp, start, run, mp->raBuffer)) return total;
+            for(uint64_t i = 0; i < run; i++)
+                lxfsFillSlot(mp, start + i, mp->raBuffer + (i * mp->blockSizeBytes), 1);
+        }
+
+        total += run;
+        count -= run;
+    }
+
+    return total;
+}
+
+/* lxfsReadAheadReset(): resets the read-ahead state of a file
+ * params: mp - mountpoint
+ * params: ra - read-ahead state
+ * returns: nothing
+ */
+
+void lxfsReadAheadReset(Mountpoint *mp, ReadAhead *ra) {
+    // assume files are read from the start until proven otherwise
+    memset(ra, 0, sizeof(ReadAhead));
+    ra->window = READAHEAD_MIN / mp->blockSizeBytes;
+    if(!ra->window) ra->window = 1;
+    ra->wasted = mp->raWasted;
+}
+
+/* lxfsReadAhead(): detects sequential access and reads ahead of a file read
+ * params: mp - mountpoint
+ * params: ra - read-ahead state of the file, NULL if not tracked
+ * params: meta - metadata block of the file
+ * params: position - file position of the read
+ * params: length - number of bytes to be read
+ * returns: nothing, blocks are placed in the cache
+ */
+
+void lxfsReadAhead(Mountpoint *mp, ReadAhead *ra, uint64_t meta, off_t position, size_t length) {
+    if(!length) return;
+
+    uint64_t first = position / mp->blockSizeBytes;
+    uint64_t last = (position + length - 1) / mp->blockSizeBytes;
+    uint64_t count = last - first + 1;
+
+    uint64_t minWindow = READAHEAD_MIN / mp->blockSizeBytes;
+    uint64_t maxWindow = READAHEAD_MAX / mp->blockSizeBytes;
+    if(!minWindow) minWindow = 1;
+    if(!maxWindow) maxWindow = 1;
+
+    if(!ra) {
+        // file isn't tracked, but still coalesce the read itself
+        if(count > 1) lxfsPrefetch(mp, meta, first, count);
+        return;
+    }
+
+    if(ra->expected != position) {
+        // random access, collapse the window and only read what was requested
+        ra->expected = position + length;
+        ra->window = minWindow;
+        ra->start = first;
+        ra->end = first;
+        ra->wasted = mp->raWasted;
+
+        if(count > 1) lxfsPrefetch(mp, meta, first, count);
+        return;
+    }
+
+    ra->expected = position + length;
+
+    // nothing to do while the reader is still well inside the last window
+    if((last + (ra->window / 2)) < ra->end) return;
+
+    // adapt the window: shrink it when read-ahead blocks were evicted before
+    // they were used, and grow it when the previous window was consumed
+    if(mp->raWasted > ra->wasted) {
+        ra->window /= 2;
+        if(ra->window < minWindow) ra->window = minWindow;
+    } else if(ra->end > ra->start) {
+        ra->window *= 2;
+        if(ra->window > maxWindow) ra->window = maxWindow;
+    }
+
+    ra->wasted = mp->raWasted;
+
+    uint64_t start = (ra->end > first) ? ra->end : first;
+    uint64_t end = start + ra->window;
+    if(end <= last) end = last + 1;
+
+    ra->start = start;
+    ra->end = start + lxfsPrefetch(mp, meta, start, end - start);
+}
\ No newline at end of file
@@ -0,0 +1,569 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <errno.h>
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Deduplication: the block table links every block to exactly one successor,
+ * so two chains can only ever have their tails in common, and what is shared
+ * is the whole data chain of files with the same contents. A file is hashed
+ * when it is closed after being written, or on request through ioctl(), and
+ * looked up in an index of files hashed before; on a match both files are
+ * compared in full, and only then is the chain of the new one freed and its
+ * metadata block linked to the chain of the other. Files sharing a chain form
+ * a ring on disk, see lxfs.h. The index is a direct-mapped table in memory,
+ * so a file that was pushed out of it by another is simply not matched until
+ * it is hashed again. Since identical files now read the same blocks, the
+ * cache only ever holds one copy of them. */
+
+#define PRIME64_1   0x9E3779B185EBCA87
+#define PRIME64_2   0xC2B2AE3D27D4EB4F
+#define PRIME64_3   0x165667B19E3779F9
+#define PRIME64_4   0x85EBCA77C2B2AE63
+#define PRIME64_5   0x27D4EB2F165667C5
+
+/* XXH64 of the contents of a file, fed a chunk at a time; every chunk but the
+ * last is a multiple of 32 bytes, which any run of blocks is */
+typedef struct {
+    uint64_t v[4];
+    uint64_t length;
+} DedupHash;
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static void lxfsHashStart(DedupHash *hash) {
+    hash->v[0] = PRIME64_1 + PRIME64_2;
+    hash->v[1] = PRIME64_2;
+    hash->v[2] = 0;
+    hash->v[3] = -PRIME64_1;
+    hash->length = 0;
+}
+
+/* lxfsHashUpdate(): helper function to hash the whole stripes of a chunk
+ * params: hash - hash state
+ * params: data - chunk of data
+ * params: size - size of the chunk
+ * returns: number of bytes left over after the last whole stripe
+ */
+
+static size_t lxfsHashUpdate(DedupHash *hash, const uint8_t *data, size_t size) {
+    size_t i;
+    for(i = 0; (i + 32) <= size; i += 32) {
+        hash->v[0] = round64(hash->v[0], read64(data + i));
+        hash->v[1] = round64(hash->v[1], read64(data + i + 8));
+        hash->v[2] = round64(hash->v[2], read64(data + i + 16));
+        hash->v[3] = round64(hash->v[3], read64(data + i + 24));
+    }
+
+    hash->length += size;
+    return size - i;
+}
+
+/* lxfsHashEnd(): helper function to finish a hash
+ * params: hash - hash state, after the last chunk was passed to lxfsHashUpdate()
+ * params: tail - bytes left over after the last whole stripe
+ * params: size - number of bytes left over
+ * returns: hash
+ */
+
+static uint64_t lxfsHashEnd(DedupHash *hash, const uint8_t *tail, size_t size) {
+    uint64_t h;
+    if(hash->length >= 32) {
+        h = rotl(hash->v[0], 1) + rotl(hash->v[1], 7) + rotl(hash->v[2], 12) + rotl(hash->v[3], 18);
+        for(int i = 0; i < 4; i++) {
+            h ^= round64(0, hash->v[i]);
+            h = (h * PRIME64_1) + PRIME64_4;
+        }
+    } else {
+        h = PRIME64_5;
+    }
+
+    h += hash->length;
+
+    for(; size >= 8; tail += 8, size -= 8) {
+        h ^= round64(0, read64(tail));
+        h = (rotl(h, 27) * PRIME64_1) + PRIME64_4;
+    }
+
+    if(size >= 4) {
+        h ^= (uint64_t) read32(tail) * PRIME64_1;
+        h = (rotl(h, 23) * PRIME64_2) + PRIME64_3;
+        tail += 4;
+        size -= 4;
+    }
+
+    for(; size; tail++, size--) {
+        h ^= *tail * PRIME64_5;
+        h = rotl(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* lxfsShareGet(): reads the share record of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: share - buffer to store the record, zeroed if the file isn't shared
+ * returns: zero on success
+ */
+
+int lxfsShareGet(Mountpoint *mp, uint64_t meta, LXFSShare *share) {
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 1;
+
+    memcpy(share, (const void *)((uintptr_t) data + LXFS_SHARE_OFFSET), sizeof(LXFSShare));
+    if((share->magic != LXFS_SHARE_MAGIC) || !share->prev || !share->next ||
+    (share->prev >= mp->volumeSize) || (share->next >= mp->volumeSize))
+        memset(share, 0, sizeof(LXFSShare));
+    return 0;
+}
+
+/* lxfsShareSet(): helper function to write the share record of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: share - record to write, NULL to clear it
+ * returns: zero on success
+ */
+
+static int lxfsShareSet(Mountpoint *mp, uint64_t meta, const LXFSShare *share) {
+    void *data = lxfsModifyBlock(mp, meta, 1);
+    if(!data) return 1;
+
+    void *record = (void *)((uintptr_t) data + LXFS_SHARE_OFFSET);
+    if(share) memcpy(record, share, sizeof(LXFSShare));
+    else memset(record, 0, sizeof(LXFSShare));
+    return lxfsJournalBlock(mp, meta);
+}
+
+/* lxfsShareLeave(): helper function to remove a file from its ring
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: share - share record of the file
+ * returns: zero on success
+ */
+
+static int lxfsShareLeave(Mountpoint *mp, uint64_t meta, const LXFSShare *share) {
+    if(share->prev == share->next) {
+        // the one file left keeps the chain to itself
+        if(lxfsShareSet(mp, share->next, NULL)) return 1;
+    } else {
+        LXFSShare neighbour;
+        if(lxfsShareGet(mp, share->prev, &neighbour)) return 1;
+        neighbour.next = share->next;
+        if(lxfsShareSet(mp, share->prev, &neighbour)) return 1;
+
+        if(lxfsShareGet(mp, share->next, &neighbour)) return 1;
+        neighbour.prev = share->prev;
+        if(lxfsShareSet(mp, share->next, &neighbour)) return 1;
+    }
+
+    return lxfsShareSet(mp, meta, NULL);
+}
+
+/* lxfsShareJoin(): helper function to add a file to the ring of another
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file joining
+ * params: other - metadata block of a file in the ring, which may be alone
+ * returns: zero on success
+ */
+
+static int lxfsShareJoin(Mountpoint *mp, uint64_t meta, uint64_t other) {
+    LXFSShare share;
+    if(lxfsShareGet(mp, other, &share)) return 1;
+    if(!share.magic) {
+        share.magic = LXFS_SHARE_MAGIC;
+        share.prev = other;
+        share.next = other;
+    }
+
+    LXFSShare joining;
+    memset(&joining, 0, sizeof(LXFSShare));
+    joining.magic = LXFS_SHARE_MAGIC;
+    joining.prev = other;
+    joining.next = share.next;
+
+    if(share.next == other) {
+        share.prev = meta;
+    } else {
+        LXFSShare neighbour;
+        if(lxfsShareGet(mp, share.next, &neighbour)) return 1;
+        neighbour.prev = meta;
+        if(lxfsShareSet(mp, share.next, &neighbour)) return 1;
+    }
+
+    share.next = meta;
+    if(lxfsShareSet(mp, other, &share)) return 1;
+    return lxfsShareSet(mp, meta, &joining);
+}
+
+/* lxfsShareRelink(): helper function to point a file at a new chain
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: first - first data block, LXFS_BLOCK_EOF if none
+ * returns: zero on success
+ */
+
+static int lxfsShareRelink(Mountpoint *mp, uint64_t meta, uint64_t first) {
+    if(lxfsSetNextBlock(mp, meta, first)) return 1;
+    lxfsChainRebuild(mp, meta);
+    lxfsCursorForget(mp, meta);
+
+    // the file no longer ends where its reservations were made
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta) file->reserveCount = 0;
+            file = file->next;
+        }
+    }
+
+    return 0;
+}
+
+/* lxfsShareRead(): helper function to read data blocks of a file, taking
+ * those that are cached from the cache
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: n - file-relative index of the first block
+ * params: count - number of blocks
+ * params: buffer - buffer to read into
+ * returns: zero on success
+ */
+
+static int lxfsShareRead(Mountpoint *mp, uint64_t meta, uint64_t n, uint64_t count, void *buffer) {
+    while(count) {
+        uint64_t run;
+        uint64_t block = lxfsChainRun(mp, meta, n, &run);
+        if(!block || (block == LXFS_BLOCK_EOF)) return 1;
+        if(run > count) run = count;
+
+        // cached blocks may be newer than the disk, the rest are read together
+        uint64_t i = 0;
+        while(i < run) {
+            uint64_t index = (block + i) % CACHE_SIZE;
+            if(mp->cache[index].valid && (mp->cache[index].tag == ((block + i) / CACHE_SIZE))) {
+                memcpy((void *)((uintptr_t) buffer + (i * mp->blockSizeBytes)),
+                       mp->cache[index].data, mp->blockSizeBytes);
+                i++;
+                continue;
+            }
+
+            uint64_t missing = 1;
+            while((i + missing) < run) {
+                index = (block + i + missing) % CACHE_SIZE;
+                if(mp->cache[index].valid && (mp->cache[index].tag == ((block + i + missing) / CACHE_SIZE)))
+                    break;
+                missing++;
+            }
+
+            if(lxfsReadBlocks(mp, block + i, missing, (void *)((uintptr_t) buffer + (i * mp->blockSizeBytes))))
+                return 1;
+            i += missing;
+        }
+
+        buffer = (void *)((uintptr_t) buffer + (run * mp->blockSizeBytes));
+        n += run;
+        count -= run;
+    }
+
+    return 0;
+}
+
+/* lxfsShareBlocks(): helper function to count the data blocks of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: number of data blocks
+ */
+
+static uint64_t lxfsShareBlocks(Mountpoint *mp, uint64_t meta) {
+    uint64_t blocks;
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(index) return index->blocks;
+
+    lxfsExtents(mp, meta, &blocks);
+    return blocks;
+}
+
+/* lxfsUnshare(): gives a file that shares its data blocks a copy of its own,
+ * to be called before the data or the chain of the file is changed
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: keep - number of data blocks to copy, the rest are left behind
+ * returns: zero on success, including when the file isn't shared
+ */
+
+int lxfsUnshare(Mountpoint *mp, uint64_t meta, uint64_t keep) {
+    if(!mp->dedup) return 0;
+
+    LXFSShare share;
+    if(lxfsShareGet(mp, meta, &share)) return 1;
+    if(!share.magic) return 0;
+
+    // the copy is taken from the next file in the ring, which keeps the chain
+    uint64_t blocks = lxfsShareBlocks(mp, share.next);
+    if(keep < blocks) blocks = keep;
+
+    uint64_t copy = LXFS_BLOCK_EOF;
+    if(blocks) {
+        copy = lxfsAllocate(mp, blocks, meta + 1, NULL);
+        if(!copy) return 1;
+
+        uint64_t chunk = READAHEAD_MAX / mp->blockSizeBytes;
+        uint64_t block = copy;
+        for(uint64_t n = 0; n < blocks; n += chunk) {
+            uint64_t count = ((blocks - n) < chunk) ? (blocks - n) : chunk;
+            if(lxfsShareRead(mp, share.next, n, count, mp->raBuffer)) goto fail;
+
+            // and written out along the new chain a run at a time
+            uint64_t i = 0;
+            while(i < count) {
+                uint64_t run = 1;
+                while(((i + run) < count) && (lxfsNextBlock(mp, block + run - 1) == (block + run)))
+                    run++;
+
+                if(lxfsWriteBlocks(mp, block, run, (const void *)((uintptr_t) mp->raBuffer +
+                                   (i * mp->blockSizeBytes))))
+                    goto fail;
+
+                i += run;
+                block = lxfsNextBlock(mp, block + run - 1);
+            }
+        }
+    }
+
+    if(lxfsShareLeave(mp, meta, &share)) goto fail;
+    return lxfsShareRelink(mp, meta, copy);
+
+fail:
+    if(copy != LXFS_BLOCK_EOF) lxfsFreeChain(mp, copy);
+    return 1;
+}
+
+/* lxfsShareMove(): moves the data chain of a file and of every file sharing
+ * it to a new copy
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: first - first block of the copy
+ * returns: zero on success
+ */
+
+int lxfsShareMove(Mountpoint *mp, uint64_t meta, uint64_t first) {
+    LXFSShare share;
+    if(!mp->dedup) memset(&share, 0, sizeof(LXFSShare));
+    else if(lxfsShareGet(mp, meta, &share)) return 1;
+
+    if(!share.magic) return lxfsSetNextBlock(mp, meta, first);
+
+    uint64_t limit = mp->volumeSize;
+    uint64_t file = meta;
+    do {
+        if(lxfsShareRelink(mp, file, first) || lxfsShareGet(mp, file, &share)) return 1;
+        file = share.next;
+        limit--;
+    } while(share.magic && (file != meta) && limit);
+
+    return 0;
+}
+
+/* lxfsDedupCandidate(): helper function to check that a file can share its
+ * data blocks, with the size and attributes that are on disk
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: size - pointer to store the size of the file
+ * returns: non-zero if the file can be shared
+ */
+
+static int lxfsDedupCandidate(Mountpoint *mp, uint64_t meta, uint64_t *size) {
+    lxfsFlushFiles(mp, meta);
+
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 0;
+
+    const LXFSFileHeader *header = (const LXFSFileHeader *) data;
+    const LXFSUnwritten *unwritten = (const LXFSUnwritten *)((uintptr_t) data + sizeof(LXFSFileHeader));
+    if(!header->refCount || !header->size || unwritten->count) return 0;
+
+    // inline and compressed files don't map their data to blocks one to one
+    if(lxfsIsInline(mp, data) || lxfsUnitTable(mp, data)) return 0;
+    *size = header->size;
+
+    uint64_t first = lxfsNextBlock(mp, meta);
+    if(!first || (first == LXFS_BLOCK_EOF) || (first >= mp->volumeSize)) return 0;
+
+    return lxfsShareBlocks(mp, meta) >= ((*size + mp->blockSizeBytes - 1) / mp->blockSizeBytes);
+}
+
+/* lxfsDedupHash(): helper function to hash the contents of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: size - size of the file
+ * params: hash - pointer to store the hash
+ * returns: zero on success
+ */
+
+static int lxfsDedupHash(Mountpoint *mp, uint64_t meta, uint64_t size, uint64_t *hash) {
+    DedupHash state;
+    lxfsHashStart(&state);
+
+    uint64_t chunk = READAHEAD_MAX / mp->blockSizeBytes;
+    uint64_t blocks = (size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    uint64_t bytes = 0;
+    size_t left = 0;
+    for(uint64_t n = 0; n < blocks; n += chunk) {
+        uint64_t count = ((blocks - n) < chunk) ? (blocks - n) : chunk;
+        if(lxfsShareRead(mp, meta, n, count, mp->raBuffer)) return 1;
+
+        // only the bytes within the size count, the rest of the last block is slack
+        bytes = count * mp->blockSizeBytes;
+        if(bytes > (size - (n * mp->blockSizeBytes))) bytes = size - (n * mp->blockSizeBytes);
+        left = lxfsHashUpdate(&state, mp->raBuffer, bytes);
+    }
+
+    // the stripes left over are still in the buffer after the last chunk
+    *hash = lxfsHashEnd(&state, (const uint8_t *) mp->raBuffer + bytes - left, left);
+    return 0;
+}
+
+/* lxfsDedupCompare(): helper function to compare the contents of two files
+ * params: mp - mountpoint
+ * params: a, b - metadata blocks of the files
+ * params: size - size of both files
+ * returns: zero if the contents are the same, positive if they differ,
+ * negative on I/O error
+ */
+
+static int lxfsDedupCompare(Mountpoint *mp, uint64_t a, uint64_t b, uint64_t size) {
+    uint64_t chunk = READAHEAD_MAX / mp->blockSizeBytes;
+    void *other = malloc(READAHEAD_MAX);
+    if(!other) return -1;
+
+    int status = 0;
+    uint64_t blocks = (size + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    for(uint64_t n = 0; !status && (n < blocks); n += chunk) {
+        uint64_t count = ((blocks - n) < chunk) ? (blocks - n) : chunk;
+        if(lxfsShareRead(mp, a, n, count, mp->raBuffer) || lxfsShareRead(mp, b, n, count, other)) {
+            status = -1;
+            break;
+        }
+
+        uint64_t bytes = count * mp->blockSizeBytes;
+        if(bytes > (size - (n * mp->blockSizeBytes))) bytes = size - (n * mp->blockSizeBytes);
+        if(memcmp(mp->raBuffer, other, bytes)) status = 1;
+    }
+
+    free(other);
+    return status;
+}
+
+/* lxfsDedup(): shares the data blocks of a file with a file of the same
+ * contents that was hashed before, or remembers the file for later ones
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: freed - pointer to store the number of data blocks freed
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsDedup(Mountpoint *mp, OpenFile *file, uint64_t *freed) {
+    *freed = 0;
+    if(!mp->dedup) return -ENODEV;
+
+    uint64_t meta = file->entry.block;
+    uint64_t size;
+    if(!lxfsDedupCandidate(mp, meta, &size)) return 0;
+
+    if(!mp->dedupIndex) {
+        mp->dedupIndex = calloc(DEDUP_INDEX_SIZE, sizeof(DedupRecord));
+        if(!mp->dedupIndex) return -ENOMEM;
+    }
+
+    uint64_t hash;
+    if(lxfsDedupHash(mp, meta, size, &hash)) return -EIO;
+
+    DedupRecord *record = &mp->dedupIndex[hash % DEDUP_INDEX_SIZE];
+    uint64_t other = record->meta;
+    uint64_t otherSize;
+
+    // the file takes the place of whatever was indexed unless it joins it
+    if(!other || (other == meta) || (record->hash != hash) || (record->size != size) ||
+    !lxfsDedupCandidate(mp, other, &otherSize) || (otherSize != size) ||
+    (lxfsNextBlock(mp, other) == lxfsNextBlock(mp, meta))) {
+        record->hash = hash;
+        record->size = size;
+        record->meta = meta;
+        return 0;
+    }
+
+    // a file that already shares is left where it is
+    LXFSShare share;
+    if(lxfsShareGet(mp, meta, &share)) return -EIO;
+    if(share.magic) return 0;
+
+    // a matching hash is only a hint, the contents have to be the same
+    int status = lxfsDedupCompare(mp, meta, other, size);
+    if(status < 0) return -EIO;
+    if(status) {
+        record->meta = meta;
+        return 0;
+    }
+
+    // switch the file over to the shared chain before its own is released
+    uint64_t blocks = lxfsShareBlocks(mp, meta);
+    uint64_t first = lxfsNextBlock(mp, meta);
+    if(lxfsShareJoin(mp, meta, other) || lxfsShareRelink(mp, meta, lxfsNextBlock(mp, other)))
+        return -EIO;
+
+    lxfsFreeChain(mp, first);
+
+    luxLogf(KPRINT_LEVEL_DEBUG, "%s: %s shares %d blocks with the file at block %d\n",
+            mp->device, file->path, (int) blocks, (int) other);
+
+    *freed = blocks;
+    return 0;
+}
+
+/* lxfsDedupForget(): removes a file whose metadata block was freed from the
+ * deduplication index
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * returns: nothing
+ */
+
+void lxfsDedupForget(Mountpoint *mp, uint64_t meta) {
+    if(!mp->dedupIndex) return;
+
+    for(int i = 0; i < DEDUP_INDEX_SIZE; i++) {
+        if(mp->dedupIndex[i].meta == meta) mp->dedupIndex[i].meta = 0;
+    }
+}
\ No newline at end of file
@@ -25,7 +25,9 @@ void lxfsStat(StatCommand *cmd) {
 
     // and the file entry
     LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, cmd->path, NULL, NULL)) {
+    uint64_t dirBlock = 0;
+    off_t dirOffset = 0;
+    if(!lxfsFind(&entry, mp, cmd->path, &dirBlock, &dirOffset)) {
         cmd->header.header.status = -ENOENT;
         luxSendKernel(cmd);
         return;
@@ -39,6 +41,11 @@ void lxfsStat(StatCommand *cmd) {
         return;
     }
 
+    // open files may have attributes that were not written back yet
+    uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+    if((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK))
+        lxfsPendingAttributes(mp, &entry, dirBlock, dirOffset, (LXFSFileHeader *) mp->meta);
+
     // now construct the stat structure
     cmd->buffer.st_atime = entry.accessTime;
     cmd->buffer.st_mtime = entry.modTime;
@@ -49,9 +56,13 @@ void lxfsStat(StatCommand *cmd) {
     cmd->buffer.st_dev = mp->fd;
     cmd->buffer.st_rdev = mp->fd;
     cmd->buffer.st_ino = first;
+
+    // files sharing their data blocks are told apart by their metadata instead
+    if(mp->dedup && ((type == LXFS_DIR_TYPE_FILE) || (type == LXFS_DIR_TYPE_HARD_LINK)) &&
+    (((LXFSShare *)((uintptr_t) mp->meta + LXFS_SHARE_OFFSET))->magic == LXFS_SHARE_MAGIC))
+        cmd->buffer.st_ino = entry.block;
     
     // parse the mode
-    uint8_t type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
     switch(type) {
     case LXFS_DIR_TYPE_DIR:
         LXFSDirectoryHeader *dirMeta = (LXFSDirectoryHeader *) mp->meta;
@@ -74,7 +85,9 @@ void lxfsStat(StatCommand *cmd) {
     default:
         LXFSFileHeader *fileMeta = (LXFSFileHeader *) mp->meta;
         cmd->buffer.st_mode = S_IFREG;
-        cmd->buffer.st_blocks = (fileMeta->size+mp->blockSizeBytes-1) / mp->blockSizeBytes;
+        if(lxfsIsInline(mp, mp->meta)) cmd->buffer.st_blocks = 0;
+        else if(lxfsUnitTable(mp, mp->meta)) cmd->buffer.st_blocks = lxfsCompressedBlocks(mp, entry.block);
+        else cmd->buffer.st_blocks = (fileMeta->size+mp->blockSizeBytes-1) / mp->blockSizeBytes;
         cmd->buffer.st_size = fileMeta->size;
         cmd->buffer.st_nlink = fileMeta->refCount;
     }
@@ -0,0 +1,171 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <stdlib.h>
+
+/* Pinned block table: every chain walk and allocation goes through the block
+ * table, so rather than competing with file data for the cache, where a large
+ * read can evict it, the whole table is read into memory at mount and stays
+ * there. A lookup is then an array index. Modified blocks of the table, or
+ * pages, are flagged dirty and written back together with the cache, which
+ * merges runs of dirty pages into single writes straight from the array. The
+ * journal treats pages like cache slots: they are logged from the array, and
+ * flagged as logged until they are modified again. Volumes whose table is too
+ * large to pin, or that couldn't allocate it, reach the table through the
+ * cache as before. */
+
+/* lxfsTableLoad(): reads the block table of a volume into memory
+ * params: mp - mountpoint
+ * returns: zero on success, including when the table is left in the cache
+ */
+
+int lxfsTableLoad(Mountpoint *mp) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+    uint64_t blocks = (mp->volumeSize + entries - 1) / entries;
+    if((blocks * mp->blockSizeBytes) > TABLE_PINNED_MAX) return 0;
+
+    uint64_t *table = malloc(blocks * mp->blockSizeBytes);
+    uint8_t *pages = calloc(blocks, 1);
+    if(!table || !pages) {
+        free(table);
+        free(pages);
+        return 0;
+    }
+
+    uint64_t run = WRITEBACK_MAX / mp->blockSizeBytes;
+    for(uint64_t i = 0; i < blocks; i += run) {
+        uint64_t count = ((blocks - i) < run) ? (blocks - i) : run;
+        if(lxfsDeviceRead(mp, LXFS_TABLE_START + i, count, (void *)((uintptr_t) table + (i * mp->blockSizeBytes)))) {
+            free(table);
+            free(pages);
+            return 1;
+        }
+    }
+
+    mp->table = table;
+    mp->tableBlocks = blocks;
+    mp->tablePages = pages;
+    return 0;
+}
+
+/* lxfsTablePage(): returns the pinned copy of a block of the block table
+ * params: mp - mountpoint
+ * params: block - block number
+ * returns: pointer to the page, NULL if the block isn't a pinned table block
+ */
+
+void *lxfsTablePage(Mountpoint *mp, uint64_t block) {
+    if(!mp->table || (block < LXFS_TABLE_START) || (block >= (LXFS_TABLE_START + mp->tableBlocks))) return NULL;
+    return (void *)((uintptr_t) mp->table + ((block - LXFS_TABLE_START) * mp->blockSizeBytes));
+}
+
+/* lxfsTableEntry(): returns the entry of a block in the block table, from the
+ * pinned table if there is one and from its cached table block otherwise
+ * params: mp - mountpoint
+ * params: block - block number
+ * params: modify - non-zero if the caller is about to change the entry
+ * returns: pointer to the entry, valid until the next cache operation, NULL on fail
+ */
+
+uint64_t *lxfsTableEntry(Mountpoint *mp, uint64_t block, int modify) {
+    uint64_t entries = mp->blockSizeBytes / 8;
+
+    if(!mp->table) {
+        uint64_t *data = modify ? lxfsModifyBlock(mp, LXFS_TABLE_START + (block / entries), 1) :
+            (uint64_t *) lxfsPeekBlock(mp, LXFS_TABLE_START + (block / entries));
+        if(!data) return NULL;
+        return &data[block % entries];
+    }
+
+    if(block >= mp->volumeSize) return NULL;
+
+    if(modify) {
+        uint8_t *page = &mp->tablePages[block / entries];
+        if(!(*page & TABLE_PAGE_DIRTY)) {
+            if(!mp->tableDirtyPages) mp->tableDirtied = mp->clock;
+            mp->tableDirtyPages++;
+        }
+
+        *page = TABLE_PAGE_DIRTY;   // and no longer the same as in the journal
+    }
+
+    return &mp->table[block];
+}
+
+/* lxfsTableLogged(): checks if a page is unmodified since it was copied to the
+ * journal, or flags it as such
+ * params: mp - mountpoint
+ * params: block - block number of the page
+ * params: set - non-zero to flag the page as logged
+ * returns: non-zero if the page is logged
+ */
+
+int lxfsTableLogged(Mountpoint *mp, uint64_t block, int set) {
+    uint8_t *page = &mp->tablePages[block - LXFS_TABLE_START];
+    if(set) *page |= TABLE_PAGE_LOGGED;
+    return (*page & TABLE_PAGE_LOGGED) != 0;
+}
+
+/* lxfsTableWriteRun(): helper function to write back a run of pages
+ * params: mp - mountpoint
+ * params: first - index of the first page
+ * params: count - number of pages
+ * returns: zero on success
+ */
+
+static int lxfsTableWriteRun(Mountpoint *mp, uint64_t first, uint64_t count) {
+    const void *data = (const void *)((uintptr_t) mp->table + (first * mp->blockSizeBytes));
+    if(lxfsDeviceWrite(mp, LXFS_TABLE_START + first, count, data)) return 1;
+
+    for(uint64_t i = first; i < (first + count); i++) {
+        if(mp->tablePages[i] & TABLE_PAGE_DIRTY) {
+            mp->tablePages[i] &= ~TABLE_PAGE_DIRTY;
+            mp->tableDirtyPages--;
+        }
+    }
+
+    return 0;
+}
+
+/* lxfsTableFlush(): writes back a page of the block table if it is dirty
+ * params: mp - mountpoint
+ * params: block - block number of the page
+ * returns: zero on success
+ */
+
+int lxfsTableFlush(Mountpoint *mp, uint64_t block) {
+    if(!(mp->tablePages[block - LXFS_TABLE_START] & TABLE_PAGE_DIRTY)) return 0;
+    return lxfsTableWriteRun(mp, block - LXFS_TABLE_START, 1);
+}
+
+/* lxfsTableWriteback(): writes back every dirty page of the block table,
+ * merging neighbouring pages into single device writes
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsTableWriteback(Mountpoint *mp) {
+    uint64_t maxRun = WRITEBACK_MAX / mp->blockSizeBytes;
+    uint64_t i = 0;
+    while(mp->tableDirtyPages && (i < mp->tableBlocks)) {
+        if(!(mp->tablePages[i] & TABLE_PAGE_DIRTY)) {
+            i++;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while(((i + run) < mp->tableBlocks) && (run < maxRun) && (mp->tablePages[i + run] & TABLE_PAGE_DIRTY))
+            run++;
+
+        if(lxfsTableWriteRun(mp, i, run)) return 1;
+        i += run;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,343 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <liblux/liblux.h>
+#include <lxfs/lxfs.h>
+#include <string.h>
+#include <errno.h>
+
+/* Unwritten blocks: blocks allocated ahead of being written, by preallocation
+ * or by a write past the end of a file, are recorded as runs in the metadata
+ * block of the file following its header. They hold whatever was on disk and
+ * are never read, but read back as zeros until they are first written to, so
+ * extending a file doesn't have to write zero blocks. Only when the table is
+ * full are the blocks actually zeroed on disk. */
+
+/* lxfsFlagUnwritten(): helper function to update every open instance of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: unwritten - non-zero if the file has unwritten blocks
+ * returns: nothing
+ */
+
+static void lxfsFlagUnwritten(Mountpoint *mp, uint64_t meta, int unwritten) {
+    for(int i = 0; i < OPEN_FILE_BUCKETS; i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(file->entry.block == meta) file->unwritten = unwritten;
+            file = file->next;
+        }
+    }
+}
+
+/* lxfsChainLength(): helper function to count the data blocks of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: last - pointer to store the last block, the metadata block if none
+ * returns: number of data blocks
+ */
+
+static uint64_t lxfsChainLength(Mountpoint *mp, uint64_t meta, uint64_t *last) {
+    ChainIndex *index = lxfsChainIndex(mp, meta);
+    if(index) {
+        *last = index->blocks ? lxfsChainBlock(mp, meta, index->blocks - 1) : meta;
+        return index->blocks;
+    }
+
+    uint64_t count = 0;
+    uint64_t block = meta;
+    uint64_t next = lxfsNextBlock(mp, meta);
+    while(next && (next != LXFS_BLOCK_EOF)) {
+        block = next;
+        next = lxfsNextBlock(mp, next);
+        count++;
+    }
+
+    *last = block;
+    return count;
+}
+
+/* lxfsGetUnwritten(): copies the table of unwritten blocks of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: table - buffer to copy the table into
+ * returns: zero on success
+ */
+
+int lxfsGetUnwritten(Mountpoint *mp, uint64_t meta, LXFSUnwritten *table) {
+    const void *data = lxfsPeekBlock(mp, meta);
+    if(!data) return 1;
+
+    memcpy(table, (const void *)((uintptr_t)data + sizeof(LXFSFileHeader)), sizeof(LXFSUnwritten));
+    if(table->count > LXFS_UNWRITTEN_MAX) table->count = 0;
+    return 0;
+}
+
+/* lxfsIsUnwritten(): checks if a block of a file was never written
+ * params: table - table of unwritten blocks of the file
+ * params: n - file-relative index of the block
+ * returns: one if unwritten, zero if not
+ */
+
+int lxfsIsUnwritten(const LXFSUnwritten *table, uint64_t n) {
+    for(uint64_t i = 0; i < table->count; i++) {
+        if((n >= table->runs[i].start) && (n < (table->runs[i].start + table->runs[i].count)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* lxfsZeroBlocks(): writes zeros to a range of blocks of a file
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: start - file-relative index of the first block
+ * params: count - number of blocks
+ * returns: zero on success
+ */
+
+int lxfsZeroBlocks(Mountpoint *mp, uint64_t meta, uint64_t start, uint64_t count) {
+    uint64_t chunk = READAHEAD_MAX / mp->blockSizeBytes;
+    memset(mp->raBuffer, 0, chunk * mp->blockSizeBytes);
+
+    uint64_t i = 0;
+    while(i < count) {
+        uint64_t block = lxfsChainBlock(mp, meta, start + i);
+        if(!block || (block == LXFS_BLOCK_EOF)) return 1;
+
+        uint64_t run = 1;
+        while(((i + run) < count) && (run < chunk) &&
+        (lxfsChainBlock(mp, meta, start + i + run) == (block + run)))
+            run++;
+
+        if(lxfsWriteBlocks(mp, block, run, mp->raBuffer)) return 1;
+        i += run;
+    }
+
+    return 0;
+}
+
+/* lxfsMarkUnwritten(): records a range of blocks of a file as unwritten
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: start - file-relative index of the first block
+ * params: count - number of blocks
+ * returns: zero on success, in which case the blocks read back as zeros
+ */
+
+int lxfsMarkUnwritten(Mountpoint *mp, uint64_t meta, uint64_t start, uint64_t count) {
+    if(!count) return 0;
+
+    void *data = lxfsModifyBlock(mp, meta, 1);
+    if(!data) return 1;
+
+    LXFSUnwritten *table = (LXFSUnwritten *)((uintptr_t)data + sizeof(LXFSFileHeader));
+    if(table->count > LXFS_UNWRITTEN_MAX) table->count = 0;
+
+    // ranges are appended at the end of the file, merge with the last run
+    if(table->count && ((table->runs[table->count-1].start + table->runs[table->count-1].count) == start)) {
+        table->runs[table->count-1].count += count;
+    } else if(table->count < LXFS_UNWRITTEN_MAX) {
+        table->runs[table->count].start = start;
+        table->runs[table->count].count = count;
+        table->count++;
+    } else {
+        // no room left to record the range, so zero it for real
+        return lxfsZeroBlocks(mp, meta, start, count);
+    }
+
+    lxfsFlagUnwritten(mp, meta, 1);
+    return 0;
+}
+
+/* lxfsMarkWritten(): removes a range of blocks of a file from its unwritten blocks
+ * params: mp - mountpoint
+ * params: meta - metadata block of the file
+ * params: start - file-relative index of the first block
+ * params: count - number of blocks
+ * returns: zero on success
+ */
+
+int lxfsMarkWritten(Mountpoint *mp, uint64_t meta, uint64_t start, uint64_t count) {
+    LXFSUnwritten copy;
+    if(lxfsGetUnwritten(mp, meta, &copy)) return 1;
+
+    // avoid dirtying the metadata block if nothing changes
+    int overlaps = 0;
+    for(uint64_t i = 0; i < copy.count; i++) {
+        if((start < (copy.runs[i].start + copy.runs[i].count)) && (copy.runs[i].start < (start + count)))
+            overlaps = 1;
+    }
+
+    if(!overlaps) return 0;
+
+    void *data = lxfsModifyBlock(mp, meta, 1);
+    if(!data) return 1;
+
+    LXFSUnwritten *table = (LXFSUnwritten *)((uintptr_t)data + sizeof(LXFSFileHeader));
+    uint64_t end = start + count;
+    uint64_t i = 0;
+    while(i < table->count) {
+        uint64_t runStart = table->runs[i].start;
+        uint64_t runEnd = runStart + table->runs[i].count;
+
+        if((end <= runStart) || (start >= runEnd)) {
+            i++;
+            continue;
+        }
+
+        if((start > runStart) && (end < runEnd)) {
+            // the write splits the run in two
+            if(table->count < LXFS_UNWRITTEN_MAX) {
+                memmove(&table->runs[i+2], &table->runs[i+1], (table->count - i - 1) * sizeof(table->runs[0]));
+                table->runs[i+1].start = end;
+                table->runs[i+1].count = runEnd - end;
+                table->count++;
+            } else {
+                // no room for the second half, zero it for real
+                if(lxfsZeroBlocks(mp, meta, end, runEnd - end)) return 1;
+
+                // looking up the chain may have evicted the metadata block
+                data = lxfsModifyBlock(mp, meta, 1);
+                if(!data) return 1;
+                table = (LXFSUnwritten *)((uintptr_t)data + sizeof(LXFSFileHeader));
+            }
+
+            table->runs[i].count = start - runStart;
+            i++;
+        } else if(start > runStart) {
+            table->runs[i].count = start - runStart;
+            i++;
+        } else if(end < runEnd) {
+            table->runs[i].start = end;
+            table->runs[i].count = runEnd - end;
+            i++;
+        } else {
+            // the run was written entirely
+            memmove(&table->runs[i], &table->runs[i+1], (table->count - i - 1) * sizeof(table->runs[0]));
+            table->count--;
+        }
+    }
+
+    if(!table->count) lxfsFlagUnwritten(mp, meta, 0);
+    return 0;
+}
+
+/* lxfsPrepareWrite(): prepares the unwritten blocks a write partially covers,
+ * which must read back as zeros around the written data
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position of the write
+ * params: length - length of the write
+ * returns: zero on success
+ */
+
+int lxfsPrepareWrite(Mountpoint *mp, OpenFile *file, off_t position, size_t length) {
+    LXFSUnwritten table;
+    if(lxfsGetUnwritten(mp, file->entry.block, &table)) return 1;
+
+    uint64_t edges[2];
+    edges[0] = position / mp->blockSizeBytes;
+    edges[1] = (position + length - 1) / mp->blockSizeBytes;
+
+    for(int i = 0; i < 2; i++) {
+        if(i && (edges[1] == edges[0])) break;
+        if(!lxfsIsUnwritten(&table, edges[i])) continue;
+
+        uint64_t block = lxfsChainBlock(mp, file->entry.block, edges[i]);
+        if(!block) return 1;
+        if(block == LXFS_BLOCK_EOF) continue;
+
+        // no need to read a block that holds no data
+        void *slot = lxfsModifyBlock(mp, block, 0);
+        if(!slot) return 1;
+        memset(slot, 0, mp->blockSizeBytes);
+    }
+
+    return 0;
+}
+
+/* lxfsZeroTail(): helper function to zero the last block of a file past its
+ * end, which may hold stale data that extending the file would expose
+ * params: mp - mountpoint
+ * params: file - open file
+ * returns: zero on success
+ */
+
+static int lxfsZeroTail(Mountpoint *mp, OpenFile *file) {
+    uint64_t offset = file->meta.size % mp->blockSizeBytes;
+    if(!offset) return 0;
+
+    uint64_t index = file->meta.size / mp->blockSizeBytes;
+    if(file->unwritten) {
+        LXFSUnwritten table;
+        if(lxfsGetUnwritten(mp, file->entry.block, &table)) return 1;
+        if(lxfsIsUnwritten(&table, index)) return 0;
+    }
+
+    uint64_t block = lxfsChainBlock(mp, file->entry.block, index);
+    if(!block) return 1;
+    if(block == LXFS_BLOCK_EOF) return 0;
+
+    void *slot = lxfsModifyBlock(mp, block, 1);
+    if(!slot) return 1;
+
+    // journaled, so the zeros never reach the disk later than the new size
+    memset((void *)((uintptr_t)slot + offset), 0, mp->blockSizeBytes - offset);
+    return lxfsJournalBlock(mp, block);
+}
+
+/* lxfsPreallocate(): allocates the blocks of a file up to an offset without
+ * writing them, so that they read back as zeros
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: end - offset in bytes the file must have blocks for
+ * returns: zero on success, negative error code on fail
+ */
+
+int lxfsPreallocate(Mountpoint *mp, OpenFile *file, uint64_t end) {
+    // inline files already have room up to their capacity
+    if(file->inlined) {
+        if(end <= lxfsInlineCapacity(mp)) return 0;
+
+        int status = lxfsInlineMigrate(mp, file);
+        if(status) return status;
+    }
+
+    // compressed files read back zeros from units that were never written
+    if(file->units) return 0;
+
+    uint64_t meta = file->entry.block;
+    if(lxfsUnshare(mp, meta, LXFS_BLOCK_EOF)) return -EIO;
+    if((end > file->meta.size) && lxfsZeroTail(mp, file)) return -EIO;
+
+    uint64_t last;
+    uint64_t have = lxfsChainLength(mp, meta, &last);
+    uint64_t need = (end + mp->blockSizeBytes - 1) / mp->blockSizeBytes;
+    if(need <= have) return 0;
+
+    // one allocation for the whole range, contiguous with the file if possible
+    uint64_t first = lxfsAllocate(mp, need - have, last + 1, file);
+    if(!first) return -ENOSPC;
+
+    if(lxfsSetNextBlock(mp, last, first)) {
+        lxfsFreeChain(mp, first);
+        return -EIO;
+    }
+
+    lxfsChainExtend(mp, meta);
+
+    if(lxfsMarkUnwritten(mp, meta, have, need - have)) {
+        // never expose blocks that hold stale data
+        lxfsSetNextBlock(mp, last, LXFS_BLOCK_EOF);
+        lxfsChainTruncate(mp, meta, have);
+        lxfsFreeChain(mp, first);
+        return -EIO;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -15,59 +15,165 @@
 #include <errno.h>
 #include <time.h>
 
+/* lxfsWriteChain(): helper function to write file data into a chain of blocks
+ * data is composed directly in the cache slots, and runs of whole contiguous
+ * blocks large enough are written straight to the device
+ * params: mp - mountpoint
+ * params: block - first block to write to
+ * params: offset - offset into the first block
+ * params: data - data to write
+ * params: length - number of bytes to write
+ * params: fresh - non-zero if the blocks were just allocated and hold no data
+ * params: last - pointer to store the last block written to
+ * returns: number of bytes written, stopping early at the end of the chain,
+ * negative on I/O error
+ */
+
+static ssize_t lxfsWriteChain(Mountpoint *mp, uint64_t block, off_t offset, const void *data,
+                              size_t length, int fresh, uint64_t *last) {
+    size_t written = 0;
+    while((written < length) && (block != LXFS_BLOCK_EOF)) {
+        if(!block) return -1;
+        size_t remaining = length - written;
+
+        if(!offset && (remaining >= mp->blockSizeBytes)) {
+            // find the run of contiguous blocks entirely covered by the write
+            uint64_t max = remaining / mp->blockSizeBytes;
+            uint64_t count = 1;
+            uint64_t next = lxfsNextBlock(mp, block);
+            while((count < max) && (next == (block + count))) {
+                next = lxfsNextBlock(mp, next);
+                count++;
+            }
+
+            if(!next) return -1;
+
+            if((count * mp->blockSizeBytes) >= DIRECT_WRITE_MIN) {
+                if(lxfsWriteBlocks(mp, block, count, (const void *)((uintptr_t)data + written)))
+                    return -1;
+            } else {
+                // whole blocks never need to be read first
+                for(uint64_t i = 0; i < count; i++) {
+                    void *slot = lxfsModifyBlock(mp, block + i, 0);
+                    if(!slot) return -1;
+                    memcpy(slot, (const void *)((uintptr_t)data + written + (i * mp->blockSizeBytes)), mp->blockSizeBytes);
+                }
+            }
+
+            written += count * mp->blockSizeBytes;
+            *last = block + count - 1;
+            block = next;
+            continue;
+        }
+
+        // partial block, which only needs to be read if it holds file data
+        size_t s = mp->blockSizeBytes - offset;
+        if(s > remaining) s = remaining;
+
+        void *slot = lxfsModifyBlock(mp, block, !fresh);
+        if(!slot) return -1;
+
+        if(fresh) {
+            memset(slot, 0, offset);
+            memset((void *)((uintptr_t)slot + offset + s), 0, mp->blockSizeBytes - offset - s);
+        }
+
+        memcpy((void *)((uintptr_t)slot + offset), (const void *)((uintptr_t)data + written), s);
+        written += s;
+        offset = 0;
+        *last = block;
+        block = lxfsNextBlock(mp, block);
+    }
+
+    return written;
+}
+
+/* lxfsOverwrite(): writes over the data blocks a file already has
+ * params: mp - mountpoint
+ * params: file - open file
+ * params: position - position in the file to write at
+ * params: data - data to write
+ * params: length - number of bytes to write
+ * params: last - pointer to store the last block written to, left unchanged
+ * if nothing was written
+ * returns: number of bytes written, stopping early at the end of the chain,
+ * negative on I/O error
+ */
+
+ssize_t lxfsOverwrite(Mountpoint *mp, OpenFile *file, off_t position, const void *data,
+                      size_t length, uint64_t *last) {
+    // inline files have as much data as their size says
+    if(file->inlined) {
+        if(position >= file->meta.size) return 0;
+        if(length > (file->meta.size - position)) length = file->meta.size - position;
+        if(lxfsInlineWrite(mp, file, position, data, length)) return -1;
+        return length;
+    }
+
+    // and so do compressed files, which don't map blocks to positions
+    if(file->units) {
+        if(position >= file->meta.size) return 0;
+        if(length > (file->meta.size - position)) length = file->meta.size - position;
+        if(lxfsCompressWrite(mp, file, position, data, length)) return -1;
+        return length;
+    }
+
+    if(lxfsUnshare(mp, file->entry.block, LXFS_BLOCK_EOF)) return -1;
+
+    uint64_t blockIndex = position / mp->blockSizeBytes;
+    uint64_t block = lxfsChainBlock(mp, file->entry.block, blockIndex);
+    if(!block) return -1;
+    if(block == LXFS_BLOCK_EOF) return 0;
+
+    // unwritten blocks hold no data to keep around a partial write
+    if(file->unwritten && lxfsPrepareWrite(mp, file, position, length)) return -1;
+
+    ssize_t s = lxfsWriteChain(mp, block, position % mp->blockSizeBytes, data, length, 0, last);
+    if(s <= 0) return s;
+
+    if(file->unwritten && lxfsMarkWritten(mp, file->entry.block, blockIndex,
+    ((position + s - 1) / mp->blockSizeBytes) - blockIndex + 1))
+        return -1;
+
+    return s;
+}
+
 /* lxfsWriteNew(): helper function to write to a new file
  * params: wcmd - write command message
  * params: mp - mountpoint
- * params: entry - directory entry for the file
- * params: metadata - file metadata block
+ * params: file - open file
  * returns: nothing, response relayed to kernel
  */
 
-void lxfsWriteNew(RWCommand *wcmd, Mountpoint *mp, LXFSDirectoryEntry *entry, LXFSFileHeader *metadata) {
+void lxfsWriteNew(RWCommand *wcmd, Mountpoint *mp, OpenFile *file) {
     // round up to block size
     uint64_t blockCount = (wcmd->length+mp->blockSizeBytes-1) / mp->blockSizeBytes;
-    uint64_t block = lxfsAllocate(mp, blockCount);
-    uint64_t first = block;
-    if(!block) {
+    uint64_t first = lxfsAllocate(mp, blockCount, file->entry.block + 1, file);
+    if(!first) {
         wcmd->header.header.status = -ENOSPC;   /* out of space */
         luxSendKernel(wcmd);
         return;
     }
 
-    uint64_t size = wcmd->length;
-    uint64_t position = 0;
-    while(size) {
-        if(size > mp->blockSizeBytes) {
-            memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), mp->blockSizeBytes);
-            size -= mp->blockSizeBytes;
-            position += mp->blockSizeBytes;
-        } else {
-            memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), size);
-            size = 0;
-        }
-
-        block = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
-        if(!block) {
-            wcmd->header.header.status = -EIO;
-            luxSendKernel(wcmd);
-            return;
-        }
-    }
-
-    // update file metadata
-    metadata->size = wcmd->length;
-    if(lxfsWriteBlock(mp, entry->block, mp->meta)) {
+    uint64_t last;
+    if(lxfsWriteChain(mp, first, 0, wcmd->data, wcmd->length, 1, &last) != wcmd->length) {
         wcmd->header.header.status = -EIO;
         luxSendKernel(wcmd);
         return;
     }
 
-    if(lxfsSetNextBlock(mp, entry->block, first)) {
+    if(lxfsSetNextBlock(mp, file->entry.block, first)) {
         wcmd->header.header.status = -EIO;
         luxSendKernel(wcmd);
         return;
     }
 
+    lxfsChainExtend(mp, file->entry.block);
+
+    // update file metadata, which is written back lazily
+    lxfsResizeFile(mp, file, wcmd->length);
+    lxfsTouchFile(mp, file, time(NULL), 1);
+
     wcmd->header.header.status = wcmd->length;
     wcmd->position += wcmd->length;
     luxSendKernel(wcmd);
@@ -89,152 +195,169 @@ void lxfsWrite(RWCommand *wcmd) {
         return;
     }
 
-    LXFSDirectoryEntry entry;
-    if(!lxfsFind(&entry, mp, wcmd->path, NULL, NULL)) {
+    OpenFile *file = lxfsGetFile(mp, wcmd->id, wcmd->path);
+    if(!file) {
         wcmd->header.header.status = -ENOENT;
         luxSendKernel(wcmd);
         return;
     }
 
-    uint64_t first = lxfsReadNextBlock(mp, entry.block, mp->meta);
-    if(!first) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
-        return;
-    }
-
-    LXFSFileHeader *metadata = (LXFSFileHeader *) mp->meta;
+    LXFSFileHeader *metadata = &file->meta;
 
     // the kernel will communicate O_APPEND by setting position to -1
     if(wcmd->position == -1)
         wcmd->position = metadata->size;
 
-    /* TODO: handle case for padding with zeroes when position > actual size */
-    if(wcmd->position > metadata->size) {
-        luxLogf(KPRINT_LEVEL_ERROR, "TODO: position > file size, handle zero pad case\n");
-        wcmd->header.header.status = -ENOSYS;   /* not implemented */
+    if(!wcmd->length) {
+        wcmd->header.header.status = 0;
         luxSendKernel(wcmd);
         return;
     }
 
-    // check if this is a new file
-    if(first == LXFS_BLOCK_EOF) {
-        lxfsWriteNew(wcmd, mp, &entry, metadata);
-        return;
-    }
-
-    // here we're writing to an existing file
-    uint64_t block = lxfsGetBlock(mp, first, wcmd->position);
-    uint64_t prevBlock;
-    if(wcmd->position >= mp->blockSizeBytes)
-        prevBlock = lxfsGetBlock(mp, first, wcmd->position-mp->blockSizeBytes);
-    else
-        prevBlock = block;
+    // small files are written into their metadata block, until they outgrow it
+    if(file->inlined) {
+        if((wcmd->position + wcmd->length) <= lxfsInlineCapacity(mp)) {
+            if(lxfsInlineWrite(mp, file, wcmd->position, wcmd->data, wcmd->length)) {
+                wcmd->header.header.status = -EIO;
+                luxSendKernel(wcmd);
+                return;
+            }
 
-    uint64_t size = wcmd->length;
-    uint64_t position = 0;
-    uint64_t tempPosition = wcmd->position % mp->blockSizeBytes;
+            if((wcmd->position + wcmd->length) > metadata->size)
+                lxfsResizeFile(mp, file, wcmd->position + wcmd->length);
+            lxfsTouchFile(mp, file, time(NULL), 1);
 
-    while(size && block && (block != LXFS_BLOCK_EOF)) {
-        if(lxfsReadBlock(mp, block, mp->dataBuffer)) {
-            wcmd->header.header.status = -EIO;
+            wcmd->header.header.status = wcmd->length;
+            wcmd->position += wcmd->length;
             luxSendKernel(wcmd);
             return;
         }
 
-        if(size >= (mp->blockSizeBytes - tempPosition)) {
-            memcpy((void *)((uintptr_t)mp->dataBuffer+tempPosition), (const void *)((uintptr_t)wcmd->data+position), mp->blockSizeBytes - tempPosition);
-            size -= (mp->blockSizeBytes - tempPosition);
-            position += (mp->blockSizeBytes - tempPosition);
-            tempPosition = 0;
-        } else {
-            memcpy((void *)((uintptr_t)mp->dataBuffer+tempPosition), (const void *)((uintptr_t)wcmd->data+position), size);
-            size = 0;
-        }
-
-        prevBlock = block;
-        block = lxfsWriteNextBlock(mp, block, mp->dataBuffer);
-        if(!block) {
-            wcmd->header.header.status = -EIO;
+        int status = lxfsInlineMigrate(mp, file);
+        if(status) {
+            wcmd->header.header.status = status;
             luxSendKernel(wcmd);
             return;
         }
     }
 
-    if(size) {
-        // allocate new blocks for the remaining bytes
-        uint64_t blockCount = (size+mp->blockSizeBytes-1) / mp->blockSizeBytes;
-        uint64_t newBlock = lxfsAllocate(mp, blockCount);
-        uint64_t firstNewBlock = newBlock;
-        if(!newBlock) {
-            wcmd->header.header.status = -ENOSPC;   /* out of storage */
+    // compressed files are written a unit at a time, and gaps past the end
+    // of the file are left as units that take up no blocks
+    if(file->units) {
+        int status = lxfsCompressWrite(mp, file, wcmd->position, wcmd->data, wcmd->length);
+        if(status) {
+            wcmd->header.header.status = status;
             luxSendKernel(wcmd);
             return;
         }
 
-        while(size) {
-            if(size > mp->blockSizeBytes) {
-                memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), mp->blockSizeBytes);
-                size -= mp->blockSizeBytes;
-                position += mp->blockSizeBytes;
-            } else {
-                memcpy(mp->dataBuffer, (const void *)((uintptr_t)wcmd->data + position), size);
-                size = 0;
-            }
+        if((wcmd->position + wcmd->length) > metadata->size)
+            lxfsResizeFile(mp, file, wcmd->position + wcmd->length);
+        lxfsTouchFile(mp, file, time(NULL), 1);
 
-            newBlock = lxfsWriteNextBlock(mp, newBlock, mp->dataBuffer);
-            if(!newBlock) {
-                wcmd->header.header.status = -EIO;
-                luxSendKernel(wcmd);
-                return;
-            }
-        }
+        wcmd->header.header.status = wcmd->length;
+        wcmd->position += wcmd->length;
+        luxSendKernel(wcmd);
+        return;
+    }
 
-        // update the block list
-        if(lxfsSetNextBlock(mp, prevBlock, firstNewBlock)) {
-            wcmd->header.header.status = -EIO;
+    // a file sharing its blocks with others is given a copy of its own first
+    if(lxfsUnshare(mp, file->entry.block, LXFS_BLOCK_EOF)) {
+        wcmd->header.header.status = -EIO;
+        luxSendKernel(wcmd);
+        return;
+    }
+
+    // writing past the end of the file leaves a gap that reads back as zeros,
+    // allocate it as unwritten blocks instead of writing zeros to it, and zero
+    // the tail of the last block, which may still hold stale data
+    if(wcmd->position > metadata->size) {
+        int status = lxfsPreallocate(mp, file, wcmd->position);
+        if(status) {
+            wcmd->header.header.status = status;
             luxSendKernel(wcmd);
             return;
         }
+
+        lxfsResizeFile(mp, file, wcmd->position);
     }
 
-    // and finally update the file metadata header
-    metadata->size += wcmd->length;
-    if(lxfsWriteBlock(mp, entry.block, mp->meta)) {
+    // check if this is a new file
+    uint64_t first = lxfsChainBlock(mp, file->entry.block, 0);
+    if(!first) {
         wcmd->header.header.status = -EIO;
         luxSendKernel(wcmd);
         return;
     }
 
-    // and update the timestamps
-    time_t timestamp = time(NULL);
-    uint64_t dirBlock;
-    off_t dirOffset;
-    if(!lxfsFind(&entry, mp, wcmd->path, &dirBlock, &dirOffset)) {
-        wcmd->header.header.status = -EIO;
-        luxSendKernel(wcmd);
+    if(first == LXFS_BLOCK_EOF) {
+        lxfsWriteNew(wcmd, mp, file);
         return;
     }
 
-    LXFSDirectoryEntry *dir = (LXFSDirectoryEntry *)((uintptr_t)mp->dataBuffer + dirOffset);
-    dir->accessTime = timestamp;
-    dir->modTime = timestamp;
+    // here we're writing to an existing file
+    uint64_t blockIndex = wcmd->position / mp->blockSizeBytes;
+    uint64_t block = lxfsChainBlock(mp, file->entry.block, blockIndex);
+    uint64_t prevBlock;
+    if(blockIndex)
+        prevBlock = lxfsChainBlock(mp, file->entry.block, blockIndex-1);
+    else
+        prevBlock = block;
 
-    uint64_t next = lxfsWriteNextBlock(mp, dirBlock, mp->dataBuffer);
-    if(!next) {
+    if(!block || !prevBlock || (prevBlock == LXFS_BLOCK_EOF)) {
         wcmd->header.header.status = -EIO;
         luxSendKernel(wcmd);
         return;
     }
 
-    if((dirOffset + entry.entrySize) > mp->blockSizeBytes) {
-        if(lxfsWriteBlock(mp, next, (const void *)((uintptr_t)mp->dataBuffer + mp->blockSizeBytes))) {
+    // overwrite the blocks the file already has
+    size_t written = 0;
+    if(block != LXFS_BLOCK_EOF) {
+        ssize_t s = lxfsOverwrite(mp, file, wcmd->position, wcmd->data, wcmd->length, &prevBlock);
+        if(s < 0) {
             wcmd->header.header.status = -EIO;
             luxSendKernel(wcmd);
             return;
         }
+
+        written = s;
     }
 
+    if(written < wcmd->length) {
+        // allocate new blocks for the remaining bytes
+        size_t size = wcmd->length - written;
+        uint64_t blockCount = (size+mp->blockSizeBytes-1) / mp->blockSizeBytes;
+        uint64_t firstNewBlock = lxfsAllocate(mp, blockCount, prevBlock + 1, file);
+        if(!firstNewBlock) {
+            wcmd->header.header.status = -ENOSPC;   /* out of storage */
+            luxSendKernel(wcmd);
+            return;
+        }
+
+        uint64_t last;
+        if(lxfsWriteChain(mp, firstNewBlock, 0, (const void *)((uintptr_t)wcmd->data + written),
+                          size, 1, &last) != size) {
+            wcmd->header.header.status = -EIO;
+            luxSendKernel(wcmd);
+            return;
+        }
+
+        // update the block list
+        if(lxfsSetNextBlock(mp, prevBlock, firstNewBlock)) {
+            wcmd->header.header.status = -EIO;
+            luxSendKernel(wcmd);
+            return;
+        }
+
+        lxfsChainExtend(mp, file->entry.block);
+    }
+
+    // and finally update the size and timestamps, which are written back
+    // lazily; overwrites within the file don't change its size
+    if((wcmd->position + wcmd->length) > metadata->size)
+        lxfsResizeFile(mp, file, wcmd->position + wcmd->length);
+    lxfsTouchFile(mp, file, time(NULL), 1);
+
     wcmd->header.header.status = wcmd->length;
     wcmd->position += wcmd->length;
     luxSendKernel(wcmd);
@@ -0,0 +1,132 @@
+/*
+ * luxOS - a unix-like operating system
+ * Omar Elghoul, 2024-25
+ * 
+ * lxfs: Driver for the lxfs file system
+ */
+
+#include <lxfs/lxfs.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lxfsCompareBlocks(): helper function to sort block numbers in ascending order
+ * params: a - pointer to first block number
+ * params: b - pointer to second block number
+ * returns: negative, zero, or positive as with strcmp()
+ */
+
+static int lxfsCompareBlocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    if(x < y) return -1;
+    if(x > y) return 1;
+    return 0;
+}
+
+/* lxfsWriteRun(): helper function to write back a run of contiguous dirty blocks
+ * params: mp - mountpoint
+ * params: block - first block number
+ * params: count - number of blocks, all of which are dirty and cached
+ * returns: zero on success
+ */
+
+static int lxfsWriteRun(Mountpoint *mp, uint64_t block, uint64_t count) {
+    if((count == 1) || !mp->wbBuffer) {
+        // nothing to merge, or no staging buffer to merge into
+        for(uint64_t i = 0; i < count; i++) {
+            if(lxfsFlushSlot(mp, (block + i) % CACHE_SIZE)) return 1;
+        }
+
+        return 0;
+    }
+
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t index = (block + i) % CACHE_SIZE;
+        memcpy(mp->wbBuffer + (i * mp->blockSizeBytes), mp->cache[index].data, mp->blockSizeBytes);
+    }
+
+    if(lxfsDeviceWrite(mp, block, count, mp->wbBuffer)) return 1;
+
+    for(uint64_t i = 0; i < count; i++) {
+        uint64_t index = (block + i) % CACHE_SIZE;
+        mp->cache[index].dirty = 0;
+        mp->dirtyBlocks--;
+    }
+
+    return 0;
+}
+
+/* lxfsWriteback(): writes back dirty cache slots in ascending block order,
+ * merging contiguous blocks into single device writes
+ * params: mp - mountpoint
+ * params: target - stop once no more than this many blocks are dirty
+ * params: age - only write back blocks that have been dirty this many seconds
+ * returns: zero on success
+ */
+
+int lxfsWriteback(Mountpoint *mp, size_t target, time_t age) {
+    if(mp->dirtyBlocks <= target) return 0;
+
+    if(!mp->wbList) mp->wbList = malloc(CACHE_SIZE * sizeof(uint64_t));
+    if(!mp->wbBuffer) mp->wbBuffer = malloc(WRITEBACK_MAX);
+
+    if(!mp->wbList) {
+        // no memory to sort, write back in cache order instead
+        for(uint64_t i = 0; (i < CACHE_SIZE) && (mp->dirtyBlocks > target); i++) {
+            if(mp->cache[i].valid && mp->cache[i].dirty && ((mp->clock - mp->cache[i].dirtied) >= age)) {
+                if(lxfsFlushSlot(mp, i)) return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    size_t count = 0;
+    for(uint64_t i = 0; i < CACHE_SIZE; i++) {
+        if(mp->cache[i].valid && mp->cache[i].dirty && ((mp->clock - mp->cache[i].dirtied) >= age))
+            mp->wbList[count++] = (mp->cache[i].tag * CACHE_SIZE) + i;
+    }
+
+    qsort(mp->wbList, count, sizeof(uint64_t), lxfsCompareBlocks);
+
+    uint64_t maxRun = WRITEBACK_MAX / mp->blockSizeBytes;
+    size_t i = 0;
+    while((i < count) && (mp->dirtyBlocks > target)) {
+        uint64_t run = 1;
+        while(((i + run) < count) && (run < maxRun) && (mp->wbList[i + run] == (mp->wbList[i] + run)))
+            run++;
+
+        if(lxfsWriteRun(mp, mp->wbList[i], run)) return 1;
+        i += run;
+    }
+
+    return 0;
+}
+
+/* lxfsSyncVolume(): writes back every dirty attribute and block of a volume
+ * and empties its journal
+ * params: mp - mountpoint
+ * returns: zero on success
+ */
+
+int lxfsSyncVolume(Mountpoint *mp) {
+    int status = 0;
+    for(int i = 0; mp->dirtyFiles && (i < OPEN_FILE_BUCKETS); i++) {
+        OpenFile *file = mp->files[i];
+        while(file) {
+            if(lxfsFlushFile(mp, file)) status = 1;
+            file = file->next;
+        }
+    }
+
+    // committing first lets the blocks of the running transaction be written
+    // back in place, and whatever writeback holds back is committed after it
+    // for the checkpoint to write
+    if(lxfsJournalCommit(mp)) status = 1;
+    if(lxfsWriteback(mp, 0, 0)) status = 1;
+    if(lxfsTableWriteback(mp)) status = 1;
+    if(lxfsJournalCommit(mp)) status = 1;
+    if(lxfsJournalCheckpoint(mp)) status = 1;
+    return status;
+}
\ No newline at end of file
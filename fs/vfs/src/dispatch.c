@@ -72,8 +72,9 @@ void vfsDispatchIoctl(SyscallHeader *hdr) {
     IOCTLCommand *cmd = (IOCTLCommand *) hdr;
     char type[32];
     if(resolve(cmd->path, type, cmd->device, cmd->path)) {
-        // ioctl() is only valid for /dev because it manipulates device files
-        if(strcmp(type, "devfs")) {
+        // ioctl() is valid for device files under /dev, and for files on
+        // lxfs volumes which implement their own opcodes
+        if(strcmp(type, "devfs") && strcmp(type, "lxfs")) {
             cmd->header.header.length = sizeof(IOCTLCommand);
             cmd->header.header.response = 1;
             cmd->header.header.status = -ENOTTY;
@@ -198,6 +199,18 @@ void vfsDispatchUtime(SyscallHeader *hdr) {
     }
 }
 
+void vfsDispatchMsync(SyscallHeader *hdr) {
+    MsyncCommand *cmd = (MsyncCommand *) hdr;
+    char type[32];
+    if(resolve(cmd->path, type, cmd->device, cmd->path)) {
+        int sd = findFSServer(type);
+        if(sd <= 0) luxLogf(KPRINT_LEVEL_WARNING, "no file system driver loaded for '%s'\n", type);
+        else luxSend(sd, cmd);
+    } else {
+        luxLogf(KPRINT_LEVEL_WARNING, "could not resolve path '%s'\n", cmd->path);
+    }
+}
+
 void vfsDispatchUnlink(SyscallHeader *hdr) {
     UnlinkCommand *cmd = (UnlinkCommand *) hdr;
     char type[32];
@@ -278,7 +291,7 @@ void (*vfsDispatchTable[])(SyscallHeader *) = {
     NULL, NULL, NULL,   // 15, 16, 17 - irrelevant to vfs
 
     vfsDispatchMmap,    // 18 - mmap()
-    NULL,               // 19 - msync()
+    vfsDispatchMsync,   // 19 - msync()
     vfsDispatchUnlink,  // 20 - unlink()
     vfsDispatchSymlink, // 21 - symlink()
     vfsDispatchReadLink,// 22 - readlink()
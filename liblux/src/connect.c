@@ -161,6 +161,51 @@ int luxConnectDependency(const char *name) {
     return 0;
 }
 
+/* luxConnectServer(): opens an additional connection to another server, for
+ * servers that talk to more than their dependency
+ * params: name - name of the server
+ * returns: socket descriptor on success, negative on fail
+ */
+
+int luxConnectServer(const char *name) {
+    if(strlen(name) + strlen(server) > 501) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "lux:///");
+    strcpy(&addr.sun_path[7], name);
+
+    // self address prefixed with lux:///ds and suffixed with the server name,
+    // to keep it distinct from the dependency socket
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(struct sockaddr_un));
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, "lux:///ds");
+    strcpy(&local.sun_path[9], server);
+    strcat(local.sun_path, ":");
+    strcat(local.sun_path, name);
+
+    int sd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sd < 0) return -1;
+
+    int status = bind(sd, (const struct sockaddr *) &local, sizeof(struct sockaddr_un));
+    if(status) {
+        close(sd);
+        return -1;
+    }
+
+    status = connect(sd, (const struct sockaddr *) &addr, sizeof(struct sockaddr_un));
+    if(status) {
+        close(sd);
+        return -1;
+    }
+
+    if(!self) self = getpid();
+    for(int i = 0; i < 16; i++) sched_yield();
+    return sd;
+}
+
 /* luxSendKernel(): sends a message to the kernel
  * params: msg - message header
  * returns: number of bytes sent, zero or negative on fail
@@ -338,11 +338,25 @@ typedef struct {
     int flags;
     off_t off;
 
-    int responseType;   // 0 = returning data, 1 = returning mmio
+    int responseType;   // 0 = returning data, 1 = returning mmio, 2 = paged on demand
     uint64_t mmio;      // mmio pointer
+    int paging;         // MMAP_PAGING_*, set by the kernel
     uint64_t data[];
 } MmapCommand;
 
+/* file systems that support it map files lazily when the kernel asks for it,
+ * and the kernel then requests the pages of the mapping as they are faulted
+ * in, with off and len giving the range to return; kernels that predate this
+ * send the message without the paging field, which header.length shows, and
+ * expect any data returned to begin where the field would be */
+#define MMAP_PAGING_NONE        0   // return the whole mapping at once
+#define MMAP_PAGING_MAP         1   // new mapping, the kernel can page it on demand
+#define MMAP_PAGING_FAULT       2   // page request for an existing mapping
+
+#define MMAP_RESPONSE_DATA      0
+#define MMAP_RESPONSE_MMIO      1
+#define MMAP_RESPONSE_PAGED     2   // no data returned, pages are requested on fault
+
 /* msync() */
 typedef struct {
     SyscallHeader header;
@@ -358,7 +372,7 @@ typedef struct {
     int mapFlags;
     int syncFlags;
 
-    uint64_t data[];
+    uint64_t data[];    // contents of the pages in the range to write back
 } MsyncCommand;
 
 /* statvfs() */
@@ -378,6 +392,7 @@ int luxReady();
 int luxConnectKernel();
 int luxConnectLumen();
 int luxConnectDependency(const char *);
+int luxConnectServer(const char *);
 int luxGetKernelSocket();
 ssize_t luxSendKernel(void *);
 ssize_t luxRecvKernel(void *, size_t, bool, bool);
@@ -16,8 +16,11 @@
 #define COMMAND_SDEV_READ               0xE003
 #define COMMAND_SDEV_WRITE              0xE004
 
+/* And this one by file system servers that do block I/O directly through sdev */
+#define COMMAND_SDEV_ATTACH             0xE005
+
 #define COMMAND_MIN_SDEV                0xE001
-#define COMMAND_MAX_SDEV                0xE004
+#define COMMAND_MAX_SDEV                0xE005
 
 typedef struct {
     MessageHeader header;
@@ -43,5 +46,26 @@ typedef struct {
     uint64_t partitionStart;
     uint64_t sectorSize;
 
+    int client;                 // socket of the attached server, zero for syscalls
+    uint64_t tag;               // request ID chosen by the attached server
+
     uint64_t buffer[];
 } SDevRWCommand;
+
+/* attached servers send SDevRWCommand requests with the device field set to
+ * the handle returned here and start relative to the device or partition;
+ * sdev first answers without a handle and with a range of the device, which
+ * the server reads through the device file it opened to prove its access, and
+ * answers again with the handle once that read reaches it */
+typedef struct {
+    MessageHeader header;
+    char device[256];           // device or partition under /dev, e.g. "/sd0p1"
+    int write;                  // non-zero to request write access
+
+    uint64_t handle;            // returned by sdev, zero until access is proven
+    uint64_t sectorSize;        // bytes
+    uint64_t size;              // sectors
+
+    uint64_t proofStart;        // bytes, range to read through the device file
+    uint64_t proofCount;
+} SDevAttachCommand;